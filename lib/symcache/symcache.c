@@ -0,0 +1,803 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <elf.h>
+#include <pthread.h>
+
+#include "symcache.h"
+
+#ifdef USE_BLAZESYM
+#include "blazesym.h"
+#endif
+
+#define SYMCACHE_KERNEL_ID   0              // binary id of kernel addresses
+#define SYMCACHE_PROCS       1024           // power of 2, direct mapped by pid
+#define SYMCACHE_BINARIES    1024           // power of 2
+#define SYMCACHE_MAPS_TTL_NS (10 * 1000000000ULL)
+#define SYMCACHE_QUEUE_MAX   4096
+#define SYMCACHE_NOTE_MAX    4096
+#define SYMCACHE_NONE        UINT32_MAX
+
+struct entry {
+    __u64 bin;              // SYMCACHE_KERNEL_ID, binary id or per process id for anonymous memory
+    __u64 addr;             // kernel address or file offset
+    char *name;
+    char *inlined;
+    __u64 offset;
+    __u32 hnext;            // hash chain
+    __u32 prev, next;       // LRU list, most recent first
+};
+
+// executable mapping of a process, from /proc/PID/maps
+struct mapping {
+    __u64 start;
+    __u64 end;
+    __u64 offset;
+    __u64 bin;
+};
+
+struct proc_maps {
+    pid_t pid;
+    __u64 loaded_ns;
+    int nr;
+    int alloc;
+    struct mapping *maps;
+};
+
+// binary id by (device, inode), the build id only has to be read once
+struct binary {
+    __u64 dev;
+    __u64 ino;
+    __u64 id;
+    struct binary *next;
+};
+
+struct ksym {
+    __u64 addr;
+    __u32 name;             // offset in the names pool
+};
+
+struct job {
+    symcache_job_fn fn;
+    void *arg;
+    struct job *next;
+};
+
+struct symcache {
+    struct blaze_symbolizer *symbolizer;
+    pthread_mutex_t lock;
+
+    struct entry *entries;
+    __u32 *buckets;
+    __u32 nr_buckets;       // power of 2
+    __u32 max_entries;
+    __u32 nr_entries;
+    __u32 lru_head, lru_tail;
+
+    struct proc_maps procs[SYMCACHE_PROCS];
+    struct binary *binaries[SYMCACHE_BINARIES];
+
+    bool ksyms_loaded;
+    struct ksym *ksyms;
+    size_t nr_ksyms;
+    char *ksym_names;
+
+    // worker
+    pthread_t worker;
+    bool worker_started;
+    bool stopping;
+    pthread_mutex_t qlock;
+    pthread_cond_t qcond;       // jobs queued, or stopping
+    pthread_cond_t qdone;       // queue has room, or was drained
+    struct job *qhead, *qtail;
+    int queued;
+    bool busy;
+
+    struct symcache_stats stats;
+};
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u64 fnv1a(__u64 h, const void *data, size_t len)
+{
+    const __u8 *p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void read_build_id(const __u8 *p, const __u8 *end, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    while ((size_t)(end - p) >= sizeof(Elf64_Nhdr)) {
+        Elf64_Nhdr nh;
+        memcpy(&nh, p, sizeof(nh));
+        p += sizeof(nh);
+
+        size_t name_sz = (nh.n_namesz + 3) & ~3U;
+        size_t desc_sz = (nh.n_descsz + 3) & ~3U;
+        if (name_sz > (size_t)(end - p) || desc_sz > (size_t)(end - p - name_sz))
+            return;
+
+        if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4 && memcmp(p, "GNU", 4) == 0) {
+            const __u8 *id = p + name_sz;
+            __u32 len = nh.n_descsz < SYMCACHE_BUILD_ID_MAX ? nh.n_descsz : SYMCACHE_BUILD_ID_MAX;
+
+            for (__u32 i = 0; i < len; i++) {
+                out[2 * i] = hex[id[i] >> 4];
+                out[2 * i + 1] = hex[id[i] & 0xf];
+            }
+            out[2 * len] = '\0';
+            return;
+        }
+        p += name_sz + desc_sz;
+    }
+}
+
+int symcache_read_elf(int fd, struct symcache_elf *elf)
+{
+    Elf64_Ehdr eh;
+    Elf64_Phdr ph[64];
+
+    memset(elf, 0, sizeof(*elf));
+
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_phentsize != sizeof(Elf64_Phdr))
+        return -1;
+
+    int nr_ph = eh.e_phnum < 64 ? eh.e_phnum : 64;
+    if (pread(fd, ph, nr_ph * sizeof(Elf64_Phdr), eh.e_phoff) != (ssize_t)(nr_ph * sizeof(Elf64_Phdr)))
+        return -1;
+
+    for (int i = 0; i < nr_ph; i++) {
+        if (ph[i].p_type == PT_LOAD && (ph[i].p_flags & PF_X) && elf->nr_loads < SYMCACHE_MAX_LOADS) {
+            elf->loads[elf->nr_loads].vaddr = ph[i].p_vaddr;
+            elf->loads[elf->nr_loads].offset = ph[i].p_offset;
+            elf->loads[elf->nr_loads].filesz = ph[i].p_filesz;
+            elf->nr_loads++;
+        } else if (ph[i].p_type == PT_NOTE && !elf->build_id[0]) {
+            __u8 note[SYMCACHE_NOTE_MAX];
+            size_t len = ph[i].p_filesz < sizeof(note) ? ph[i].p_filesz : sizeof(note);
+            ssize_t n = pread(fd, note, len, ph[i].p_offset);
+
+            if (n > 0)
+                read_build_id(note, note + n, elf->build_id);
+        }
+    }
+
+    return 0;
+}
+
+struct symcache *symcache_new(struct blaze_symbolizer *symbolizer, size_t max_entries)
+{
+    struct symcache *sc = calloc(1, sizeof(*sc));
+    if (!sc)
+        return NULL;
+
+    if (max_entries < SYMCACHE_MIN_ENTRIES)
+        max_entries = SYMCACHE_MIN_ENTRIES;
+
+    sc->symbolizer = symbolizer;
+    sc->max_entries = max_entries;
+    for (sc->nr_buckets = 1; sc->nr_buckets < max_entries; sc->nr_buckets <<= 1)
+        ;
+
+    sc->entries = calloc(max_entries, sizeof(*sc->entries));
+    sc->buckets = malloc(sc->nr_buckets * sizeof(*sc->buckets));
+    if (!sc->entries || !sc->buckets) {
+        free(sc->entries);
+        free(sc->buckets);
+        free(sc);
+        return NULL;
+    }
+    memset(sc->buckets, 0xff, sc->nr_buckets * sizeof(*sc->buckets));
+    sc->lru_head = sc->lru_tail = SYMCACHE_NONE;
+
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_mutex_init(&sc->qlock, NULL);
+    pthread_cond_init(&sc->qcond, NULL);
+    pthread_cond_init(&sc->qdone, NULL);
+    return sc;
+}
+
+void symcache_free(struct symcache *sc)
+{
+    if (!sc)
+        return;
+
+    if (sc->worker_started) {
+        pthread_mutex_lock(&sc->qlock);
+        sc->stopping = true;
+        pthread_cond_signal(&sc->qcond);
+        pthread_mutex_unlock(&sc->qlock);
+        pthread_join(sc->worker, NULL);
+    }
+
+    for (__u32 i = 0; i < sc->nr_entries; i++) {
+        free(sc->entries[i].name);
+        free(sc->entries[i].inlined);
+    }
+    for (int i = 0; i < SYMCACHE_PROCS; i++)
+        free(sc->procs[i].maps);
+    for (int i = 0; i < SYMCACHE_BINARIES; i++) {
+        struct binary *b = sc->binaries[i];
+        while (b) {
+            struct binary *next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+
+    pthread_mutex_destroy(&sc->lock);
+    pthread_mutex_destroy(&sc->qlock);
+    pthread_cond_destroy(&sc->qcond);
+    pthread_cond_destroy(&sc->qdone);
+    free(sc->ksyms);
+    free(sc->ksym_names);
+    free(sc->entries);
+    free(sc->buckets);
+    free(sc);
+}
+
+/* LRU cache */
+
+static __u32 bucket_of(const struct symcache *sc, __u64 bin, __u64 addr)
+{
+    __u64 h = (bin ^ (addr * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return (h >> 32) & (sc->nr_buckets - 1);
+}
+
+static void lru_unlink(struct symcache *sc, __u32 i)
+{
+    struct entry *e = &sc->entries[i];
+
+    if (e->prev != SYMCACHE_NONE)
+        sc->entries[e->prev].next = e->next;
+    else
+        sc->lru_head = e->next;
+    if (e->next != SYMCACHE_NONE)
+        sc->entries[e->next].prev = e->prev;
+    else
+        sc->lru_tail = e->prev;
+}
+
+static void lru_push(struct symcache *sc, __u32 i)
+{
+    struct entry *e = &sc->entries[i];
+
+    e->prev = SYMCACHE_NONE;
+    e->next = sc->lru_head;
+    if (sc->lru_head != SYMCACHE_NONE)
+        sc->entries[sc->lru_head].prev = i;
+    sc->lru_head = i;
+    if (sc->lru_tail == SYMCACHE_NONE)
+        sc->lru_tail = i;
+}
+
+static struct entry *cache_get(struct symcache *sc, __u64 bin, __u64 addr)
+{
+    for (__u32 i = sc->buckets[bucket_of(sc, bin, addr)]; i != SYMCACHE_NONE; i = sc->entries[i].hnext) {
+        struct entry *e = &sc->entries[i];
+
+        if (e->bin == bin && e->addr == addr) {
+            if (sc->lru_head != i) {
+                lru_unlink(sc, i);
+                lru_push(sc, i);
+            }
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void hash_remove(struct symcache *sc, __u32 i)
+{
+    struct entry *e = &sc->entries[i];
+    __u32 *p = &sc->buckets[bucket_of(sc, e->bin, e->addr)];
+
+    while (*p != i)
+        p = &sc->entries[*p].hnext;
+    *p = e->hnext;
+}
+
+// takes over name and inlined
+static struct entry *cache_put(struct symcache *sc, __u64 bin, __u64 addr,
+                               char *name, __u64 offset, char *inlined)
+{
+    __u32 i;
+
+    if (sc->nr_entries < sc->max_entries) {
+        i = sc->nr_entries++;
+    } else {
+        i = sc->lru_tail;
+        hash_remove(sc, i);
+        lru_unlink(sc, i);
+        free(sc->entries[i].name);
+        free(sc->entries[i].inlined);
+        sc->stats.evictions++;
+    }
+
+    struct entry *e = &sc->entries[i];
+    __u32 b = bucket_of(sc, bin, addr);
+
+    e->bin = bin;
+    e->addr = addr;
+    e->name = name;
+    e->offset = offset;
+    e->inlined = inlined;
+    e->hnext = sc->buckets[b];
+    sc->buckets[b] = i;
+    lru_push(sc, i);
+    return e;
+}
+
+/* kallsyms */
+
+static int cmp_ksym(const void *a, const void *b)
+{
+    const struct ksym *ka = a, *kb = b;
+
+    if (ka->addr != kb->addr)
+        return ka->addr < kb->addr ? -1 : 1;
+    return 0;
+}
+
+// Text symbols only, sorted by address. Without CAP_SYSLOG all addresses
+// read as zero and the table stays empty
+static void load_kallsyms(struct symcache *sc)
+{
+    size_t alloc = 0, names_len = 0, names_alloc = 0;
+    char line[512];
+
+    sc->ksyms_loaded = true;
+
+    FILE *f = fopen("/proc/kallsyms", "r");
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long addr;
+        char type;
+        char sym[256];
+
+        if (sscanf(line, "%llx %c %255s", &addr, &type, sym) != 3 || !addr)
+            continue;
+        if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+            continue;
+
+        size_t len = strlen(sym) + 1;
+        if (names_len + len > names_alloc) {
+            names_alloc = names_alloc ? names_alloc * 2 : 1024 * 1024;
+            char *p = realloc(sc->ksym_names, names_alloc);
+            if (!p)
+                break;
+            sc->ksym_names = p;
+        }
+        if (sc->nr_ksyms == alloc) {
+            alloc = alloc ? alloc * 2 : 64 * 1024;
+            struct ksym *p = realloc(sc->ksyms, alloc * sizeof(*sc->ksyms));
+            if (!p)
+                break;
+            sc->ksyms = p;
+        }
+
+        memcpy(sc->ksym_names + names_len, sym, len);
+        sc->ksyms[sc->nr_ksyms].addr = addr;
+        sc->ksyms[sc->nr_ksyms].name = names_len;
+        sc->nr_ksyms++;
+        names_len += len;
+    }
+    fclose(f);
+
+    qsort(sc->ksyms, sc->nr_ksyms, sizeof(*sc->ksyms), cmp_ksym);
+}
+
+// last symbol starting at or before addr
+static const struct ksym *ksym_find(struct symcache *sc, __u64 addr)
+{
+    size_t lo = 0, hi = sc->nr_ksyms;
+
+    if (!sc->ksyms_loaded)
+        load_kallsyms(sc);
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sc->ksyms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &sc->ksyms[lo - 1] : NULL;
+}
+
+bool symcache_ksym_range(struct symcache *sc, const char *name, __u64 *start, __u64 *end)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&sc->lock);
+    if (!sc->ksyms_loaded)
+        load_kallsyms(sc);
+
+    for (size_t i = 0; i < sc->nr_ksyms; i++) {
+        if (strcmp(sc->ksym_names + sc->ksyms[i].name, name) != 0)
+            continue;
+
+        *start = sc->ksyms[i].addr;
+        *end = *start + 0x2000;     // fallback range guess for the last symbol
+        for (size_t j = i + 1; j < sc->nr_ksyms; j++) {
+            if (sc->ksyms[j].addr > *start) {
+                *end = sc->ksyms[j].addr;
+                break;
+            }
+        }
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return found;
+}
+
+/* process mappings */
+
+static __u64 binary_id(struct symcache *sc, pid_t pid, __u64 dev, __u64 ino, __u64 start, __u64 end)
+{
+    unsigned int h = (unsigned int)((ino ^ dev) * 2654435761ULL) & (SYMCACHE_BINARIES - 1);
+
+    for (struct binary *b = sc->binaries[h]; b; b = b->next)
+        if (b->dev == dev && b->ino == ino)
+            return b->id;
+
+    struct binary *bin = calloc(1, sizeof(*bin));
+    if (!bin)
+        return 0;
+
+    char path[64];
+    struct symcache_elf elf = {0};
+
+    snprintf(path, sizeof(path), "/proc/%d/map_files/%llx-%llx", pid, start, end);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        symcache_read_elf(fd, &elf);
+        close(fd);
+    }
+
+    // the same build in another container or after a reinstall is the same binary
+    if (elf.build_id[0]) {
+        bin->id = fnv1a(0xcbf29ce484222325ULL, elf.build_id, strlen(elf.build_id));
+    } else {
+        bin->id = fnv1a(0xcbf29ce484222325ULL, &dev, sizeof(dev));
+        bin->id = fnv1a(bin->id, &ino, sizeof(ino));
+    }
+    if (bin->id == SYMCACHE_KERNEL_ID)
+        bin->id = 1;
+
+    bin->dev = dev;
+    bin->ino = ino;
+    bin->next = sc->binaries[h];
+    sc->binaries[h] = bin;
+    return bin->id;
+}
+
+static struct proc_maps *get_maps(struct symcache *sc, pid_t pid)
+{
+    struct proc_maps *pm = &sc->procs[pid & (SYMCACHE_PROCS - 1)];
+    __u64 now = now_ns();
+    char path[64], line[1024];
+
+    if (pm->pid == pid && now - pm->loaded_ns < SYMCACHE_MAPS_TTL_NS)
+        return pm;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+
+    pm->pid = pid;
+    pm->loaded_ns = now;
+    pm->nr = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long start, end, offset, ino;
+        unsigned int major, minor;
+        char perms[5];
+
+        if (sscanf(line, "%llx-%llx %4s %llx %x:%x %llu", &start, &end, perms, &offset,
+                   &major, &minor, &ino) != 7 || perms[2] != 'x' || !ino)
+            continue;
+
+        if (pm->nr == pm->alloc) {
+            int n = pm->alloc ? pm->alloc * 2 : 64;
+            struct mapping *p = realloc(pm->maps, n * sizeof(*pm->maps));
+            if (!p)
+                break;
+            pm->maps = p;
+            pm->alloc = n;
+        }
+
+        struct mapping *m = &pm->maps[pm->nr++];
+        m->start = start;
+        m->end = end;
+        m->offset = offset;
+        m->bin = binary_id(sc, pid, ((__u64)major << 32) | minor, ino, start, end);
+    }
+    fclose(f);
+    return pm;
+}
+
+// (binary id, file offset) of a user address, anonymous memory is keyed by process
+static void user_key(const struct proc_maps *pm, pid_t pid, __u64 addr, __u64 *bin, __u64 *key)
+{
+    for (int i = 0; pm && i < pm->nr; i++) {
+        const struct mapping *m = &pm->maps[i];
+
+        if (addr >= m->start && addr < m->end) {
+            *bin = m->bin;
+            *key = addr - m->start + m->offset;
+            return;
+        }
+    }
+
+    *bin = fnv1a(0x84222325cbf29ce4ULL, &pid, sizeof(pid)) | 1;
+    *key = addr;
+}
+
+/* resolving */
+
+#ifdef USE_BLAZESYM
+static char *format_inlined(const struct blaze_sym *sym)
+{
+    char buf[1024];
+    size_t len = 0;
+
+    for (size_t j = 0; j < sym->inlined_cnt && len < sizeof(buf); j++) {
+        int n = snprintf(buf + len, sizeof(buf) - len, ";%s[inlined]", sym->inlined[j].name);
+        if (n < 0 || (size_t)n >= sizeof(buf) - len)
+            break;
+        len += n;
+    }
+    return len ? strdup(buf) : NULL;
+}
+#endif
+
+int symcache_resolve(struct symcache *sc, pid_t pid, bool is_kernel,
+                     const __u64 *addrs, int cnt, struct symcache_sym *out)
+{
+    __u64 bins[SYMCACHE_MAX_FRAMES], keys[SYMCACHE_MAX_FRAMES], offsets[SYMCACHE_MAX_FRAMES];
+    int miss_idx[SYMCACHE_MAX_FRAMES];
+    char *names[SYMCACHE_MAX_FRAMES], *inlined[SYMCACHE_MAX_FRAMES];
+    int nr_missed = 0, resolved = 0;
+    struct proc_maps *pm = NULL;
+
+    if (cnt > SYMCACHE_MAX_FRAMES)
+        cnt = SYMCACHE_MAX_FRAMES;
+    if (cnt <= 0)
+        return 0;
+
+    pthread_mutex_lock(&sc->lock);
+
+    if (!is_kernel && pid > 0)
+        pm = get_maps(sc, pid);
+
+    for (int i = 0; i < cnt; i++) {
+        if (is_kernel) {
+            bins[i] = SYMCACHE_KERNEL_ID;
+            keys[i] = addrs[i];
+        } else {
+            user_key(pm, pid, addrs[i], &bins[i], &keys[i]);
+        }
+
+        sc->stats.lookups++;
+        struct entry *e = cache_get(sc, bins[i], keys[i]);
+        if (e) {
+            sc->stats.hits++;
+            out[i].name = e->name;
+            out[i].offset = e->offset;
+            out[i].inlined = e->inlined;
+            resolved += e->name != NULL;
+            continue;
+        }
+
+        sc->stats.misses++;
+        out[i].name = NULL;
+        out[i].offset = 0;
+        out[i].inlined = NULL;
+        names[nr_missed] = inlined[nr_missed] = NULL;
+        offsets[nr_missed] = 0;
+        miss_idx[nr_missed++] = i;
+    }
+
+    // an exited process has nothing left to symbolize, and nothing to cache
+    if (!nr_missed || (!is_kernel && !pm))
+        goto out;
+
+#ifdef USE_BLAZESYM
+    if (sc->symbolizer) {
+        uintptr_t missed[SYMCACHE_MAX_FRAMES];
+        const struct blaze_syms *syms;
+
+        for (int j = 0; j < nr_missed; j++)
+            missed[j] = addrs[miss_idx[j]];
+
+        if (is_kernel) {
+            struct blaze_symbolize_src_kernel src = {
+                .type_size = sizeof(src),
+            };
+            syms = blaze_symbolize_kernel_abs_addrs(sc->symbolizer, &src, missed, nr_missed);
+        } else {
+            struct blaze_symbolize_src_process src = {
+                .type_size = sizeof(src),
+                .pid = pid,
+            };
+            syms = blaze_symbolize_process_abs_addrs(sc->symbolizer, &src, missed, nr_missed);
+        }
+
+        for (size_t j = 0; syms && j < syms->cnt && j < (size_t)nr_missed; j++) {
+            const struct blaze_sym *sym = &syms->syms[j];
+
+            if (!sym->name)
+                continue;
+            names[j] = strdup(sym->name);
+            offsets[j] = sym->offset;
+            inlined[j] = format_inlined(sym);
+        }
+        if (syms)
+            blaze_syms_free(syms);
+    }
+#endif
+
+    // The entries touched by this call are the most recently used ones, and
+    // a stack has fewer frames than the cache entries, so putting the misses
+    // only evicts entries that nothing in out[] points at
+    for (int j = 0; j < nr_missed; j++) {
+        int i = miss_idx[j];
+
+        if (!names[j] && is_kernel) {
+            const struct ksym *ks = ksym_find(sc, addrs[i]);
+            if (ks) {
+                names[j] = strdup(sc->ksym_names + ks->name);
+                offsets[j] = addrs[i] - ks->addr;
+                sc->stats.kallsyms++;
+            }
+        }
+
+        // the same address may be missing twice in one stack (recursion)
+        struct entry *e = cache_get(sc, bins[i], keys[i]);
+        if (e) {
+            free(names[j]);
+            free(inlined[j]);
+        } else {
+            e = cache_put(sc, bins[i], keys[i], names[j], offsets[j], inlined[j]);
+        }
+
+        out[i].name = e->name;
+        out[i].offset = e->offset;
+        out[i].inlined = e->inlined;
+        resolved += e->name != NULL;
+    }
+
+out:
+    sc->stats.entries = sc->nr_entries;
+    pthread_mutex_unlock(&sc->lock);
+    return resolved;
+}
+
+/* worker */
+
+static void *worker_main(void *arg)
+{
+    struct symcache *sc = arg;
+
+    pthread_mutex_lock(&sc->qlock);
+    for (;;) {
+        while (!sc->qhead && !sc->stopping)
+            pthread_cond_wait(&sc->qcond, &sc->qlock);
+        if (!sc->qhead)
+            break;
+
+        struct job *j = sc->qhead;
+        sc->qhead = j->next;
+        if (!sc->qhead)
+            sc->qtail = NULL;
+        sc->queued--;
+        sc->busy = true;
+        pthread_mutex_unlock(&sc->qlock);
+
+        j->fn(sc, j->arg);
+        free(j);
+
+        pthread_mutex_lock(&sc->qlock);
+        sc->busy = false;
+        sc->stats.jobs++;
+        pthread_cond_broadcast(&sc->qdone);
+    }
+    pthread_mutex_unlock(&sc->qlock);
+    return NULL;
+}
+
+int symcache_start(struct symcache *sc)
+{
+    if (sc->worker_started)
+        return 0;
+
+    int err = pthread_create(&sc->worker, NULL, worker_main, sc);
+    if (err)
+        return -err;
+
+    pthread_setname_np(sc->worker, "symcache");
+    sc->worker_started = true;
+    return 0;
+}
+
+void symcache_submit(struct symcache *sc, symcache_job_fn fn, void *arg)
+{
+    struct job *j = sc->worker_started ? malloc(sizeof(*j)) : NULL;
+
+    if (!j) {
+        fn(sc, arg);
+        return;
+    }
+
+    j->fn = fn;
+    j->arg = arg;
+    j->next = NULL;
+
+    pthread_mutex_lock(&sc->qlock);
+    while (sc->queued >= SYMCACHE_QUEUE_MAX)
+        pthread_cond_wait(&sc->qdone, &sc->qlock);
+    if (sc->qtail)
+        sc->qtail->next = j;
+    else
+        sc->qhead = j;
+    sc->qtail = j;
+    sc->queued++;
+    pthread_cond_signal(&sc->qcond);
+    pthread_mutex_unlock(&sc->qlock);
+}
+
+void symcache_drain(struct symcache *sc)
+{
+    if (!sc->worker_started)
+        return;
+
+    pthread_mutex_lock(&sc->qlock);
+    while (sc->qhead || sc->busy)
+        pthread_cond_wait(&sc->qdone, &sc->qlock);
+    pthread_mutex_unlock(&sc->qlock);
+}
+
+void symcache_get_stats(struct symcache *sc, struct symcache_stats *st)
+{
+    pthread_mutex_lock(&sc->lock);
+    pthread_mutex_lock(&sc->qlock);
+    *st = sc->stats;
+    pthread_mutex_unlock(&sc->qlock);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+void symcache_print_stats(struct symcache *sc, FILE *f)
+{
+    struct symcache_stats st;
+
+    symcache_get_stats(sc, &st);
+    fprintf(f, "Symbol cache: %llu lookups, %.1f%% hits, %llu entries, %llu evictions, %llu from kallsyms\n",
+            st.lookups, st.lookups ? 100.0 * st.hits / st.lookups : 0.0,
+            st.entries, st.evictions, st.kallsyms);
+}
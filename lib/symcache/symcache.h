@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#ifndef __SYMCACHE_H
+#define __SYMCACHE_H
+
+// Stack address symbolization shared by xcapture, xstack and xintr.
+//
+// Resolved frames are cached by (binary, address): kernel addresses as they
+// are, user addresses as file offsets in the binary identified by its GNU
+// build id, so the same libc frame hits the cache in every process and across
+// process restarts. The cache holds a bounded number of entries and evicts the
+// least recently used one. Misses go to BlazeSym when the tool has a
+// symbolizer, kernel addresses also fall back to a sorted copy of
+// /proc/kallsyms, which is all there is without BlazeSym.
+//
+// The optional worker thread runs submitted jobs in submission order, so a
+// tool can hand over the printing of a sample and get back to sampling.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#define SYMCACHE_DEFAULT_ENTRIES (64 * 1024)
+#define SYMCACHE_MAX_FRAMES      256        // per symcache_resolve() call
+#define SYMCACHE_MIN_ENTRIES     1024       // several times SYMCACHE_MAX_FRAMES
+#define SYMCACHE_BUILD_ID_MAX    32         // bytes, GNU build ids are 20
+#define SYMCACHE_MAX_LOADS       8
+
+struct blaze_symbolizer;
+struct symcache;
+
+struct symcache_sym {
+    const char *name;       // NULL when the address could not be resolved
+    __u64 offset;           // from the start of the symbol
+    const char *inlined;    // ";fn[inlined];fn2[inlined]" when the symbolizer reports inlined calls, else NULL
+};
+
+struct symcache_stats {
+    __u64 lookups;
+    __u64 hits;
+    __u64 misses;
+    __u64 evictions;
+    __u64 entries;
+    __u64 kallsyms;         // misses resolved from the kallsyms table
+    __u64 jobs;             // run by the worker thread
+};
+
+// Build id and executable load segments of an ELF file
+struct symcache_elf {
+    char build_id[2 * SYMCACHE_BUILD_ID_MAX + 1];   // hex, empty when the binary has none
+    int nr_loads;
+    struct {
+        __u64 vaddr;
+        __u64 offset;
+        __u64 filesz;
+    } loads[SYMCACHE_MAX_LOADS];    // PT_LOAD segments, for file offset -> virtual address
+};
+
+typedef void (*symcache_job_fn)(struct symcache *sc, void *arg);
+
+// symbolizer may be NULL, max_entries is raised to SYMCACHE_MIN_ENTRIES
+struct symcache *symcache_new(struct blaze_symbolizer *symbolizer, size_t max_entries);
+// runs the jobs still queued first
+void symcache_free(struct symcache *sc);
+
+// Resolve cnt (at most SYMCACHE_MAX_FRAMES) addresses of a kernel stack, or
+// of a user stack of process pid.
+// The returned names point into the cache and stay valid until the next
+// symcache_resolve() call, callers that share a cache between threads must
+// only resolve from one of them (the worker, if started). Returns the number
+// of addresses resolved
+int symcache_resolve(struct symcache *sc, pid_t pid, bool is_kernel,
+                     const __u64 *addrs, int cnt, struct symcache_sym *out);
+
+// [start, end) of a kernel function from the kallsyms table
+bool symcache_ksym_range(struct symcache *sc, const char *name, __u64 *start, __u64 *end);
+
+// Worker thread for symcache_submit(), jobs run one at a time in submission
+// order. Without a started worker jobs run right away in the caller
+int symcache_start(struct symcache *sc);
+// Queue fn(sc, arg), blocks while the queue is full
+void symcache_submit(struct symcache *sc, symcache_job_fn fn, void *arg);
+// Wait until all submitted jobs have run
+void symcache_drain(struct symcache *sc);
+
+void symcache_get_stats(struct symcache *sc, struct symcache_stats *st);
+void symcache_print_stats(struct symcache *sc, FILE *f);
+
+// Build id and PT_LOAD segments of an open ELF file, -1 if it isn't one
+int symcache_read_elf(int fd, struct symcache_elf *elf);
+
+#endif /* __SYMCACHE_H */
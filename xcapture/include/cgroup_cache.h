@@ -7,23 +7,32 @@
 #include <linux/types.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define CGROUP_CACHE_SIZE 4096  // Must be power of 2 for fast modulo
+#define CGROUP_CACHE_MAX_ENTRIES 16384  // least recently used ones evicted beyond this
 #define CGROUP_PATH_MAX 256
+#define CGROUP_ROOT "/sys/fs/cgroup"
 
 // Individual cache entry
 typedef struct cgroup_entry {
     __u64 cgroup_id;
-    char path[CGROUP_PATH_MAX];
     struct cgroup_entry *next;  // Chain for collision handling
+    struct cgroup_entry *lru_prev, *lru_next;
+    bool reported;              // path written to output since it was cached or renamed
+    char path[CGROUP_PATH_MAX];
 } cgroup_entry_t;
 
 // Cache statistics
 typedef struct {
-    int lookups;
-    int hits;
-    int misses;
-    int collisions;
+    __u64 lookups;
+    __u64 hits;
+    __u64 misses;
+    __u64 collisions;
+    __u64 evictions;
+    __u64 proc_reads;       // misses resolved from /proc/PID/cgroup
+    __u64 index_events;     // inotify events applied to the index
+    __u64 renames;
 } cgroup_cache_stats_t;
 
 // Initialize the global cache
@@ -38,6 +47,24 @@ int cgroup_cache_insert(__u64 cgroup_id, const char *path);
 // Check if cgroup is cached
 bool cgroup_cache_contains(__u64 cgroup_id);
 
+// Whether the cached path of a cgroup was already written to the output,
+// a renamed cgroup is reported again with its new path
+bool cgroup_cache_reported(__u64 cgroup_id);
+void cgroup_cache_set_reported(__u64 cgroup_id);
+
+// Index all cgroups under root by inode number (the cgroup id) and keep the
+// index current with inotify, misses then rarely need /proc/PID/cgroup.
+// Returns 0, or -1 if root can't be walked and misses go to /proc
+int cgroup_index_init(const char *root);
+
+// Apply pending cgroup creations, renames and removals to the cache
+void cgroup_index_poll(void);
+
+// Cgroup v2 ids of the comma separated cgroup paths (relative to CGROUP_ROOT)
+// or ids in arg, and of all cgroups below them. Returns the number of ids,
+// -E2BIG if there are more than max, or another negative errno
+int parse_cgroup_filter(const char *arg, __u64 *ids, int max);
+
 // Get cache statistics
 void cgroup_cache_get_stats(cgroup_cache_stats_t *stats);
 
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#ifndef UNWIND_TABLE_H
+#define UNWIND_TABLE_H
+
+#include <sys/types.h>
+#include <linux/types.h>
+
+#define UNWIND_RESCAN_SEC        60  // re-read /proc/PID/maps to pick up dlopen()ed libraries
+#define UNWIND_PROCS_PER_ITER    16  // bound the userspace work done per sampling iteration
+
+// Set up userspace state, rows_fd is the mmapable unwind_rows array map
+int unwind_tables_init(int rows_fd, int procs_fd);
+
+// Remember a sampled process for (re)registering its mappings on the next refresh
+void unwind_note_process(pid_t tgid);
+
+// Compile unwind tables of newly seen executables and publish process mappings
+void unwind_tables_refresh(void);
+
+// Free all allocated memory
+void unwind_tables_destroy(void);
+
+#endif /* UNWIND_TABLE_H */
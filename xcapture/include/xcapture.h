@@ -135,36 +135,82 @@ struct task_state {
     // Namespace and cgroup information
     __u32 pid_ns_id;               // PID namespace inode number
     __u64 cgroup_id;               // Cgroup v2 ID from task->cgroups->dfl_cgrp->kn->id
-
-    __u32 trace_payload_len;       // Length of captured request payload prefix
-    __u8  trace_payload[TRACE_PAYLOAD_LEN];
-    __s32 trace_payload_syscall;   // Syscall number associated with payload (if any)
-    __u64 trace_payload_seq_num;   // Syscall sequence number that produced payload
 };
 
 // Fields for BPF internal task local caching only
 struct task_cache {
+    __u64 uring_last_user_data;       // Last SQE user_data tracked for CQ correlation
+    __s32 uring_last_fd;              // Last SQE fd (or -1 for registered files)
+    __s32 uring_last_reg_idx;         // Last registered index when IOSQE_FIXED_FILE was used
+    __u64 uring_last_file_ptr;        // Kernel pointer to struct file when known
+};
+
+// This is the central "extended Task State Array" (eTSA)
+// to be used with BPF_MAP_TYPE_TASK_STORAGE for maximum awesomeness
+struct task_storage {
+    struct task_state state;   // ~180 bytes - what we emit to userspace
+    struct task_cache cache;   // ~24 bytes - internal BPF use only
+};
+
+// Request payload capture state (-Y), kept in a separate task storage map
+// that is only populated for tasks doing traced reads/writes
+struct task_payload {
     __u64 pending_trace_buf;        // userspace buffer pointer captured on syscall entry
     __u32 pending_trace_len;        // requested read length on syscall entry
     __s32 pending_trace_syscall;    // syscall number to correlate entry/exit
     __s32 pending_trace_fd;         // file descriptor associated with buffered payload
     __u8  pending_trace_is_write;   // direction hint (1=write,0=read)
     __u8  reserved_trace_flags[3];  // pad to keep alignment predictable
+
+    __u32 trace_payload_len;        // Length of captured request payload prefix
+    __s32 trace_payload_syscall;    // Syscall number associated with payload (if any)
+    __u64 trace_payload_seq_num;    // Syscall sequence number that produced payload
+    __u8  trace_payload[TRACE_PAYLOAD_LEN];
+};
+
+// Cached stacks for skipping stack walks of tasks that haven't been scheduled
+// since the previous sample, only created when -k or -u is enabled
+struct task_stack_cache {
     int cached_kstack_len;              // Cached kernel stack length
     __u64 cached_kstack[MAX_STACK_LEN]; // Cached kernel stack (127 entries)
-    int cached_ustack_len;              // Cached user stack length  
+    int cached_ustack_len;              // Cached user stack length
     __u64 cached_ustack[MAX_STACK_LEN]; // Cached user stack (127 entries)
-    __u64 uring_last_user_data;       // Last SQE user_data tracked for CQ correlation
-    __s32 uring_last_fd;              // Last SQE fd (or -1 for registered files)
-    __s32 uring_last_reg_idx;         // Last registered index when IOSQE_FIXED_FILE was used
-    __u64 uring_last_file_ptr;        // Kernel pointer to struct file when known
 };
 
-// This is the central "extended Task State Array" (eTSA)
-// to be used with BPF_MAP_TYPE_TASK_STORAGE for maximum awesomeness
-struct task_storage {
-    struct task_state state;   // ~160 bytes - what we emit to userspace
-    struct task_cache cache;   // ~2032 bytes - internal BPF use only
+// DWARF user stack unwinding (--dwarf-stacks, x86_64 only). Userspace compiles
+// the .eh_frame CFI of every mapped executable into rows sorted by pc, stored
+// once per build-id in the unwind_rows array, and describes each process's
+// executable mappings in unwind_procs so the iterator can find them by pc
+#define UNWIND_MAX_ROWS      (512 * 1024)
+#define UNWIND_MAX_MAPPINGS  32
+#define UNWIND_MAX_PROCS     4096
+#define UNWIND_BSEARCH_STEPS 20           // > log2(UNWIND_MAX_ROWS)
+
+#define UNWIND_CFA_UNKNOWN   0            // no usable CFI here, fall back to frame pointers
+#define UNWIND_CFA_SP        1            // CFA = rsp + cfa_offset
+#define UNWIND_CFA_FP        2            // CFA = rbp + cfa_offset
+#define UNWIND_CFA_END       3            // outermost frame, return address undefined
+
+struct unwind_row {
+    __u64 pc;                             // ELF virtual address where this row starts
+    __s32 cfa_offset;
+    __s16 fp_offset;                      // caller's rbp saved at CFA + fp_offset, 0 = unchanged
+    __u8  cfa_type;                       // UNWIND_CFA_*
+    __u8  pad;
+};
+
+struct unwind_mapping {
+    __u64 start;
+    __u64 end;
+    __u64 load_bias;                      // runtime address - ELF virtual address
+    __u32 first_row;                      // index into unwind_rows
+    __u32 nr_rows;                        // 0 = no CFI, frame pointers only
+};
+
+struct unwind_proc {
+    __u32 nr_mappings;
+    __u32 pad;
+    struct unwind_mapping mappings[UNWIND_MAX_MAPPINGS];
 };
 
 // Syscall completion event structure for ringbuf
@@ -205,6 +251,22 @@ struct iorq_completion_event {
 };
 
 
+// Per-CPU counters of records and map updates the BPF programs had to give up
+// on (xcap_drops map), summed and written to xcapture_selfstats_*.csv by userspace
+enum xcap_drop_counter {
+    XCAP_DROP_TASK_SAMPLES,       // task_samples ringbuf full
+    XCAP_DROP_STACK_TRACES,       // stack_traces ringbuf full
+    XCAP_DROP_SC_COMPLETION,      // completion_events ringbuf full, syscall end
+    XCAP_DROP_IORQ_COMPLETION,    // completion_events ringbuf full, I/O request end
+    XCAP_DROP_EMITTED_STACKS,     // emitted_stacks update failed
+    XCAP_DROP_TASK_AGG,           // task_agg insert failed (XCAP_AGG_MAX_KEYS reached)
+    XCAP_DROP_IORQ_TRACKING,      // iorq_tracking insert failed
+    XCAP_DROP_TASK_STORAGE,       // task storage create failed
+    XCAP_DROP_LATENCY_HIST,       // latency histogram insert failed (XCAP_HIST_MAX_KEYS reached)
+    XCAP_DROP_TASK_SEQ,           // task iterator seq_file buffer full, the task is shown again
+    XCAP_DROP_COUNTERS
+};
+
 // network connection tracking
 #define XCAPTURE_UNIX_PATH_MAX 108
 
@@ -306,12 +368,183 @@ struct task_output_event {
     // Extended task state storage (only the state portion)
     struct task_state storage;  // Was: struct task_storage storage
 
+    // Request payload prefix (only populated with -Y)
+    __u32 trace_payload_len;
+    __s32 trace_payload_syscall;
+    __u64 trace_payload_seq_num;
+    __u8  trace_payload[TRACE_PAYLOAD_LEN];
+
     // Stack trace hashes (actual stacks are written separately to kstacks file)
     __u64 kstack_hash;  // Hash of kernel stack (0 = no stack)
     __u64 ustack_hash;  // Hash of userspace stack (0 = no stack)
 
 };
 
+// Compact wire encoding of struct task_output_event, used for the task_samples
+// ringbuf and the iterator seq_file. A fixed header and the task_state snapshot
+// are followed by tagged sections that are only appended
+// when the sample has something in them. Strings are length-prefixed (no NUL).
+// Userspace decodes records back into struct task_output_event (task_wire.c).
+#define TASK_WIRE_MAX_SIZE   4096  // upper bound of an encoded record (power of 2)
+#define TASK_STATE_WIRE_SIZE sizeof(struct task_state)
+
+#define TASK_WIRE_SCHED_IN_EXECVE           0x01
+#define TASK_WIRE_SCHED_IN_IOWAIT           0x02
+#define TASK_WIRE_SCHED_IN_THRASHING        0x04
+#define TASK_WIRE_SCHED_REMOTE_WAKEUP       0x08
+
+enum task_wire_tag {
+    TASK_WIRE_FILENAME = 1,       // string
+    TASK_WIRE_EXE_FILE,           // string
+    TASK_WIRE_CMDLINE,            // raw argv bytes (NUL separated)
+    TASK_WIRE_SOCKET,             // struct socket_info up to unix_path + unix_path_len bytes
+    TASK_WIRE_TCP_STATS,          // struct tcp_stats_info
+    TASK_WIRE_AIO_FILENAME,       // string
+    TASK_WIRE_UR_FILENAME,        // string
+    TASK_WIRE_UR_SQ_FILENAME,     // string
+    TASK_WIRE_URING,              // struct task_wire_uring
+    TASK_WIRE_URING_DBG,          // struct task_wire_uring_dbg
+    TASK_WIRE_PAYLOAD,            // struct task_wire_payload + payload bytes
+};
+
+struct task_wire_header {
+    enum event_type type;         // EVENT_TASK_INFO
+    __u16 len;                    // total record length, including header and sections
+    __u8  sched_bits;             // TASK_WIRE_SCHED_*
+    __u8  pad;
+    pid_t pid;
+    pid_t tgid;
+    __u32 state;
+    __u32 flags;
+    uid_t euid;
+    __s32 emit_reason;
+    __s32 syscall_nr;
+    __s32 aio_fd;
+    __s32 on_cpu;
+    __s32 on_rq;
+    char  comm[TASK_COMM_LEN];
+    __u64 syscall_args[6];
+    __u64 migration_pending;
+    __u64 kstack_hash;
+    __u64 ustack_hash;
+    // followed by TASK_STATE_WIRE_SIZE bytes of struct task_state and the sections
+};
+
+struct task_wire_section {
+    __u16 tag;                    // enum task_wire_tag
+    __u16 len;                    // number of data bytes following this section header
+};
+
+struct task_wire_uring {
+    __s32 fd;
+    __s32 reg_idx;
+    __u64 offset;
+    __u32 len;
+    __u32 rw_flags;
+    __u8  opcode;
+    __u8  flags;
+    __u8  pad[6];
+};
+
+struct task_wire_uring_dbg {
+    __s32 sq_idx;
+    __s32 sq_fixed;
+    __u64 sq_user_data;
+    __u64 sq_file_ptr;
+    __s32 cq_scanned;
+    __s32 cq_matched;
+    __u64 cq_file_ptr;
+};
+
+struct task_wire_payload {
+    __u32 len;
+    __s32 syscall;
+    __u64 seq_num;
+    // followed by len bytes of payload
+};
+
+// emit_reason of samples taken by the perf_event on-CPU sampler (--oncpu-freq),
+// 1-6 are the task iterator's reasons, see should_emit_task() in task.bpf.c
+#define EMIT_REASON_ONCPU 7
+
+// Stack collection switched off at runtime by the overhead governor (--max-cpu),
+// userspace writes these bits to xcap_governor_skip in task.bpf.c's .bss
+#define XCAP_GOV_SKIP_USTACK (1U << 0)
+#define XCAP_GOV_SKIP_KSTACK (1U << 1)
+
+// Probe filters (-p, --cgroup, --syscalls), see src/filters/task_filters.h.
+// Syscall tracking attaches fentry/fexit programs to at most XCAP_FENTRY_SLOTS
+// syscall functions instead of the raw sys_enter/sys_exit tracepoints
+#define XCAP_MAX_FILTER_CGROUPS  64
+#define XCAP_MAX_SYSCALL_NR      1024
+#define XCAP_SYSCALL_SET_WORDS   (XCAP_MAX_SYSCALL_NR / 64)
+#define XCAP_FENTRY_SLOTS        8
+
+// Log-linear latency histograms (--syscall-hist, --iorq-hist): every power of two of
+// nanoseconds is split into 1 << XCAP_HIST_SUB_BITS equal buckets, slots 0-3
+// hold 0-3 ns. The last slot also takes everything from 2^41 ns (~36 min) on
+#define XCAP_HIST_SUB_BITS   2
+#define XCAP_HIST_SLOTS      160
+#define XCAP_HIST_MAX_KEYS   4096
+
+// What a latency histogram key identifies besides the syscall
+#define XCAP_HIST_BY_TGID    1
+#define XCAP_HIST_BY_CGROUP  2
+
+struct xcap_hist {
+    __u32 slots[XCAP_HIST_SLOTS];
+};
+
+struct sc_hist_key {
+    __u64 id;                     // TGID or cgroup id, see xcap_syscall_hist
+    __s32 syscall_nr;
+    __u32 pad;
+};
+
+struct iorq_hist_key {
+    __u64 cgroup_id;              // blkcg of the request's bio, 0 if it has none
+    __u32 dev;                    // MKDEV(major, minor)
+    __u32 op;                     // REQ_OP_* (cmd_flags & REQ_OP_MASK)
+};
+
+// In-kernel aggregation mode (--aggregate): get_tasks counts samples per
+// combination of the selected dimensions instead of emitting a record per task
+#define XCAP_AGG_STATE      (1U << 0)
+#define XCAP_AGG_SYSCALL    (1U << 1)
+#define XCAP_AGG_EXE        (1U << 2)
+#define XCAP_AGG_COMM       (1U << 3)
+#define XCAP_AGG_TGID       (1U << 4)
+#define XCAP_AGG_USER       (1U << 5)
+#define XCAP_AGG_CGROUP     (1U << 6)
+#define XCAP_AGG_KSTACK     (1U << 7)
+#define XCAP_AGG_USTACK     (1U << 8)
+
+#define XCAP_AGG_EXE_LEN    64
+#define XCAP_AGG_MAX_KEYS   16384
+
+struct task_agg_key {
+    __u32 state;                  // task state (with on_cpu/on_rq bits below for RUN/RUNQ)
+    __u8  on_cpu;
+    __u8  on_rq;
+    __u8  migration_pending;
+    __u8  oncpu_sampler;          // 1 = counted by the perf_event on-CPU sampler, its own weight
+    __s32 syscall_nr;
+    pid_t tgid;
+    uid_t euid;
+    __u32 pad2;
+    __u64 cgroup_id;
+    __u64 kstack_hash;
+    __u64 ustack_hash;
+    char  comm[TASK_COMM_LEN];
+    char  exe[XCAP_AGG_EXE_LEN];
+};
+
+struct task_agg_val {
+    __u64 count;                  // samples that fell into this key
+    pid_t pid;                    // one of the sampled TIDs (for cgroup path and stack lookups)
+    __u32 pad;
+};
+
 // Stack trace event for unique stacks
 struct stack_trace_event {
     enum event_type type;
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <linux/types.h>
 #include "xcapture_types.h"
 
 struct xcapture_context {
@@ -17,8 +18,28 @@ struct xcapture_context {
     bool print_cgroups;
     bool print_uring_debug;
     bool payload_trace_enabled;
+    bool dwarf_stacks;          // unwind user stacks with .eh_frame tables
+    bool pipelined;             // CSV output goes through the consumer/worker/writer threads
+    bool output_parquet;        // --format parquet, hourly .parquet files instead of .csv
+    enum compress_algo compress;    // --compress, CSV files become .csv.zst / .csv.lz4
+    bool raw_journal;           // --raw, records go unformatted into a journal for xcapture-decode
+    bool defer_symbols;         // --defer-symbols, user stacks are symbolized later by xcapture-symbolize
+    int rotate_minutes;         // --rotate, length of a file period (1, 5, 15 or 60)
+    bool hive_layout;           // --hive, files go into date=YYYY-MM-DD/hour=HH/ subdirectories
+    __u64 max_file_size;        // --max-file-size, rotate early when a file grows past it
+    __u64 retain_bytes;         // --retain-size, delete oldest files above this total
+    __u64 retain_free_bytes;    // --retain-free, delete oldest files below this much free space
+    const char *live_socket;    // --live, serve the last minutes of output on this Unix socket
+    int live_window_min;        // --live-window
+    __u64 live_bytes;           // --live-size, memory for all live tables
+    __u32 aggregate_dims;       // XCAP_AGG_* bits, 0 = per-sample output
+    bool selfstats;             // open xcapture_selfstats files, filled once selfstats_init() ran
+    int syscall_hist;           // --syscall-hist, XCAP_HIST_BY_*, 0 = off
+    bool iorq_hist;             // --iorq-hist
+    int hist_interval_sec;      // --hist-interval
     const char *output_dirname;
     long sample_weight_us;
+    long oncpu_weight_us;       // weight of perf_event on-CPU samples (--oncpu-freq)
     char *custom_columns;
     char *append_columns;
     struct output_files files;
@@ -3,12 +3,22 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <linux/types.h>
 
 struct time_correlation {
     struct timespec wall_time;    // CLOCK_REALTIME
     struct timespec mono_time;    // CLOCK_MONOTONIC: what bpf_ktime_get_ns() returns
 };
 
+struct pq_writer;
+
+// --compress, streaming compression of the CSV output files
+enum compress_algo {
+    COMPRESS_NONE,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4,
+};
+
 struct output_files {
     FILE *sample_file;
     FILE *sc_completion_file;
@@ -16,10 +26,26 @@ struct output_files {
     FILE *kstack_file;
     FILE *ustack_file;
     FILE *cgroup_file;
+    FILE *agg_file;
+    FILE *journal_file;                   // --raw writes only this one
+    FILE *uaddrs_file;                    // --defer-symbols writes these instead of ustack_file
+    FILE *umaps_file;
+    FILE *selfstats_file;                 // written by the sampler thread at every rotation
+    FILE *schist_file;                    // --syscall-hist, every --hist-interval and rotation
+    FILE *iohist_file;                    // --iorq-hist, likewise
+    struct pq_writer *sample_pq;          // --format parquet writes these instead of the CSV files
+    struct pq_writer *sc_completion_pq;   // (aggregates stay CSV)
+    struct pq_writer *iorq_completion_pq;
+    struct pq_writer *kstack_pq;
+    struct pq_writer *ustack_pq;
+    struct pq_writer *cgroup_pq;
     int current_year;    // Track full timestamp in case of long VM pauses
     int current_month;   // that may cause the timestamp to jump by 24 hours or more
     int current_day;
     int current_hour;
+    int current_minute;  // First minute of the period with --rotate < 60
+    int part;            // Size rotations within the current period
+    __u32 epoch;         // Bumped on every rotation, stacks get re-emitted into each new file
 };
 
 #endif /* __XCAPTURE_TYPES_H */
@@ -9,12 +9,16 @@
 
 #define XCAP_UNUSED(x) (void)(x)
 
+#define XCAPTURE_VERSION "3.0.3"
 #define DEFAULT_OUTPUT_DIR "."
 #define SAMPLE_CSV_FILENAME "xcapture_samples" // .csv will be appended later
 #define KSTACK_CSV_FILENAME "xcapture_kstacks"
 #define USTACK_CSV_FILENAME "xcapture_ustacks"
+#define UADDRS_CSV_FILENAME "xcapture_uaddrs"   // --defer-symbols, raw user stacks
+#define UMAPS_CSV_FILENAME "xcapture_umaps"     // --defer-symbols, process mapping snapshots
 #define SYSC_COMPLETION_CSV_FILENAME "xcapture_syscend"
 #define IORQ_COMPLETION_CSV_FILENAME "xcapture_iorqend"
+#define AGGREGATE_CSV_FILENAME "xcapture_aggregates"
 #define XCAP_BUFSIZ (256 * 1024)
 
 // Forward declarations
@@ -25,8 +29,10 @@ struct xcapture_context;
 extern const char *getusername(uid_t uid);
 extern const char *format_task_state(__u32 state, int on_rq, int on_cpu, void *migration_pending);
 extern const char *safe_syscall_name(__s32 syscall_nr);
+extern int syscall_nr_by_name(const char *name);
 extern const char *get_syscall_info_desc(__u32 syscall_nr);
 extern const char *get_iorq_op_flags(__u32 cmd_flags);
+extern const char *get_iorq_op_name(__u32 op);
 extern const char *format_connection(const struct socket_info *si, char *buf, size_t buflen);
 extern const char *get_connection_state(const struct socket_info *si);
 extern struct timespec get_wall_from_mono(struct time_correlation *tcorr, __u64 bpf_time);
@@ -34,9 +40,13 @@ extern struct timespec sub_ns_from_ts(struct timespec ts, __u64 ns);
 extern void get_str_from_ts(struct timespec ts, char *buf, size_t bufsize);
 extern void close_output_files(struct output_files *files);
 extern int check_and_rotate_files(struct output_files *files, const struct xcapture_context *ctx);
+extern bool output_files_rotation_due(const struct output_files *files, const struct xcapture_context *ctx);
+extern int open_output_files_at(struct output_files *files, const struct xcapture_context *ctx, time_t when);
 extern void add_unique_stack(__u64 hash, bool is_kernel);
 extern void reset_unique_stacks();
 extern const char* lookup_cached_stack(__u64 hash, bool is_kernel);
+extern void stack_cache_next_iteration(void);
+extern void stack_cache_destroy(bool print_stats);
 
 static inline void bytes_to_hex(const __u8 *src, size_t len, char *dst, size_t dstlen)
 {
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#ifndef __TASK_FILTERS_H
+#define __TASK_FILTERS_H
+
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+
+#include "xcapture.h"
+#include "../probes/xcapture_config.h"
+
+// Filters for -p, --cgroup and --syscalls. The tracking probes call these
+// before touching task storage or any map, so that the syscalls and I/Os of
+// tasks we don't sample cost only a few instructions. All filter values are
+// rodata, with no filter given the verifier prunes the checks away
+
+static __u64 __always_inline task_cgroup_id(struct task_struct *task)
+{
+    if (task->cgroups && task->cgroups->dfl_cgrp && task->cgroups->dfl_cgrp->kn)
+        return task->cgroups->dfl_cgrp->kn->id;
+    return 0;
+}
+
+static bool __always_inline cgroup_selected(__u64 cgroup_id)
+{
+    if (!xcap_nr_filter_cgroups)
+        return true;
+
+    for (int i = 0; i < XCAP_MAX_FILTER_CGROUPS; i++) {
+        if (i >= xcap_nr_filter_cgroups)
+            break;
+        if (xcap_filter_cgroups[i] == cgroup_id)
+            return true;
+    }
+    return false;
+}
+
+// For tracepoints and fentry programs running in the context of the task
+static bool __always_inline current_selected(struct task_struct *task)
+{
+    if (xcap_filter_tgid > 0 && task->tgid != xcap_filter_tgid)
+        return false;
+    return !xcap_nr_filter_cgroups || cgroup_selected(bpf_get_current_cgroup_id());
+}
+
+static bool __always_inline syscall_selected(long syscall_nr)
+{
+    if (!xcap_filter_syscalls)
+        return true;
+    if (syscall_nr < 0 || syscall_nr >= XCAP_MAX_SYSCALL_NR)
+        return false;
+    return xcap_syscall_set[syscall_nr / 64] & (1ULL << (syscall_nr % 64));
+}
+
+#endif /* __TASK_FILTERS_H */
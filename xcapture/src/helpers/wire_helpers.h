@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#ifndef __WIRE_HELPERS_H
+#define __WIRE_HELPERS_H
+
+#include <vmlinux.h>
+#include <bpf/bpf_helpers.h>
+
+#include "xcapture.h"
+
+// Encode a fully populated task_output_event into the compact wire format
+// (see struct task_wire_header in xcapture.h). The destination buffer is
+// 2 * TASK_WIRE_MAX_SIZE bytes, so masking the running offset keeps every
+// write provably in bounds for the verifier without per-section checks.
+// The sum of all section maximums stays below TASK_WIRE_MAX_SIZE, so the
+// mask never changes a real offset.
+
+#define TASK_WIRE_OFF_MASK (TASK_WIRE_MAX_SIZE - 1)
+
+static __always_inline __u32 wire_put_str(__u8 *buf, __u32 off, __u16 tag,
+                                          const char *str, __u32 size)
+{
+    if (!str[0])
+        return off;
+
+    off &= TASK_WIRE_OFF_MASK;
+    long len = bpf_probe_read_kernel_str(buf + off + sizeof(struct task_wire_section), size, str);
+    if (len <= 1)
+        return off;
+
+    struct task_wire_section sec = { .tag = tag, .len = len - 1 }; // drop the NUL
+    __builtin_memcpy(buf + off, &sec, sizeof(sec));
+
+    return off + sizeof(sec) + sec.len;
+}
+
+static __always_inline __u32 wire_put_bytes(__u8 *buf, __u32 off, __u16 tag,
+                                            const void *data, __u32 size)
+{
+    off &= TASK_WIRE_OFF_MASK;
+    if (size > TASK_WIRE_MAX_SIZE - sizeof(struct task_wire_section))
+        return off;
+
+    struct task_wire_section sec = { .tag = tag, .len = size };
+    __builtin_memcpy(buf + off, &sec, sizeof(sec));
+    bpf_probe_read_kernel(buf + off + sizeof(sec), size, data);
+
+    return off + sizeof(sec) + size;
+}
+
+static __always_inline __u32 wire_put_payload(__u8 *buf, __u32 off, const struct task_output_event *event)
+{
+    __u32 len = event->trace_payload_len;
+    if (len > TRACE_PAYLOAD_LEN)
+        len = TRACE_PAYLOAD_LEN;
+
+    struct task_wire_payload p = {
+        .len = len,
+        .syscall = event->trace_payload_syscall,
+        .seq_num = event->trace_payload_seq_num,
+    };
+
+    off &= TASK_WIRE_OFF_MASK;
+    struct task_wire_section sec = { .tag = TASK_WIRE_PAYLOAD, .len = sizeof(p) + len };
+    __builtin_memcpy(buf + off, &sec, sizeof(sec));
+    bpf_probe_read_kernel(buf + off + sizeof(sec), sizeof(p), &p);
+    bpf_probe_read_kernel(buf + off + sizeof(sec) + sizeof(p), len, event->trace_payload);
+
+    return off + sizeof(sec) + sec.len;
+}
+
+// returns the encoded record length
+static __always_inline __u32 encode_task_event(__u8 *buf, const struct task_output_event *event)
+{
+    struct task_wire_header *hdr = (struct task_wire_header *)buf;
+    __u32 off = sizeof(*hdr) + TASK_STATE_WIRE_SIZE;
+
+    hdr->type = event->type;
+    hdr->sched_bits = (event->in_execve ? TASK_WIRE_SCHED_IN_EXECVE : 0) |
+                      (event->in_iowait ? TASK_WIRE_SCHED_IN_IOWAIT : 0) |
+                      (event->in_thrashing ? TASK_WIRE_SCHED_IN_THRASHING : 0) |
+                      (event->sched_remote_wakeup ? TASK_WIRE_SCHED_REMOTE_WAKEUP : 0);
+    hdr->pad = 0;
+    hdr->pid = event->pid;
+    hdr->tgid = event->tgid;
+    hdr->state = event->state;
+    hdr->flags = event->flags;
+    hdr->euid = event->euid;
+    hdr->emit_reason = event->emit_reason;
+    hdr->syscall_nr = event->syscall_nr;
+    hdr->aio_fd = event->aio_fd;
+    hdr->on_cpu = event->on_cpu;
+    hdr->on_rq = event->on_rq;
+    __builtin_memcpy(hdr->comm, event->comm, sizeof(hdr->comm));
+    __builtin_memcpy(hdr->syscall_args, event->syscall_args, sizeof(hdr->syscall_args));
+    hdr->migration_pending = (__u64)event->migration_pending;
+    hdr->kstack_hash = event->kstack_hash;
+    hdr->ustack_hash = event->ustack_hash;
+
+    __builtin_memcpy(buf + sizeof(*hdr), &event->storage, TASK_STATE_WIRE_SIZE);
+
+    off = wire_put_str(buf, off, TASK_WIRE_FILENAME, event->filename, sizeof(event->filename));
+    off = wire_put_str(buf, off, TASK_WIRE_EXE_FILE, event->exe_file, sizeof(event->exe_file));
+
+    if (event->cmdline_len > 0 && event->cmdline_len < MAX_CMDLINE_LEN)
+        off = wire_put_bytes(buf, off, TASK_WIRE_CMDLINE, event->cmdline, event->cmdline_len);
+
+    if (event->has_socket_info) {
+        __u32 path_len = event->sock_info.unix_path_len;
+        if (path_len > XCAPTURE_UNIX_PATH_MAX)
+            path_len = 0;
+        off = wire_put_bytes(buf, off, TASK_WIRE_SOCKET, &event->sock_info,
+                             __builtin_offsetof(struct socket_info, unix_path) + path_len);
+    }
+
+    if (event->has_tcp_stats)
+        off = wire_put_bytes(buf, off, TASK_WIRE_TCP_STATS, &event->tcp_stats, sizeof(event->tcp_stats));
+
+    off = wire_put_str(buf, off, TASK_WIRE_AIO_FILENAME, event->aio_filename, sizeof(event->aio_filename));
+    off = wire_put_str(buf, off, TASK_WIRE_UR_FILENAME, event->ur_filename, sizeof(event->ur_filename));
+    off = wire_put_str(buf, off, TASK_WIRE_UR_SQ_FILENAME, event->ur_sq_filename, sizeof(event->ur_sq_filename));
+
+    if (event->uring_fd != -1 || event->uring_reg_idx != -1 || event->uring_opcode ||
+        event->uring_flags || event->uring_offset || event->uring_len || event->uring_rw_flags) {
+        struct task_wire_uring ur = {
+            .fd = event->uring_fd,
+            .reg_idx = event->uring_reg_idx,
+            .offset = event->uring_offset,
+            .len = event->uring_len,
+            .rw_flags = event->uring_rw_flags,
+            .opcode = event->uring_opcode,
+            .flags = event->uring_flags,
+        };
+        off = wire_put_bytes(buf, off, TASK_WIRE_URING, &ur, sizeof(ur));
+    }
+
+    if (event->uring_dbg_sq_idx != -1 || event->uring_dbg_sq_fixed || event->uring_dbg_sq_user_data ||
+        event->uring_dbg_sq_file_ptr || event->uring_dbg_cq_scanned || event->uring_dbg_cq_matched ||
+        event->uring_dbg_cq_file_ptr) {
+        struct task_wire_uring_dbg dbg = {
+            .sq_idx = event->uring_dbg_sq_idx,
+            .sq_fixed = event->uring_dbg_sq_fixed,
+            .sq_user_data = event->uring_dbg_sq_user_data,
+            .sq_file_ptr = event->uring_dbg_sq_file_ptr,
+            .cq_scanned = event->uring_dbg_cq_scanned,
+            .cq_matched = event->uring_dbg_cq_matched,
+            .cq_file_ptr = event->uring_dbg_cq_file_ptr,
+        };
+        off = wire_put_bytes(buf, off, TASK_WIRE_URING_DBG, &dbg, sizeof(dbg));
+    }
+
+    if (event->trace_payload_len > 0)
+        off = wire_put_payload(buf, off, event);
+
+    hdr->len = off;
+    return off;
+}
+
+#endif /* __WIRE_HELPERS_H */
@@ -16,6 +16,25 @@ struct {
     __uint(pinning, XCAP_MAP_PINNING);
 } task_storage SEC(".maps");
 
+// Side storage for request payload capture (-Y) and cached stacks (-k/-u).
+// Kept out of task_storage so that tasks only pay for them when the feature
+// is enabled (task storage entries are only created with F_CREATE)
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct task_payload);
+    __uint(pinning, XCAP_MAP_PINNING);
+} task_payloads SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct task_stack_cache);
+    __uint(pinning, XCAP_MAP_PINNING);
+} task_stacks SEC(".maps");
+
 // Ring buffers for event completion records and sampled task info
 struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
@@ -38,13 +57,31 @@ struct {
 } stack_traces SEC(".maps");
 
 // Map for tracking which stack traces have already been emitted
-// Key is the stack hash value, value is a flag (1 = emitted)
+// Key is the stack hash value, value is the output file epoch it was emitted in.
+// LRU keeps kernel memory bounded, an evicted stack just gets emitted again
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1024 * 1024);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 256 * 1024);
     __type(key, __u64);
-    __type(value, __u8);
+    __type(value, __u32);
     __uint(pinning, XCAP_MAP_PINNING);
 } emitted_stacks SEC(".maps");
 
+// Drop and error counters, indexed by enum xcap_drop_counter. Shared by all
+// programs like the ring buffers, userspace reads the per-CPU sums
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, XCAP_DROP_COUNTERS);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, XCAP_MAP_PINNING);
+} xcap_drops SEC(".maps");
+
+static void __always_inline count_drop(__u32 counter)
+{
+    __u64 *cnt = bpf_map_lookup_elem(&xcap_drops, &counter);
+    if (cnt)
+        __sync_fetch_and_add(cnt, 1);
+}
+
 #endif /* XCAPTURE_MAPS_COMMON_H */
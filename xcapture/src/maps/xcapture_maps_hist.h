@@ -0,0 +1,48 @@
+#ifndef XCAPTURE_MAPS_HIST_H
+#define XCAPTURE_MAPS_HIST_H
+
+// Latency histograms, drained and cleared by userspace every --hist-interval
+// with bpf_map_lookup_and_delete_batch(). Only the keys seen during the
+// interval take memory, a slot array per key and CPU
+
+// Per syscall and TGID or cgroup (--syscall-hist), counted at syscall exit
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(max_entries, XCAP_HIST_MAX_KEYS);
+    __type(key, struct sc_hist_key);
+    __type(value, struct xcap_hist);
+} syscall_hist SEC(".maps");
+
+// Per block device, op and cgroup (--iorq-hist), counted at request completion
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(max_entries, XCAP_HIST_MAX_KEYS);
+    __type(key, struct iorq_hist_key);
+    __type(value, struct xcap_hist);
+} iorq_hist SEC(".maps");
+
+// New keys start from this, a histogram doesn't fit on the BPF stack
+static struct xcap_hist hist_zero;
+
+static void __always_inline hist_add(void *map, const void *key, __u64 ns)
+{
+    struct xcap_hist *hist = bpf_map_lookup_elem(map, key);
+
+    if (!hist) {
+        // EEXIST when another CPU inserted it first, fine as well
+        bpf_map_update_elem(map, key, &hist_zero, BPF_NOEXIST);
+        hist = bpf_map_lookup_elem(map, key);
+        if (!hist) {
+            count_drop(XCAP_DROP_LATENCY_HIST);
+            return;
+        }
+    }
+
+    __u32 slot = hist_slot(ns);
+    if (slot < XCAP_HIST_SLOTS)
+        hist->slots[slot]++;
+}
+
+#endif /* XCAPTURE_MAPS_HIST_H */
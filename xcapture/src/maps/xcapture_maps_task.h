@@ -0,0 +1,79 @@
+#ifndef XCAPTURE_MAPS_TASK_H
+#define XCAPTURE_MAPS_TASK_H
+
+// Maps used only by the task iterator program (and the on-CPU sampler)
+
+// The per-CPU scratch maps have one slot per program, the perf_event on-CPU
+// sampler can interrupt get_tasks on the same CPU halfway through a sample
+#define SCRATCH_SLOT_ITER  0
+#define SCRATCH_SLOT_ONCPU 1
+#define SCRATCH_SLOTS      2
+
+// Per-CPU scratch area where get_tasks assembles a full task sample before
+// encoding it into the compact wire format. Sleepable iterators run with
+// migration disabled, so a single slot per CPU is enough.
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, SCRATCH_SLOTS);
+    __type(key, __u32);
+    __type(value, struct task_output_event);
+} task_event_scratch SEC(".maps");
+
+// Per-CPU buffer for the encoded record (see wire_helpers.h). It is twice the
+// maximum record size so that masked section offsets always stay in bounds.
+struct task_wire_buf {
+    __u8 data[TASK_WIRE_MAX_SIZE * 2];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, SCRATCH_SLOTS);
+    __type(key, __u32);
+    __type(value, struct task_wire_buf);
+} task_wire_scratch SEC(".maps");
+
+// Sample counters for --aggregate mode, drained and cleared by userspace
+// after every iteration with bpf_map_lookup_and_delete_batch()
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(max_entries, XCAP_AGG_MAX_KEYS);
+    __type(key, struct task_agg_key);
+    __type(value, struct task_agg_val);
+} task_agg SEC(".maps");
+
+// Aggregation key is too large for the BPF stack next to everything else in get_tasks
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, SCRATCH_SLOTS);
+    __type(key, __u32);
+    __type(value, struct task_agg_key);
+} task_agg_key_scratch SEC(".maps");
+
+// Compiled .eh_frame unwind rows of all known executables (--dwarf-stacks),
+// userspace mmaps this array and appends the rows of every new build-id
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(max_entries, UNWIND_MAX_ROWS);
+    __type(key, __u32);
+    __type(value, struct unwind_row);
+} unwind_rows SEC(".maps");
+
+// Executable mappings of each process (keyed by tgid) pointing into unwind_rows
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, UNWIND_MAX_PROCS);
+    __type(key, pid_t);
+    __type(value, struct unwind_proc);
+} unwind_procs SEC(".maps");
+
+// Stack buffers of the on-CPU sampler, bpf_get_stack() output is too big for the BPF stack
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct task_stack_cache);
+} oncpu_stack_scratch SEC(".maps");
+
+#endif /* XCAPTURE_MAPS_TASK_H */
@@ -10,25 +10,34 @@
 #include "maps/xcapture_maps_common.h"
 #include "maps/xcapture_maps_iorq_classic.h"
 #include "xcapture_helpers.h"
+#include "maps/xcapture_maps_hist.h"
+#include "filters/task_filters.h"
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
-// Classic hashtable-based I/O request tracking
+// Classic hashtable-based I/O request tracking. With -p or --cgroup only the
+// requests of selected tasks are tracked, the others could never be sampled
 
 SEC("tp_btf/block_rq_insert")
 int BPF_PROG(xcap_iorq_insert, struct request *rq)
 {
     struct task_struct *task = bpf_get_current_task_btf();
+    if (!current_selected(task))
+        return 0;
+
     struct task_storage *storage = bpf_task_storage_get(&task_storage, task, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
-    if (!storage)
+    if (!storage) {
+        count_drop(XCAP_DROP_TASK_STORAGE);
         return 0;
+    }
 
     struct iorq_info info = {0};
     storage->state.last_iorq_rq = rq;
     info.iorq_sequence_num = ++storage->state.iorq_sequence_num;
     info.insert_pid = task->pid;
     info.insert_tgid = task->tgid;
-    bpf_map_update_elem(&iorq_tracking, &rq, &info, BPF_ANY);
+    if (bpf_map_update_elem(&iorq_tracking, &rq, &info, BPF_ANY))
+        count_drop(XCAP_DROP_IORQ_TRACKING);
     return 0;
 }
 
@@ -36,27 +45,62 @@ SEC("tp_btf/block_rq_issue")
 int BPF_PROG(xcap_iorq_issue, struct request *rq)
 {
     struct task_struct *task = bpf_get_current_task_btf();
-    struct task_storage *storage = bpf_task_storage_get(&task_storage, task, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
-    if (!storage)
-        return 0;
 
+    // requests inserted by a selected task are followed whoever issues them
     struct iorq_info *info = bpf_map_lookup_elem(&iorq_tracking, &rq);
     if (info) {
         info->issue_pid = task->pid;
         info->issue_tgid = task->tgid;
-    } else {
-        struct iorq_info ni = {0};
-        storage->state.last_iorq_rq = rq;
-        ni.iorq_sequence_num = ++storage->state.iorq_sequence_num;
-        ni.insert_pid = task->pid;
-        ni.insert_tgid = task->tgid;
-        ni.issue_pid = task->pid;
-        ni.issue_tgid = task->tgid;
-        bpf_map_update_elem(&iorq_tracking, &rq, &ni, BPF_ANY);
+        return 0;
     }
+
+    if (!current_selected(task))
+        return 0;
+
+    struct task_storage *storage = bpf_task_storage_get(&task_storage, task, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (!storage) {
+        count_drop(XCAP_DROP_TASK_STORAGE);
+        return 0;
+    }
+
+    struct iorq_info ni = {0};
+    storage->state.last_iorq_rq = rq;
+    ni.iorq_sequence_num = ++storage->state.iorq_sequence_num;
+    ni.insert_pid = task->pid;
+    ni.insert_tgid = task->tgid;
+    ni.issue_pid = task->pid;
+    ni.issue_tgid = task->tgid;
+    if (bpf_map_update_elem(&iorq_tracking, &rq, &ni, BPF_ANY))
+        count_drop(XCAP_DROP_IORQ_TRACKING);
     return 0;
 }
 
+// --iorq-hist counts the service time (issue to completion) of every request,
+// sampled or not. With -p only the requests tracked for the process are known,
+// --cgroup is matched against the cgroup the request is charged to
+static void __always_inline count_iorq_latency(struct request *rq, bool tracked)
+{
+    __u64 issue_time = BPF_CORE_READ(rq, io_start_time_ns);
+    if (!issue_time)
+        return;
+
+    if (xcap_filter_tgid > 0 && !tracked)
+        return;
+
+    struct iorq_hist_key key = {
+        .cgroup_id = get_rq_cgroup_id(rq),
+        .op = BPF_CORE_READ(rq, cmd_flags) & 0xff,  // REQ_OP_MASK
+    };
+    if (!cgroup_selected(key.cgroup_id))
+        return;
+
+    struct gendisk *disk = get_disk(rq);
+    if (disk)
+        key.dev = MKDEV(BPF_CORE_READ(disk, major), BPF_CORE_READ(disk, first_minor));
+
+    hist_add(&iorq_hist, &key, bpf_ktime_get_ns() - issue_time);
+}
+
 SEC("tp_btf/block_rq_complete")
 int BPF_PROG(xcap_iorq_complete, struct request *rq, int error, unsigned int nr_bytes)
 {
@@ -64,14 +108,20 @@ int BPF_PROG(xcap_iorq_complete, struct request *rq, int error, unsigned int nr_
         return 0;
 
     struct iorq_info *iorq_info = bpf_map_lookup_elem(&iorq_tracking, &rq);
+
+    if (xcap_iorq_hist)
+        count_iorq_latency(rq, iorq_info != NULL);
+
     if (!iorq_info)
         return 0;
     if (!iorq_info->iorq_sampled)
         goto cleanup;
 
     struct iorq_completion_event *event = bpf_ringbuf_reserve(&completion_events, sizeof(*event), 0);
-    if (!event)
+    if (!event) {
+        count_drop(XCAP_DROP_IORQ_COMPLETION);
         goto cleanup;
+    }
 
     event->type = EVENT_IORQ_COMPLETION;
     event->rq = rq;
@@ -6,6 +6,8 @@
 #include "xcapture_config.h"
 #include "xcapture_helpers.h"
 #include "maps/xcapture_maps_common.h"
+#include "maps/xcapture_maps_hist.h"
+#include "filters/task_filters.h"
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
@@ -107,22 +109,37 @@ static __u32 __always_inline get_num_inflight_aios_ring(__u64 ctx_id)
 }
 
 
-// syscall entry & exit handlers for active tracking mode
-SEC("tp_btf/sys_enter")
-int BPF_PROG(xcap_sys_enter, struct pt_regs *regs, long syscall_nr)
+// Syscall number of the user registers, for filtering on sys_exit
+static long __always_inline regs_syscall_nr(struct pt_regs *regs)
+{
+#if defined(__TARGET_ARCH_x86)
+    return BPF_CORE_READ(regs, orig_ax);
+#elif defined(__TARGET_ARCH_arm64)
+    return BPF_CORE_READ(regs, syscallno);
+#else
+    return -1;
+#endif
+}
+
+// syscall entry & exit handlers for active tracking mode, called by the raw
+// tracepoint programs for all syscalls or by the fentry/fexit slot programs
+// for the syscall functions given with --syscalls
+static int __always_inline handle_sys_enter(struct task_struct *task, struct pt_regs *regs, long syscall_nr)
 {
     struct task_storage *storage;
-    struct task_struct *task = bpf_get_current_task_btf();
-    if (!task)
-        return 0;
 
     storage = bpf_task_storage_get(&task_storage, task, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
-    if (!storage)
+    if (!storage) {
+        count_drop(XCAP_DROP_TASK_STORAGE);
         return 0;
+    }
 
     storage->state.sc_enter_time = bpf_ktime_get_ns();
     storage->state.in_syscall_nr = syscall_nr;
     storage->state.sc_sequence_num++;
+    // a sample taken during an untracked syscall must not emit this one's completion
+    if (xcap_filter_syscalls)
+        storage->state.sc_sampled = false;
 
     if (syscall_nr == __NR_io_getevents || syscall_nr == __NR_io_pgetevents) {
         __u64 ctx_id = PT_REGS_PARM1_CORE_SYSCALL(regs); // aio ctx_id (process-wide mem addr)
@@ -131,48 +148,60 @@ int BPF_PROG(xcap_sys_enter, struct pt_regs *regs, long syscall_nr)
 
     if (xcap_capture_rw_payloads) {
         struct rw_capture_state state = {};
-
-        storage->cache.pending_trace_buf = 0;
-        storage->cache.pending_trace_len = 0;
-        storage->cache.pending_trace_syscall = -1;
-        storage->cache.pending_trace_fd = -1;
-        storage->cache.pending_trace_is_write = 0;
-
-        if (get_rw_capture_state(syscall_nr, regs, &state)) {
-            __u32 copy_len = state.len > TRACE_COPY_LEN ? TRACE_COPY_LEN : (__u32) state.len;
-            storage->cache.pending_trace_buf = (__u64) state.buf;
-            storage->cache.pending_trace_len = copy_len;
-            storage->cache.pending_trace_syscall = syscall_nr;
-            storage->cache.pending_trace_fd = state.fd;
-            storage->cache.pending_trace_is_write = state.is_write;
+        bool capture = get_rw_capture_state(syscall_nr, regs, &state);
+
+        // payload storage is only allocated for tasks that actually do traced reads/writes
+        struct task_payload *payload = bpf_task_storage_get(&task_payloads, task, NULL,
+                                           capture ? BPF_LOCAL_STORAGE_GET_F_CREATE : 0);
+        if (!payload && capture)
+            count_drop(XCAP_DROP_TASK_STORAGE);
+        if (payload) {
+            payload->pending_trace_buf = 0;
+            payload->pending_trace_len = 0;
+            payload->pending_trace_syscall = -1;
+            payload->pending_trace_fd = -1;
+            payload->pending_trace_is_write = 0;
+
+            if (capture) {
+                __u32 copy_len = state.len > TRACE_COPY_LEN ? TRACE_COPY_LEN : (__u32) state.len;
+                payload->pending_trace_buf = (__u64) state.buf;
+                payload->pending_trace_len = copy_len;
+                payload->pending_trace_syscall = syscall_nr;
+                payload->pending_trace_fd = state.fd;
+                payload->pending_trace_is_write = state.is_write;
+            }
         }
     }
 
     return 0;
 }
 
-SEC("tp_btf/sys_exit")
-int BPF_PROG(xcap_sys_exit, struct pt_regs *regs, long ret)
+static int __always_inline handle_sys_exit(struct task_struct *task, long ret)
 {
     struct task_storage *storage;
-    struct task_struct *task = bpf_get_current_task_btf();
     storage = bpf_task_storage_get(&task_storage, task, NULL,
                                   BPF_LOCAL_STORAGE_GET_F_CREATE);
-    if (!storage)
+    if (!storage) {
+        count_drop(XCAP_DROP_TASK_STORAGE);
         return 0;
+    }
 
-    if (xcap_capture_rw_payloads) {
-        __u64 buf_addr = storage->cache.pending_trace_buf;
-        __s32 pending_nr = storage->cache.pending_trace_syscall;
-        __u32 requested_len = storage->cache.pending_trace_len;
-        __s32 pending_fd = storage->cache.pending_trace_fd;
-        storage->cache.pending_trace_buf = 0;
-        storage->cache.pending_trace_len = 0;
-        storage->cache.pending_trace_syscall = -1;
-        storage->cache.pending_trace_fd = -1;
-        storage->cache.pending_trace_is_write = 0;
-
-        storage->state.trace_payload_len = 0;
+    struct task_payload *payload = NULL;
+    if (xcap_capture_rw_payloads)
+        payload = bpf_task_storage_get(&task_payloads, task, NULL, 0);
+
+    if (payload) {
+        __u64 buf_addr = payload->pending_trace_buf;
+        __s32 pending_nr = payload->pending_trace_syscall;
+        __u32 requested_len = payload->pending_trace_len;
+        __s32 pending_fd = payload->pending_trace_fd;
+        payload->pending_trace_buf = 0;
+        payload->pending_trace_len = 0;
+        payload->pending_trace_syscall = -1;
+        payload->pending_trace_fd = -1;
+        payload->pending_trace_is_write = 0;
+
+        payload->trace_payload_len = 0;
 
         if (!buf_addr || requested_len == 0 || pending_nr != storage->state.in_syscall_nr)
             goto skip_payload_copy;
@@ -191,23 +220,30 @@ int BPF_PROG(xcap_sys_exit, struct pt_regs *regs, long ret)
         if (copy_len == 0)
             goto skip_payload_copy;
 
-        storage->state.trace_payload_len = copy_len;
-        int err = bpf_probe_read_user(storage->state.trace_payload, copy_len, (void *) buf_addr);
+        payload->trace_payload_len = copy_len;
+        int err = bpf_probe_read_user(payload->trace_payload, copy_len, (void *) buf_addr);
         if (err != 0) {
-            storage->state.trace_payload_len = 0;
-            storage->state.trace_payload_syscall = -1;
-            storage->state.trace_payload_seq_num = (unsigned long long)(-err);
+            payload->trace_payload_len = 0;
+            payload->trace_payload_syscall = -1;
+            payload->trace_payload_seq_num = (unsigned long long)(-err);
         } else {
-            storage->state.trace_payload_syscall = pending_nr;
-            storage->state.trace_payload_seq_num = storage->state.sc_sequence_num;
+            payload->trace_payload_syscall = pending_nr;
+            payload->trace_payload_seq_num = storage->state.sc_sequence_num;
         }
 
 skip_payload_copy:
         ;
-    } else {
-        storage->state.trace_payload_len = 0;
-        storage->state.trace_payload_syscall = -1;
-        storage->state.trace_payload_seq_num = 0;
+    }
+
+    // Every tracked syscall goes into the histograms, not just the sampled ones.
+    // Tasks that were already in a syscall when tracking started have no enter
+    // time yet (or only the sampler's guess), sc_sequence_num is 0 for them
+    if (xcap_syscall_hist && storage->state.sc_sequence_num && storage->state.in_syscall_nr >= 0) {
+        struct sc_hist_key key = {
+            .id = xcap_syscall_hist == XCAP_HIST_BY_CGROUP ? bpf_get_current_cgroup_id() : task->tgid,
+            .syscall_nr = storage->state.in_syscall_nr,
+        };
+        hist_add(&syscall_hist, &key, bpf_ktime_get_ns() - storage->state.sc_enter_time);
     }
 
     if (!storage->state.sc_sampled) { // only emit syscalls caught by task sampler
@@ -220,9 +256,9 @@ skip_payload_copy:
             __builtin_memset(scevent, 0, sizeof(*scevent));
 
             __u64 exit_time = bpf_ktime_get_ns();
-            __u32 payload_len = storage->state.trace_payload_len;
-            __s32 payload_syscall = storage->state.trace_payload_syscall;
-            __u64 payload_seq = storage->state.trace_payload_seq_num;
+            __u32 payload_len = payload ? payload->trace_payload_len : 0;
+            __s32 payload_syscall = payload ? payload->trace_payload_syscall : -1;
+            __u64 payload_seq = payload ? payload->trace_payload_seq_num : 0;
 
             if (payload_len > TRACE_PAYLOAD_LEN)
                 payload_len = TRACE_PAYLOAD_LEN;
@@ -243,10 +279,10 @@ skip_payload_copy:
             scevent->trace_payload_syscall = payload_syscall;
             scevent->trace_payload_seq_num = payload_seq;
 
-            if (payload_len > 0) {
+            if (payload && payload_len > 0) {
                 if (bpf_probe_read_kernel(scevent->trace_payload,
                                           payload_len,
-                                          storage->state.trace_payload) != 0) {
+                                          payload->trace_payload) != 0) {
                     scevent->trace_payload_len = 0;
                     scevent->trace_payload_syscall = -1;
                     scevent->trace_payload_seq_num = 0;
@@ -254,6 +290,8 @@ skip_payload_copy:
             }
 
             bpf_ringbuf_submit(scevent, 0);
+        } else {
+            count_drop(XCAP_DROP_SC_COMPLETION);
         }
     }
 
@@ -261,5 +299,64 @@ skip_payload_copy:
     storage->state.sc_sampled = false;
     storage->state.in_syscall_nr = -1;
     // storage->state.sc_enter_time = 0;
+    // with --syscalls, samples taken in any other syscall must not look like this one
+    if (xcap_filter_syscalls)
+        storage->state.sc_enter_time = 0;
     return 0;
 }
+
+SEC("tp_btf/sys_enter")
+int BPF_PROG(xcap_sys_enter, struct pt_regs *regs, long syscall_nr)
+{
+    struct task_struct *task = bpf_get_current_task_btf();
+
+    if (!task || !current_selected(task) || !syscall_selected(syscall_nr))
+        return 0;
+
+    return handle_sys_enter(task, regs, syscall_nr);
+}
+
+SEC("tp_btf/sys_exit")
+int BPF_PROG(xcap_sys_exit, struct pt_regs *regs, long ret)
+{
+    struct task_struct *task = bpf_get_current_task_btf();
+
+    if (!task || !current_selected(task))
+        return 0;
+    if (xcap_filter_syscalls && !syscall_selected(regs_syscall_nr(regs)))
+        return 0;
+
+    return handle_sys_exit(task, ret);
+}
+
+// fentry/fexit on the syscall functions (__x64_sys_*, __arm64_sys_*) of at most
+// XCAP_FENTRY_SLOTS syscalls: userspace sets the attach target of the slots it
+// uses and doesn't load the rest, nor the tracepoint programs above. Only the
+// selected syscalls then run any BPF code at all
+#define XCAP_SYSCALL_FENTRY_SLOT(slot)                                              \
+SEC("fentry")                                                                       \
+int BPF_PROG(xcap_sys_enter_##slot, struct pt_regs *regs)                           \
+{                                                                                   \
+    struct task_struct *task = bpf_get_current_task_btf();                          \
+    if (!current_selected(task))                                                    \
+        return 0;                                                                   \
+    return handle_sys_enter(task, regs, xcap_fentry_syscalls[slot]);                \
+}                                                                                   \
+                                                                                    \
+SEC("fexit")                                                                        \
+int BPF_PROG(xcap_sys_exit_##slot, struct pt_regs *regs, long ret)                  \
+{                                                                                   \
+    struct task_struct *task = bpf_get_current_task_btf();                          \
+    if (!current_selected(task))                                                    \
+        return 0;                                                                   \
+    return handle_sys_exit(task, ret);                                              \
+}
+
+XCAP_SYSCALL_FENTRY_SLOT(0)
+XCAP_SYSCALL_FENTRY_SLOT(1)
+XCAP_SYSCALL_FENTRY_SLOT(2)
+XCAP_SYSCALL_FENTRY_SLOT(3)
+XCAP_SYSCALL_FENTRY_SLOT(4)
+XCAP_SYSCALL_FENTRY_SLOT(5)
+XCAP_SYSCALL_FENTRY_SLOT(6)
+XCAP_SYSCALL_FENTRY_SLOT(7)
@@ -7,6 +7,7 @@
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_tracing.h>
 
+#include "xcapture.h"
 #include "maps/xcapture_maps_common.h"
 
 // platform specific syscall stuff
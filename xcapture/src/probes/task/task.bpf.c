@@ -9,12 +9,15 @@
 #include "xcapture.h"
 #include "maps/xcapture_maps_common.h"
 #include "maps/xcapture_maps_iorq_classic.h"
+#include "maps/xcapture_maps_task.h"
 #include "xcapture_config.h"
 #include "xcapture_helpers.h"
+#include "filters/task_filters.h"
 #include "helpers/file_helpers.h"
 #include "helpers/tcp_helpers_simple.h"
 #include "helpers/fd_helpers.h"
 #include "helpers/io_helpers.h"
+#include "helpers/wire_helpers.h"
 
 #if defined(__TARGET_ARCH_arm64)
 #include "syscall_aarch64.h"
@@ -32,6 +35,14 @@ extern int LINUX_KERNEL_VERSION __kconfig;
 #define PAGE_SIZE 4096
 #define EAGAIN    11
 
+// Output file epoch, bumped by userspace whenever the CSV files rotate, so that every
+// hourly stack file gets its own copy of the stacks referenced by its samples
+volatile __u32 xcap_stack_epoch = 0;
+
+// XCAP_GOV_SKIP_* bits, set by the --max-cpu governor to shed stack collection
+// without reloading the programs (the rodata -k/-u flags are fixed at load time)
+volatile __u32 xcap_governor_skip = 0;
+
 // Version-adaptive task state field retrieval
 static __u32 __always_inline get_task_state(void *arg)
 {
@@ -54,6 +65,7 @@ static __u32 __always_inline get_task_state(void *arg)
 //   4 - interruptible READ on non-daemon port (active client)
 //   5 - default path (task deemed interesting)
 //   6 - interruptible READ on UNIX stream socket with active peer
+//   7 - on-CPU sample taken by the perf_event sampler (EMIT_REASON_ONCPU, --oncpu-freq)
 static __s32 __always_inline should_emit_task(__u32 task_state,
                                               __s32 syscall_nr, __u32 aio_inflight_reqs,
                                               __u32 io_uring_sq_pending, __u32 io_uring_cq_pending,
@@ -103,6 +115,307 @@ static __s32 __always_inline should_emit_task(__u32 task_state,
 }
 
 
+// Reset the optional parts of a sample, they are populated conditionally and
+// the per-CPU scratch event is reused between samples
+static void __always_inline reset_sample_details(struct task_output_event *event)
+{
+    event->kstack_hash = 0;  // 0 means no stack
+    event->ustack_hash = 0;  // 0 means no stack
+    event->filename[0] = '-';
+    event->filename[1] = '\0';
+    event->has_socket_info = false;
+    event->has_tcp_stats = false;
+    event->aio_fd = -1; // Initialize to -1 (no fd)
+    event->ur_filename[0] = '\0'; // Initialize io_uring CQE filename
+    event->ur_sq_filename[0] = '\0'; // Initialize io_uring SQE filename
+    event->aio_filename[0] = '\0'; // Initialize AIO filename
+    event->uring_fd = -1; // Initialize to -1 (no fd)
+    event->uring_reg_idx = -1; // Initialize to -1 (not registered)
+    event->uring_offset = 0;
+    event->uring_len = 0;
+    event->uring_opcode = 0;
+    event->uring_flags = 0;
+    event->uring_rw_flags = 0;
+    event->uring_dbg_sq_idx = -1;
+    event->uring_dbg_sq_fixed = 0;
+    event->uring_dbg_sq_user_data = 0;
+    event->uring_dbg_sq_file_ptr = 0;
+    event->uring_dbg_cq_scanned = 0;
+    event->uring_dbg_cq_matched = 0;
+    event->uring_dbg_cq_file_ptr = 0;
+}
+
+// Send a stack trace through the stack_traces ring buffer unless it has already
+// been emitted into the current output files
+static void __always_inline emit_stack_once(__u64 stack_hash, const __u64 *stack, int stack_len,
+                                            bool is_kernel, pid_t pid)
+{
+    __u32 stack_epoch = xcap_stack_epoch;
+    __u32 *emitted = bpf_map_lookup_elem(&emitted_stacks, &stack_hash);
+    if (emitted && *emitted == stack_epoch)
+        return;
+
+    struct stack_trace_event *stack_event;
+    stack_event = bpf_ringbuf_reserve(&stack_traces, sizeof(*stack_event), 0);
+    if (!stack_event) {
+        count_drop(XCAP_DROP_STACK_TRACES);
+        return;
+    }
+
+    stack_event->type = EVENT_STACK_TRACE;
+    stack_event->stack_hash = stack_hash;
+    stack_event->is_kernel = is_kernel;
+    stack_event->stack_len = stack_len;
+    stack_event->pid = pid;
+
+    // Copy stack addresses
+    for (int i = 0; i < MAX_STACK_LEN; i++) {
+        if (i < stack_len) {
+            stack_event->stack[i] = stack[i];
+        } else {
+            stack_event->stack[i] = 0;
+        }
+    }
+
+    bpf_ringbuf_submit(stack_event, 0);
+
+    // Mark as emitted in this epoch
+    if (bpf_map_update_elem(&emitted_stacks, &stack_hash, &stack_epoch, BPF_ANY))
+        count_drop(XCAP_DROP_EMITTED_STACKS);
+}
+
+// Apply what get_tasks() changes in task storage, the stack caches and the
+// emitted_stacks map for a sample, once the sample has been written. Until then
+// a replay of the same task after a full seq_file buffer sees unchanged state
+static void __always_inline commit_task_sample(struct task_struct *task, struct task_storage *storage,
+                                              struct task_stack_cache *stacks, struct task_payload *payload,
+                                              const struct task_output_event *event, __u64 total_ctxsw)
+{
+    if (event->storage.sc_sampled) {
+        storage->state.sc_sampled = true;
+        if (storage->state.sc_enter_time == 0) {
+            storage->state.in_syscall_nr = event->storage.in_syscall_nr;
+            storage->state.sc_enter_time = event->storage.sc_enter_time;
+        }
+    }
+
+    // the request payload is reported once
+    if (payload) {
+        payload->trace_payload_len = 0;
+        payload->trace_payload_syscall = -1;
+        payload->trace_payload_seq_num = 0;
+    }
+
+    // Track iorq info if relevant: iorq struct addresses get quickly reused in kernel
+    // by any task in the system. iorq pointers are not unique over time so need
+    // to compare kernel-provided iorq insert/issue time with our tracked state.
+    // this is because we don't clear the storage->state.last_iorq_rq in iorq completion tracepoint
+    if (storage->state.last_iorq_rq) {
+        storage->state.last_iorq_sampled = storage->state.last_iorq_rq;
+        storage->state.last_iorq_dev_sampled = storage->state.last_iorq_dev;
+        storage->state.last_iorq_sector_sampled = storage->state.last_iorq_sector;
+        storage->state.last_iorq_sequence_num = storage->state.iorq_sequence_num;
+        // storage->state.last_iorq_sampled_insert_ns = storage->last_iorq_insert_ns;
+        // storage->state.last_iorq_sampled_issue_ns = storage->last_iorq_issue_ns;
+
+        // Mark tracked iorq as sampled in the hashtable
+        struct iorq_info *iorq_info = bpf_map_lookup_elem(&iorq_tracking, &storage->state.last_iorq_sampled);
+        if (iorq_info && iorq_info->insert_pid == task->pid &&
+            iorq_info->iorq_sequence_num == storage->state.iorq_sequence_num) {
+            iorq_info->iorq_sampled = true;
+        }
+    }
+
+    if (stacks) {
+        if (event->kstack_hash)
+            emit_stack_once(event->kstack_hash, stacks->cached_kstack, stacks->cached_kstack_len, true, task->pid);
+        if (event->ustack_hash)
+            emit_stack_once(event->ustack_hash, stacks->cached_ustack, stacks->cached_ustack_len, false, task->pid);
+    }
+
+    // Update last_total_ctxsw for next iteration (only if stack traces are enabled)
+    if (xcap_dump_kernel_stack_traces || xcap_dump_user_stack_traces) {
+        storage->state.last_total_ctxsw = total_ctxsw;
+    }
+}
+
+// Add one sample to the aggregation counter keyed by the selected dimensions,
+// slot selects the per-CPU key scratch (the on-CPU sampler can interrupt get_tasks)
+static void __always_inline count_task_sample(const struct task_output_event *event, __u32 slot)
+{
+    struct task_agg_key *key = bpf_map_lookup_elem(&task_agg_key_scratch, &slot);
+    if (!key)
+        return;
+
+    __builtin_memset(key, 0, sizeof(*key));
+    key->oncpu_sampler = event->emit_reason == EMIT_REASON_ONCPU;
+
+    if (xcap_aggregate_dims & XCAP_AGG_STATE) {
+        key->state = event->state;
+        key->on_cpu = event->on_cpu ? 1 : 0;
+        key->on_rq = event->on_rq ? 1 : 0;
+        key->migration_pending = event->migration_pending ? 1 : 0;
+    }
+    if (xcap_aggregate_dims & XCAP_AGG_SYSCALL)
+        key->syscall_nr = event->syscall_nr;
+    if (xcap_aggregate_dims & XCAP_AGG_TGID)
+        key->tgid = event->tgid;
+    if (xcap_aggregate_dims & XCAP_AGG_USER)
+        key->euid = event->euid;
+    if (xcap_aggregate_dims & XCAP_AGG_CGROUP)
+        key->cgroup_id = event->storage.cgroup_id;
+    if (xcap_aggregate_dims & XCAP_AGG_KSTACK)
+        key->kstack_hash = event->kstack_hash;
+    if (xcap_aggregate_dims & XCAP_AGG_USTACK)
+        key->ustack_hash = event->ustack_hash;
+    if (xcap_aggregate_dims & XCAP_AGG_COMM)
+        __builtin_memcpy(key->comm, event->comm, sizeof(key->comm));
+    if (xcap_aggregate_dims & XCAP_AGG_EXE)
+        bpf_probe_read_kernel_str(key->exe, sizeof(key->exe), event->exe_file);
+
+    struct task_agg_val *val = bpf_map_lookup_elem(&task_agg, key);
+    if (val) {
+        val->count++;   // per-CPU value, no atomics needed
+        val->pid = event->pid;
+    } else {
+        struct task_agg_val init = { .count = 1, .pid = event->pid };
+        if (bpf_map_update_elem(&task_agg, key, &init, BPF_NOEXIST))
+            count_drop(XCAP_DROP_TASK_AGG);
+    }
+}
+
+#ifndef OLD_KERNEL_SUPPORT
+struct ustack_walk_ctx {
+    struct task_struct *task;
+    struct task_stack_cache *stacks;
+    __u64 fp;
+    __u64 sp;
+    __u64 ip;                           // only used by the DWARF unwinder
+    const struct unwind_proc *proc;     // NULL = frame pointer unwinding
+};
+
+// One frame pointer unwinding step of a userspace stack, called via bpf_loop()
+static long ustack_walk_step(__u64 i, void *data)
+{
+    struct ustack_walk_ctx *w = data;
+    __u64 fp = w->fp;
+
+    // Basic sanity check: fp should be above sp and within reasonable range
+    if (i >= MAX_STACK_LEN || !fp || fp < w->sp || fp > w->sp + 0x100000)
+        return 1;
+
+    // Read the stack frame
+    __u64 next_fp, ret_addr;
+    if (xcap_copy_from_user_task(&next_fp, sizeof(next_fp), (void *)fp, w->task, 0) < 0)
+        return 1;
+    if (xcap_copy_from_user_task(&ret_addr, sizeof(ret_addr), (void *)(fp + 8), w->task, 0) < 0)
+        return 1;
+
+    // Store the return address
+    w->stacks->cached_ustack[i] = ret_addr;
+    w->stacks->cached_ustack_len = i + 1;
+
+    // Move to next frame
+    w->fp = next_fp;
+    return 0;
+}
+
+#if defined(__TARGET_ARCH_x86)
+// Find the unwind row covering pc: first the executable mapping that contains it,
+// then a binary search for the last row starting at or below its ELF address
+static __always_inline const struct unwind_row *find_unwind_row(const struct unwind_proc *proc, __u64 pc)
+{
+    const struct unwind_mapping *m = NULL;
+
+    for (int j = 0; j < UNWIND_MAX_MAPPINGS; j++) {
+        if (j >= proc->nr_mappings)
+            break;
+        if (pc >= proc->mappings[j].start && pc < proc->mappings[j].end) {
+            m = &proc->mappings[j];
+            break;
+        }
+    }
+
+    if (!m || !m->nr_rows)
+        return NULL;
+
+    __u64 rel_pc = pc - m->load_bias;
+    __u32 lo = m->first_row;
+    __u32 hi = m->first_row + m->nr_rows;
+    const struct unwind_row *found = NULL;
+
+    for (int s = 0; s < UNWIND_BSEARCH_STEPS; s++) {
+        if (lo >= hi)
+            break;
+
+        __u32 mid = lo + (hi - lo) / 2;
+        const struct unwind_row *row = bpf_map_lookup_elem(&unwind_rows, &mid);
+        if (!row)
+            return NULL;
+
+        if (row->pc <= rel_pc) {
+            found = row;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return found;
+}
+
+// One .eh_frame CFA/RA unwinding step, called via bpf_loop(). Unlike the plain
+// frame pointer walk this records the current ip too, and falls back to frame
+// pointers only for code without usable CFI (JIT code, expression based CFAs)
+static long ustack_dwarf_step(__u64 i, void *data)
+{
+    struct ustack_walk_ctx *w = data;
+    __u64 ip = w->ip;
+    __u64 cfa, ra, fp = w->fp;
+
+    if (i >= MAX_STACK_LEN || !ip || !w->proc)
+        return 1;
+
+    w->stacks->cached_ustack[i] = ip;
+    w->stacks->cached_ustack_len = i + 1;
+
+    // Return addresses point past the call, which may be the first byte of the next function
+    const struct unwind_row *row = find_unwind_row(w->proc, i ? ip - 1 : ip);
+
+    if (row && row->cfa_type == UNWIND_CFA_END)
+        return 1;
+
+    if (row && (row->cfa_type == UNWIND_CFA_SP || row->cfa_type == UNWIND_CFA_FP)) {
+        cfa = (row->cfa_type == UNWIND_CFA_SP ? w->sp : w->fp) + (__s64)row->cfa_offset;
+
+        // x86_64 return address is always at CFA - 8
+        if (xcap_copy_from_user_task(&ra, sizeof(ra), (void *)(cfa - 8), w->task, 0) < 0)
+            return 1;
+        if (row->fp_offset &&
+            xcap_copy_from_user_task(&fp, sizeof(fp), (void *)(cfa + (__s64)row->fp_offset), w->task, 0) < 0)
+            return 1;
+    } else {
+        if (!fp || fp < w->sp || fp > w->sp + 0x100000)
+            return 1;
+        if (xcap_copy_from_user_task(&fp, sizeof(fp), (void *)w->fp, w->task, 0) < 0)
+            return 1;
+        if (xcap_copy_from_user_task(&ra, sizeof(ra), (void *)(w->fp + 8), w->task, 0) < 0)
+            return 1;
+        cfa = w->fp + 16;
+    }
+
+    // Caller frames are always above the current one, this also stops unwinding loops
+    if (cfa <= w->sp)
+        return 1;
+
+    w->ip = ra;
+    w->sp = cfa;
+    w->fp = fp;
+    return 0;
+}
+#endif // __TARGET_ARCH_x86
+#endif // !OLD_KERNEL_SUPPORT
+
 #ifdef OLD_KERNEL_SUPPORT
 #define TASK_ITER_SECTION "iter/task"
 #else
@@ -134,16 +447,24 @@ int get_tasks(struct bpf_iter__task *ctx)
         return 0;
 
     // TGID filtering is now done at kernel iterator level when -p option is used
+    if (xcap_nr_filter_cgroups && !cgroup_selected(task_cgroup_id(task)))
+        return 0;
 
     // Skip xcapture itself (it's always on CPU when sampling)
     if (xcap_xcapture_pid > 0 && task->tgid == xcap_xcapture_pid)
         return 0;
 
+    // Tasks running on a CPU are sampled by the on-CPU sampler, don't count them twice
+    if (xcap_oncpu_sampling && task->on_cpu)
+        return 0;
+
     // Get task storage early to check for interesting tasks
     struct task_storage *storage;
     storage = bpf_task_storage_get(&task_storage, task, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
-    if (!storage)
+    if (!storage) {
+        count_drop(XCAP_DROP_TASK_STORAGE);
         return 0;
+    }
 
     if (!storage->state.pid) storage->state.pid = task->pid;
     if (!storage->state.tgid) storage->state.tgid = task->tgid;
@@ -347,31 +668,16 @@ int get_tasks(struct bpf_iter__task *ctx)
     }
 
     // Cgroup v2 ID - walk through task->cgroups->dfl_cgrp->kn->id
-    // dfl_cgrp is the default (v2) cgroup hierarchy
-    if (task->cgroups && task->cgroups->dfl_cgrp && task->cgroups->dfl_cgrp->kn) {
-        storage->state.cgroup_id = task->cgroups->dfl_cgrp->kn->id;
-    } else {
-        storage->state.cgroup_id = 0;  // Fallback if cgroup structures are NULL
-    }
-
-    // Mark any ongoing tracepoint-captured syscall as "sampled" so we get completion events later
-    if (passive_syscall_nr >= 0) {
-
-        storage->state.sc_sampled = true;
-
-        // edge: syscall entry time is 0 only for syscalls already ongoing when xcapture started
-        // so set it to current sample timestamp, so we'll know the partial duration when sc ends
-        if (storage->state.sc_enter_time == 0) {
-            storage->state.in_syscall_nr = passive_syscall_nr; // trust passive sample instead of tracepoint
-            storage->state.sc_enter_time = storage->state.sample_actual_ktime;
-        }
-    }
-
-    // Reserve space in output ring buffer and start populating it
-    // Important: We are reusing existing ringbuf space, so pages are not zero-filled
-    struct task_output_event *event;
-    event = bpf_ringbuf_reserve(&task_samples, sizeof(*event), 0);
-    if (!event) {
+    // dfl_cgrp is the default (v2) cgroup hierarchy, 0 if cgroup structures are NULL
+    storage->state.cgroup_id = task_cgroup_id(task);
+
+    // Assemble the full sample in per-CPU scratch space, it gets encoded into the
+    // compact variable-length wire format only at the end
+    // Important: We are reusing the scratch slot, so it is not zero-filled
+    __u32 slot = SCRATCH_SLOT_ITER;
+    struct task_output_event *event = bpf_map_lookup_elem(&task_event_scratch, &slot);
+    struct task_wire_buf *wire = bpf_map_lookup_elem(&task_wire_scratch, &slot);
+    if (!event || !wire) {
         return 0;
     }
 
@@ -400,27 +706,55 @@ int get_tasks(struct bpf_iter__task *ctx)
     __builtin_memset(event->syscall_args, 0, sizeof(event->syscall_args));
     __u64 sc1_arg = 0;
 
-    // TODO: refactor the task_storage struct to hold a storage.state {} part and storage.cache {}
-    // Copy task storage fields to output event using partial memcpy
-    // We only copy up to (but not including) the cached stack fields,
-    // which are internal to BPF and never used in userspace
-    // This copies ~160 bytes instead of ~2040 bytes (avoiding the large stack arrays)
+    // Copy the emitted part of task storage (the payload and stack caches live in
+    // separate task storage maps, so this is only ~180 bytes)
     event->storage = storage->state; // (shallow) copy the entire task_state struct
 
-    if (event->storage.trace_payload_len > 0) {
-        __s32 payload_sys_nr = event->storage.trace_payload_syscall;
+    // Mark any ongoing tracepoint-captured syscall as "sampled" so we get completion events later
+    // (with --syscalls only the tracked ones, the others never reach sys_exit),
+    // the task storage itself is updated in commit_task_sample()
+    if (passive_syscall_nr >= 0 && syscall_selected(passive_syscall_nr)) {
+
+        event->storage.sc_sampled = true;
+
+        // edge: syscall entry time is 0 only for syscalls already ongoing when xcapture started
+        // so set it to current sample timestamp, so we'll know the partial duration when sc ends
+        if (event->storage.sc_enter_time == 0) {
+            event->storage.in_syscall_nr = passive_syscall_nr; // trust passive sample instead of tracepoint
+            event->storage.sc_enter_time = event->storage.sample_actual_ktime;
+        }
+    }
+
+    // Request payload prefix lives in its own task storage, only present with -Y
+    event->trace_payload_len = 0;
+    event->trace_payload_syscall = -1;
+    event->trace_payload_seq_num = 0;
+
+    struct task_payload *payload = NULL;
+    bool payload_taken = false;
+    if (xcap_capture_rw_payloads)
+        payload = bpf_task_storage_get(&task_payloads, task, NULL, 0);
+
+    if (payload && payload->trace_payload_len > 0) {
+        __s32 payload_sys_nr = payload->trace_payload_syscall;
         bool payload_is_rw = is_read_syscall(payload_sys_nr) || is_write_syscall(payload_sys_nr);
         bool passive_is_rw = (passive_syscall_nr >= 0) &&
                              (is_read_syscall(passive_syscall_nr) || is_write_syscall(passive_syscall_nr));
         bool still_in_syscall = passive_is_rw && (passive_syscall_nr == payload_sys_nr);
 
-        if (!payload_is_rw || event->storage.trace_payload_seq_num == 0 ||
-            (passive_is_rw && !still_in_syscall)) {
-            event->storage.trace_payload_len = 0;
-        } else {
-            storage->state.trace_payload_len = 0;
-            storage->state.trace_payload_syscall = -1;
-            storage->state.trace_payload_seq_num = 0;
+        if (payload_is_rw && payload->trace_payload_seq_num != 0 &&
+            !(passive_is_rw && !still_in_syscall)) {
+            __u32 payload_len = payload->trace_payload_len;
+            if (payload_len > TRACE_PAYLOAD_LEN)
+                payload_len = TRACE_PAYLOAD_LEN;
+
+            if (bpf_probe_read_kernel(event->trace_payload, payload_len, payload->trace_payload) == 0) {
+                event->trace_payload_len = payload_len;
+                event->trace_payload_syscall = payload_sys_nr;
+                event->trace_payload_seq_num = payload->trace_payload_seq_num;
+            }
+
+            payload_taken = true; // cleared in commit_task_sample()
         }
     }
 
@@ -488,365 +822,428 @@ int get_tasks(struct bpf_iter__task *ctx)
         }
     }
 
-    // first reset the output values due to conditional population below (and ringbuf reuse!)
-    event->kstack_hash = 0;  // 0 means no stack
-    event->ustack_hash = 0;  // 0 means no stack
-    event->filename[0] = '-';
-    event->filename[1] = '\0';
-    event->has_socket_info = false;
-    event->has_tcp_stats = false;
-    event->aio_fd = -1; // Initialize to -1 (no fd)
-    event->ur_filename[0] = '\0'; // Initialize io_uring CQE filename
-    event->ur_sq_filename[0] = '\0'; // Initialize io_uring SQE filename
-    event->aio_filename[0] = '\0'; // Initialize AIO filename
-    event->uring_fd = -1; // Initialize to -1 (no fd)
-    event->uring_reg_idx = -1; // Initialize to -1 (not registered)
-    event->uring_offset = 0;
-    event->uring_len = 0;
-    event->uring_opcode = 0;
-    event->uring_flags = 0;
-    event->uring_rw_flags = 0;
-    event->uring_dbg_sq_idx = -1;
-    event->uring_dbg_sq_fixed = 0;
-    event->uring_dbg_sq_user_data = 0;
-    event->uring_dbg_sq_file_ptr = 0;
-    event->uring_dbg_cq_scanned = 0;
-    event->uring_dbg_cq_matched = 0;
-    event->uring_dbg_cq_file_ptr = 0;
+    // first reset the output values due to conditional population below (and scratch reuse!)
+    reset_sample_details(event);
 
-    // Read file descriptor information for current syscall
-    struct file *file = NULL;
+    // File, socket and io_uring details are only needed for per-sample records,
+    // aggregated samples are keyed by dimensions that do not depend on them
+    if (!xcap_aggregate_dims) {
+        // Read file descriptor information for current syscall
+        struct file *file = NULL;
 
-    // Special handling for ppoll/pselect6 - get first fd info
-    if (passive_syscall_nr == __NR_ppoll && passive_regs) {
-        int fd;
-        if (get_ppoll_first_fd_info(passive_regs, task, &fd, &file, NULL) == 0) {
-            // Update syscall_args[0] to show the actual fd being monitored
-            event->syscall_args[0] = fd;
+        // Special handling for ppoll/pselect6 - get first fd info
+        if (passive_syscall_nr == __NR_ppoll && passive_regs) {
+            int fd;
+            if (get_ppoll_first_fd_info(passive_regs, task, &fd, &file, NULL) == 0) {
+                // Update syscall_args[0] to show the actual fd being monitored
+                event->syscall_args[0] = fd;
+            }
         }
-    }
 #ifdef __NR_poll
-    else if (passive_syscall_nr == __NR_poll && passive_regs) {
-        int fd;
-        if (get_ppoll_first_fd_info(passive_regs, task, &fd, &file, NULL) == 0) {
-            event->syscall_args[0] = fd;
+        else if (passive_syscall_nr == __NR_poll && passive_regs) {
+            int fd;
+            if (get_ppoll_first_fd_info(passive_regs, task, &fd, &file, NULL) == 0) {
+                event->syscall_args[0] = fd;
+            }
         }
-    }
 #endif
-    else if (passive_syscall_nr == __NR_pselect6 && passive_regs) {
-        int fd;
-        if (get_pselect6_first_fd_info(passive_regs, task, &fd, &file) == 0) {
-            // Update syscall_args[0] to show the actual fd being monitored
-            event->syscall_args[0] = fd;
+        else if (passive_syscall_nr == __NR_pselect6 && passive_regs) {
+            int fd;
+            if (get_pselect6_first_fd_info(passive_regs, task, &fd, &file) == 0) {
+                // Update syscall_args[0] to show the actual fd being monitored
+                event->syscall_args[0] = fd;
+            }
         }
-    }
-    else if (passive_syscall_nr == __NR_io_uring_enter && passive_regs) {
-        int fd;
-        __u8 opcode;
-        if (get_io_uring_sqe_info(passive_regs, task, &fd, &file, &opcode) == 0) {
-            // Update syscall_args[0] to show the target fd from SQE
-            event->syscall_args[0] = fd;
-            // Store opcode in syscall_args[1] for visibility
-            event->syscall_args[1] = opcode;
+        else if (passive_syscall_nr == __NR_io_uring_enter && passive_regs) {
+            int fd;
+            __u8 opcode;
+            if (get_io_uring_sqe_info(passive_regs, task, &fd, &file, &opcode) == 0) {
+                // Update syscall_args[0] to show the target fd from SQE
+                event->syscall_args[0] = fd;
+                // Store opcode in syscall_args[1] for visibility
+                event->syscall_args[1] = opcode;
+            }
         }
-    }
-    else if ((passive_syscall_nr == __NR_io_getevents || passive_syscall_nr == __NR_io_pgetevents ||
-              passive_syscall_nr == __NR_io_submit) && passive_regs) {
-        int fd;
-        if (get_aio_first_fd_info(passive_regs, task, &fd, &file) == 0) {
-            // Update syscall_args[0] to show the actual fd being accessed via AIO
-            event->syscall_args[0] = fd;
-            // Store the extracted fd in aio_fd field for debugging
-            event->aio_fd = fd;
-            // Extract filename from the file pointer if we have it
-            if (file) {
-                get_file_name(file, event->aio_filename, sizeof(event->aio_filename), "-");
+        else if ((passive_syscall_nr == __NR_io_getevents || passive_syscall_nr == __NR_io_pgetevents ||
+                  passive_syscall_nr == __NR_io_submit) && passive_regs) {
+            int fd;
+            if (get_aio_first_fd_info(passive_regs, task, &fd, &file) == 0) {
+                // Update syscall_args[0] to show the actual fd being accessed via AIO
+                event->syscall_args[0] = fd;
+                // Store the extracted fd in aio_fd field for debugging
+                event->aio_fd = fd;
+                // Extract filename from the file pointer if we have it
+                if (file) {
+                    get_file_name(file, event->aio_filename, sizeof(event->aio_filename), "-");
+                }
             }
         }
-    }
-    else if (passive_syscall_nr >= 0 && SYSCALL_HAS_FD_ARG1(passive_syscall_nr)) {
-        // Regular single-fd syscalls
-        struct files_struct *files = task->files;
+        else if (passive_syscall_nr >= 0 && SYSCALL_HAS_FD_ARG1(passive_syscall_nr)) {
+            // Regular single-fd syscalls
+            struct files_struct *files = task->files;
 
-        if (files) {
-            struct fdtable *fdt = files->fdt;
-            struct file **fd_array = fdt ? fdt->fd : NULL;
+            if (files) {
+                struct fdtable *fdt = files->fdt;
+                struct file **fd_array = fdt ? fdt->fd : NULL;
 
-            if (fd_array) {
-                if (event->syscall_args[0] >= 0 && event->syscall_args[0] < 1024) {
-                    bpf_probe_read_kernel(&file, sizeof(file), &fd_array[event->syscall_args[0]]);
+                if (fd_array) {
+                    if (event->syscall_args[0] >= 0 && event->syscall_args[0] < 1024) {
+                        bpf_probe_read_kernel(&file, sizeof(file), &fd_array[event->syscall_args[0]]);
+                    }
                 }
             }
         }
-    }
 
-    // Common file handling for all syscalls with file info
-    if (file) {
-        get_file_name(file, event->filename, sizeof(event->filename), "-");
-
-        // Try to get socket information
-        struct inode *inode = BPF_CORE_READ(file, f_path.dentry, d_inode);
-        if (inode) {
-            unsigned short i_mode = BPF_CORE_READ(inode, i_mode);
-            // Check if file is of socket type (S_IFSOCK == 0140000)
-            if ((i_mode & S_IFMT) == S_IFSOCK) {
-                event->has_socket_info = get_socket_info(file, &event->sock_info);
-
-                // If we got socket info and it's a TCP socket, get TCP stats
-                if (event->has_socket_info && should_collect_tcp_stats(&event->sock_info)) {
-                    struct socket *sock = BPF_CORE_READ(file, private_data);
-                    if (sock) {
-                        struct sock *sk = BPF_CORE_READ(sock, sk);
-                        if (sk) {
-                            event->has_tcp_stats = get_tcp_stats(sk, &event->tcp_stats);
+        // Common file handling for all syscalls with file info
+        if (file) {
+            get_file_name(file, event->filename, sizeof(event->filename), "-");
+
+            // Try to get socket information
+            struct inode *inode = BPF_CORE_READ(file, f_path.dentry, d_inode);
+            if (inode) {
+                unsigned short i_mode = BPF_CORE_READ(inode, i_mode);
+                // Check if file is of socket type (S_IFSOCK == 0140000)
+                if ((i_mode & S_IFMT) == S_IFSOCK) {
+                    event->has_socket_info = get_socket_info(file, &event->sock_info);
+
+                    // If we got socket info and it's a TCP socket, get TCP stats
+                    if (event->has_socket_info && should_collect_tcp_stats(&event->sock_info)) {
+                        struct socket *sock = BPF_CORE_READ(file, private_data);
+                        if (sock) {
+                            struct sock *sk = BPF_CORE_READ(sock, sk);
+                            if (sk) {
+                                event->has_tcp_stats = get_tcp_stats(sk, &event->tcp_stats);
+                            }
                         }
                     }
                 }
             }
         }
-    }
 
-    // If we're in io_uring_enter syscall, capture one filename sample for SQ and CQ (if present)
-    if (passive_syscall_nr == __NR_io_uring_enter && passive_regs) {
-        __u64 ring_fd;
+        // If we're in io_uring_enter syscall, capture one filename sample for SQ and CQ (if present)
+        if (passive_syscall_nr == __NR_io_uring_enter && passive_regs) {
+            __u64 ring_fd;
 #if defined(__TARGET_ARCH_x86)
-        ring_fd = passive_regs->di;
+            ring_fd = passive_regs->di;
 #elif defined(__TARGET_ARCH_arm64)
-        ring_fd = passive_regs->regs[0];
+            ring_fd = passive_regs->regs[0];
 #endif
 
-        if (ring_fd < 1024) {
-            struct file *ring_file = NULL;
-            struct files_struct *files = task->files;
+            if (ring_fd < 1024) {
+                struct file *ring_file = NULL;
+                struct files_struct *files = task->files;
 
-            if (files) {
-                struct fdtable *fdt = files->fdt;
-                struct file **fd_array = fdt->fd;
+                if (files) {
+                    struct fdtable *fdt = files->fdt;
+                    struct file **fd_array = fdt->fd;
 
-                if (fd_array && ring_fd >= 0) {
-                    bpf_probe_read_kernel(&ring_file, sizeof(ring_file), &fd_array[ring_fd]);
+                    if (fd_array && ring_fd >= 0) {
+                        bpf_probe_read_kernel(&ring_file, sizeof(ring_file), &fd_array[ring_fd]);
+                    }
                 }
-            }
 
-            if (ring_file) {
-                __u32 sq_pending_dummy, cq_pending_dummy;
-                get_io_uring_pending_counts(ring_file, task,
-                                          &sq_pending_dummy,
-                                          &cq_pending_dummy,
-                                          event->ur_sq_filename,
-                                          sizeof(event->ur_sq_filename),
-                                          event->ur_filename,
-                                          sizeof(event->ur_filename),
-                                          storage,
-                                          event);
+                if (ring_file) {
+                    __u32 sq_pending_dummy, cq_pending_dummy;
+                    get_io_uring_pending_counts(ring_file, task,
+                                              &sq_pending_dummy,
+                                              &cq_pending_dummy,
+                                              event->ur_sq_filename,
+                                              sizeof(event->ur_sq_filename),
+                                              event->ur_filename,
+                                              sizeof(event->ur_filename),
+                                              storage,
+                                              event);
+                }
             }
         }
     }
 
-    // Track iorq info if relevant: iorq struct addresses get quickly reused in kernel
-    // by any task in the system. iorq pointers are not unique over time so need
-    // to compare kernel-provided iorq insert/issue time with our tracked state.
-    // this is because we don't clear the storage->state.last_iorq_rq in iorq completion tracepoint
-    if (storage->state.last_iorq_rq) {
-        storage->state.last_iorq_sampled = storage->state.last_iorq_rq;
-        storage->state.last_iorq_dev_sampled = storage->state.last_iorq_dev;
-        storage->state.last_iorq_sector_sampled = storage->state.last_iorq_sector;
-        storage->state.last_iorq_sequence_num = storage->state.iorq_sequence_num;
-        // storage->state.last_iorq_sampled_insert_ns = storage->last_iorq_insert_ns;
-        // storage->state.last_iorq_sampled_issue_ns = storage->last_iorq_issue_ns;
-
-        // Mark tracked iorq as sampled in the hashtable
-        struct iorq_info *iorq_info = bpf_map_lookup_elem(&iorq_tracking, &storage->state.last_iorq_sampled);
-        if (iorq_info && iorq_info->insert_pid == task->pid &&
-            iorq_info->iorq_sequence_num == storage->state.iorq_sequence_num) {
-            iorq_info->iorq_sampled = true;
-        }
+    // Stack caches are kept in their own task storage, created only when -k/-u is used
+    struct task_stack_cache *stacks = NULL;
+    if (xcap_dump_kernel_stack_traces || xcap_dump_user_stack_traces) {
+        stacks = bpf_task_storage_get(&task_stacks, task, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
+        if (!stacks)
+            count_drop(XCAP_DROP_TASK_STORAGE);
     }
 
+    __u32 governor_skip = xcap_governor_skip;
+
+    // A shed stack is not refreshed while last_total_ctxsw keeps advancing, so
+    // forget it: once the governor lets stacks through again the cache would
+    // otherwise pass for current in a task that hasn't switched since
+    if (stacks && (governor_skip & XCAP_GOV_SKIP_KSTACK))
+        stacks->cached_kstack_len = 0;
+    if (stacks && (governor_skip & XCAP_GOV_SKIP_USTACK))
+        stacks->cached_ustack_len = 0;
+
     // Collect kernel stack trace if requested
-    if (xcap_dump_kernel_stack_traces) {
+    if (xcap_dump_kernel_stack_traces && stacks && !(governor_skip & XCAP_GOV_SKIP_KSTACK)) {
         // Only read fresh stack if task was scheduled or is on CPU
-        if (!can_use_cached_stack || storage->cache.cached_kstack_len == 0) {
+        if (!can_use_cached_stack || stacks->cached_kstack_len == 0) {
             // Read fresh stack trace
-            int stack_len = bpf_get_task_stack(task, storage->cache.cached_kstack,
-                                             sizeof(storage->cache.cached_kstack), 0);
+            int stack_len = bpf_get_task_stack(task, stacks->cached_kstack,
+                                             sizeof(stacks->cached_kstack), 0);
             if (stack_len > 0) {
-                storage->cache.cached_kstack_len = stack_len / sizeof(__u64);
-                if (storage->cache.cached_kstack_len > MAX_STACK_LEN) {
-                    storage->cache.cached_kstack_len = MAX_STACK_LEN;
+                stacks->cached_kstack_len = stack_len / sizeof(__u64);
+                if (stacks->cached_kstack_len > MAX_STACK_LEN) {
+                    stacks->cached_kstack_len = MAX_STACK_LEN;
                 }
             } else {
-                storage->cache.cached_kstack_len = 0;
+                stacks->cached_kstack_len = 0;
             }
         }
 
         // Compute hash of the kernel stack and store in event
-        if (storage->cache.cached_kstack_len > 0) {
-            event->kstack_hash = get_stack_hash(storage->cache.cached_kstack, storage->cache.cached_kstack_len);
-
-            // Copy hash to stack for old kernel verifier compatibility
-            __u64 kstack_hash = event->kstack_hash;
-
-            // Check if this stack has already been emitted
-            __u8 *emitted = bpf_map_lookup_elem(&emitted_stacks, &kstack_hash);
-            if (!emitted || *emitted != 1) {
-                // New stack, send it through stack_traces ring buffer
-                struct stack_trace_event *stack_event;
-                stack_event = bpf_ringbuf_reserve(&stack_traces, sizeof(*stack_event), 0);
-                if (stack_event) {
-                    stack_event->type = EVENT_STACK_TRACE;
-                    stack_event->stack_hash = event->kstack_hash;
-                    stack_event->is_kernel = true;
-                    stack_event->stack_len = storage->cache.cached_kstack_len;
-                    stack_event->pid = task->pid;
-
-                    // Copy stack addresses
-                    for (int i = 0; i < MAX_STACK_LEN; i++) {
-                        if (i < storage->cache.cached_kstack_len) {
-                            stack_event->stack[i] = storage->cache.cached_kstack[i];
-                        } else {
-                            stack_event->stack[i] = 0;
-                        }
-                    }
-
-                    bpf_ringbuf_submit(stack_event, 0);
-
-                    // Mark as emitted
-                    __u8 one = 1;
-                    bpf_map_update_elem(&emitted_stacks, &kstack_hash, &one, BPF_ANY);
-                }
-            }
+        if (stacks->cached_kstack_len > 0) {
+            event->kstack_hash = get_stack_hash(stacks->cached_kstack, stacks->cached_kstack_len);
         }
     }
 
     // Collect userspace stack trace if requested
     #ifndef OLD_KERNEL_SUPPORT
-    if (xcap_dump_user_stack_traces && !(event->flags & PF_KTHREAD)) {
+    if (xcap_dump_user_stack_traces && stacks && !(governor_skip & XCAP_GOV_SKIP_USTACK) &&
+        !(event->flags & PF_KTHREAD)) {
         // Only read fresh stack if task was scheduled or is on CPU
-        if (!can_use_cached_stack || storage->cache.cached_ustack_len == 0) {
+        if (!can_use_cached_stack || stacks->cached_ustack_len == 0) {
             // Reset cached stack length
-            storage->cache.cached_ustack_len = 0;
+            stacks->cached_ustack_len = 0;
 
             // Get the current stack pointer from task's pt_regs
             struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(task);
             if (regs) {
-                // Architecture-specific frame pointer unwinding
+                // Architecture-specific frame pointer and stack pointer
+                // Both x86_64 and arm64 frames start with struct { void *fp; void *ret_addr; }
                 #if defined(__TARGET_ARCH_x86)
-                    // x86_64 stack frame layout:
-                    // struct stack_frame {
-                    //     void *rbp;  // next frame pointer
-                    //     void *rip;  // return address
-                    // };
-                    __u64 fp = regs->bp;  // Frame pointer (RBP)
-                    __u64 sp = regs->sp;  // Stack pointer (RSP)
-
-                    // Unwind up to MAX_STACK_LEN frames
-                    for (int i = 0; i < MAX_STACK_LEN && i < 20; i++) {
-                        if (!fp || fp < sp || fp > sp + 0x100000) {
-                            // Basic sanity check: fp should be above sp and within reasonable range
-                            break;
-                        }
+                    __u64 fp = regs->bp;         // Frame pointer (RBP)
+                    __u64 sp = regs->sp;         // Stack pointer (RSP)
+                #elif defined(__TARGET_ARCH_arm64)
+                    __u64 fp = regs->regs[29];   // Frame pointer (x29)
+                    __u64 sp = regs->sp;         // Stack pointer
+                #else
+                    __u64 fp = 0, sp = 0;
+                #endif // target arch
 
-                        // Read the stack frame
-                        __u64 next_fp, ret_addr;
-                        if (xcap_copy_from_user_task(&next_fp, sizeof(next_fp),
-                                                    (void *)fp, task, 0) < 0) {
-                            break;
-                        }
-                        if (xcap_copy_from_user_task(&ret_addr, sizeof(ret_addr),
-                                                    (void *)(fp + 8), task, 0) < 0) {
-                            break;
-                        }
+                struct ustack_walk_ctx walk = {
+                    .task = task,
+                    .stacks = stacks,
+                    .fp = fp,
+                    .sp = sp,
+                };
 
-                        // Store the return address
-                        storage->cache.cached_ustack[i] = ret_addr;
-                        storage->cache.cached_ustack_len++;
+                // Unwind up to MAX_STACK_LEN frames, with .eh_frame tables once
+                // userspace has registered this process's mappings
+                #if defined(__TARGET_ARCH_x86)
+                if (xcap_dwarf_unwind) {
+                    pid_t tgid = task->tgid;
+                    walk.proc = bpf_map_lookup_elem(&unwind_procs, &tgid);
+                    walk.ip = regs->ip;
+                }
+                if (walk.proc)
+                    bpf_loop(MAX_STACK_LEN, ustack_dwarf_step, &walk, 0);
+                else
+                #endif
+                    bpf_loop(MAX_STACK_LEN, ustack_walk_step, &walk, 0);
+            }
+        }
 
-                        // Move to next frame
-                        fp = next_fp;
-                    }
-                #elif defined(__TARGET_ARCH_arm64)
-                    // ARM64 frame pointer unwinding
-                    // struct stack_frame {
-                    //     void *fp;  // x29 - next frame pointer
-                    //     void *lr;  // x30 - return address
-                    // };
-                    __u64 fp = regs->regs[29];  // Frame pointer (x29)
-                    __u64 sp = regs->sp;        // Stack pointer
-
-                    for (int i = 0; i < MAX_STACK_LEN && i < 20; i++) {
-                        if (!fp || fp < sp || fp > sp + 0x100000) {
-                            break;
-                        }
+        // Compute hash of the userspace stack and store in event
+        if (stacks->cached_ustack_len > 0) {
+            event->ustack_hash = get_stack_hash(stacks->cached_ustack, stacks->cached_ustack_len);
+        }
+    }
+    #endif // !OLD_KERNEL_SUPPORT
 
-                        // Read the stack frame
-                        __u64 next_fp, ret_addr;
-                        if (xcap_copy_from_user_task(&next_fp, sizeof(next_fp),
-                                                    (void *)fp, task, 0) < 0) {
-                            break;
-                        }
-                        if (xcap_copy_from_user_task(&ret_addr, sizeof(ret_addr),
-                                                    (void *)(fp + 8), task, 0) < 0) {
-                            break;
-                        }
+    // In aggregation mode just bump the per-CPU counter of this sample's dimension key
+    if (xcap_aggregate_dims) {
+        count_task_sample(event, SCRATCH_SLOT_ITER);
+        commit_task_sample(task, storage, stacks, payload_taken ? payload : NULL, event, total_ctxsw);
+        return 0;
+    }
 
-                        // Store the return address
-                        storage->cache.cached_ustack[i] = ret_addr;
-                        storage->cache.cached_ustack_len++;
+    __u32 wire_len = encode_task_event(wire->data, event);
+    if (wire_len > TASK_WIRE_MAX_SIZE)
+        return 0;
 
-                        // Move to next frame
-                        fp = next_fp;
-                    }
-                #endif // target arch
-            }
+    // In seq_file mode a full seq buffer makes the kernel discard this record and
+    // call us again for the same task once userspace has drained the buffer, so
+    // nothing is lost; userspace read() pacing provides the backpressure. The
+    // replay must see the task as it was, so nothing is committed until the
+    // record has been written
+    if (xcap_iter_seq_output) {
+        if (bpf_seq_write(ctx->meta->seq, wire->data, wire_len)) {
+            count_drop(XCAP_DROP_TASK_SEQ);
+            return 0;
         }
+    } else if (bpf_ringbuf_output(&task_samples, wire->data, wire_len, 0)) {
+        count_drop(XCAP_DROP_TASK_SAMPLES);
+    }
 
-        // Compute hash of the userspace stack and store in event
-        if (storage->cache.cached_ustack_len > 0) {
-            event->ustack_hash = get_stack_hash(storage->cache.cached_ustack, storage->cache.cached_ustack_len);
-
-            // Copy hash to stack for old kernel verifier compatibility
-            __u64 ustack_hash = event->ustack_hash;
-
-            // Check if this stack has already been emitted
-            __u8 *emitted = bpf_map_lookup_elem(&emitted_stacks, &ustack_hash);
-            if (!emitted || *emitted != 1) {
-                // New stack, send it through stack_traces ring buffer
-                struct stack_trace_event *stack_event;
-                stack_event = bpf_ringbuf_reserve(&stack_traces, sizeof(*stack_event), 0);
-                if (stack_event) {
-                    stack_event->type = EVENT_STACK_TRACE;
-                    stack_event->stack_hash = event->ustack_hash;
-                    stack_event->is_kernel = false;
-                    stack_event->stack_len = storage->cache.cached_ustack_len;
-                    stack_event->pid = task->pid;
-
-                    // Copy stack addresses
-                    for (int i = 0; i < MAX_STACK_LEN; i++) {
-                        if (i < storage->cache.cached_ustack_len) {
-                            stack_event->stack[i] = storage->cache.cached_ustack[i];
-                        } else {
-                            stack_event->stack[i] = 0;
-                        }
-                    }
+    commit_task_sample(task, storage, stacks, payload_taken ? payload : NULL, event, total_ctxsw);
+    return 0;
+}
 
-                    bpf_ringbuf_submit(stack_event, 0);
+#ifndef OLD_KERNEL_SUPPORT
+// On-CPU sampler, attached by userspace to a cpu-clock perf event on every CPU
+// (--oncpu-freq). It samples whatever runs on the CPU with stacks taken from
+// the interrupted context, unlike get_tasks that has to read the stacks of
+// tasks running on other CPUs with bpf_get_task_stack() while they change
+SEC("perf_event")
+int sample_oncpu(struct bpf_perf_event_data *ctx)
+{
+    struct task_struct *task = bpf_get_current_task_btf();
+    __u32 task_flags = task->flags;
 
-                    // Mark as emitted
-                    __u8 one = 1;
-                    bpf_map_update_elem(&emitted_stacks, &ustack_hash, &one, BPF_ANY);
-                }
-            }
+    // skip the idle task, xcapture itself and other processes when -p is used
+    if (!task->pid)
+        return 0;
+    if (xcap_xcapture_pid > 0 && task->tgid == xcap_xcapture_pid)
+        return 0;
+    if (xcap_filter_tgid > 0 && task->tgid != xcap_filter_tgid)
+        return 0;
+    if (xcap_nr_filter_cgroups && !cgroup_selected(bpf_get_current_cgroup_id()))
+        return 0;
+
+    __u32 slot = SCRATCH_SLOT_ONCPU;
+    struct task_output_event *event = bpf_map_lookup_elem(&task_event_scratch, &slot);
+    struct task_wire_buf *wire = bpf_map_lookup_elem(&task_wire_scratch, &slot);
+    if (!event || !wire)
+        return 0;
+
+#if defined(__TARGET_ARCH_x86)
+    bool user_mode = ctx->regs.cs & 3;
+#elif defined(__TARGET_ARCH_arm64)
+    bool user_mode = (ctx->regs.pstate & 0xf) == 0; // PSR_MODE_EL0t
+#else
+    bool user_mode = false;
+#endif
+
+    // The syscall number in the saved user registers is only meaningful while in kernel mode
+    __s32 syscall_nr = -1;
+    struct pt_regs *uregs = NULL;
+    if (!(task_flags & PF_KTHREAD) && !user_mode) {
+        uregs = (struct pt_regs *)bpf_task_pt_regs(task);
+        if (uregs) {
+#if defined(__TARGET_ARCH_x86)
+            __s64 orig_ax = (__s64)uregs->orig_ax;
+            syscall_nr = orig_ax == -1 ? -1 : (__s32)(orig_ax & 0x1ffUL);
+#elif defined(__TARGET_ARCH_arm64)
+            __s64 syscallno = (__s64)uregs->syscallno;
+            syscall_nr = syscallno == -1 ? -1 : (__s32)(syscallno & 0x1ffUL);
+#endif
         }
     }
-    #endif // !OLD_KERNEL_SUPPORT
 
-    // Update last_total_ctxsw for next iteration (only if stack traces are enabled)
-    if (xcap_dump_kernel_stack_traces || xcap_dump_user_stack_traces) {
-        storage->state.last_total_ctxsw = total_ctxsw;
+    event->type = EVENT_TASK_INFO;
+    event->pid = task->pid;
+    event->tgid = task->tgid;
+    event->emit_reason = EMIT_REASON_ONCPU;
+    event->flags = task_flags;
+    event->state = get_task_state(task);
+    event->on_cpu = 1;
+    event->on_rq = task->on_rq;
+    event->migration_pending = task->migration_pending;
+    event->in_execve = BPF_CORE_READ_BITFIELD_PROBED(task, in_execve);
+    event->in_iowait = BPF_CORE_READ_BITFIELD_PROBED(task, in_iowait);
+    if (bpf_core_field_exists(task->sched_remote_wakeup))
+        event->sched_remote_wakeup = BPF_CORE_READ_BITFIELD_PROBED(task, sched_remote_wakeup);
+
+    event->syscall_nr = syscall_nr;
+    __builtin_memset(event->syscall_args, 0, sizeof(event->syscall_args));
+    if (syscall_nr >= 0 && uregs) {
+#if defined(__TARGET_ARCH_x86)
+        event->syscall_args[0] = uregs->di;
+        event->syscall_args[1] = uregs->si;
+        event->syscall_args[2] = uregs->dx;
+        event->syscall_args[3] = uregs->r10;
+        event->syscall_args[4] = uregs->r8;
+        event->syscall_args[5] = uregs->r9;
+#elif defined(__TARGET_ARCH_arm64)
+        event->syscall_args[0] = uregs->regs[0];
+        event->syscall_args[1] = uregs->regs[1];
+        event->syscall_args[2] = uregs->regs[2];
+        event->syscall_args[3] = uregs->regs[3];
+        event->syscall_args[4] = uregs->regs[4];
+        event->syscall_args[5] = uregs->regs[5];
+#endif
+    }
+
+    // Task storage is only read here, syscall sequence numbers and other tracking state
+    // come along if the tracking probes have created it, but the sample times are our own
+    struct task_storage *storage = bpf_task_storage_get(&task_storage, task, NULL, 0);
+    if (storage)
+        event->storage = storage->state;
+    else
+        __builtin_memset(&event->storage, 0, sizeof(event->storage));
+
+    event->storage.pid = task->pid;
+    event->storage.tgid = task->tgid;
+    event->storage.sample_start_ktime = bpf_ktime_get_ns();
+    event->storage.sample_actual_ktime = event->storage.sample_start_ktime;
+    event->storage.pid_ns_id = 0;
+    if (task->nsproxy && task->nsproxy->pid_ns_for_children)
+        event->storage.pid_ns_id = task->nsproxy->pid_ns_for_children->ns.inum;
+    event->storage.cgroup_id = 0;
+    if (task->cgroups && task->cgroups->dfl_cgrp && task->cgroups->dfl_cgrp->kn)
+        event->storage.cgroup_id = task->cgroups->dfl_cgrp->kn->id;
+
+    event->trace_payload_len = 0;
+    event->trace_payload_syscall = -1;
+    event->trace_payload_seq_num = 0;
+
+    const struct cred *cred = task->cred;
+    event->euid = cred->euid.val;
+    bpf_get_current_comm(&event->comm, sizeof(event->comm));
+
+    if (task->mm) {
+        get_file_name(task->mm->exe_file, event->exe_file, sizeof(event->exe_file), "[NO_EXE]");
+    } else {
+        __builtin_memcpy(event->exe_file, "[NO_MM]", 8);
+    }
+
+    event->cmdline_len = 0;
+    event->cmdline[0] = '\0';
+
+    reset_sample_details(event);
+
+    __u32 zero = 0;
+    struct task_stack_cache *stacks = bpf_map_lookup_elem(&oncpu_stack_scratch, &zero);
+
+    __u32 governor_skip = xcap_governor_skip;
+
+    if (stacks && xcap_dump_kernel_stack_traces && !(governor_skip & XCAP_GOV_SKIP_KSTACK) && !user_mode) {
+        long len = bpf_get_stack(ctx, stacks->cached_kstack, sizeof(stacks->cached_kstack), 0);
+        if (len > 0) {
+            int nr = len / sizeof(__u64);
+            if (nr > MAX_STACK_LEN)
+                nr = MAX_STACK_LEN;
+            event->kstack_hash = get_stack_hash(stacks->cached_kstack, nr);
+            emit_stack_once(event->kstack_hash, stacks->cached_kstack, nr, true, task->pid);
+        }
     }
 
-    bpf_ringbuf_submit(event, 0);
+    if (stacks && xcap_dump_user_stack_traces && !(governor_skip & XCAP_GOV_SKIP_USTACK) &&
+        !(task_flags & PF_KTHREAD)) {
+        long len = bpf_get_stack(ctx, stacks->cached_ustack, sizeof(stacks->cached_ustack), BPF_F_USER_STACK);
+        if (len > 0) {
+            int nr = len / sizeof(__u64);
+            if (nr > MAX_STACK_LEN)
+                nr = MAX_STACK_LEN;
+            event->ustack_hash = get_stack_hash(stacks->cached_ustack, nr);
+            emit_stack_once(event->ustack_hash, stacks->cached_ustack, nr, false, task->pid);
+        }
+    }
+
+    if (xcap_aggregate_dims) {
+        count_task_sample(event, SCRATCH_SLOT_ONCPU);
+        return 0;
+    }
+
+    __u32 wire_len = encode_task_event(wire->data, event);
+    if (wire_len > TASK_WIRE_MAX_SIZE)
+        return 0;
 
+    if (bpf_ringbuf_output(&task_samples, wire->data, wire_len, 0))
+        count_drop(XCAP_DROP_TASK_SAMPLES);
     return 0;
 }
+#endif // !OLD_KERNEL_SUPPORT
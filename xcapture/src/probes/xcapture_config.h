@@ -38,4 +38,33 @@ const volatile bool xcap_capture_rw_payloads = false;
 // Enable cmdline sampling from userspace memory when requested columns are active
 const volatile bool xcap_capture_cmdline = false;
 
+// Write task samples into the task iterator seq_file instead of the task_samples ringbuf
+const volatile bool xcap_iter_seq_output = false;
+
+// Dimensions (XCAP_AGG_* bits) to aggregate task samples by in the kernel, 0 = emit every sample
+const volatile __u32 xcap_aggregate_dims = 0;
+
+// Unwind user stacks with the .eh_frame tables in unwind_rows/unwind_procs (x86_64 only)
+const volatile bool xcap_dwarf_unwind = false;
+
+// On-CPU tasks are sampled by the perf_event program (--oncpu-freq), the iterator skips them
+const volatile bool xcap_oncpu_sampling = false;
+
+// Cgroup v2 IDs that sampling and tracking are limited to, none = no filter (--cgroup)
+const volatile __u32 xcap_nr_filter_cgroups = 0;
+const volatile __u64 xcap_filter_cgroups[XCAP_MAX_FILTER_CGROUPS] = {};
+
+// Track only the syscalls whose bit is set in xcap_syscall_set (--syscalls)
+const volatile bool xcap_filter_syscalls = false;
+const volatile __u64 xcap_syscall_set[XCAP_SYSCALL_SET_WORDS] = {};
+
+// Syscall numbers of the fentry/fexit slot programs in syscall.bpf.c
+const volatile __s32 xcap_fentry_syscalls[XCAP_FENTRY_SLOTS] = {};
+
+// Syscall latency histograms by TGID or cgroup (--syscall-hist), XCAP_HIST_BY_*
+const volatile __u32 xcap_syscall_hist = 0;
+
+// Block I/O service time histograms per device, op and cgroup (--iorq-hist)
+const volatile bool xcap_iorq_hist = false;
+
 #endif /* __XCAPTURE_CONFIG_H */
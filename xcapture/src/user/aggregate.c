@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "xcapture_context.h"
+#include "aggregate.h"
+#include "task_handler.h"
+
+// In-kernel aggregation mode (--aggregate): get_tasks bumps per-CPU counters
+// in the task_agg map keyed by the selected dimensions, and once per iteration
+// we drain the map and write one row per key with the sample count and the
+// summed sample weight
+
+#define AGG_BATCH_SIZE 1024
+
+static const struct {
+    const char *name;
+    __u32 bit;
+} agg_dims[] = {
+    { "state",       XCAP_AGG_STATE   },
+    { "syscall",     XCAP_AGG_SYSCALL },
+    { "exe",         XCAP_AGG_EXE     },
+    { "comm",        XCAP_AGG_COMM    },
+    { "tgid",        XCAP_AGG_TGID    },
+    { "username",    XCAP_AGG_USER    },
+    { "user",        XCAP_AGG_USER    },
+    { "cgroup_id",   XCAP_AGG_CGROUP  },
+    { "cgroup",      XCAP_AGG_CGROUP  },
+    { "kstack_hash", XCAP_AGG_KSTACK  },
+    { "kstack",      XCAP_AGG_KSTACK  },
+    { "ustack_hash", XCAP_AGG_USTACK  },
+    { "ustack",      XCAP_AGG_USTACK  },
+};
+
+static struct task_agg_key agg_keys[AGG_BATCH_SIZE];
+static struct task_agg_val *agg_vals;  // AGG_BATCH_SIZE * agg_ncpus per-CPU values
+static int agg_ncpus;
+
+int parse_aggregate_dims(const char *arg, __u32 *dims_out)
+{
+    __u32 dims = 0;
+    char *list = strdup(arg);
+    if (!list)
+        return -ENOMEM;
+
+    char *saveptr = NULL;
+    for (char *token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        while (isspace((unsigned char)*token)) token++;
+        char *end = token + strlen(token);
+        while (end > token && isspace((unsigned char)*(end - 1)))
+            *(--end) = '\0';
+        if (*token == '\0')
+            continue;
+
+        size_t i;
+        for (i = 0; i < sizeof(agg_dims) / sizeof(agg_dims[0]); i++) {
+            if (strcasecmp(token, agg_dims[i].name) == 0) {
+                dims |= agg_dims[i].bit;
+                break;
+            }
+        }
+        if (i == sizeof(agg_dims) / sizeof(agg_dims[0])) {
+            fprintf(stderr, "Unknown aggregation dimension '%s'. Supported: "
+                    "state, syscall, exe, comm, tgid, username, cgroup_id, kstack_hash, ustack_hash.\n", token);
+            free(list);
+            return -EINVAL;
+        }
+    }
+
+    free(list);
+    if (!dims)
+        return -EINVAL;
+
+    *dims_out = dims;
+    return 0;
+}
+
+int aggregate_init(void)
+{
+    agg_ncpus = libbpf_num_possible_cpus();
+    if (agg_ncpus <= 0)
+        return -EINVAL;
+
+    agg_vals = calloc((size_t)AGG_BATCH_SIZE * agg_ncpus, sizeof(struct task_agg_val));
+    if (!agg_vals)
+        return -ENOMEM;
+
+    return 0;
+}
+
+void aggregate_destroy(void)
+{
+    free(agg_vals);
+    agg_vals = NULL;
+}
+
+void print_aggregate_header(void)
+{
+    printf("%-26s %8s %12s %-12s %-12s %-20s %-16s %8s %-20s %18s %-16s %-16s\n",
+           "TIMESTAMP", "SAMPLES", "WEIGHT_US", "STATE", "USERNAME", "EXE", "COMM",
+           "TGID", "SYSCALL", "CGROUP_ID", "KSTACK_HASH", "USTACK_HASH");
+}
+
+static void emit_aggregate_row(struct xcapture_context *xctx, const char *timestamp,
+                               const struct task_agg_key *key, __u64 count, pid_t pid)
+{
+    __u32 dims = xctx->aggregate_dims;
+    char tgid[16] = "", cgroup[24] = "", kstack[24] = "", ustack[24] = "";
+    const char *state = "", *user = "", *syscall = "";
+    char exe[XCAP_AGG_EXE_LEN + 1] = "", comm[TASK_COMM_LEN + 1] = "";
+
+    if (dims & XCAP_AGG_STATE)
+        state = format_task_state(key->state, key->on_rq, key->on_cpu,
+                                  key->migration_pending ? (void *)1 : NULL);
+    if (dims & XCAP_AGG_USER)
+        user = getusername(key->euid);
+    if (dims & XCAP_AGG_SYSCALL)
+        syscall = safe_syscall_name(key->syscall_nr);
+    if (dims & XCAP_AGG_EXE)
+        snprintf(exe, sizeof(exe), "%.*s", XCAP_AGG_EXE_LEN, key->exe);
+    if (dims & XCAP_AGG_COMM)
+        snprintf(comm, sizeof(comm), "%.*s", TASK_COMM_LEN, key->comm);
+    if (dims & XCAP_AGG_TGID)
+        snprintf(tgid, sizeof(tgid), "%d", key->tgid);
+    if (dims & XCAP_AGG_CGROUP) {
+        snprintf(cgroup, sizeof(cgroup), "%llu", key->cgroup_id);
+        record_cgroup_path(xctx, key->cgroup_id, pid);
+    }
+    if ((dims & XCAP_AGG_KSTACK) && key->kstack_hash)
+        snprintf(kstack, sizeof(kstack), "%llx", key->kstack_hash);
+    if ((dims & XCAP_AGG_USTACK) && key->ustack_hash)
+        snprintf(ustack, sizeof(ustack), "%llx", key->ustack_hash);
+
+    __u64 weight_us = count * (__u64)(key->oncpu_sampler ? xctx->oncpu_weight_us : xctx->sample_weight_us);
+
+    if (xctx->output_csv) {
+        if (!xctx->files.agg_file)
+            return;
+        fprintf(xctx->files.agg_file, "%s,%llu,%llu,%s,%s,%s,%s,%s,%s,%s,%s,%s\n",
+                timestamp, count, weight_us, state, user, exe, comm,
+                tgid, syscall, cgroup, kstack, ustack);
+    } else {
+        printf("%-26s %8llu %12llu %-12s %-12s %-20s %-16s %8s %-20s %18s %-16s %-16s\n",
+               timestamp, count, weight_us, state, user, exe, comm,
+               tgid, syscall, cgroup, kstack, ustack);
+    }
+}
+
+static void emit_aggregate_batch(struct xcapture_context *xctx, const char *timestamp, __u32 count)
+{
+    for (__u32 i = 0; i < count; i++) {
+        __u64 total = 0;
+        pid_t pid = 0;
+
+        for (int cpu = 0; cpu < agg_ncpus; cpu++) {
+            const struct task_agg_val *v = &agg_vals[(size_t)i * agg_ncpus + cpu];
+            total += v->count;
+            if (v->count && !pid)
+                pid = v->pid;
+        }
+
+        if (total)
+            emit_aggregate_row(xctx, timestamp, &agg_keys[i], total, pid);
+    }
+}
+
+// Older kernels lack batch ops on hash maps, walk the keys one by one instead.
+// The walked keys are deleted after every batch, so each batch starts over
+// from the first key still left in the map
+static __u32 drain_task_aggregates_batch_slow(int map_fd)
+{
+    struct task_agg_key key, next;
+    __u32 n = 0;
+    void *prev = NULL;
+
+    while (n < AGG_BATCH_SIZE && bpf_map_get_next_key(map_fd, prev, &next) == 0) {
+        agg_keys[n] = next;
+        if (bpf_map_lookup_elem(map_fd, &next, &agg_vals[(size_t)n * agg_ncpus]) == 0)
+            n++;
+        key = next;
+        prev = &key;
+    }
+
+    for (__u32 i = 0; i < n; i++)
+        bpf_map_delete_elem(map_fd, &agg_keys[i]);
+
+    return n;
+}
+
+static int drain_task_aggregates_slow(int map_fd, struct xcapture_context *xctx, const char *timestamp)
+{
+    __u32 n;
+    int rows = 0;
+
+    do {
+        n = drain_task_aggregates_batch_slow(map_fd);
+        emit_aggregate_batch(xctx, timestamp, n);
+        rows += n;
+    } while (n == AGG_BATCH_SIZE);
+
+    return rows;
+}
+
+int drain_task_aggregates(int map_fd, struct xcapture_context *xctx)
+{
+    static bool batch_unsupported = false;
+    char timestamp[64];
+    int rows = 0;
+
+    if (!agg_vals)
+        return -EINVAL;
+
+    // pipelined output only rotates at the iteration boundary, see pipeline_rotate_files()
+    if (xctx->output_csv && !xctx->pipelined && check_and_rotate_files(&xctx->files, xctx) < 0) {
+        fprintf(stderr, "Failed to rotate output files\n");
+        return -EIO;
+    }
+
+    get_str_from_ts(xctx->tcorr.wall_time, timestamp, sizeof(timestamp));
+
+    if (batch_unsupported)
+        return drain_task_aggregates_slow(map_fd, xctx, timestamp);
+
+    __u32 batch_token = 0;
+    void *in_batch = NULL;
+
+    for (;;) {
+        __u32 count = AGG_BATCH_SIZE;
+        int err = bpf_map_lookup_and_delete_batch(map_fd, in_batch, &batch_token,
+                                                  agg_keys, agg_vals, &count, NULL);
+        if (err && errno != ENOENT) {
+            if (!in_batch && (errno == EINVAL || errno == ENOTSUP || errno == EOPNOTSUPP)) {
+                batch_unsupported = true;
+                return drain_task_aggregates_slow(map_fd, xctx, timestamp);
+            }
+            return -errno;
+        }
+
+        emit_aggregate_batch(xctx, timestamp, count);
+        rows += count;
+
+        if (err) // ENOENT: the whole map has been drained
+            break;
+        in_batch = &batch_token;
+    }
+
+    return rows;
+}
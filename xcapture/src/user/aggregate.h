@@ -0,0 +1,13 @@
+#ifndef __AGGREGATE_H
+#define __AGGREGATE_H
+
+#include <linux/types.h>
+#include "xcapture_context.h"
+
+int parse_aggregate_dims(const char *arg, __u32 *dims_out);
+int aggregate_init(void);
+void aggregate_destroy(void);
+void print_aggregate_header(void);
+int drain_task_aggregates(int map_fd, struct xcapture_context *xctx);
+
+#endif /* __AGGREGATE_H */
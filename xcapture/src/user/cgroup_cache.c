@@ -1,27 +1,127 @@
 // SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
 // Copyright 2024-2038 Tanel Poder [0x.tools]
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include "cgroup_cache.h"
 #include "xcapture_user.h"
 
+// Cached cgroups are also on an LRU list, most recently looked up first,
+// removed cgroups go to the cold end to be evicted before live ones
+#define CGROUP_INDEX_POLL_LOOKUPS 65536  // also poll inotify this often without misses
+#define CGROUP_INDEX_MASK (IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_ONLYDIR)
+
 // Global cache instance
 static struct {
     cgroup_entry_t *buckets[CGROUP_CACHE_SIZE];
+    cgroup_entry_t *lru_head, *lru_tail;
     int total_entries;
     cgroup_cache_stats_t stats;
 } g_cgroup_cache = {0};
 
+// The directory and cgroup of every inotify watch descriptor, watch
+// descriptors are small increasing integers
+struct cgroup_watch {
+    char *dir;
+    __u64 cgroup_id;
+};
+
+static struct {
+    int fd;
+    char *root;
+    size_t root_len;
+    struct cgroup_watch *watches;
+    int nr_watches;
+    bool watch_limit_hit;
+} g_cgroup_index = { .fd = -1 };
+
 // Simple hash function for cgroup IDs
 static inline unsigned int hash_cgroup_id(__u64 cgroup_id) {
     // Multiplicative hash with golden ratio constant
     return (cgroup_id * 2654435761ULL) & (CGROUP_CACHE_SIZE - 1);
 }
 
+static void lru_unlink(cgroup_entry_t *entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        g_cgroup_cache.lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        g_cgroup_cache.lru_tail = entry->lru_prev;
+}
+
+static void lru_push_head(cgroup_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = g_cgroup_cache.lru_head;
+    if (g_cgroup_cache.lru_head)
+        g_cgroup_cache.lru_head->lru_prev = entry;
+    else
+        g_cgroup_cache.lru_tail = entry;
+    g_cgroup_cache.lru_head = entry;
+}
+
+static void lru_push_tail(cgroup_entry_t *entry) {
+    entry->lru_next = NULL;
+    entry->lru_prev = g_cgroup_cache.lru_tail;
+    if (g_cgroup_cache.lru_tail)
+        g_cgroup_cache.lru_tail->lru_next = entry;
+    else
+        g_cgroup_cache.lru_head = entry;
+    g_cgroup_cache.lru_tail = entry;
+}
+
+static cgroup_entry_t *find_entry(__u64 cgroup_id) {
+    cgroup_entry_t *entry = g_cgroup_cache.buckets[hash_cgroup_id(cgroup_id)];
+
+    while (entry && entry->cgroup_id != cgroup_id)
+        entry = entry->next;
+    return entry;
+}
+
+// Find and move to the hot end of the LRU list
+static cgroup_entry_t *touch_entry(__u64 cgroup_id) {
+    cgroup_entry_t *entry = find_entry(cgroup_id);
+
+    g_cgroup_cache.stats.lookups++;
+    if (!entry) {
+        g_cgroup_cache.stats.misses++;
+        return NULL;
+    }
+
+    g_cgroup_cache.stats.hits++;
+    if (entry != g_cgroup_cache.lru_head) {
+        lru_unlink(entry);
+        lru_push_head(entry);
+    }
+    return entry;
+}
+
+static void evict_lru(void) {
+    cgroup_entry_t *victim = g_cgroup_cache.lru_tail;
+    cgroup_entry_t **pp = &g_cgroup_cache.buckets[hash_cgroup_id(victim->cgroup_id)];
+
+    while (*pp != victim)
+        pp = &(*pp)->next;
+    *pp = victim->next;
+
+    lru_unlink(victim);
+    free(victim);
+    g_cgroup_cache.total_entries--;
+    g_cgroup_cache.stats.evictions++;
+}
+
 // Initialize the cache
 void cgroup_cache_init(void) {
     memset(&g_cgroup_cache, 0, sizeof(g_cgroup_cache));
@@ -29,53 +129,41 @@ void cgroup_cache_init(void) {
 
 // Lookup a cgroup by ID
 const char* cgroup_cache_lookup(__u64 cgroup_id) {
-    unsigned int hash = hash_cgroup_id(cgroup_id);
-    cgroup_entry_t *entry = g_cgroup_cache.buckets[hash];
-    
-    g_cgroup_cache.stats.lookups++;
-    
-    while (entry) {
-        if (entry->cgroup_id == cgroup_id) {
-            g_cgroup_cache.stats.hits++;
-            return entry->path;
-        }
-        entry = entry->next;
-    }
-    
-    g_cgroup_cache.stats.misses++;
-    return NULL;
+    cgroup_entry_t *entry = touch_entry(cgroup_id);
+
+    return entry ? entry->path : NULL;
 }
 
 // Insert a new cgroup
 int cgroup_cache_insert(__u64 cgroup_id, const char *path) {
     unsigned int hash = hash_cgroup_id(cgroup_id);
-    cgroup_entry_t *entry = g_cgroup_cache.buckets[hash];
-    
-    // Check if already exists
-    while (entry) {
-        if (entry->cgroup_id == cgroup_id) {
-            return 0;  // Already cached
-        }
-        entry = entry->next;
-    }
-    
+    cgroup_entry_t *entry;
+
+    if (find_entry(cgroup_id))
+        return 0;  // Already cached
+
+    if (g_cgroup_cache.total_entries >= CGROUP_CACHE_MAX_ENTRIES)
+        evict_lru();
+
     // Allocate new entry
     entry = malloc(sizeof(cgroup_entry_t));
     if (!entry) {
         return -1;  // Memory allocation failed
     }
-    
+
     entry->cgroup_id = cgroup_id;
+    entry->reported = false;
     strncpy(entry->path, path, CGROUP_PATH_MAX - 1);
     entry->path[CGROUP_PATH_MAX - 1] = '\0';
-    
+
     // Insert at head of chain (collision handling)
     if (g_cgroup_cache.buckets[hash] != NULL) {
         g_cgroup_cache.stats.collisions++;
     }
     entry->next = g_cgroup_cache.buckets[hash];
     g_cgroup_cache.buckets[hash] = entry;
-    
+    lru_push_head(entry);
+
     g_cgroup_cache.total_entries++;
     return 1;  // New entry added
 }
@@ -85,6 +173,22 @@ bool cgroup_cache_contains(__u64 cgroup_id) {
     return cgroup_cache_lookup(cgroup_id) != NULL;
 }
 
+bool cgroup_cache_reported(__u64 cgroup_id) {
+    if (g_cgroup_index.fd >= 0 &&
+        g_cgroup_cache.stats.lookups % CGROUP_INDEX_POLL_LOOKUPS == 0)
+        cgroup_index_poll();
+
+    cgroup_entry_t *entry = touch_entry(cgroup_id);
+    return entry && entry->reported;
+}
+
+void cgroup_cache_set_reported(__u64 cgroup_id) {
+    cgroup_entry_t *entry = find_entry(cgroup_id);
+
+    if (entry)
+        entry->reported = true;
+}
+
 // Get cache statistics
 void cgroup_cache_get_stats(cgroup_cache_stats_t *stats) {
     if (stats) {
@@ -103,6 +207,154 @@ void cgroup_cache_destroy(void) {
         }
     }
     memset(&g_cgroup_cache, 0, sizeof(g_cgroup_cache));
+
+    if (g_cgroup_index.fd >= 0)
+        close(g_cgroup_index.fd);
+    for (int i = 0; i < g_cgroup_index.nr_watches; i++)
+        free(g_cgroup_index.watches[i].dir);
+    free(g_cgroup_index.watches);
+    free(g_cgroup_index.root);
+    memset(&g_cgroup_index, 0, sizeof(g_cgroup_index));
+    g_cgroup_index.fd = -1;
+}
+
+// Cache a cgroup found in the cgroup filesystem, a cached one with another
+// path was renamed (or the id reused) and gets reported again
+static void index_cgroup(__u64 cgroup_id, const char *path) {
+    cgroup_entry_t *entry = find_entry(cgroup_id);
+
+    if (!entry) {
+        cgroup_cache_insert(cgroup_id, path);
+        return;
+    }
+    if (strncmp(entry->path, path, CGROUP_PATH_MAX - 1) != 0) {
+        strncpy(entry->path, path, CGROUP_PATH_MAX - 1);
+        entry->path[CGROUP_PATH_MAX - 1] = '\0';
+        entry->reported = false;
+        g_cgroup_cache.stats.renames++;
+    }
+}
+
+static void watch_dir(const char *dir, __u64 cgroup_id) {
+    if (g_cgroup_index.watch_limit_hit)
+        return;
+
+    // watching an already watched directory returns its existing descriptor,
+    // so a renamed subtree just gets its directories updated
+    int wd = inotify_add_watch(g_cgroup_index.fd, dir, CGROUP_INDEX_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            fprintf(stderr, "Warning: out of inotify watches (fs.inotify.max_user_watches), "
+                    "cgroups created later are resolved from /proc\n");
+            g_cgroup_index.watch_limit_hit = true;
+        }
+        return;
+    }
+
+    if (wd >= g_cgroup_index.nr_watches) {
+        int n = g_cgroup_index.nr_watches ? g_cgroup_index.nr_watches : 256;
+        while (n <= wd)
+            n *= 2;
+
+        struct cgroup_watch *w = realloc(g_cgroup_index.watches, n * sizeof(*w));
+        if (!w) {
+            inotify_rm_watch(g_cgroup_index.fd, wd);
+            return;
+        }
+        memset(w + g_cgroup_index.nr_watches, 0, (n - g_cgroup_index.nr_watches) * sizeof(*w));
+        g_cgroup_index.watches = w;
+        g_cgroup_index.nr_watches = n;
+    }
+
+    free(g_cgroup_index.watches[wd].dir);
+    g_cgroup_index.watches[wd].dir = strdup(dir);
+    g_cgroup_index.watches[wd].cgroup_id = cgroup_id;
+}
+
+// nftw() takes no argument for its callback, the root length is in g_cgroup_index
+static int index_walk_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    XCAP_UNUSED(ftwbuf);
+
+    if (typeflag != FTW_D)
+        return 0;
+
+    // cgroup v2 directory inode numbers are the cgroup ids, the paths are
+    // relative to the cgroup root as in /proc/PID/cgroup
+    const char *rel = fpath + g_cgroup_index.root_len;
+    index_cgroup(sb->st_ino, *rel ? rel : "/");
+    watch_dir(fpath, sb->st_ino);
+    return 0;
+}
+
+static int index_walk(const char *dir) {
+    return nftw(dir, index_walk_cb, 16, FTW_PHYS | FTW_MOUNT);
+}
+
+int cgroup_index_init(const char *root) {
+    struct stat st;
+
+    if (stat(root, &st) || !S_ISDIR(st.st_mode))
+        return -1;
+
+    g_cgroup_index.root = strdup(root);
+    if (!g_cgroup_index.root)
+        return -1;
+    g_cgroup_index.root_len = strlen(root);
+    while (g_cgroup_index.root_len > 1 && root[g_cgroup_index.root_len - 1] == '/')
+        g_cgroup_index.root[--g_cgroup_index.root_len] = '\0';
+
+    g_cgroup_index.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    // without inotify the walk still saves the /proc reads of existing cgroups
+    if (index_walk(g_cgroup_index.root)) {
+        if (g_cgroup_index.fd >= 0)
+            close(g_cgroup_index.fd);
+        g_cgroup_index.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void cgroup_index_poll(void) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    if (g_cgroup_index.fd < 0)
+        return;
+
+    while ((len = read(g_cgroup_index.fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            struct cgroup_watch *w = ev->wd >= 0 && ev->wd < g_cgroup_index.nr_watches ?
+                                     &g_cgroup_index.watches[ev->wd] : NULL;
+
+            p += sizeof(*ev) + ev->len;
+            g_cgroup_cache.stats.index_events++;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // lost events, walk everything again
+                index_walk(g_cgroup_index.root);
+            } else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR) &&
+                       ev->len && w && w->dir) {
+                // a new or renamed cgroup, with all its children
+                char dir[PATH_MAX];
+
+                snprintf(dir, sizeof(dir), "%s/%s", w->dir, ev->name);
+                index_walk(dir);
+            } else if ((ev->mask & IN_IGNORED) && w && w->dir) {
+                // the directory is gone, samples still in flight may resolve
+                // its path but it goes first when something must be evicted
+                cgroup_entry_t *entry = find_entry(w->cgroup_id);
+
+                if (entry && entry != g_cgroup_cache.lru_tail) {
+                    lru_unlink(entry);
+                    lru_push_tail(entry);
+                }
+                free(w->dir);
+                w->dir = NULL;
+            }
+        }
+    }
 }
 
 // Resolve cgroup path from /proc/[pid]/cgroup
@@ -152,8 +404,20 @@ int resolve_cgroup_path(__u64 cgroup_id, pid_t pid, char *path_out, size_t path_
         return 0;
     }
     
+    // A cgroup created since the last poll of the index
+    if (g_cgroup_index.fd >= 0) {
+        cgroup_index_poll();
+        cached_path = cgroup_cache_lookup(cgroup_id);
+        if (cached_path) {
+            strncpy(path_out, cached_path, path_size - 1);
+            path_out[path_size - 1] = '\0';
+            return 0;
+        }
+    }
+
     // Try to resolve from /proc/[pid]/cgroup
     if (pid > 0) {
+        g_cgroup_cache.stats.proc_reads++;
         if (resolve_cgroup_from_proc(pid, path_out, path_size) == 0) {
             // Cache the result
             cgroup_cache_insert(cgroup_id, path_out);
@@ -161,10 +425,6 @@ int resolve_cgroup_path(__u64 cgroup_id, pid_t pid, char *path_out, size_t path_
         }
     }
     
-    // Future: Could add other resolution methods here
-    // - Walk /sys/fs/cgroup/ to find matching inode
-    // - Use cgroup ID to path mapping if available
-    
     return -1;  // Could not resolve
 }
 
@@ -197,10 +457,84 @@ FILE* open_cgroup_file(const char *output_dir) {
     return f;
 }
 
-// Write cgroup entry to file
+// Write cgroup entry to file, flushed with the other files of the iteration
 void write_cgroup_entry(FILE *f, __u64 cgroup_id, const char *path) {
     if (f) {
         fprintf(f, "%llu,%s\n", cgroup_id, path);
-        fflush(f);
     }
-}
\ No newline at end of file
+}
+
+// --cgroup: the BPF programs compare exact cgroup ids, so every cgroup below
+// a given one is added as well, as of startup
+static struct {
+    __u64 *ids;
+    int nr;
+    int max;
+} g_cgroup_filter;
+
+static int filter_walk_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    XCAP_UNUSED(fpath);
+    XCAP_UNUSED(ftwbuf);
+
+    if (typeflag != FTW_D)
+        return 0;
+
+    for (int i = 0; i < g_cgroup_filter.nr; i++)
+        if (g_cgroup_filter.ids[i] == sb->st_ino)
+            return 0;
+
+    if (g_cgroup_filter.nr == g_cgroup_filter.max)
+        return -1;
+    g_cgroup_filter.ids[g_cgroup_filter.nr++] = sb->st_ino;
+    return 0;
+}
+
+int parse_cgroup_filter(const char *arg, __u64 *ids, int max) {
+    char *list = strdup(arg);
+    char *saveptr = NULL;
+    int err = 0;
+
+    if (!list)
+        return -ENOMEM;
+
+    g_cgroup_filter.ids = ids;
+    g_cgroup_filter.nr = 0;
+    g_cgroup_filter.max = max;
+
+    for (char *tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        char path[PATH_MAX];
+        char *end;
+        struct stat st;
+
+        // a plain number is a cgroup id, as in the CGROUP_ID column
+        unsigned long long id = strtoull(tok, &end, 10);
+        if (*tok && !*end) {
+            if (g_cgroup_filter.nr == max) {
+                err = -E2BIG;
+                break;
+            }
+            ids[g_cgroup_filter.nr++] = id;
+            continue;
+        }
+
+        // paths are relative to the cgroup root as in /proc/PID/cgroup, unless
+        // they already start with it
+        if (strncmp(tok, CGROUP_ROOT "/", sizeof(CGROUP_ROOT)) == 0 || strcmp(tok, CGROUP_ROOT) == 0)
+            snprintf(path, sizeof(path), "%s", tok);
+        else
+            snprintf(path, sizeof(path), "%s/%s", CGROUP_ROOT, tok[0] == '/' ? tok + 1 : tok);
+
+        if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Error: cgroup %s not found\n", path);
+            err = -ENOENT;
+            break;
+        }
+        if (nftw(path, filter_walk_cb, 16, FTW_PHYS | FTW_MOUNT)) {
+            err = g_cgroup_filter.nr == max ? -E2BIG : -errno;
+            break;
+        }
+    }
+
+    free(list);
+    return err ? err : g_cgroup_filter.nr;
+}
@@ -328,20 +328,20 @@ static void format_cgroup_id(char *buf, size_t len, const struct task_output_eve
 
 static void format_trace_payload(char *buf, size_t len, const struct task_output_event *event, const column_context_t *ctx) {
     UNUSED_COLUMNS_ARGS();
-    __u32 plen = event->storage.trace_payload_len;
+    __u32 plen = event->trace_payload_len;
     if (plen == 0 || plen > TRACE_PAYLOAD_LEN) {
         snprintf(buf, len, "-");
         return;
     }
 
     char hex[TRACE_PAYLOAD_LEN * 2 + 1];
-    bytes_to_hex(event->storage.trace_payload, plen, hex, sizeof(hex));
+    bytes_to_hex(event->trace_payload, plen, hex, sizeof(hex));
     snprintf(buf, len, "%s", hex);
 }
 
 static void format_trace_payload_len(char *buf, size_t len, const struct task_output_event *event, const column_context_t *ctx) {
     UNUSED_COLUMNS_ARGS();
-    __u32 plen = event->storage.trace_payload_len;
+    __u32 plen = event->trace_payload_len;
     if (plen == 0 || plen > TRACE_PAYLOAD_LEN) {
         snprintf(buf, len, "-");
         return;
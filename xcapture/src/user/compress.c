@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "compress.h"
+
+// Streaming compression of the CSV output files (--compress zstd|lz4), driven
+// by the pipeline writer threads. Output is a sequence of independent frames:
+// a frame is ended once it is COMPRESS_FRAME_MS old, whether the writer is
+// busy or idle, and when the file is closed, so the file on disk is always
+// complete frames plus at most a few seconds of a partial one. Concatenated
+// frames decode as one stream (zstdcat, lz4cat, DuckDB's .csv.zst reader).
+// A compressed file is never appended to: after a restart within the same
+// period output continues in a new <stem>.N.csv.zst (.lz4) file next to it,
+// as a crash may have left the old one ending in a partial frame
+
+#define COMPRESS_OUT_SIZE   (512 * 1024)
+#define COMPRESS_ZSTD_LEVEL 3
+#define COMPRESS_LZ4_CHUNK  (64 * 1024)
+
+struct compressor {
+    enum compress_algo algo;
+    bool frame_open;
+    char *out;
+    size_t out_len;
+    size_t min_room;            // worst case output of one compression call
+#ifdef USE_ZSTD
+    ZSTD_CCtx *zctx;
+#endif
+#ifdef USE_LZ4
+    LZ4F_cctx *lctx;
+    LZ4F_preferences_t prefs;
+#endif
+};
+
+int parse_compress(const char *arg, enum compress_algo *algo)
+{
+    if (strcmp(arg, "none") == 0) {
+        *algo = COMPRESS_NONE;
+        return 0;
+    }
+    if (strcmp(arg, "zstd") == 0) {
+#ifdef USE_ZSTD
+        *algo = COMPRESS_ZSTD;
+        return 0;
+#else
+        return -ENOTSUP;
+#endif
+    }
+    if (strcmp(arg, "lz4") == 0) {
+#ifdef USE_LZ4
+        *algo = COMPRESS_LZ4;
+        return 0;
+#else
+        return -ENOTSUP;
+#endif
+    }
+    return -EINVAL;
+}
+
+const char *compress_suffix(enum compress_algo algo)
+{
+    switch (algo) {
+        case COMPRESS_ZSTD: return ".zst";
+        case COMPRESS_LZ4:  return ".lz4";
+        default:            return "";
+    }
+}
+
+struct compressor *compressor_new(enum compress_algo algo)
+{
+    struct compressor *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+
+    c->algo = algo;
+    c->out = malloc(COMPRESS_OUT_SIZE);
+    if (!c->out)
+        goto fail;
+
+    switch (algo) {
+#ifdef USE_ZSTD
+        case COMPRESS_ZSTD:
+            c->zctx = ZSTD_createCCtx();
+            if (!c->zctx)
+                goto fail;
+            ZSTD_CCtx_setParameter(c->zctx, ZSTD_c_compressionLevel, COMPRESS_ZSTD_LEVEL);
+            ZSTD_CCtx_setParameter(c->zctx, ZSTD_c_checksumFlag, 1);
+            c->min_room = ZSTD_CStreamOutSize();
+            break;
+#endif
+#ifdef USE_LZ4
+        case COMPRESS_LZ4:
+            if (LZ4F_isError(LZ4F_createCompressionContext(&c->lctx, LZ4F_VERSION)))
+                goto fail;
+            memset(&c->prefs, 0, sizeof(c->prefs));
+            c->prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+            c->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+            c->min_room = LZ4F_compressBound(COMPRESS_LZ4_CHUNK, &c->prefs) + LZ4F_HEADER_SIZE_MAX;
+            break;
+#endif
+        default:
+            goto fail;
+    }
+
+    return c;
+
+fail:
+    compressor_free(c);
+    return NULL;
+}
+
+void compressor_free(struct compressor *c)
+{
+    if (!c)
+        return;
+
+#ifdef USE_ZSTD
+    ZSTD_freeCCtx(c->zctx);
+#endif
+#ifdef USE_LZ4
+    if (c->lctx)
+        LZ4F_freeCompressionContext(c->lctx);
+#endif
+    free(c->out);
+    free(c);
+}
+
+bool compressor_frame_open(const struct compressor *c)
+{
+    return c->frame_open;
+}
+
+static ssize_t flush_out(struct compressor *c, int fd)
+{
+    size_t done = 0;
+
+    while (done < c->out_len) {
+        ssize_t n = write(fd, c->out + done, c->out_len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            c->out_len = 0;
+            return -errno;
+        }
+        done += n;
+    }
+
+    c->out_len = 0;
+    return done;
+}
+
+#if defined(USE_ZSTD) || defined(USE_LZ4)
+// make sure the next compression call has room for its worst case output
+static ssize_t ensure_room(struct compressor *c, int fd)
+{
+    if (COMPRESS_OUT_SIZE - c->out_len >= c->min_room)
+        return 0;
+    return flush_out(c, fd);
+}
+#endif
+
+ssize_t compressor_write(struct compressor *c, int fd, const void *buf, size_t len)
+{
+    ssize_t written = 0, n;
+
+    if (!len)
+        return 0;
+
+#if !defined(USE_ZSTD) && !defined(USE_LZ4)
+    (void)buf;                  // compressor_new() fails, never called
+#endif
+#ifdef USE_ZSTD
+    if (c->algo == COMPRESS_ZSTD) {
+        ZSTD_inBuffer in = { buf, len, 0 };
+
+        while (in.pos < in.size) {
+            if ((n = ensure_room(c, fd)) < 0)
+                return n;
+            written += n;
+
+            ZSTD_outBuffer out = { c->out + c->out_len, COMPRESS_OUT_SIZE - c->out_len, 0 };
+            if (ZSTD_isError(ZSTD_compressStream2(c->zctx, &out, &in, ZSTD_e_continue)))
+                return -EIO;
+            c->out_len += out.pos;
+        }
+    }
+#endif
+#ifdef USE_LZ4
+    if (c->algo == COMPRESS_LZ4) {
+        const char *src = buf;
+
+        if (!c->frame_open) {
+            if ((n = ensure_room(c, fd)) < 0)
+                return n;
+            written += n;
+
+            size_t hdr = LZ4F_compressBegin(c->lctx, c->out + c->out_len,
+                                            COMPRESS_OUT_SIZE - c->out_len, &c->prefs);
+            if (LZ4F_isError(hdr))
+                return -EIO;
+            c->out_len += hdr;
+        }
+
+        while (len) {
+            size_t chunk = len < COMPRESS_LZ4_CHUNK ? len : COMPRESS_LZ4_CHUNK;
+
+            if ((n = ensure_room(c, fd)) < 0)
+                return n;
+            written += n;
+
+            size_t r = LZ4F_compressUpdate(c->lctx, c->out + c->out_len,
+                                           COMPRESS_OUT_SIZE - c->out_len, src, chunk, NULL);
+            if (LZ4F_isError(r))
+                return -EIO;
+            c->out_len += r;
+            src += chunk;
+            len -= chunk;
+        }
+    }
+#endif
+
+    c->frame_open = true;
+
+    // the writer calls us per queue record, only hit the disk in large writes
+    if (c->out_len >= COMPRESS_OUT_SIZE / 2) {
+        if ((n = flush_out(c, fd)) < 0)
+            return n;
+        written += n;
+    }
+
+    return written;
+}
+
+ssize_t compressor_end_frame(struct compressor *c, int fd)
+{
+    ssize_t written = 0, n;
+
+    if (!c->frame_open)
+        return 0;
+    c->frame_open = false;
+
+#ifdef USE_ZSTD
+    if (c->algo == COMPRESS_ZSTD) {
+        size_t remaining;
+
+        do {
+            if ((n = ensure_room(c, fd)) < 0)
+                return n;
+            written += n;
+
+            ZSTD_inBuffer in = { NULL, 0, 0 };
+            ZSTD_outBuffer out = { c->out + c->out_len, COMPRESS_OUT_SIZE - c->out_len, 0 };
+            remaining = ZSTD_compressStream2(c->zctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(remaining))
+                return -EIO;
+            c->out_len += out.pos;
+        } while (remaining);
+    }
+#endif
+#ifdef USE_LZ4
+    if (c->algo == COMPRESS_LZ4) {
+        if ((n = ensure_room(c, fd)) < 0)
+            return n;
+        written += n;
+
+        size_t r = LZ4F_compressEnd(c->lctx, c->out + c->out_len, COMPRESS_OUT_SIZE - c->out_len, NULL);
+        if (LZ4F_isError(r))
+            return -EIO;
+        c->out_len += r;
+    }
+#endif
+
+    if ((n = flush_out(c, fd)) < 0)
+        return n;
+
+    return written + n;
+}
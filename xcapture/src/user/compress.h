@@ -0,0 +1,25 @@
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "xcapture_types.h"
+
+// how long a frame stays open before it's ended, bounds what a crash can lose
+#define COMPRESS_FRAME_MS 5000
+
+int parse_compress(const char *arg, enum compress_algo *algo);
+const char *compress_suffix(enum compress_algo algo);
+
+struct compressor;
+
+struct compressor *compressor_new(enum compress_algo algo);
+void compressor_free(struct compressor *c);
+
+// Both return the number of compressed bytes written to fd, or -errno
+ssize_t compressor_write(struct compressor *c, int fd, const void *buf, size_t len);
+ssize_t compressor_end_frame(struct compressor *c, int fd);
+bool compressor_frame_open(const struct compressor *c);
+
+#endif /* __COMPRESS_H */
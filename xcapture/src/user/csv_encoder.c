@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "csv_encoder.h"
+
+const char csv_digit_pairs[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// localtime_r() + strftime() only run when the second changes, rows within the
+// same second only get their microsecond digits written. Per thread, as the
+// format worker and the sampling thread both produce timestamps
+static __thread struct {
+    time_t sec;
+    char prefix[20];        // YYYY-MM-DDTHH:MM:SS
+} ts_cache = { .sec = -1 };
+
+void csv_format_ts(struct timespec ts, char *dst)
+{
+    if (ts.tv_sec != ts_cache.sec) {
+        struct tm tm;
+
+        if (!localtime_r(&ts.tv_sec, &tm) ||
+            strftime(ts_cache.prefix, sizeof(ts_cache.prefix), "%Y-%m-%dT%H:%M:%S", &tm) != 19)
+            memset(ts_cache.prefix, '?', 19);
+        ts_cache.sec = ts.tv_sec;
+    }
+
+    unsigned int us = ts.tv_nsec / 1000;
+
+    memcpy(dst, ts_cache.prefix, 19);
+    dst[19] = '.';
+    memcpy(dst + 20, &csv_digit_pairs[(us / 10000) * 2], 2);
+    memcpy(dst + 22, &csv_digit_pairs[(us / 100 % 100) * 2], 2);
+    memcpy(dst + 24, &csv_digit_pairs[(us % 100) * 2], 2);
+    dst[CSV_TS_LEN] = '\0';
+}
@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+// Rows per second of the CSV row encoder compared to the fprintf() formats and
+// the localtime() + strftime() timestamps it replaced, for sample and SYSC_END
+// rows written into a 256 kB buffered /dev/null. Every row is also formatted
+// both ways and compared byte for byte. Not installed, build it with
+// cmake -DBUILD_BENCHMARKS=ON and run build/csv-encoder-bench [rows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "csv_encoder.h"
+
+#define ROWS_PER_SEC 1000       // rows sharing a timestamp second, one sampling iteration's worth
+#define FILE_BUF_SIZE (256 * 1024)
+
+struct fake_sample {
+    struct timespec ts;
+    struct timespec sc_start;
+    long weight_us;
+    int pid, tgid;
+    unsigned int pid_ns;
+    __u64 cgroup_id;
+    const char *state, *user, *exe, *comm, *syscall, *in_syscall;
+    long long sc_duration_ns, sc_seq, iorq_seq;
+    __u64 args[6];
+    const char *filename, *conn, *conn_state, *extra;
+    __u64 kstack_hash, ustack_hash;
+    __s64 ret_val;
+};
+
+static const char *states[] = { "RUNNING", "SLEEP", "DISK", "RUNQUEUE" };
+static const char *syscalls[] = { "read", "pread64", "io_getevents", "futex", "epoll_wait", "-" };
+static const char *comms[] = { "postgres", "java", "kworker/u16:2", "mysqld" };
+static const char *files[] = { "", "/data/pg/base/16384/2619", "socket:[84271]", "/dev/nvme0n1" };
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u64 rnd_state = 0x2545f4914f6cdd1dULL;
+
+static __u64 rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+static void fake_samples(struct fake_sample *s, __u32 n)
+{
+    time_t base = time(NULL);
+
+    for (__u32 i = 0; i < n; i++) {
+        struct fake_sample *f = &s[i];
+
+        f->ts.tv_sec = base + i / ROWS_PER_SEC;
+        f->ts.tv_nsec = (i % ROWS_PER_SEC) * 997 + 1000;
+        f->sc_start.tv_sec = f->ts.tv_sec - rnd() % 3;
+        f->sc_start.tv_nsec = rnd() % 1000000000;
+        f->weight_us = 1000000;
+        f->pid = 1000 + rnd() % 4000000;
+        f->tgid = f->pid - rnd() % 64;
+        f->pid_ns = 4026531836U;
+        f->cgroup_id = rnd() % 100000;
+        f->state = states[rnd() % 4];
+        f->user = "postgres";
+        f->exe = "/usr/lib/postgresql/16/bin/postgres";
+        f->comm = comms[rnd() % 4];
+        f->syscall = syscalls[rnd() % 6];
+        f->in_syscall = syscalls[rnd() % 6];
+        f->sc_duration_ns = rnd() % 50000000;
+        f->sc_seq = rnd() % 100000000;
+        f->iorq_seq = rnd() % 1000;
+        for (int a = 0; a < 6; a++)
+            f->args[a] = (rnd() & 1) ? rnd() % 4096 : rnd();
+        f->filename = files[rnd() % 4];
+        f->conn = (rnd() & 1) ? "10.0.0.5:5432->10.0.0.9:51234" : "";
+        f->conn_state = f->conn[0] ? "ESTABLISHED" : "";
+        f->extra = "";
+        f->kstack_hash = rnd();
+        f->ustack_hash = (rnd() & 1) ? rnd() : 0;
+        f->ret_val = (rnd() % 8) ? (__s64)(rnd() % 65536) - 4096 : (__s64)rnd();
+    }
+}
+
+// the get_str_from_ts() before the encoder
+static void old_ts(struct timespec ts, char *buf, size_t bufsize)
+{
+    struct tm *tm = localtime(&ts.tv_sec);
+    strftime(buf, bufsize, "%Y-%m-%dT%H:%M:%S", tm);
+    snprintf(buf + 19, bufsize - 19, ".%06ld", ts.tv_nsec / 1000);
+}
+
+#define OLD_SAMPLE_FMT "%s,%ld,%d,%d,%u,%llu,%s,'%s','%s','%s',%s,%s,%s,%lld,%lld,%lld,%llx,%llx,%llx,%llx,%llx,%llx,'%s','%s','%s','%s',%llx,%llx\n"
+#define OLD_SAMPLE_ARGS(f, ts, sc_ts) \
+    ts, (f)->weight_us, (f)->pid, (f)->tgid, (f)->pid_ns, (f)->cgroup_id, (f)->state, (f)->user, (f)->exe, \
+    (f)->comm, (f)->syscall, (f)->in_syscall, sc_ts, (f)->sc_duration_ns, (f)->sc_seq, (f)->iorq_seq, \
+    (f)->args[0], (f)->args[1], (f)->args[2], (f)->args[3], (f)->args[4], (f)->args[5], \
+    (f)->filename, (f)->conn, (f)->conn_state, (f)->extra, (f)->kstack_hash, (f)->ustack_hash
+
+static void new_sample(struct csv_row *row, const struct fake_sample *f)
+{
+    csv_begin_row(row);
+    csv_ts(row, f->ts);
+    csv_s64(row, f->weight_us);
+    csv_s64(row, f->pid);
+    csv_s64(row, f->tgid);
+    csv_u64(row, f->pid_ns);
+    csv_u64(row, f->cgroup_id);
+    csv_str(row, f->state);
+    csv_quoted(row, f->user);
+    csv_quoted(row, f->exe);
+    csv_quoted(row, f->comm);
+    csv_str(row, f->syscall);
+    csv_str(row, f->in_syscall);
+    csv_ts(row, f->sc_start);
+    csv_s64(row, f->sc_duration_ns);
+    csv_s64(row, f->sc_seq);
+    csv_s64(row, f->iorq_seq);
+    for (int i = 0; i < 6; i++)
+        csv_hex(row, f->args[i]);
+    csv_quoted(row, f->filename);
+    csv_quoted(row, f->conn);
+    csv_quoted(row, f->conn_state);
+    csv_quoted(row, f->extra);
+    csv_hex(row, f->kstack_hash);
+    csv_hex(row, f->ustack_hash);
+}
+
+static void new_sysc_end(struct csv_row *row, const struct fake_sample *f)
+{
+    csv_begin_row(row);
+    csv_str(row, "SYSC_END");
+    csv_s64(row, f->pid);
+    csv_s64(row, f->tgid);
+    csv_quoted(row, f->syscall);
+    csv_u64(row, f->sc_duration_ns);
+    if (f->ret_val >= -4095 && f->ret_val <= (1024*1024*16)) {
+        csv_s64(row, f->ret_val);
+    } else {
+        csv_raw(row, "0x", 2);
+        csv_hex(row, f->ret_val);
+    }
+    csv_u64(row, f->sc_seq);
+    csv_ts(row, f->sc_start);
+}
+
+static int old_sysc_end(char *buf, size_t len, const struct fake_sample *f, const char *ts_enter)
+{
+    if (f->ret_val >= -4095 && f->ret_val <= (1024*1024*16))
+        return snprintf(buf, len, "SYSC_END,%d,%d,'%s',%llu,%lld,%llu,%s\n", f->pid, f->tgid, f->syscall,
+                        (__u64)f->sc_duration_ns, (long long)f->ret_val, (__u64)f->sc_seq, ts_enter);
+    return snprintf(buf, len, "SYSC_END,%d,%d,'%s',%llu,0x%llx,%llu,%s\n", f->pid, f->tgid, f->syscall,
+                    (__u64)f->sc_duration_ns, (unsigned long long)f->ret_val, (__u64)f->sc_seq, ts_enter);
+}
+
+// the fields end with a comma until csv_end_row(), compare as it would write them
+static int row_differs(struct csv_row *row, const char *old, int old_len)
+{
+    size_t len = row->pos - row->buf;
+
+    if (len && row->buf[len - 1] == ',')
+        len--;
+    return (int)len + 1 != old_len || memcmp(row->buf, old, len) || old[len] != '\n';
+}
+
+static __u32 verify(const struct fake_sample *s, __u32 n)
+{
+    char old[CSV_ROW_MAX], ts[64], sc_ts[64];
+    struct csv_row row;
+    __u32 bad = 0;
+
+    for (__u32 i = 0; i < n; i++) {
+        const struct fake_sample *f = &s[i];
+
+        old_ts(f->ts, ts, sizeof(ts));
+        old_ts(f->sc_start, sc_ts, sizeof(sc_ts));
+
+        int len = snprintf(old, sizeof(old), OLD_SAMPLE_FMT, OLD_SAMPLE_ARGS(f, ts, sc_ts));
+        new_sample(&row, f);
+        bad += row_differs(&row, old, len);
+
+        len = old_sysc_end(old, sizeof(old), f, sc_ts);
+        new_sysc_end(&row, f);
+        bad += row_differs(&row, old, len);
+    }
+    return bad;
+}
+
+static FILE *open_sink(char *buf)
+{
+    FILE *f = fopen("/dev/null", "w");
+
+    if (f)
+        setbuffer(f, buf, FILE_BUF_SIZE);
+    return f;
+}
+
+static void report(const char *what, __u32 n, __u64 old_ns, __u64 new_ns)
+{
+    printf("  %-10s fprintf %6.2f M rows/s %6.0f ns/row   encoder %6.2f M rows/s %6.0f ns/row   %5.1fx\n",
+           what, n * 1e3 / old_ns, (double)old_ns / n, n * 1e3 / new_ns, (double)new_ns / n,
+           (double)old_ns / new_ns);
+}
+
+static void bench(const struct fake_sample *s, __u32 n)
+{
+    static char buf[FILE_BUF_SIZE];
+    char ts[64], sc_ts[64];
+    struct csv_row row;
+    FILE *f;
+    __u64 t0, old_ns, new_ns;
+
+    f = open_sink(buf);
+    t0 = now_ns();
+    for (__u32 i = 0; i < n; i++) {
+        old_ts(s[i].ts, ts, sizeof(ts));
+        old_ts(s[i].sc_start, sc_ts, sizeof(sc_ts));
+        fprintf(f, OLD_SAMPLE_FMT, OLD_SAMPLE_ARGS(&s[i], ts, sc_ts));
+    }
+    fflush(f);
+    old_ns = now_ns() - t0;
+    fclose(f);
+
+    f = open_sink(buf);
+    t0 = now_ns();
+    for (__u32 i = 0; i < n; i++) {
+        new_sample(&row, &s[i]);
+        csv_end_row(&row, f);
+    }
+    fflush(f);
+    new_ns = now_ns() - t0;
+    fclose(f);
+    report("samples", n, old_ns, new_ns);
+
+    f = open_sink(buf);
+    t0 = now_ns();
+    for (__u32 i = 0; i < n; i++) {
+        const struct fake_sample *e = &s[i];
+
+        old_ts(e->sc_start, sc_ts, sizeof(sc_ts));
+        if (e->ret_val >= -4095 && e->ret_val <= (1024*1024*16))
+            fprintf(f, "SYSC_END,%d,%d,'%s',%llu,%lld,%llu,%s\n", e->pid, e->tgid, e->syscall,
+                    (__u64)e->sc_duration_ns, (long long)e->ret_val, (__u64)e->sc_seq, sc_ts);
+        else
+            fprintf(f, "SYSC_END,%d,%d,'%s',%llu,0x%llx,%llu,%s\n", e->pid, e->tgid, e->syscall,
+                    (__u64)e->sc_duration_ns, (unsigned long long)e->ret_val, (__u64)e->sc_seq, sc_ts);
+    }
+    fflush(f);
+    old_ns = now_ns() - t0;
+    fclose(f);
+
+    f = open_sink(buf);
+    t0 = now_ns();
+    for (__u32 i = 0; i < n; i++) {
+        new_sysc_end(&row, &s[i]);
+        csv_end_row(&row, f);
+    }
+    fflush(f);
+    new_ns = now_ns() - t0;
+    fclose(f);
+    report("SYSC_END", n, old_ns, new_ns);
+}
+
+int main(int argc, char **argv)
+{
+    __u32 n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    struct fake_sample *s;
+
+    if (n == 0) {
+        fprintf(stderr, "Usage: %s [rows]\n", argv[0]);
+        return 1;
+    }
+
+    s = calloc(n, sizeof(*s));
+    if (!s) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    fake_samples(s, n);
+
+    __u32 bad = verify(s, n);
+    printf("%u rows, %u differences from the fprintf output\n", n, bad);
+    bench(s, n);
+
+    free(s);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+// xcapture-decode turns the journal segments written by xcapture --raw into the
+// CSV or Parquet files that xcapture would have written during the capture.
+// The records go through the same task, tracking and stack handlers, with the
+// iteration clock correlations, cgroup paths and user names taken from the
+// journal instead of the local machine.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <argp.h>
+#include <sys/stat.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "xcapture_context.h"
+#include "cgroup_cache.h"
+#include "task_handler.h"
+#include "tracking_handler.h"
+#include "pipeline.h"
+#include "parquet_writer.h"
+#include "compress.h"
+#include "journal.h"
+#include "symcache.h"
+
+#ifdef USE_BLAZESYM
+#include "blazesym.h"
+
+blaze_symbolizer *g_symbolizer = NULL;
+struct symcache *g_symcache = NULL;
+bool symbolize_stacks = true;
+#endif
+
+struct segment {
+    const char *path;
+    struct xcj_segment_header hdr;
+};
+
+static struct xcapture_context ctx;
+static bool want_symbolize = true;
+static bool verbose;
+static struct segment *segments;
+static int nr_segments;
+
+static struct {
+    __u64 records;
+    __u64 bad_crc;
+    int truncated;
+} stats;
+
+// user names from the journal, the decoding machine's passwd means nothing
+#define DECODE_USERS 4096  // power of 2
+
+static struct {
+    uid_t uid;
+    bool valid;
+    char name[64];
+} users[DECODE_USERS];
+
+static void add_user(uid_t uid, const char *name, size_t len)
+{
+    unsigned int i = uid & (DECODE_USERS - 1);
+
+    for (int n = 0; n < DECODE_USERS; n++, i = (i + 1) & (DECODE_USERS - 1)) {
+        if (users[i].valid && users[i].uid != uid)
+            continue;
+        users[i].uid = uid;
+        users[i].valid = true;
+        snprintf(users[i].name, sizeof(users[i].name), "%.*s", (int)len, name);
+        return;
+    }
+}
+
+const char *getusername(uid_t uid)
+{
+    unsigned int i = uid & (DECODE_USERS - 1);
+
+    for (int n = 0; n < DECODE_USERS && users[i].valid; n++, i = (i + 1) & (DECODE_USERS - 1))
+        if (users[i].uid == uid)
+            return users[i].name;
+
+    return "-";
+}
+
+// only used for the stack printout of stdout mode
+void add_unique_stack(__u64 hash, bool is_kernel)
+{
+    XCAP_UNUSED(hash);
+    XCAP_UNUSED(is_kernel);
+}
+
+const char *argp_program_version = "xcapture-decode " XCAPTURE_VERSION;
+const char *argp_program_bug_address = "https://github.com/tanelpoder/0xtools";
+static const char argp_program_doc[] =
+"xcapture-decode converts xcapture --raw journals into CSV or Parquet files\n"
+"\n"
+"USAGE: xcapture-decode -o OUTPUT_DIRNAME [--format csv|parquet] JOURNAL...\n"
+"\n"
+"EXAMPLES:\n"
+"    xcapture-decode -o /tmp/data /tmp/raw/xcapture_journal_*.xcj\n";
+
+enum {
+    OPT_FORMAT = 1000,
+    OPT_COMPRESS,
+    OPT_HIVE,
+};
+
+static const struct argp_option opts[] = {
+    { "output-dir", 'o', "DIR", 0, "Write the decoded files to specified directory", 0 },
+    { "format", OPT_FORMAT, "csv|parquet", 0, "Output file format (default: csv)", 0 },
+    { "compress", OPT_COMPRESS, "zstd|lz4", 0, "Compress CSV output files into .csv.zst or .csv.lz4 frames", 0 },
+    { "hive", OPT_HIVE, NULL, 0, "Write output files into date=YYYY-MM-DD/hour=HH/ subdirectories", 0 },
+    { "verbose", 'v', NULL, 0, "Describe every journal segment decoded", 0 },
+#ifdef USE_BLAZESYM
+    { "no-symbolize", 'N', NULL, 0, "Disable stack trace symbolization (show raw addresses)", 0 },
+#endif
+    {},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+    switch (key) {
+        case 'o':
+            ctx.output_dirname = arg;
+            break;
+        case OPT_FORMAT:
+            if (strcmp(arg, "parquet") == 0) {
+                ctx.output_parquet = true;
+            } else if (strcmp(arg, "csv") != 0) {
+                fprintf(stderr, "Invalid --format value. Must be csv or parquet.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_COMPRESS: {
+            int err = parse_compress(arg, &ctx.compress);
+            if (err == -ENOTSUP) {
+                fprintf(stderr, "--compress %s is not supported, xcapture-decode was built without it\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            } else if (err) {
+                fprintf(stderr, "Invalid --compress value. Must be zstd, lz4 or none.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        }
+        case OPT_HIVE:
+            ctx.hive_layout = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+#ifdef USE_BLAZESYM
+        case 'N':
+            want_symbolize = false;
+            break;
+#endif
+        case ARGP_KEY_ARG:
+            segments = realloc(segments, (nr_segments + 1) * sizeof(*segments));
+            if (!segments)
+                return ENOMEM;
+            segments[nr_segments++].path = arg;
+            break;
+        case ARGP_KEY_END:
+            if (!nr_segments) {
+                fprintf(stderr, "No journal files given\n");
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static int cmp_segment(const void *a, const void *b)
+{
+    const struct segment *sa = a, *sb = b;
+
+    if (sa->hdr.created_wall_ns != sb->hdr.created_wall_ns)
+        return sa->hdr.created_wall_ns < sb->hdr.created_wall_ns ? -1 : 1;
+    return strcmp(sa->path, sb->path);
+}
+
+static int ensure_output_dirname(void)
+{
+    struct stat st = {0};
+
+    if (stat(ctx.output_dirname, &st) == -1) {
+        if (mkdir(ctx.output_dirname, 0750) == -1) {
+            fprintf(stderr, "Failed to create output directory %s: %s\n",
+                    ctx.output_dirname, strerror(errno));
+            return -1;
+        }
+    } else if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s exists but is not a directory\n", ctx.output_dirname);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void write_cgroup(const struct xcj_cgroup *cg, const char *path, size_t len)
+{
+    char buf[CGROUP_PATH_MAX];
+
+    snprintf(buf, sizeof(buf), "%.*s", (int)len, path);
+
+    // tasks look their cgroup up in the cache only to see if it's known, the
+    // row goes into the output files of every segment that describes it
+    cgroup_cache_insert(cg->cgroup_id, buf);
+    cgroup_cache_set_reported(cg->cgroup_id);
+
+    if (ctx.files.cgroup_pq) {
+        pq_put_i64(ctx.files.cgroup_pq, cg->cgroup_id);
+        pq_put_str(ctx.files.cgroup_pq, buf);
+        pq_end_row(ctx.files.cgroup_pq);
+    } else if (ctx.files.cgroup_file) {
+        write_cgroup_entry(ctx.files.cgroup_file, cg->cgroup_id, buf);
+    }
+}
+
+static void note_iteration(const struct xcj_iteration *it)
+{
+    ctx.tcorr.mono_time.tv_sec = it->mono_ns / 1000000000ULL;
+    ctx.tcorr.mono_time.tv_nsec = it->mono_ns % 1000000000ULL;
+    ctx.tcorr.wall_time.tv_sec = it->wall_sec;
+    ctx.tcorr.wall_time.tv_nsec = it->wall_nsec;
+    ctx.sample_weight_us = it->weight_us;
+    pipeline_note_iteration(&ctx);
+}
+
+static void decode_record(const struct xcj_record *rec, void *data)
+{
+    switch (rec->type) {
+        case XCJ_REC_ITERATION:
+            if (rec->len >= sizeof(struct xcj_iteration))
+                note_iteration(data);
+            break;
+        case XCJ_REC_TASK:
+            if (rec->len >= sizeof(struct task_wire_header) + sizeof(struct task_state)) {
+                struct task_state st;
+
+                // a cgroup the capture couldn't resolve stays unresolved, and
+                // not looked up in the decoding machine's /proc
+                memcpy(&st, (char *)data + sizeof(struct task_wire_header), sizeof(st));
+                if (st.cgroup_id && cgroup_cache_insert(st.cgroup_id, "") > 0)
+                    cgroup_cache_set_reported(st.cgroup_id);
+            }
+            handle_task_event(&ctx, data, rec->len);
+            break;
+        case XCJ_REC_TRACKING:
+            pipeline_iteration_info(~0ULL, &ctx.sample_weight_us, &ctx.tcorr);
+            handle_tracking_event(&ctx, data, rec->len);
+            break;
+        case XCJ_REC_STACK:
+            handle_stack_event(&ctx, data, rec->len);
+            break;
+        case XCJ_REC_CGROUP:
+            if (rec->len >= sizeof(struct xcj_cgroup))
+                write_cgroup(data, (char *)data + sizeof(struct xcj_cgroup),
+                             rec->len - sizeof(struct xcj_cgroup));
+            break;
+        case XCJ_REC_USER:
+            if (rec->len >= sizeof(struct xcj_user))
+                add_user(((struct xcj_user *)data)->uid, (char *)data + sizeof(struct xcj_user),
+                         rec->len - sizeof(struct xcj_user));
+            break;
+        default:
+            break;  // written by a newer xcapture, nothing to do with it
+    }
+}
+
+static void read_boot_id(char *buf, size_t size)
+{
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    buf[0] = '\0';
+    if (!f)
+        return;
+    if (fgets(buf, size, f))
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(f);
+}
+
+// Stack addresses only mean something on the boot that captured them, other
+// journals get their stack hashes and addresses written without symbols
+static void setup_symbolizer(const struct xcj_segment_header *hdr, const char *boot_id)
+{
+#ifdef USE_BLAZESYM
+    symbolize_stacks = want_symbolize && boot_id[0] && strcmp(hdr->boot_id, boot_id) == 0;
+
+    if (symbolize_stacks && !g_symbolizer) {
+        blaze_symbolizer_opts opts = {
+            .type_size = sizeof(opts),
+            .debug_dirs = NULL,
+            .debug_dirs_len = 0,
+            .auto_reload = true,
+            .code_info = true,
+            .inlined_fns = true,
+            .demangle = true,
+        };
+
+        g_symbolizer = blaze_symbolizer_new_opts(&opts);
+        if (g_symbolizer)
+            g_symcache = symcache_new(g_symbolizer, SYMCACHE_DEFAULT_ENTRIES);
+        if (!g_symcache) {
+            fprintf(stderr, "Warning: Failed to initialize BlazeSym symbolizer: %s\n",
+                    blaze_err_str(blaze_err_last()));
+            want_symbolize = symbolize_stacks = false;
+        }
+    }
+#else
+    XCAP_UNUSED(hdr);
+    XCAP_UNUSED(boot_id);
+#endif
+}
+
+static int decode_segment(struct segment *seg, const char *boot_id, bool keep_tz)
+{
+    static __u64 buf[XCJ_MAX_RECORD / sizeof(__u64)];
+    const struct xcj_segment_header *hdr = &seg->hdr;
+    struct xcj_record rec;
+    __u64 records = 0;
+    int ret;
+
+    FILE *f = fopen(seg->path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", seg->path, strerror(errno));
+        return -1;
+    }
+
+    // reading the header again leaves f at the first record
+    if (journal_read_header(f, seg->path, &seg->hdr)) {
+        fclose(f);
+        return -1;
+    }
+
+    // file names and timestamps in the capture host's local time
+    if (!keep_tz && hdr->timezone[0]) {
+        setenv("TZ", hdr->timezone, 1);
+        tzset();
+    }
+
+    ctx.mypid = hdr->capture_pid;
+    ctx.rotate_minutes = hdr->rotate_minutes;
+    ctx.oncpu_weight_us = hdr->oncpu_weight_us;
+    ctx.payload_trace_enabled = hdr->flags & XCJ_F_PAYLOAD;
+    ctx.dump_kernel_stack_traces = hdr->flags & XCJ_F_KSTACKS;
+    ctx.dump_user_stack_traces = hdr->flags & XCJ_F_USTACKS;
+    setup_symbolizer(hdr, boot_id);
+
+    if (open_output_files_at(&ctx.files, &ctx, hdr->created_wall_ns / 1000000000ULL)) {
+        fprintf(stderr, "Failed to open output files for %s\n", seg->path);
+        fclose(f);
+        return -1;
+    }
+
+    while ((ret = journal_read_record(f, &rec, buf, sizeof(buf))) != 0) {
+        if (ret == -EBADMSG) {
+            stats.bad_crc++;
+            continue;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: truncated after %llu records\n", seg->path, records);
+            stats.truncated++;
+            break;
+        }
+        decode_record(&rec, buf);
+        records++;
+    }
+    fclose(f);
+
+    if (verbose)
+        fprintf(stderr, "%s: %llu records from %s (Linux %s, xcapture %s)\n",
+                seg->path, records, hdr->hostname, hdr->kernel_release, hdr->xcapture_version);
+
+    stats.records += records;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct argp argp = {
+        .options = opts,
+        .parser = parse_arg,
+        .doc = argp_program_doc,
+    };
+    char boot_id[40];
+    int err, failed = 0;
+
+    err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+    if (err)
+        return err;
+
+    if (!ctx.output_dirname) {
+        fprintf(stderr, "Error: xcapture-decode requires an output directory (-o)\n\n");
+        return 1;
+    }
+
+    if (ctx.compress != COMPRESS_NONE && ctx.output_parquet) {
+        fprintf(stderr, "Error: --compress works with CSV output only, Parquet pages are compressed already\n\n");
+        return 1;
+    }
+
+    // the same file layout and writer threads as xcapture -o
+    ctx.output_csv = true;
+    ctx.pipelined = true;
+
+    if (ensure_output_dirname())
+        return 1;
+
+    // segments go out in the order they were written, whatever the file names
+    for (int i = 0; i < nr_segments; i++) {
+        FILE *f = fopen(segments[i].path, "r");
+
+        if (!f) {
+            fprintf(stderr, "Failed to open %s: %s\n", segments[i].path, strerror(errno));
+            return 1;
+        }
+        err = journal_read_header(f, segments[i].path, &segments[i].hdr);
+        fclose(f);
+        if (err)
+            return 1;
+    }
+    qsort(segments, nr_segments, sizeof(*segments), cmp_segment);
+
+    read_boot_id(boot_id, sizeof(boot_id));
+    cgroup_cache_init();
+
+    bool keep_tz = getenv("TZ") != NULL;
+    for (int i = 0; i < nr_segments; i++)
+        if (decode_segment(&segments[i], boot_id, keep_tz))
+            failed++;
+
+    close_output_files(&ctx.files);
+    pipeline_destroy();
+
+#ifdef USE_BLAZESYM
+    if (g_symcache) {
+        if (verbose)
+            symcache_print_stats(g_symcache, stderr);
+        symcache_free(g_symcache);
+    }
+    if (g_symbolizer)
+        blaze_symbolizer_free(g_symbolizer);
+#endif
+    cgroup_cache_destroy();
+
+    fprintf(stderr, "xcapture-decode: %llu records from %d of %d journal segments",
+            stats.records, nr_segments - failed, nr_segments);
+    if (stats.bad_crc || stats.truncated)
+        fprintf(stderr, ", skipped %llu records with bad checksums, %d segments truncated",
+                stats.bad_crc, stats.truncated);
+    fprintf(stderr, "\n");
+
+    free(segments);
+    return failed ? 1 : 0;
+}
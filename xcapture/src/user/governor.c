@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "xcapture.h"
+#include "governor.h"
+
+// Overhead governor (--max-cpu): once per window, compare xcapture's own CPU
+// usage (getrusage, which includes the task iterator's kernel time spent in
+// our read() call) against the cap and step through a ladder of levels:
+//
+//   0: everything requested on the command line
+//   1: user stacks off                  (if -u was used)
+//   2: kernel stacks off as well        (if -k was used)
+//   3+: task iterator frequency halved per level, down to 1 Hz
+//
+// Shedding happens after one window over the cap, restoring a level only after
+// GOV_CALM_WINDOWS windows well below it. If a restored level immediately blows
+// the budget again, the number of calm windows required doubles (up to
+// GOV_MAX_CALM_WINDOWS) so that we don't keep flapping between two levels
+
+#define GOV_WINDOW_NS          1000000000L
+#define GOV_HEADROOM           0.5   // restore a level when usage is below half the cap
+#define GOV_CALM_WINDOWS       5
+#define GOV_MAX_CALM_WINDOWS   120
+
+static struct {
+    double max_cpu_pct;       // 0 means the governor is off
+    int base_freq;
+    bool kernel_stacks;
+    bool user_stacks;
+    int nr_levels;
+    int level;
+    int calm_windows;         // consecutive windows with headroom
+    int calm_needed;
+    int windows_since_up;     // for detecting a level that can't be afforded
+    struct timespec window_start;
+    struct rusage window_ru;
+    long window_iter_ns;
+    long window_ringbuf_ns;
+} gov;
+
+int parse_max_cpu(const char *arg, double *pct_out)
+{
+    char *end = NULL;
+
+    errno = 0;
+    double pct = strtod(arg, &end);
+    if (errno || end == arg || pct <= 0 || pct > 100)
+        return -EINVAL;
+
+    if (*end == '%')
+        end++;
+    if (*end != '\0')
+        return -EINVAL;
+
+    *pct_out = pct;
+    return 0;
+}
+
+static int feature_levels(void)
+{
+    return (gov.user_stacks ? 1 : 0) + (gov.kernel_stacks ? 1 : 0);
+}
+
+__u32 governor_skip_mask(void)
+{
+    int shed = gov.level < feature_levels() ? gov.level : feature_levels();
+    __u32 mask = 0;
+
+    // user stacks are shed first, they're the most expensive to collect and resolve
+    if (shed > 0 && gov.user_stacks) {
+        mask |= XCAP_GOV_SKIP_USTACK;
+        shed--;
+    }
+    if (shed > 0 && gov.kernel_stacks)
+        mask |= XCAP_GOV_SKIP_KSTACK;
+
+    return mask;
+}
+
+int governor_sample_freq(void)
+{
+    int halvings = gov.level - feature_levels();
+    int freq = gov.base_freq;
+
+    for (int i = 0; i < halvings && freq > 1; i++)
+        freq /= 2;
+
+    return freq > 0 ? freq : 1;
+}
+
+void governor_init(double max_cpu_pct, int sample_freq, bool kernel_stacks, bool user_stacks)
+{
+    gov.max_cpu_pct = max_cpu_pct;
+    gov.base_freq = sample_freq;
+    gov.kernel_stacks = kernel_stacks;
+    gov.user_stacks = user_stacks;
+    gov.level = 0;
+    gov.calm_needed = GOV_CALM_WINDOWS;
+    gov.windows_since_up = GOV_MAX_CALM_WINDOWS;
+
+    gov.nr_levels = 1 + feature_levels();
+    for (int freq = sample_freq; freq > 1; freq /= 2)
+        gov.nr_levels++;
+
+    clock_gettime(CLOCK_MONOTONIC, &gov.window_start);
+    getrusage(RUSAGE_SELF, &gov.window_ru);
+}
+
+static long timeval_us(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+static void describe_level(char *buf, size_t len)
+{
+    __u32 mask = governor_skip_mask();
+
+    snprintf(buf, len, "%d Hz%s%s", governor_sample_freq(),
+             mask & XCAP_GOV_SKIP_USTACK ? ", no user stacks" : "",
+             mask & XCAP_GOV_SKIP_KSTACK ? ", no kernel stacks" : "");
+}
+
+// Account one sampling iteration, returns true when the level changed and
+// the caller needs to apply the new skip mask and sampling frequency
+bool governor_update(long iter_ns, long ringbuf_ns)
+{
+    if (gov.max_cpu_pct <= 0)
+        return false;
+
+    gov.window_iter_ns += iter_ns;
+    gov.window_ringbuf_ns += ringbuf_ns;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long wall_ns = (now.tv_sec - gov.window_start.tv_sec) * 1000000000L +
+                   (now.tv_nsec - gov.window_start.tv_nsec);
+    if (wall_ns < GOV_WINDOW_NS)
+        return false;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    long cpu_us = timeval_us(&ru.ru_utime) - timeval_us(&gov.window_ru.ru_utime) +
+                  timeval_us(&ru.ru_stime) - timeval_us(&gov.window_ru.ru_stime);
+    double cpu_pct = 100.0 * cpu_us * 1000.0 / wall_ns;
+    double iter_ms_per_s = gov.window_iter_ns / 1e6 * (1e9 / wall_ns);
+    double ringbuf_ms_per_s = gov.window_ringbuf_ns / 1e6 * (1e9 / wall_ns);
+
+    int old_level = gov.level;
+    gov.windows_since_up++;
+
+    if (cpu_pct > gov.max_cpu_pct) {
+        gov.calm_windows = 0;
+        if (gov.level < gov.nr_levels - 1) {
+            // the level we just restored didn't fit, be slower to try it again
+            if (gov.windows_since_up <= 1 && gov.calm_needed < GOV_MAX_CALM_WINDOWS)
+                gov.calm_needed *= 2;
+            gov.level++;
+        }
+    } else if (cpu_pct < gov.max_cpu_pct * GOV_HEADROOM) {
+        if (gov.level > 0 && ++gov.calm_windows >= gov.calm_needed) {
+            gov.level--;
+            gov.calm_windows = 0;
+            gov.windows_since_up = 0;
+        }
+    } else {
+        gov.calm_windows = 0;
+    }
+
+    // a long stable stretch earns back the default restore delay
+    if (gov.windows_since_up > GOV_MAX_CALM_WINDOWS)
+        gov.calm_needed = GOV_CALM_WINDOWS;
+
+    if (gov.level != old_level) {
+        char desc[64];
+        describe_level(desc, sizeof(desc));
+        fprintf(stderr, "xcapture: CPU usage %.1f%% %s --max-cpu %.1f%% (iterator %.1f ms/s, ring buffers %.1f ms/s), %s to %s\n",
+                cpu_pct, gov.level > old_level ? "over" : "well under", gov.max_cpu_pct,
+                iter_ms_per_s, ringbuf_ms_per_s,
+                gov.level > old_level ? "stepping down" : "stepping up", desc);
+    }
+
+    gov.window_start = now;
+    gov.window_ru = ru;
+    gov.window_iter_ns = 0;
+    gov.window_ringbuf_ns = 0;
+
+    return gov.level != old_level;
+}
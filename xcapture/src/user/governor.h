@@ -0,0 +1,13 @@
+#ifndef __GOVERNOR_H
+#define __GOVERNOR_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+int parse_max_cpu(const char *arg, double *pct_out);
+void governor_init(double max_cpu_pct, int sample_freq, bool kernel_stacks, bool user_stacks);
+bool governor_update(long iter_ns, long ringbuf_ns);
+__u32 governor_skip_mask(void);
+int governor_sample_freq(void);
+
+#endif /* __GOVERNOR_H */
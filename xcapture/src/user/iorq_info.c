@@ -71,3 +71,23 @@ const char *get_iorq_op_flags(__u32 cmd_flags)
 
     return buf;
 }
+
+// Name of the operation alone (cmd_flags & REQ_OP_MASK)
+const char *get_iorq_op_name(__u32 op)
+{
+    static char unknown_str[16];
+
+    switch (op) {
+        case REQ_OP_READ:         return "READ";
+        case REQ_OP_WRITE:        return "WRITE";
+        case REQ_OP_FLUSH:        return "FLUSH";
+        case REQ_OP_DISCARD:      return "DISCARD";
+        case REQ_OP_SECURE_ERASE: return "SECURE_ERASE";
+        case REQ_OP_WRITE_ZEROES: return "WRITE_ZEROES";
+        case REQ_OP_DRV_IN:       return "DRV_IN";
+        case REQ_OP_DRV_OUT:      return "DRV_OUT";
+    }
+
+    snprintf(unknown_str, sizeof(unknown_str), "%u", op);
+    return unknown_str;
+}
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <zlib.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "xcapture_context.h"
+#include "cgroup_cache.h"
+#include "unwind_table.h"
+#include "journal.h"
+
+// --raw skips all formatting at capture time: the journal worker copies the
+// ring buffer records into the segment file with a small header each. What
+// formatting needs from the capturing machine goes into the journal too:
+// the iteration clock correlations and weights, the paths of the cgroups and
+// the names of the users seen in each segment (so that every segment decodes
+// on its own), and in the segment header the boot id, kernel release, time
+// zone and struct layouts.
+
+#if defined(__TARGET_ARCH_arm64)
+#define XCJ_ARCH "arm64"
+#elif defined(__TARGET_ARCH_x86)
+#define XCJ_ARCH "x86"
+#else
+#define XCJ_ARCH "unknown"
+#endif
+
+#define XCJ_LAYOUT(type) { #type, sizeof(struct type) }
+
+static const struct {
+    const char *name;
+    __u32 size;
+} xcj_layouts[] = {
+    XCJ_LAYOUT(task_wire_header),
+    XCJ_LAYOUT(task_state),
+    XCJ_LAYOUT(socket_info),
+    XCJ_LAYOUT(task_wire_uring),
+    XCJ_LAYOUT(task_wire_payload),
+    XCJ_LAYOUT(sc_completion_event),
+    XCJ_LAYOUT(iorq_completion_event),
+    XCJ_LAYOUT(stack_trace_event),
+};
+
+_Static_assert(sizeof(xcj_layouts) / sizeof(xcj_layouts[0]) <= XCJ_MAX_LAYOUTS, "too many layouts");
+
+// cgroups and users already described in the current segment, open addressing
+#define JOURNAL_SEEN_SIZE 4096  // power of 2
+
+static struct {
+    __u64 cgroups[JOURNAL_SEEN_SIZE];   // 0 = free slot
+    __u64 uids[JOURNAL_SEEN_SIZE];      // uid + 1, 0 = free slot
+} seen;
+
+// Slot holding key, or the free slot it goes into. NULL when the set is full,
+// the decoder then shows "-" for the cgroups and users that didn't fit
+static __u64 *seen_slot(__u64 *set, __u64 key)
+{
+    unsigned int i = (key * 2654435761ULL) & (JOURNAL_SEEN_SIZE - 1);
+
+    for (int n = 0; n < JOURNAL_SEEN_SIZE; n++, i = (i + 1) & (JOURNAL_SEEN_SIZE - 1))
+        if (set[i] == key || set[i] == 0)
+            return &set[i];
+    return NULL;
+}
+
+static void read_first_line(const char *path, char *buf, size_t size)
+{
+    FILE *f = fopen(path, "r");
+
+    buf[0] = '\0';
+    if (!f)
+        return;
+    if (fgets(buf, size, f))
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(f);
+}
+
+// TZ if set, otherwise the zoneinfo name /etc/localtime points to
+static void get_timezone(char *buf, size_t size)
+{
+    const char *tz = getenv("TZ");
+    char link[256];
+    ssize_t n;
+
+    buf[0] = '\0';
+    if (tz && tz[0]) {
+        snprintf(buf, size, "%s", tz);
+        return;
+    }
+
+    n = readlink("/etc/localtime", link, sizeof(link) - 1);
+    if (n <= 0)
+        return;
+    link[n] = '\0';
+
+    const char *name = strstr(link, "zoneinfo/");
+    if (name)
+        snprintf(buf, size, "%s", name + strlen("zoneinfo/"));
+}
+
+int journal_write_header(FILE *f, const struct xcapture_context *xctx)
+{
+    struct xcj_segment_header hdr;
+    struct timespec wall, mono;
+    struct utsname uts;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, XCJ_MAGIC, sizeof(hdr.magic));
+    hdr.version = XCJ_VERSION;
+    hdr.header_size = sizeof(hdr);
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    hdr.created_wall_ns = wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+    hdr.mono_to_wall_ns = (__s64)hdr.created_wall_ns - (__s64)(mono.tv_sec * 1000000000ULL + mono.tv_nsec);
+
+    if (xctx->payload_trace_enabled)    hdr.flags |= XCJ_F_PAYLOAD;
+    if (xctx->dump_kernel_stack_traces) hdr.flags |= XCJ_F_KSTACKS;
+    if (xctx->dump_user_stack_traces)   hdr.flags |= XCJ_F_USTACKS;
+    hdr.capture_pid = xctx->mypid;
+    hdr.rotate_minutes = xctx->rotate_minutes;
+    hdr.oncpu_weight_us = xctx->oncpu_weight_us;
+
+    read_first_line("/proc/sys/kernel/random/boot_id", hdr.boot_id, sizeof(hdr.boot_id));
+    gethostname(hdr.hostname, sizeof(hdr.hostname) - 1);
+    // utsname.release is 65 bytes, the header field keeps the on-disk 64 and
+    // the memset above leaves it NUL terminated
+    if (uname(&uts) == 0)
+        memcpy(hdr.kernel_release, uts.release,
+               strnlen(uts.release, sizeof(hdr.kernel_release) - 1));
+    snprintf(hdr.xcapture_version, sizeof(hdr.xcapture_version), "%s", XCAPTURE_VERSION);
+    snprintf(hdr.arch, sizeof(hdr.arch), "%s", XCJ_ARCH);
+    get_timezone(hdr.timezone, sizeof(hdr.timezone));
+
+    hdr.nr_layouts = sizeof(xcj_layouts) / sizeof(xcj_layouts[0]);
+    for (__u32 i = 0; i < hdr.nr_layouts; i++) {
+        snprintf(hdr.layouts[i].name, sizeof(hdr.layouts[i].name), "%s", xcj_layouts[i].name);
+        hdr.layouts[i].size = xcj_layouts[i].size;
+    }
+
+    // a new segment describes its cgroups and users again
+    memset(&seen, 0, sizeof(seen));
+
+    return fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -EIO;
+}
+
+static __u32 record_crc(const struct xcj_record *rec, const void *data)
+{
+    __u32 crc = crc32(0, (const Bytef *)rec, offsetof(struct xcj_record, crc));
+    return crc32(crc, data, rec->len);
+}
+
+void journal_append(FILE *f, enum xcj_record_type type, const void *data, size_t len)
+{
+    static const char zeros[8];
+    struct xcj_record rec = {
+        .len = len,
+        .type = type,
+    };
+
+    rec.crc = record_crc(&rec, data);
+
+    // the journal file is written by the one worker only, skip the stdio lock
+    fwrite_unlocked(&rec, sizeof(rec), 1, f);
+    fwrite_unlocked(data, 1, len, f);
+    if (XCJ_ALIGN(len) != len)
+        fwrite_unlocked(zeros, 1, XCJ_ALIGN(len) - len, f);
+}
+
+static void note_cgroup(FILE *f, __u64 cgroup_id, pid_t pid)
+{
+    struct {
+        struct xcj_cgroup hdr;
+        char path[CGROUP_PATH_MAX];
+    } rec;
+    __u64 *slot;
+
+    if (cgroup_id == 0 || !(slot = seen_slot(seen.cgroups, cgroup_id)) || *slot == cgroup_id)
+        return;
+
+    // the task may be gone already, try again with its next sample
+    if (resolve_cgroup_path(cgroup_id, pid, rec.path, sizeof(rec.path)))
+        return;
+
+    *slot = cgroup_id;
+    rec.hdr.cgroup_id = cgroup_id;
+    journal_append(f, XCJ_REC_CGROUP, &rec, sizeof(rec.hdr) + strlen(rec.path));
+}
+
+static void note_user(FILE *f, uid_t uid)
+{
+    struct {
+        struct xcj_user hdr;
+        char name[64];
+    } rec;
+    __u64 *slot = seen_slot(seen.uids, (__u64)uid + 1);
+
+    if (!slot || *slot)
+        return;
+    *slot = (__u64)uid + 1;
+
+    memset(&rec.hdr, 0, sizeof(rec.hdr));
+    rec.hdr.uid = uid;
+    snprintf(rec.name, sizeof(rec.name), "%s", getusername(uid));
+    journal_append(f, XCJ_REC_USER, &rec, sizeof(rec.hdr) + strlen(rec.name));
+}
+
+void journal_append_task(struct xcapture_context *xctx, const void *data, size_t len)
+{
+    FILE *f = xctx->files.journal_file;
+    struct task_wire_header hdr;
+    struct task_state st;
+
+    if (len < sizeof(hdr) + TASK_STATE_WIRE_SIZE) {
+        fprintf(stderr, "Malformed task sample record (%zu bytes)\n", len);
+        return;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    memcpy(&st, (const char *)data + sizeof(hdr), sizeof(st));
+
+    // processes get DWARF unwinding from their next sample on, as in handle_task_event()
+    if (xctx->dwarf_stacks && !(hdr.flags & PF_KTHREAD))
+        unwind_note_process(hdr.tgid);
+
+    note_cgroup(f, st.cgroup_id, hdr.pid);
+    note_user(f, hdr.euid);
+    journal_append(f, XCJ_REC_TASK, data, len);
+}
+
+int journal_read_header(FILE *f, const char *path, struct xcj_segment_header *hdr)
+{
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || memcmp(hdr->magic, XCJ_MAGIC, sizeof(hdr->magic))) {
+        fprintf(stderr, "%s: not an xcapture journal\n", path);
+        return -1;
+    }
+
+    if (hdr->version != XCJ_VERSION || hdr->header_size < sizeof(*hdr) ||
+        hdr->nr_layouts > XCJ_MAX_LAYOUTS) {
+        fprintf(stderr, "%s: unsupported journal version %u\n", path, hdr->version);
+        return -1;
+    }
+
+    hdr->hostname[sizeof(hdr->hostname) - 1] = '\0';
+    hdr->boot_id[sizeof(hdr->boot_id) - 1] = '\0';
+    hdr->kernel_release[sizeof(hdr->kernel_release) - 1] = '\0';
+    hdr->xcapture_version[sizeof(hdr->xcapture_version) - 1] = '\0';
+    hdr->arch[sizeof(hdr->arch) - 1] = '\0';
+    hdr->timezone[sizeof(hdr->timezone) - 1] = '\0';
+
+    if (strcmp(hdr->arch, XCJ_ARCH)) {
+        fprintf(stderr, "%s: captured on %s, this xcapture-decode is built for %s\n",
+                path, hdr->arch, XCJ_ARCH);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(xcj_layouts) / sizeof(xcj_layouts[0]); i++) {
+        __u32 j;
+
+        for (j = 0; j < hdr->nr_layouts; j++)
+            if (strncmp(hdr->layouts[j].name, xcj_layouts[i].name, sizeof(hdr->layouts[j].name)) == 0)
+                break;
+
+        if (j == hdr->nr_layouts || hdr->layouts[j].size != xcj_layouts[i].size) {
+            fprintf(stderr, "%s: struct %s differs from xcapture %s that wrote it, "
+                    "decode with an xcapture-decode of the same version\n",
+                    path, xcj_layouts[i].name, hdr->xcapture_version);
+            return -1;
+        }
+    }
+
+    if (hdr->header_size > sizeof(*hdr) && fseek(f, hdr->header_size, SEEK_SET)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns 1 with the next record in buf (bufsize must fit XCJ_MAX_RECORD), 0 at
+// the end of the segment, -EBADMSG for a record that failed its checksum (the
+// next call continues after it) and -EIO when the rest can't be trusted: a
+// partial record at the end left by a crash, or a length that makes no sense
+int journal_read_record(FILE *f, struct xcj_record *rec, void *buf, size_t bufsize)
+{
+    size_t n = fread(rec, 1, sizeof(*rec), f);
+
+    if (n == 0 && feof(f))
+        return 0;
+    if (n < sizeof(*rec) || rec->len > XCJ_MAX_RECORD || XCJ_ALIGN(rec->len) > bufsize)
+        return -EIO;
+
+    if (fread(buf, 1, XCJ_ALIGN(rec->len), f) != XCJ_ALIGN(rec->len))
+        return -EIO;
+
+    return record_crc(rec, buf) == rec->crc ? 1 : -EBADMSG;
+}
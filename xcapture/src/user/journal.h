@@ -0,0 +1,102 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+#include "xcapture_context.h"
+
+// Binary event journal (--raw). A segment file is a header followed by
+// length-prefixed, checksummed records holding the ring buffer records as the
+// BPF side wrote them. xcapture-decode turns segments into the CSV/Parquet
+// files that xcapture would have written.
+
+#define JOURNAL_FILENAME    "xcapture_journal"
+#define JOURNAL_EXT         "xcj"
+#define XCJ_MAGIC           "XCAPJRN1"
+#define XCJ_VERSION         1
+#define XCJ_MAX_LAYOUTS     8
+#define XCJ_MAX_RECORD      (64 * 1024)
+#define XCJ_ALIGN(x)        (((x) + 7) & ~(size_t)7)
+
+// segment header flags, the capture options the decoder needs to know about
+#define XCJ_F_PAYLOAD       (1U << 0)   // -Y, TRACE_PAYLOAD columns
+#define XCJ_F_KSTACKS       (1U << 1)   // -k
+#define XCJ_F_USTACKS       (1U << 2)   // -u / --dwarf-stacks
+
+enum xcj_record_type {
+    XCJ_REC_ITERATION = 1,      // struct xcj_iteration
+    XCJ_REC_TASK,               // task sample in the task_wire encoding
+    XCJ_REC_TRACKING,           // struct sc_completion_event or iorq_completion_event
+    XCJ_REC_STACK,              // struct stack_trace_event
+    XCJ_REC_CGROUP,             // struct xcj_cgroup + path bytes
+    XCJ_REC_USER,               // struct xcj_user + name bytes
+};
+
+// sizeof() of the structs as the capturing binary saw them, a decoder built
+// from different headers refuses the segment instead of misreading it
+struct xcj_layout {
+    char  name[24];
+    __u32 size;
+    __u32 pad;
+};
+
+struct xcj_segment_header {
+    char  magic[8];
+    __u32 version;
+    __u32 header_size;          // records start at this offset
+    __u64 created_wall_ns;      // CLOCK_REALTIME when the segment was opened
+    __s64 mono_to_wall_ns;      // CLOCK_REALTIME - CLOCK_MONOTONIC at that time
+    __u32 flags;                // XCJ_F_*
+    __s32 capture_pid;          // xcapture's own syscalls are left out of syscend
+    __s32 rotate_minutes;
+    __u32 pad;
+    __s64 oncpu_weight_us;
+    char  boot_id[40];          // stacks are only symbolized when decoding on the same boot
+    char  hostname[64];
+    char  kernel_release[64];
+    char  xcapture_version[32];
+    char  arch[16];
+    char  timezone[64];         // capture host's TZ, file names and timestamps use its local time
+    __u32 nr_layouts;
+    __u32 pad2;
+    struct xcj_layout layouts[XCJ_MAX_LAYOUTS];
+};
+
+struct xcj_record {
+    __u32 len;                  // payload bytes, the payload is padded to 8 bytes
+    __u16 type;                 // enum xcj_record_type
+    __u16 pad;
+    __u32 crc;                  // crc32 of len, type and pad, then the payload
+    __u32 pad2;
+};
+
+struct xcj_iteration {
+    __u64 mono_ns;
+    __s64 wall_sec;
+    __s64 wall_nsec;
+    __s64 weight_us;
+};
+
+struct xcj_cgroup {
+    __u64 cgroup_id;
+    // followed by the path, not NUL terminated
+};
+
+struct xcj_user {
+    __u32 uid;
+    __u32 pad;
+    // followed by the user name, not NUL terminated
+};
+
+// Capture side, called by the pipeline worker that owns the journal file
+int journal_write_header(FILE *f, const struct xcapture_context *xctx);
+void journal_append(FILE *f, enum xcj_record_type type, const void *data, size_t len);
+void journal_append_task(struct xcapture_context *xctx, const void *data, size_t len);
+
+// Decode side
+int journal_read_header(FILE *f, const char *path, struct xcj_segment_header *hdr);
+int journal_read_record(FILE *f, struct xcj_record *rec, void *buf, size_t bufsize);
+
+#endif /* __JOURNAL_H */
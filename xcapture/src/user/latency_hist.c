@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "latency_hist.h"
+
+// The BPF programs count latencies into per-CPU log-linear histograms (see
+// XCAP_HIST_SUB_BITS), here the maps are drained with lookup-and-delete so
+// that every interval starts from empty histograms. The per-CPU slots are
+// summed and every non-empty slot becomes a row with its [LOW_NS, HIGH_NS)
+// range, the open ended last slot without HIGH_NS. Percentiles are left to the
+// queries, a running SUM(COUNT) ordered by LOW_NS finds the bucket of any of them
+
+#define HIST_BATCH_SIZE 64
+#define HIST_KEY_MAX    32      // largest *_hist_key
+
+struct hist_track {
+    int map_fd;                 // -1 = not enabled
+    int by;                     // XCAP_HIST_BY_* for syscalls
+    size_t key_size;
+    // writes the key columns of a row, up to the LOW_NS column
+    int (*format_key)(char *buf, size_t len, const void *key, int by);
+    bool batch_unsupported;
+    struct timespec last_ts;
+};
+
+static int format_sc_key(char *buf, size_t len, const void *key, int by);
+static int format_iorq_key(char *buf, size_t len, const void *key, int by);
+
+static struct {
+    int interval_sec;
+    int ncpus;
+    struct xcap_hist *vals;     // HIST_BATCH_SIZE * ncpus per-CPU values
+    struct timespec last_tick;
+    struct hist_track syscalls;
+    struct hist_track iorqs;
+} lh = {
+    .syscalls = { .map_fd = -1, .key_size = sizeof(struct sc_hist_key), .format_key = format_sc_key },
+    .iorqs = { .map_fd = -1, .key_size = sizeof(struct iorq_hist_key), .format_key = format_iorq_key },
+};
+
+static char hist_keys[HIST_BATCH_SIZE * HIST_KEY_MAX];
+
+int parse_hist_by(const char *arg)
+{
+    if (strcasecmp(arg, "tgid") == 0)
+        return XCAP_HIST_BY_TGID;
+    if (strcasecmp(arg, "cgroup") == 0 || strcasecmp(arg, "cgroup_id") == 0)
+        return XCAP_HIST_BY_CGROUP;
+    return -EINVAL;
+}
+
+int latency_hist_init(int interval_sec)
+{
+    lh.ncpus = libbpf_num_possible_cpus();
+    if (lh.ncpus <= 0)
+        return -EINVAL;
+
+    lh.vals = calloc((size_t)HIST_BATCH_SIZE * lh.ncpus, sizeof(struct xcap_hist));
+    if (!lh.vals)
+        return -ENOMEM;
+
+    lh.interval_sec = interval_sec;
+    clock_gettime(CLOCK_REALTIME, &lh.last_tick);
+    return 0;
+}
+
+static int add_track(struct hist_track *t, int map_fd, int by)
+{
+    if (!lh.vals || map_fd < 0)
+        return -EINVAL;
+
+    t->map_fd = map_fd;
+    t->by = by;
+    t->last_ts = lh.last_tick;
+    return 0;
+}
+
+int latency_hist_add_syscalls(int map_fd, int by)
+{
+    return add_track(&lh.syscalls, map_fd, by);
+}
+
+int latency_hist_add_iorqs(int map_fd)
+{
+    return add_track(&lh.iorqs, map_fd, 0);
+}
+
+void latency_hist_destroy(void)
+{
+    free(lh.vals);
+    lh.vals = NULL;
+    lh.syscalls.map_fd = -1;
+    lh.iorqs.map_fd = -1;
+}
+
+static double ts_diff_sec(struct timespec a, struct timespec b)
+{
+    return (a.tv_sec - b.tv_sec) + (a.tv_nsec - b.tv_nsec) / 1e9;
+}
+
+// Inverse of hist_slot() in xcapture_helpers.h
+static __u64 slot_low_ns(int slot)
+{
+    if (slot < (1 << XCAP_HIST_SUB_BITS))
+        return slot;
+
+    int p = (slot >> XCAP_HIST_SUB_BITS) + XCAP_HIST_SUB_BITS - 1;
+    __u64 sub = slot & ((1 << XCAP_HIST_SUB_BITS) - 1);
+
+    return ((1ULL << XCAP_HIST_SUB_BITS) + sub) << (p - XCAP_HIST_SUB_BITS);
+}
+
+// SYSCALL,TGID,CGROUP_ID
+static int format_sc_key(char *buf, size_t len, const void *key, int by)
+{
+    const struct sc_hist_key *k = key;
+
+    if (by == XCAP_HIST_BY_CGROUP)
+        return snprintf(buf, len, "%s,,%llu", safe_syscall_name(k->syscall_nr), k->id);
+    return snprintf(buf, len, "%s,%llu,", safe_syscall_name(k->syscall_nr), k->id);
+}
+
+// DEV_MAJ,DEV_MIN,OP,CGROUP_ID
+static int format_iorq_key(char *buf, size_t len, const void *key, int by)
+{
+    const struct iorq_hist_key *k = key;
+    XCAP_UNUSED(by);
+
+    return snprintf(buf, len, "%u,%u,%s,%llu", MAJOR(k->dev), MINOR(k->dev),
+                    get_iorq_op_name(k->op), k->cgroup_id);
+}
+
+static void write_rows(FILE *f, const char *ts, double interval, const struct hist_track *t, __u32 count)
+{
+    char key_cols[128];
+
+    for (__u32 i = 0; i < count; i++) {
+        t->format_key(key_cols, sizeof(key_cols), hist_keys + i * t->key_size, t->by);
+
+        for (int slot = 0; slot < XCAP_HIST_SLOTS; slot++) {
+            __u64 n = 0;
+
+            for (int cpu = 0; cpu < lh.ncpus; cpu++)
+                n += lh.vals[(size_t)i * lh.ncpus + cpu].slots[slot];
+            if (!n)
+                continue;
+
+            // the last slot holds everything past the table, its HIGH_NS stays empty
+            if (slot == XCAP_HIST_SLOTS - 1)
+                fprintf(f, "%s,%.3f,%s,%llu,,%llu\n", ts, interval, key_cols, slot_low_ns(slot), n);
+            else
+                fprintf(f, "%s,%.3f,%s,%llu,%llu,%llu\n", ts, interval, key_cols,
+                        slot_low_ns(slot), slot_low_ns(slot + 1), n);
+        }
+    }
+}
+
+// Older kernels lack batch ops on hash maps, walk the keys one by one instead.
+// Whatever was counted between the lookup and the delete of a key is lost
+static __u32 drain_slow(const struct hist_track *t)
+{
+    char key[HIST_KEY_MAX], next[HIST_KEY_MAX];
+    void *prev = NULL;
+    __u32 n = 0;
+
+    while (n < HIST_BATCH_SIZE && bpf_map_get_next_key(t->map_fd, prev, next) == 0) {
+        if (bpf_map_lookup_elem(t->map_fd, next, &lh.vals[(size_t)n * lh.ncpus]) == 0)
+            memcpy(hist_keys + n++ * t->key_size, next, t->key_size);
+        memcpy(key, next, t->key_size);
+        prev = key;
+    }
+
+    for (__u32 i = 0; i < n; i++)
+        bpf_map_delete_elem(t->map_fd, hist_keys + i * t->key_size);
+
+    return n;
+}
+
+static void write_track(struct hist_track *t, FILE *f)
+{
+    struct timespec now;
+    char ts[64];
+
+    if (t->map_fd < 0 || !f)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    get_str_from_ts(now, ts, sizeof(ts));
+    double interval = ts_diff_sec(now, t->last_ts);
+    t->last_ts = now;
+
+    __u32 batch_token = 0, count;
+    void *in_batch = NULL;
+
+    while (!t->batch_unsupported) {
+        count = HIST_BATCH_SIZE;
+        int err = bpf_map_lookup_and_delete_batch(t->map_fd, in_batch, &batch_token,
+                                                  hist_keys, lh.vals, &count, NULL);
+        if (err && errno != ENOENT) {
+            if (in_batch || (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP))
+                return;
+            t->batch_unsupported = true;
+            break;
+        }
+
+        write_rows(f, ts, interval, t, count);
+
+        if (err) // ENOENT: the whole map has been drained
+            return;
+        in_batch = &batch_token;
+    }
+
+    do {
+        count = drain_slow(t);
+        write_rows(f, ts, interval, t, count);
+    } while (count == HIST_BATCH_SIZE);
+}
+
+void latency_hist_write_syscalls(FILE *f)
+{
+    write_track(&lh.syscalls, f);
+}
+
+void latency_hist_write_iorqs(FILE *f)
+{
+    write_track(&lh.iorqs, f);
+}
+
+void latency_hist_tick(struct output_files *files)
+{
+    struct timespec now;
+
+    if (!lh.vals)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (ts_diff_sec(now, lh.last_tick) < lh.interval_sec)
+        return;
+    lh.last_tick = now;
+
+    if (files->schist_file) {
+        latency_hist_write_syscalls(files->schist_file);
+        fflush(files->schist_file);
+    }
+    if (files->iohist_file) {
+        latency_hist_write_iorqs(files->iohist_file);
+        fflush(files->iohist_file);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef __LATENCY_HIST_H
+#define __LATENCY_HIST_H
+
+#include <stdio.h>
+#include <linux/types.h>
+#include "xcapture_types.h"
+
+// In-kernel latency histograms, drained into plain CSV files every
+// --hist-interval seconds and at every rotation. One row per non-empty bucket
+
+#define SCHIST_CSV_FILENAME "xcapture_schist"
+#define SCHIST_CSV_HEADER   "TIMESTAMP,INTERVAL_SEC,SYSCALL,TGID,CGROUP_ID,LOW_NS,HIGH_NS,COUNT"
+#define IOHIST_CSV_FILENAME "xcapture_iohist"
+#define IOHIST_CSV_HEADER   "TIMESTAMP,INTERVAL_SEC,DEV_MAJ,DEV_MIN,OP,CGROUP_ID,LOW_NS,HIGH_NS,COUNT"
+
+#define LATENCY_HIST_DEFAULT_INTERVAL_SEC 10
+
+// "tgid" or "cgroup" to XCAP_HIST_BY_*, -EINVAL for anything else
+int parse_hist_by(const char *arg);
+
+int latency_hist_init(int interval_sec);
+int latency_hist_add_syscalls(int map_fd, int by);
+int latency_hist_add_iorqs(int map_fd);
+void latency_hist_destroy(void);
+
+// Writes all histograms once the interval has passed
+void latency_hist_tick(struct output_files *files);
+
+// Rows for everything since the previous call
+void latency_hist_write_syscalls(FILE *f);
+void latency_hist_write_iorqs(FILE *f);
+
+#endif /* __LATENCY_HIST_H */
@@ -0,0 +1,619 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "xcapture_user.h"
+#include "live_store.h"
+
+// Rolling window store (--live). Every CSV row written to the samples,
+// syscend, iorqend, kstacks, ustacks and cgroups files is also appended to
+// that table's ring here. A table keeps its row text in one byte ring and the
+// timestamp, offset and length of each row in separate arrays, so time range
+// filtering scans only the timestamps. Sample and completion rows are dropped
+// once they are older than --live-window minutes, or earlier when their table
+// is out of its share of --live-size. Stack and cgroup rows are referenced by
+// the samples through their hashes and ids, they only go when out of space.
+//
+// One thread serves the queries on a Unix socket, one connection at a time.
+// A query is one line, the answer the matching rows with the CSV header of
+// the table in front, then the connection is closed:
+//
+//   TABLES
+//       NAME,ROWS,BYTES,FIRST_TIMESTAMP,LAST_TIMESTAMP for every table
+//   <table> [last=SEC] [from=TIME] [to=TIME] [limit=N] [COLUMN=VALUE]...
+//       rows of samples, syscend, iorqend, kstacks, ustacks or cgroups with a
+//       timestamp in [from, to) or within the last SEC seconds (the sampling
+//       time of samples, the end time of completions), TIME being
+//       YYYY-MM-DDTHH:MM:SS[.ffffff] local time as in the files. COLUMN=VALUE
+//       keeps rows where the (unquoted) column equals VALUE, columns named as
+//       in the header, case insensitive. All conditions must match.
+//
+// Errors are answered with a single "ERROR <message>" line. Rows are copied
+// out in LIVE_CHUNK sized batches so the writers never wait for a slow client.
+
+#define LIVE_MAX_REQUEST  4096
+#define LIVE_MAX_FILTERS  16
+#define LIVE_CHUNK        (1 << 20)
+#define LIVE_IO_TIMEOUT   5           // seconds
+#define LIVE_MIN_BYTES    (64 << 10)    // per table
+
+struct live_tab {
+    pthread_mutex_t lock;
+    const char *name;
+    const char *header;
+    bool timed;                 // rows expire after the window
+    unsigned share;             // percent of --live-size
+
+    // row ring, columnar
+    __u64 *ts;
+    __u32 *off;
+    __u32 *len;
+    __u32 rows_cap;
+    __u32 first;                // oldest row
+    __u32 nr;
+    __u64 seq;                  // rows ever appended, the oldest one is seq - nr
+
+    // text ring, rows are never split at its end
+    char *text;
+    size_t text_cap;
+    size_t wpos;
+    size_t bytes;               // in rows still held
+};
+
+static struct live_tab tabs[LIVE_NR_TABLES] = {
+    [LIVE_SAMPLES] = { .name = "samples", .timed = true,  .share = 60 },
+    [LIVE_SYSCEND] = { .name = "syscend", .timed = true,  .share = 15 },
+    [LIVE_IORQEND] = { .name = "iorqend", .timed = true,  .share = 10 },
+    [LIVE_KSTACKS] = { .name = "kstacks", .timed = false, .share = 6 },
+    [LIVE_USTACKS] = { .name = "ustacks", .timed = false, .share = 6 },
+    [LIVE_CGROUPS] = { .name = "cgroups", .timed = false, .share = 3 },
+};
+
+bool live_enabled;
+
+static struct {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int listen_fd;
+    __u64 window_ns;
+    pthread_t thread;
+    bool started;
+    volatile bool stop;
+} live = { .listen_fd = -1 };
+
+struct live_filter {
+    int col;
+    const char *value;
+};
+
+struct live_query {
+    struct live_tab *tab;
+    __u64 from_ns;
+    __u64 to_ns;
+    __u64 limit;
+    struct live_filter filters[LIVE_MAX_FILTERS];
+    int nr_filters;
+};
+
+static inline __u64 ts_to_ns(struct timespec ts)
+{
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void drop_oldest(struct live_tab *t)
+{
+    t->bytes -= t->len[t->first];
+    t->first = (t->first + 1) % t->rows_cap;
+    t->nr--;
+}
+
+// Where a row of len bytes can go without overwriting held rows, or -1
+static ssize_t text_room(const struct live_tab *t, size_t len)
+{
+    if (!t->nr)
+        return len <= t->text_cap ? 0 : -1;
+
+    size_t tail = t->off[t->first];
+    if (t->wpos > tail) {
+        if (t->text_cap - t->wpos >= len)
+            return t->wpos;
+        return len <= tail ? 0 : -1;
+    }
+    return tail - t->wpos >= len ? (ssize_t)t->wpos : -1;
+}
+
+void live_set_header(enum live_table table, const char *header)
+{
+    if (!live_enabled)
+        return;
+
+    pthread_mutex_lock(&tabs[table].lock);
+    tabs[table].header = header;
+    pthread_mutex_unlock(&tabs[table].lock);
+}
+
+void live_append_row(enum live_table table, struct timespec ts, const char *row, size_t len)
+{
+    struct live_tab *t = &tabs[table];
+    __u64 ts_ns = ts_to_ns(ts);
+    ssize_t at;
+
+    if (!len || len > t->text_cap)
+        return;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->timed)
+        while (t->nr && t->ts[t->first] + live.window_ns < ts_ns)
+            drop_oldest(t);
+
+    if (t->nr == t->rows_cap)
+        drop_oldest(t);
+    while ((at = text_room(t, len)) < 0)
+        drop_oldest(t);
+
+    __u32 i = (t->first + t->nr) % t->rows_cap;
+    memcpy(t->text + at, row, len);
+    t->ts[i] = ts_ns;
+    t->off[i] = at;
+    t->len[i] = len;
+    t->wpos = at + len;
+    t->bytes += len;
+    t->nr++;
+    t->seq++;
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+// YYYY-MM-DDTHH:MM:SS[.ffffff] local time, as written into the files
+static int parse_time(const char *s, __u64 *ns_out)
+{
+    struct tm tm = {0};
+    const char *p = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+    __u64 frac = 0;
+    int digits = 0;
+
+    if (!p)
+        p = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!p)
+        return -1;
+
+    if (*p == '.')
+        for (p++; *p >= '0' && *p <= '9'; p++)
+            if (digits++ < 9)
+                frac = frac * 10 + (*p - '0');
+    if (*p)
+        return -1;
+    while (digits++ < 9)
+        frac *= 10;
+
+    tm.tm_isdst = -1;
+    time_t sec = mktime(&tm);
+    if (sec == (time_t)-1)
+        return -1;
+
+    *ns_out = (__u64)sec * 1000000000ULL + frac;
+    return 0;
+}
+
+// Position of a column in a comma separated header, -1 if not there
+static int header_column(const char *header, const char *name, size_t name_len)
+{
+    int col = 0;
+
+    for (const char *p = header; ; col++) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len == name_len && !strncasecmp(p, name, len))
+            return col;
+        if (!end)
+            return -1;
+        p = end + 1;
+    }
+}
+
+// Compare column col of a CSV row with value, fields may be single quoted
+static bool field_equals(const char *row, size_t len, int col, const char *value)
+{
+    const char *p = row, *end = row + len;
+
+    for (int c = 0; p < end; c++) {
+        const char *start = p, *stop;
+
+        if (*p == '\'') {
+            // quotes aren't escaped, a field ends at a quote and a separator
+            start = ++p;
+            while (p < end && !(*p == '\'' && (p + 1 == end || p[1] == ',' || p[1] == '\n')))
+                p++;
+            stop = p;
+            if (p < end)
+                p++;
+        } else {
+            while (p < end && *p != ',' && *p != '\n')
+                p++;
+            stop = p;
+        }
+
+        if (c == col)
+            return (size_t)(stop - start) == strlen(value) && !memcmp(start, value, stop - start);
+        if (p >= end || *p != ',')
+            return false;
+        p++;
+    }
+    return false;
+}
+
+static bool row_matches(const struct live_query *q, __u64 ts, const char *row, size_t len)
+{
+    if (q->tab->timed && (ts < q->from_ns || ts >= q->to_ns))
+        return false;
+
+    for (int i = 0; i < q->nr_filters; i++)
+        if (!field_equals(row, len, q->filters[i].col, q->filters[i].value))
+            return false;
+    return true;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void reply_error(int fd, const char *fmt, const char *arg)
+{
+    char msg[512];
+    int len = snprintf(msg, sizeof(msg), "ERROR ");
+
+    len += snprintf(msg + len, sizeof(msg) - len, fmt, arg);
+    if (len > (int)sizeof(msg) - 2)
+        len = sizeof(msg) - 2;
+    msg[len++] = '\n';
+    write_all(fd, msg, len);
+}
+
+static void reply_tables(int fd)
+{
+    static const char header[] = "NAME,ROWS,BYTES,FIRST_TIMESTAMP,LAST_TIMESTAMP\n";
+    char line[256];
+
+    write_all(fd, header, sizeof(header) - 1);
+
+    for (int i = 0; i < LIVE_NR_TABLES; i++) {
+        struct live_tab *t = &tabs[i];
+        char first[64] = "", last[64] = "";
+
+        pthread_mutex_lock(&t->lock);
+        __u32 nr = t->nr;
+        size_t bytes = t->bytes;
+        if (nr && t->timed) {
+            __u64 f = t->ts[t->first], l = t->ts[(t->first + nr - 1) % t->rows_cap];
+            struct timespec ts;
+
+            ts.tv_sec = f / 1000000000ULL;
+            ts.tv_nsec = f % 1000000000ULL;
+            get_str_from_ts(ts, first, sizeof(first));
+            ts.tv_sec = l / 1000000000ULL;
+            ts.tv_nsec = l % 1000000000ULL;
+            get_str_from_ts(ts, last, sizeof(last));
+        }
+        pthread_mutex_unlock(&t->lock);
+
+        int len = snprintf(line, sizeof(line), "%s,%u,%zu,%s,%s\n", t->name, nr, bytes, first, last);
+        if (write_all(fd, line, len))
+            return;
+    }
+}
+
+static void reply_rows(int fd, struct live_query *q)
+{
+    char *buf = malloc(LIVE_CHUNK);
+    __u64 next = 0, sent = 0;
+    bool done = false;
+
+    if (!buf) {
+        reply_error(fd, "%s", "out of memory");
+        return;
+    }
+
+    pthread_mutex_lock(&q->tab->lock);
+    const char *header = q->tab->header;
+    pthread_mutex_unlock(&q->tab->lock);
+
+    if (header && (write_all(fd, header, strlen(header)) || write_all(fd, "\n", 1)))
+        done = true;
+
+    // rows are addressed by sequence number, they may expire between batches
+    while (!done) {
+        struct live_tab *t = q->tab;
+        size_t used = 0;
+
+        pthread_mutex_lock(&t->lock);
+        __u64 oldest = t->seq - t->nr;
+        if (next < oldest)
+            next = oldest;
+
+        for (; next < t->seq; next++) {
+            __u32 i = (t->first + (next - oldest)) % t->rows_cap;
+            const char *row = t->text + t->off[i];
+
+            if (!row_matches(q, t->ts[i], row, t->len[i]))
+                continue;
+            if (used + t->len[i] > LIVE_CHUNK)
+                break;
+            memcpy(buf + used, row, t->len[i]);
+            used += t->len[i];
+            if (q->limit && ++sent >= q->limit) {
+                next = t->seq;
+                break;
+            }
+        }
+        done = next >= t->seq;
+        pthread_mutex_unlock(&t->lock);
+
+        if (used && write_all(fd, buf, used))
+            break;
+    }
+    free(buf);
+}
+
+static int parse_query(int fd, char *line, struct live_query *q)
+{
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t", &save);
+    __u64 now_ns;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_ns = ts_to_ns(now);
+
+    memset(q, 0, sizeof(*q));
+    q->to_ns = ~0ULL;
+
+    for (int i = 0; i < LIVE_NR_TABLES; i++)
+        if (!strcasecmp(tok, tabs[i].name))
+            q->tab = &tabs[i];
+    if (!q->tab) {
+        reply_error(fd, "unknown table %s", tok);
+        return -1;
+    }
+
+    while ((tok = strtok_r(NULL, " \t", &save))) {
+        char *eq = strchr(tok, '=');
+        char *end;
+
+        if (!eq || eq == tok) {
+            reply_error(fd, "expected NAME=VALUE, got %s", tok);
+            return -1;
+        }
+        *eq = '\0';
+        const char *val = eq + 1;
+
+        if (!strcmp(tok, "last")) {
+            unsigned long sec = strtoul(val, &end, 10);
+            if (*end || end == val) {
+                reply_error(fd, "invalid last=%s", val);
+                return -1;
+            }
+            q->from_ns = now_ns > sec * 1000000000ULL ? now_ns - sec * 1000000000ULL : 0;
+        } else if (!strcmp(tok, "from") || !strcmp(tok, "to")) {
+            if (parse_time(val, !strcmp(tok, "from") ? &q->from_ns : &q->to_ns)) {
+                reply_error(fd, "invalid time %s, use YYYY-MM-DDTHH:MM:SS[.ffffff]", val);
+                return -1;
+            }
+        } else if (!strcmp(tok, "limit")) {
+            q->limit = strtoull(val, &end, 10);
+            if (*end || end == val) {
+                reply_error(fd, "invalid limit=%s", val);
+                return -1;
+            }
+        } else {
+            int col = q->tab->header ? header_column(q->tab->header, tok, strlen(tok)) : -1;
+
+            if (col < 0) {
+                reply_error(fd, "unknown column %s", tok);
+                return -1;
+            }
+            if (q->nr_filters == LIVE_MAX_FILTERS) {
+                reply_error(fd, "%s", "too many filters");
+                return -1;
+            }
+            q->filters[q->nr_filters].col = col;
+            q->filters[q->nr_filters].value = val;
+            q->nr_filters++;
+        }
+    }
+    return 0;
+}
+
+static void serve_client(int fd)
+{
+    struct timeval tv = { .tv_sec = LIVE_IO_TIMEOUT };
+    char req[LIVE_MAX_REQUEST];
+    size_t have = 0;
+    char *nl = NULL;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (!nl && have < sizeof(req) - 1) {
+        ssize_t n = recv(fd, req + have, sizeof(req) - 1 - have, 0);
+        if (n <= 0)
+            return;
+        have += n;
+        req[have] = '\0';
+        nl = strchr(req, '\n');
+    }
+    if (!nl) {
+        reply_error(fd, "%s", "request line too long");
+        return;
+    }
+    *nl = '\0';
+    if (nl > req && nl[-1] == '\r')
+        nl[-1] = '\0';
+
+    if (!strcasecmp(req, "TABLES")) {
+        reply_tables(fd);
+        return;
+    }
+
+    struct live_query q;
+    if (!req[strspn(req, " \t")]) {
+        reply_error(fd, "%s", "empty request");
+        return;
+    }
+    if (parse_query(fd, req, &q) == 0)
+        reply_rows(fd, &q);
+}
+
+static void *live_main(void *arg)
+{
+    XCAP_UNUSED(arg);
+
+    while (!live.stop) {
+        int fd = accept4(live.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  // live_stop() shut the socket down
+        }
+        serve_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void free_tables(void)
+{
+    for (int i = 0; i < LIVE_NR_TABLES; i++) {
+        struct live_tab *t = &tabs[i];
+
+        free(t->ts);
+        free(t->off);
+        free(t->len);
+        free(t->text);
+        t->ts = NULL;
+        t->off = NULL;
+        t->len = NULL;
+        t->text = NULL;
+        t->nr = t->first = 0;
+        t->bytes = t->wpos = 0;
+    }
+}
+
+int live_start(const struct xcapture_context *xctx)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    sigset_t all, old;
+    int err;
+
+    if (strlen(xctx->live_socket) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Live socket path too long: %s\n", xctx->live_socket);
+        return -ENAMETOOLONG;
+    }
+    snprintf(live.path, sizeof(live.path), "%s", xctx->live_socket);
+    live.window_ns = (__u64)xctx->live_window_min * 60 * 1000000000ULL;
+
+    // rows average over 100 bytes, size the row arrays for 64 byte ones
+    for (int i = 0; i < LIVE_NR_TABLES; i++) {
+        struct live_tab *t = &tabs[i];
+
+        pthread_mutex_init(&t->lock, NULL);
+        t->text_cap = xctx->live_bytes / 100 * t->share;
+        if (t->text_cap < LIVE_MIN_BYTES)
+            t->text_cap = LIVE_MIN_BYTES;
+        t->rows_cap = t->text_cap / 64;
+        t->text = malloc(t->text_cap);
+        t->ts = malloc(t->rows_cap * sizeof(*t->ts));
+        t->off = malloc(t->rows_cap * sizeof(*t->off));
+        t->len = malloc(t->rows_cap * sizeof(*t->len));
+        if (!t->text || !t->ts || !t->off || !t->len) {
+            free_tables();
+            return -ENOMEM;
+        }
+    }
+
+    live.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (live.listen_fd < 0) {
+        err = -errno;
+        free_tables();
+        return err;
+    }
+
+    // a socket left behind by an earlier run would fail the bind
+    struct stat st;
+    if (lstat(live.path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(live.path);
+
+    memcpy(addr.sun_path, live.path, strlen(live.path) + 1);
+    if (bind(live.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        chmod(live.path, 0600) || listen(live.listen_fd, 8)) {
+        err = -errno;
+        fprintf(stderr, "Failed to listen on %s: %s\n", live.path, strerror(errno));
+        close(live.listen_fd);
+        live.listen_fd = -1;
+        free_tables();
+        return err;
+    }
+
+    live_enabled = true;
+
+    // keep SIGINT/SIGTERM for the sampler thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&live.thread, NULL, live_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        live_enabled = false;
+        close(live.listen_fd);
+        live.listen_fd = -1;
+        unlink(live.path);
+        free_tables();
+        return -err;
+    }
+
+    live.started = true;
+    return 0;
+}
+
+// Called after the pipeline threads are gone, nothing appends anymore
+void live_stop(void)
+{
+    if (!live.started)
+        return;
+
+    live.stop = true;
+    shutdown(live.listen_fd, SHUT_RDWR);
+    pthread_join(live.thread, NULL);
+    close(live.listen_fd);
+    live.listen_fd = -1;
+    unlink(live.path);
+
+    live_enabled = false;
+    live.started = false;
+    free_tables();
+}
@@ -0,0 +1,44 @@
+#ifndef __LIVE_STORE_H
+#define __LIVE_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <linux/types.h>
+#include "xcapture_context.h"
+
+// In-memory copy of the last minutes of CSV output (--live), queried over a
+// Unix socket by xtop --live. See live_store.c for the query protocol.
+
+#define LIVE_DEFAULT_WINDOW_MIN 10
+#define LIVE_DEFAULT_BYTES      (256ULL << 20)
+
+enum live_table {
+    LIVE_SAMPLES,
+    LIVE_SYSCEND,
+    LIVE_IORQEND,
+    LIVE_KSTACKS,
+    LIVE_USTACKS,
+    LIVE_CGROUPS,
+    LIVE_NR_TABLES
+};
+
+extern bool live_enabled;
+
+int live_start(const struct xcapture_context *xctx);
+void live_stop(void);
+
+// The CSV header of a table, a string that stays valid until live_stop()
+void live_set_header(enum live_table table, const char *header);
+
+// A CSV row including its newline, ts is the wall clock time the time range
+// of queries applies to (ignored for the stack and cgroup tables)
+void live_append_row(enum live_table table, struct timespec ts, const char *row, size_t len);
+
+static inline void live_append(enum live_table table, struct timespec ts, const char *row, size_t len)
+{
+    if (live_enabled)
+        live_append_row(table, ts, row, len);
+}
+
+#endif /* __LIVE_STORE_H */
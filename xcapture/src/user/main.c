@@ -9,6 +9,8 @@
 #include <signal.h>
 #include <argp.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
@@ -30,6 +32,7 @@
 #include "xcapture_context.h"
 #include "columns.h"
 #include "cgroup_cache.h"
+#include "unwind_table.h"
 
 // platform specific syscall NR<->name mapping
 #if defined(__TARGET_ARCH_arm64)
@@ -42,6 +45,15 @@
 
 #include "user/task_handler.h"
 #include "user/tracking_handler.h"
+#include "user/aggregate.h"
+#include "user/governor.h"
+#include "user/pipeline.h"
+#include "user/compress.h"
+#include "user/retention.h"
+#include "user/live_store.h"
+#include "user/selfstats.h"
+#include "user/latency_hist.h"
+#include "symcache.h"
 
 #ifdef USE_BLAZESYM
 #include "blazesym.h"
@@ -144,10 +156,13 @@ static int reuse_syscall_maps(struct syscall_bpf *sys_skel, struct task_bpf *tas
         return 0;
 
     if ((err = reuse_map(sys_skel->maps.task_storage, task_skel->maps.task_storage))) return err;
+    if ((err = reuse_map(sys_skel->maps.task_payloads, task_skel->maps.task_payloads))) return err;
+    if ((err = reuse_map(sys_skel->maps.task_stacks, task_skel->maps.task_stacks))) return err;
     if ((err = reuse_map(sys_skel->maps.completion_events, task_skel->maps.completion_events))) return err;
     if ((err = reuse_map(sys_skel->maps.task_samples, task_skel->maps.task_samples))) return err;
     if ((err = reuse_map(sys_skel->maps.stack_traces, task_skel->maps.stack_traces))) return err;
     if ((err = reuse_map(sys_skel->maps.emitted_stacks, task_skel->maps.emitted_stacks))) return err;
+    if ((err = reuse_map(sys_skel->maps.xcap_drops, task_skel->maps.xcap_drops))) return err;
 
     return 0;
 }
@@ -160,10 +175,13 @@ static int reuse_iorq_maps(struct iorq_bpf *iorq_skel, struct task_bpf *task_ske
         return 0;
 
     if ((err = reuse_map(iorq_skel->maps.task_storage, task_skel->maps.task_storage))) return err;
+    if ((err = reuse_map(iorq_skel->maps.task_payloads, task_skel->maps.task_payloads))) return err;
+    if ((err = reuse_map(iorq_skel->maps.task_stacks, task_skel->maps.task_stacks))) return err;
     if ((err = reuse_map(iorq_skel->maps.completion_events, task_skel->maps.completion_events))) return err;
     if ((err = reuse_map(iorq_skel->maps.task_samples, task_skel->maps.task_samples))) return err;
     if ((err = reuse_map(iorq_skel->maps.stack_traces, task_skel->maps.stack_traces))) return err;
     if ((err = reuse_map(iorq_skel->maps.emitted_stacks, task_skel->maps.emitted_stacks))) return err;
+    if ((err = reuse_map(iorq_skel->maps.xcap_drops, task_skel->maps.xcap_drops))) return err;
     if ((err = reuse_map(iorq_skel->maps.iorq_tracking, task_skel->maps.iorq_tracking))) return err;
 
     return 0;
@@ -198,10 +216,13 @@ static int pin_task_maps(struct task_bpf *task_skel, const char *root)
         return 0;
 
     if ((err = pin_map_to_root(task_skel->maps.task_storage, root))) return err;
+    if ((err = pin_map_to_root(task_skel->maps.task_payloads, root))) return err;
+    if ((err = pin_map_to_root(task_skel->maps.task_stacks, root))) return err;
     if ((err = pin_map_to_root(task_skel->maps.completion_events, root))) return err;
     if ((err = pin_map_to_root(task_skel->maps.task_samples, root))) return err;
     if ((err = pin_map_to_root(task_skel->maps.stack_traces, root))) return err;
     if ((err = pin_map_to_root(task_skel->maps.emitted_stacks, root))) return err;
+    if ((err = pin_map_to_root(task_skel->maps.xcap_drops, root))) return err;
     if ((err = pin_map_to_root(task_skel->maps.iorq_tracking, root))) return err;
 
     return 0;
@@ -216,42 +237,111 @@ static void unpin_map_if_needed(struct bpf_map *map)
         bpf_map__unpin(map, NULL);
 }
 
+// Attach the on-CPU sampler to a cpu-clock perf event on every online CPU,
+// returns the number of links created (offline CPUs are skipped)
+static int attach_oncpu_sampler(struct bpf_program *prog, int freq, struct bpf_link ***links_out)
+{
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0)
+        return -EINVAL;
+
+    struct bpf_link **links = calloc(ncpus, sizeof(*links));
+    if (!links)
+        return -ENOMEM;
+
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_SOFTWARE,
+        .config = PERF_COUNT_SW_CPU_CLOCK,
+        .size = sizeof(attr),
+        .sample_freq = freq,
+        .freq = 1,
+    };
+
+    int nr_links = 0;
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        int pfd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+        if (pfd < 0) {
+            if (errno == ENODEV)
+                continue;
+            int err = -errno;
+            fprintf(stderr, "Failed to open cpu-clock perf event on CPU %d: %s\n", cpu, strerror(errno));
+            for (int i = 0; i < nr_links; i++)
+                bpf_link__destroy(links[i]);
+            free(links);
+            return err;
+        }
+
+        links[nr_links] = bpf_program__attach_perf_event(prog, pfd);
+        if (!links[nr_links]) {
+            int err = -errno;
+            fprintf(stderr, "Failed to attach on-CPU sampler on CPU %d: %s\n", cpu, strerror(errno));
+            close(pfd);
+            for (int i = 0; i < nr_links; i++)
+                bpf_link__destroy(links[i]);
+            free(links);
+            return err;
+        }
+        nr_links++;
+    }
+
+    *links_out = links;
+    return nr_links;
+}
+
 #ifdef USE_BLAZESYM
 blaze_symbolizer *g_symbolizer = NULL;
+struct symcache *g_symcache = NULL;
 bool symbolize_stacks = true;  // Default to true when blazesym is available
 #endif
 
-// Track unique stack hashes seen in current iteration
+// Track unique stack hashes seen in current iteration, in first seen order,
+// with an open addressing index of positions in that list (+1, 0 = free)
 #define MAX_UNIQUE_STACKS 131072
+#define UNIQUE_STACK_SLOTS (2 * MAX_UNIQUE_STACKS)  // power of 2
 struct unique_stack {
     __u64 hash;
     bool is_kernel;
 };
 static struct unique_stack unique_stacks[MAX_UNIQUE_STACKS];
+static __u32 unique_stack_slots[UNIQUE_STACK_SLOTS];
 static int unique_stack_count = 0;
 
+static inline __u32 unique_stack_slot(__u64 hash, bool is_kernel) {
+    return (__u32)(((hash ^ is_kernel) * 0x9e3779b97f4a7c15ULL) >> 32) & (UNIQUE_STACK_SLOTS - 1);
+}
+
 // Add a stack hash to the unique list if not already present
 void add_unique_stack(__u64 hash, bool is_kernel) {
     if (hash == 0) return;
-    
-    // Check if already in list
-    for (int i = 0; i < unique_stack_count; i++) {
-        if (unique_stacks[i].hash == hash && unique_stacks[i].is_kernel == is_kernel) {
+
+    __u32 i = unique_stack_slot(hash, is_kernel);
+    while (unique_stack_slots[i]) {
+        struct unique_stack *u = &unique_stacks[unique_stack_slots[i] - 1];
+        if (u->hash == hash && u->is_kernel == is_kernel)
             return;
-        }
+        i = (i + 1) & (UNIQUE_STACK_SLOTS - 1);
     }
-    
-    // Add to list if space available
+
+    // Add to list if space available, the index is never more than half full
     if (unique_stack_count < MAX_UNIQUE_STACKS) {
         unique_stacks[unique_stack_count].hash = hash;
         unique_stacks[unique_stack_count].is_kernel = is_kernel;
-        unique_stack_count++;
+        unique_stack_slots[i] = ++unique_stack_count;
     }
 }
 
 // Reset unique stack list for new iteration
 void reset_unique_stacks() {
+    // clearing the slots of the listed stacks is enough, nothing else is set
+    for (int n = 0; n < unique_stack_count; n++) {
+        __u32 i = unique_stack_slot(unique_stacks[n].hash, unique_stacks[n].is_kernel);
+        while (unique_stack_slots[i]) {
+            unique_stack_slots[i] = 0;
+            i = (i + 1) & (UNIQUE_STACK_SLOTS - 1);
+        }
+    }
     unique_stack_count = 0;
+    stack_cache_next_iteration();
 }
 
 // Print all unique stacks collected during this iteration
@@ -291,9 +381,16 @@ static bool dist_trace_enabled = false;
 static int daemon_ports = 10000;    // default daemon ports heuristic threshold
 static int max_iterations = -1;     // -1 means run forever, >0 means run N iterations
 static pid_t filter_tgid = 0;       // filter by TGID (0 means no filter)
+static __u64 filter_cgroups[XCAP_MAX_FILTER_CGROUPS];  // --cgroup ids, including child cgroups
+static int nr_filter_cgroups = 0;
+static __s32 filter_syscalls[XCAP_MAX_SYSCALL_NR];     // --syscalls, in command line order
+static int nr_filter_syscalls = 0;
+static int oncpu_freq = 0;          // perf_event on-CPU sampling frequency (0 means off)
+static double max_cpu_pct = 0;      // overhead cap for the governor (0 means off)
+static bool iter_stream = false;    // read task samples from the iterator fd instead of ringbuf
 
 // Version and help string
-const char *argp_program_version = "xcapture 3.0.3";
+const char *argp_program_version = "xcapture " XCAPTURE_VERSION;
 const char *argp_program_bug_address = "https://github.com/tanelpoder/0xtools";
 const char argp_program_doc[] =
 "xcapture thread state tracking & sampling by Tanel Poder [0x.tools]\n"
@@ -309,24 +406,63 @@ const char argp_program_doc[] =
 // Command line options
 enum {
     OPT_URING_DEBUG = 1000,
+    OPT_ITER_STREAM,
+    OPT_AGGREGATE,
+    OPT_DWARF_STACKS,
+    OPT_ONCPU_FREQ,
+    OPT_MAX_CPU,
+    OPT_FORMAT,
+    OPT_COMPRESS,
+    OPT_ROTATE,
+    OPT_MAX_FILE_SIZE,
+    OPT_RETAIN_SIZE,
+    OPT_RETAIN_FREE,
+    OPT_HIVE,
+    OPT_RAW,
+    OPT_DEFER_SYMBOLS,
+    OPT_LIVE,
+    OPT_LIVE_WINDOW,
+    OPT_LIVE_SIZE,
+    OPT_CGROUP,
+    OPT_SYSCALLS,
+    OPT_SYSCALL_HIST,
+    OPT_IORQ_HIST,
+    OPT_HIST_INTERVAL,
 };
 
 static const struct argp_option opts[] = {
     { "all", 'a', NULL, 0, "Show all tasks including sleeping ones", 0 },
     { "passive", 'P', NULL, 0, "Allow only passive task state sampling", 0 },
     { "pgid", 'p', "PID", 0, "Filter by process ID/thread group ID (shows all threads)", 0 },
+    { "cgroup", OPT_CGROUP, "PATH|ID[,...]", 0, "Sample and track only tasks in these cgroups and their child cgroups", 0 },
+    { "syscalls", OPT_SYSCALLS, "NAME[,...]", 0, "Track only these syscalls (requires -t syscall)", 0 },
     { "track", 't', "iorq,syscall", 0, "Enable active tracking with tracepoints & probes", 0 },
     { "dist-trace", 'D', "MODE[,MODE]", 0, "Enable distributed trace capture (http,https,grpc)", 0 },
     { "payload-trace", 'Y', NULL, 0, "Capture read/write payloads observed in tracked syscalls (experimental)", 0 },
     { "track-all", 'T', NULL, 0, "Enable all available tracking components", 0 },
     { "daemon-ports", 'd', "PORT", 0, "Port threshold for daemon connections (default: 10000)", 0 },
     { "freq", 'F', "HZ", 0, "Sampling frequency in Hz (default: 1)", 0 },
+    { "oncpu-freq", OPT_ONCPU_FREQ, "HZ", 0, "Sample on-CPU tasks with a perf_event timer at HZ (e.g. 99), the task iterator then skips them", 0 },
+    { "max-cpu", OPT_MAX_CPU, "PCT", 0, "Cap xcapture's own CPU usage at PCT% of one CPU, shedding user stacks, kernel stacks, then frequency", 0 },
     { "output-dir", 'o', "DIR", 0, "Write CSV files to specified directory", 0 },
+    { "format", OPT_FORMAT, "csv|parquet", 0, "Output file format with -o (default: csv)", 0 },
+    { "compress", OPT_COMPRESS, "zstd|lz4", 0, "Compress CSV output files into .csv.zst or .csv.lz4 frames", 0 },
+    { "rotate", OPT_ROTATE, "MIN", 0, "Start new output files every 1, 5, 15 or 60 minutes (default: 60)", 0 },
+    { "max-file-size", OPT_MAX_FILE_SIZE, "SIZE", 0, "Also rotate when an output file grows past SIZE (e.g. 512M)", 0 },
+    { "retain-size", OPT_RETAIN_SIZE, "SIZE", 0, "Delete the oldest output files when all of them take more than SIZE (e.g. 20G)", 0 },
+    { "retain-free", OPT_RETAIN_FREE, "SIZE", 0, "Delete the oldest output files when the filesystem has less than SIZE free", 0 },
+    { "hive", OPT_HIVE, NULL, 0, "Write output files into date=YYYY-MM-DD/hour=HH/ subdirectories", 0 },
+    { "live", OPT_LIVE, "SOCKET", 0, "Keep the last minutes of CSV output in memory and serve queries on Unix socket SOCKET (for xtop --live, requires -o)", 0 },
+    { "live-window", OPT_LIVE_WINDOW, "MIN", 0, "Minutes of samples and completions kept for --live (default: 10)", 0 },
+    { "live-size", OPT_LIVE_SIZE, "SIZE", 0, "Memory for --live, older rows are dropped early beyond it (default: 256M)", 0 },
+    { "raw", OPT_RAW, NULL, 0, "Write unformatted records into a binary journal for xcapture-decode (requires -o)", 0 },
     { "kernel-stacks", 'k', NULL, 0, "Dump kernel stack traces to CSV files", 0 },
     { "print-stacks", 's', NULL, 0, "Print stack traces in stdout mode (requires -k and/or -u)", 0 },
     { "print-cgroups", 'C', NULL, 0, "Print cgroup paths in stdout mode", 0 },
     { "uring-debug", OPT_URING_DEBUG, NULL, 0, "Include io_uring debug fields in EXTRA_INFO", 0 },
     { "user-stacks", 'u', NULL, 0, "Dump userspace stack traces (requires -fno-omit-frame-pointer)", 0 },
+    { "defer-symbols", OPT_DEFER_SYMBOLS, NULL, 0, "Write raw user stack addresses and mapping snapshots for xcapture-symbolize instead of symbolizing (implies -u, requires -o)", 0 },
+    { "dwarf-stacks", OPT_DWARF_STACKS, NULL, 0, "Dump userspace stack traces unwound with .eh_frame tables (x86_64, implies -u)", 0 },
     { "verbose", 'v', NULL, 0, "Report sampling metrics even in CSV output mode", 0 },
     { "wide-output", 'w', NULL, 0, "Show additional syscall timing columns in stdout mode", 0 },
     { "narrow-output", 'n', NULL, 0, "Show minimal columns (TID, TGID, STATE, USERNAME, EXE, COMM, SYSCALL, FILENAME)", 0 },
@@ -334,6 +470,11 @@ static const struct argp_option opts[] = {
     { "append-columns", 'G', "COLUMNS", 0, "Append columns to the selected stdout layout", 0 },
     { "list", 'l', NULL, 0, "List all available columns and exit", 0 },
     { "iterations", 'i', "NUMBER", 0, "Exit after NUMBER sampling iterations (default: run forever)", 0 },
+    { "iter-stream", OPT_ITER_STREAM, NULL, 0, "Stream task samples through the task iterator fd instead of a ring buffer", 0 },
+    { "syscall-hist", OPT_SYSCALL_HIST, "tgid|cgroup", 0, "Count every tracked syscall into latency histograms per syscall and TGID or cgroup (requires -t syscall and -o)", 0 },
+    { "iorq-hist", OPT_IORQ_HIST, NULL, 0, "Count every block I/O into service time histograms per device, op and cgroup (requires -t iorq and -o)", 0 },
+    { "hist-interval", OPT_HIST_INTERVAL, "SEC", 0, "Write the latency histograms every SEC seconds (default: 10)", 0 },
+    { "aggregate", OPT_AGGREGATE, "DIMS", 0, "Count samples in kernel by DIMS (state,syscall,exe,comm,tgid,username,cgroup_id,kstack_hash,ustack_hash)", 0 },
     { "help", 'h', NULL, 0, "Show this help message and exit", 0 },
 #ifdef USE_BLAZESYM
     { "no-symbolize", 'N', NULL, 0, "Disable stack trace symbolization (show raw addresses)", 0 },
@@ -382,9 +523,127 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
         case OPT_URING_DEBUG:
             g_ctx.print_uring_debug = true;
             break;
+        case OPT_ITER_STREAM:
+            iter_stream = true;
+            break;
+        case OPT_AGGREGATE:
+            if (parse_aggregate_dims(arg, &g_ctx.aggregate_dims) < 0) {
+                fprintf(stderr, "Invalid aggregation dimensions: %s\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            }
+            // stack hashes are only computed when stack collection is on
+            if (g_ctx.aggregate_dims & XCAP_AGG_KSTACK)
+                g_ctx.dump_kernel_stack_traces = true;
+            if (g_ctx.aggregate_dims & XCAP_AGG_USTACK)
+                g_ctx.dump_user_stack_traces = true;
+            break;
         case 'u':
             g_ctx.dump_user_stack_traces = true;
             break;
+        case OPT_ONCPU_FREQ:
+#ifndef OLD_KERNEL_SUPPORT
+            errno = 0;
+            oncpu_freq = strtol(arg, NULL, 10);
+            if (errno || oncpu_freq <= 0) {
+                fprintf(stderr, "Invalid on-CPU sampling frequency. Must be a positive integer.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+#else
+            fprintf(stderr, "--oncpu-freq is not supported with OLD_KERNEL_SUPPORT\n");
+            argp_usage(state);
+            return EINVAL;
+#endif
+            break;
+        case OPT_MAX_CPU:
+            if (parse_max_cpu(arg, &max_cpu_pct)) {
+                fprintf(stderr, "Invalid --max-cpu value. Must be a percentage between 0 and 100, e.g. 2%%.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_FORMAT:
+            if (strcmp(arg, "parquet") == 0) {
+                g_ctx.output_parquet = true;
+            } else if (strcmp(arg, "csv") != 0) {
+                fprintf(stderr, "Invalid --format value. Must be csv or parquet.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_COMPRESS: {
+            int err = parse_compress(arg, &g_ctx.compress);
+            if (err == -ENOTSUP) {
+                fprintf(stderr, "--compress %s is not supported, xcapture was built without it\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            } else if (err) {
+                fprintf(stderr, "Invalid --compress value. Must be zstd, lz4 or none.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        }
+        case OPT_ROTATE:
+            g_ctx.rotate_minutes = atoi(arg);
+            if (g_ctx.rotate_minutes != 1 && g_ctx.rotate_minutes != 5 &&
+                g_ctx.rotate_minutes != 15 && g_ctx.rotate_minutes != 60) {
+                fprintf(stderr, "Invalid --rotate value. Must be 1, 5, 15 or 60 minutes.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_MAX_FILE_SIZE:
+        case OPT_RETAIN_SIZE:
+        case OPT_RETAIN_FREE: {
+            __u64 *size = key == OPT_MAX_FILE_SIZE ? &g_ctx.max_file_size :
+                          key == OPT_RETAIN_SIZE ? &g_ctx.retain_bytes : &g_ctx.retain_free_bytes;
+            if (parse_size(arg, size)) {
+                fprintf(stderr, "Invalid size '%s'. Use a number of bytes with an optional K, M, G or T suffix.\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        }
+        case OPT_HIVE:
+            g_ctx.hive_layout = true;
+            break;
+        case OPT_RAW:
+            g_ctx.raw_journal = true;
+            break;
+        case OPT_LIVE:
+            g_ctx.live_socket = arg;
+            break;
+        case OPT_LIVE_WINDOW:
+            g_ctx.live_window_min = atoi(arg);
+            if (g_ctx.live_window_min < 1 || g_ctx.live_window_min > 1440) {
+                fprintf(stderr, "Invalid --live-window '%s'. Use 1 to 1440 minutes.\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_LIVE_SIZE:
+            if (parse_size(arg, &g_ctx.live_bytes)) {
+                fprintf(stderr, "Invalid size '%s'. Use a number of bytes with an optional K, M, G or T suffix.\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_DEFER_SYMBOLS:
+            g_ctx.defer_symbols = true;
+            g_ctx.dump_user_stack_traces = true;
+            break;
+        case OPT_DWARF_STACKS:
+#if defined(__TARGET_ARCH_x86) && !defined(OLD_KERNEL_SUPPORT)
+            g_ctx.dwarf_stacks = true;
+            g_ctx.dump_user_stack_traces = true;
+#else
+            fprintf(stderr, "--dwarf-stacks is only supported on x86_64 without OLD_KERNEL_SUPPORT\n");
+            argp_usage(state);
+            return EINVAL;
+#endif
+            break;
         case 'v':
             g_ctx.output_verbose = true;
             break;
@@ -443,6 +702,66 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
                 argp_usage(state);
             }
             break;
+        case OPT_CGROUP: {
+            int nr = parse_cgroup_filter(arg, filter_cgroups, XCAP_MAX_FILTER_CGROUPS);
+            if (nr == -E2BIG) {
+                fprintf(stderr, "Too many cgroups in '%s', at most %d including child cgroups.\n",
+                        arg, XCAP_MAX_FILTER_CGROUPS);
+                return EINVAL;
+            }
+            if (nr <= 0) {
+                fprintf(stderr, "Invalid cgroup list '%s'.\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            }
+            nr_filter_cgroups = nr;
+            break;
+        }
+        case OPT_SYSCALLS: {
+            char *names = strdup(arg);
+            char *saveptr = NULL;
+
+            if (!names)
+                return ENOMEM;
+
+            for (char *name = strtok_r(names, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+                int nr = syscall_nr_by_name(name);
+                if (nr < 0 || nr >= XCAP_MAX_SYSCALL_NR || nr_filter_syscalls == XCAP_MAX_SYSCALL_NR) {
+                    fprintf(stderr, "Unknown syscall '%s'.\n", name);
+                    free(names);
+                    argp_usage(state);
+                    return EINVAL;
+                }
+                filter_syscalls[nr_filter_syscalls++] = nr;
+            }
+
+            free(names);
+            if (!nr_filter_syscalls) {
+                fprintf(stderr, "No syscalls supplied.\n");
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        }
+        case OPT_SYSCALL_HIST:
+            g_ctx.syscall_hist = parse_hist_by(arg);
+            if (g_ctx.syscall_hist < 0) {
+                fprintf(stderr, "Invalid histogram key '%s'. Supported: tgid, cgroup.\n", arg);
+                argp_usage(state);
+                return EINVAL;
+            }
+            break;
+        case OPT_IORQ_HIST:
+            g_ctx.iorq_hist = true;
+            break;
+        case OPT_HIST_INTERVAL:
+            errno = 0;
+            g_ctx.hist_interval_sec = strtol(arg, NULL, 10);
+            if (errno || g_ctx.hist_interval_sec <= 0) {
+                fprintf(stderr, "Invalid histogram interval. Must be a positive number of seconds.\n");
+                argp_usage(state);
+            }
+            break;
         case 't':
             // Parse comma-separated tracking components
             if (strstr(arg, "syscall"))
@@ -618,97 +937,108 @@ const char *getusername(uid_t uid)
     return username_cache[bucket].username;
 }
 
-const char *format_task_state(__u32 state, int on_rq, int on_cpu, void *migration_pending)
-{
-    static char state_str[64];  // Buffer for state string with flags
-    const char *base_state;
-    
-    // Determine base state string (TODO handle full bitset)
-    switch (state & 0xFF) {
-    case 0x0000: base_state = "RUN"; break;   // RUNNING
-    case 0x0001: base_state = "SLEEP"; break; // INTERRUPTIBLE
-    case 0x0002: base_state = "DISK"; break;  // UNINTERRUPTIBLE
-    case 0x0004: base_state = "STOPPED"; break;
-    case 0x0080: base_state = "DEAD"; break;
-    case 0x0200: base_state = "WAKING"; break;
-    case 0x0400: base_state = "NOLOAD"; break;
-    case 0x0402: base_state = "IDLE"; break;
-    case 0x0800: base_state = "NEW"; break;
-    default:
-        snprintf(state_str, sizeof(state_str), "0x%x", state);
-        base_state = state_str;
-    }
-    
-    // Copy base state to result buffer
-    strncpy(state_str, base_state, sizeof(state_str) - 3);
-    state_str[sizeof(state_str) - 3] = '\0';
-    
-    // Append flags
-    // Q = on runqueue but not on CPU (waiting to run)
-    if (on_rq > 0 && on_cpu == 0) {
-        strcat(state_str, "Q");
-    }
-    if (migration_pending != NULL) {
-        strcat(state_str, "M");
+struct timespec get_ts_diff(struct timespec end, struct timespec start) {
+    struct timespec diff;
+    if ((end.tv_nsec - start.tv_nsec) < 0) {
+        diff.tv_sec = end.tv_sec - start.tv_sec - 1;
+        diff.tv_nsec = 1000000000 + end.tv_nsec - start.tv_nsec;
+    } else {
+        diff.tv_sec = end.tv_sec - start.tv_sec;
+        diff.tv_nsec = end.tv_nsec - start.tv_nsec;
     }
-    
-    return state_str;
+    return diff;
 }
 
-
-// subtract nanoseconds from timespec
-struct timespec sub_ns_from_ts(struct timespec ts, __u64 ns)
+// Ticks are multiples of the sampling interval since the epoch, so that xcapture
+// instances on different hosts (with synced clocks) sample at the same instants
+static __u64 next_tick_ns(__u64 now_ns, __u64 interval_ns)
 {
-    struct timespec result = ts;
+    return (now_ns / interval_ns + 1) * interval_ns;
+}
 
-    if (result.tv_nsec < (long)(ns % 1000000000)) {
-        result.tv_sec--;  // Borrow a second
-        result.tv_nsec = result.tv_nsec + 1000000000 - (ns % 1000000000);
-    } else {
-        result.tv_nsec -= (ns % 1000000000);
-    }
+static __u64 realtime_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    result.tv_sec -= (ns / 1000000000);
-    return result;
+    return (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-void get_str_from_ts(struct timespec ts, char *buf, size_t bufsize) {
-    struct tm *tm = localtime(&ts.tv_sec);
-    strftime(buf, bufsize, "%Y-%m-%dT%H:%M:%S", tm);
-    snprintf(buf + 19, bufsize - 19, ".%06ld", ts.tv_nsec / 1000);
+// Sleep until an absolute wall clock time, returns early only when exiting
+static void sleep_until_ns(__u64 deadline_ns)
+{
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000ULL,
+        .tv_nsec = deadline_ns % 1000000000ULL,
+    };
+
+    while (!exiting && clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
 }
 
-// get walltime timespec from monotonic clock ns (bpf ktime)
-struct timespec get_wall_from_mono(struct time_correlation *tcorr, __u64 bpf_time)
+// The same task filters go into every BPF object, the task iterator skips
+// unselected tasks and the tracking probes return before touching any map
+#define SET_FILTER_RODATA(skel) do {                                            \
+    (skel)->rodata->xcap_filter_tgid = filter_tgid;                             \
+    (skel)->rodata->xcap_nr_filter_cgroups = nr_filter_cgroups;                 \
+    memcpy((skel)->rodata->xcap_filter_cgroups, filter_cgroups,                 \
+           sizeof(filter_cgroups));                                             \
+    (skel)->rodata->xcap_filter_syscalls = nr_filter_syscalls > 0;              \
+    for (int i = 0; i < nr_filter_syscalls; i++)                                \
+        (skel)->rodata->xcap_syscall_set[filter_syscalls[i] / 64] |=            \
+            1ULL << (filter_syscalls[i] % 64);                                  \
+} while (0)
+
+// With a few --syscalls, attach fentry/fexit programs to just their syscall
+// functions instead of the raw sys_enter/sys_exit tracepoints that every
+// syscall on the system goes through. Falls back to the tracepoints when a
+// function isn't in the kernel BTF (or there are too many syscalls)
+static void setup_syscall_attach(struct syscall_bpf *skel)
 {
-    struct timespec result = tcorr->wall_time;
-    __u64 mono_ns = tcorr->mono_time.tv_sec * 1000000000ULL + tcorr->mono_time.tv_nsec;
-    __s64 ns_diff = bpf_time - mono_ns;
-
-    result.tv_nsec += ns_diff % 1000000000;
-    result.tv_sec += ns_diff / 1000000000;
-
-    if (result.tv_nsec >= 1000000000) {
-        result.tv_nsec -= 1000000000;
-        result.tv_sec++;
-    } else if (result.tv_nsec < 0) {
-        result.tv_nsec += 1000000000;
-        result.tv_sec--;
+#if defined(__TARGET_ARCH_arm64)
+    const char *prefix = "__arm64_sys_";
+#else
+    const char *prefix = "__x64_sys_";
+#endif
+    char func[64], prog_name[32];
+    bool use_fentry = nr_filter_syscalls > 0 && nr_filter_syscalls <= XCAP_FENTRY_SLOTS;
+
+    for (int i = 0; use_fentry && i < nr_filter_syscalls; i++) {
+        snprintf(func, sizeof(func), "%s%s", prefix, safe_syscall_name(filter_syscalls[i]));
+        if (libbpf_find_vmlinux_btf_id(func, BPF_TRACE_FENTRY) < 0)
+            use_fentry = false;
     }
 
-    return result;
-}
+    for (int slot = 0; slot < XCAP_FENTRY_SLOTS; slot++) {
+        bool used = use_fentry && slot < nr_filter_syscalls;
 
-struct timespec get_ts_diff(struct timespec end, struct timespec start) {
-    struct timespec diff;
-    if ((end.tv_nsec - start.tv_nsec) < 0) {
-        diff.tv_sec = end.tv_sec - start.tv_sec - 1;
-        diff.tv_nsec = 1000000000 + end.tv_nsec - start.tv_nsec;
-    } else {
-        diff.tv_sec = end.tv_sec - start.tv_sec;
-        diff.tv_nsec = end.tv_nsec - start.tv_nsec;
+        if (used) {
+            snprintf(func, sizeof(func), "%s%s", prefix, safe_syscall_name(filter_syscalls[slot]));
+            skel->rodata->xcap_fentry_syscalls[slot] = filter_syscalls[slot];
+        }
+
+        snprintf(prog_name, sizeof(prog_name), "xcap_sys_enter_%d", slot);
+        struct bpf_program *enter = bpf_object__find_program_by_name(skel->obj, prog_name);
+        snprintf(prog_name, sizeof(prog_name), "xcap_sys_exit_%d", slot);
+        struct bpf_program *exit_prog = bpf_object__find_program_by_name(skel->obj, prog_name);
+
+        if (enter) {
+            bpf_program__set_autoload(enter, used);
+            if (used)
+                bpf_program__set_attach_target(enter, 0, func);
+        }
+        if (exit_prog) {
+            bpf_program__set_autoload(exit_prog, used);
+            if (used)
+                bpf_program__set_attach_target(exit_prog, 0, func);
+        }
     }
-    return diff;
+
+    bpf_program__set_autoload(skel->progs.xcap_sys_enter, !use_fentry);
+    bpf_program__set_autoload(skel->progs.xcap_sys_exit, !use_fentry);
+
+    if (use_fentry && g_ctx.output_verbose)
+        printf("Tracking %d syscalls with fentry/fexit\n", nr_filter_syscalls);
 }
 
 // let's go!
@@ -721,6 +1051,8 @@ int main(int argc, char **argv)
     struct iorq_bpf *iorq_skel = NULL;
     struct bpf_program *get_tasks_prog = NULL;
     struct bpf_link *task_iter_link = NULL;
+    struct bpf_link **oncpu_links = NULL;
+    int nr_oncpu_links = 0;
     int completion_fd = -1, task_samples_fd = -1, stack_traces_fd = -1;
 
     int iter_fd = 0;
@@ -743,6 +1075,93 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (nr_filter_syscalls && !track_syscalls) {
+        fprintf(stderr, "Error: --syscalls requires syscall tracking (-t syscall)\n\n");
+        return 1;
+    }
+
+    if (g_ctx.syscall_hist && (!track_syscalls || !g_ctx.output_csv)) {
+        fprintf(stderr, "Error: --syscall-hist requires syscall tracking (-t syscall) and an output directory (-o)\n\n");
+        return 1;
+    }
+
+    if (g_ctx.iorq_hist && (!track_iorq || !g_ctx.output_csv)) {
+        fprintf(stderr, "Error: --iorq-hist requires I/O request tracking (-t iorq) and an output directory (-o)\n\n");
+        return 1;
+    }
+
+    if (g_ctx.hist_interval_sec && !g_ctx.syscall_hist && !g_ctx.iorq_hist) {
+        fprintf(stderr, "Error: --hist-interval requires --syscall-hist or --iorq-hist\n\n");
+        return 1;
+    }
+    if (!g_ctx.hist_interval_sec)
+        g_ctx.hist_interval_sec = LATENCY_HIST_DEFAULT_INTERVAL_SEC;
+
+    // only per-sample rows carry the tgid that loads a process' unwind tables
+    if (g_ctx.aggregate_dims && g_ctx.dwarf_stacks) {
+        fprintf(stderr, "Error: --dwarf-stacks does not work with --aggregate\n\n");
+        return 1;
+    }
+
+    // the perf_event sampler takes user stacks with bpf_get_stack(), which
+    // only follows frame pointers, the DWARF unwinder runs in the task iterator
+    if (oncpu_freq && g_ctx.dwarf_stacks) {
+        fprintf(stderr, "Error: --dwarf-stacks does not work with --oncpu-freq\n\n");
+        return 1;
+    }
+
+    if (g_ctx.output_parquet && !g_ctx.output_csv) {
+        fprintf(stderr, "Error: --format parquet requires an output directory (-o)\n\n");
+        return 1;
+    }
+
+    if (!g_ctx.output_csv && (g_ctx.rotate_minutes || g_ctx.hive_layout || retention_enabled(&g_ctx))) {
+        fprintf(stderr, "Error: --rotate, --max-file-size, --retain-size, --retain-free and --hive require an output directory (-o)\n\n");
+        return 1;
+    }
+
+    if (g_ctx.compress != COMPRESS_NONE && (!g_ctx.output_csv || g_ctx.output_parquet)) {
+        fprintf(stderr, "Error: --compress requires CSV output to a directory (-o), Parquet pages are compressed already\n\n");
+        return 1;
+    }
+    if (g_ctx.compress == COMPRESS_LZ4)
+        fprintf(stderr, "Warning: xtop and DuckDB can't read .csv.lz4 files, decompress them with lz4cat or use --compress zstd\n");
+
+    if (g_ctx.raw_journal && (!g_ctx.output_csv || g_ctx.output_parquet ||
+                              g_ctx.compress != COMPRESS_NONE || g_ctx.aggregate_dims)) {
+        fprintf(stderr, "Error: --raw requires an output directory (-o) and works without --format, --compress and --aggregate,\n"
+                        "       xcapture-decode writes the CSV or Parquet files from the journal later\n\n");
+        return 1;
+    }
+
+    if (g_ctx.defer_symbols && (!g_ctx.output_csv || g_ctx.output_parquet ||
+                                g_ctx.compress != COMPRESS_NONE || g_ctx.raw_journal)) {
+        fprintf(stderr, "Error: --defer-symbols requires CSV output to a directory (-o) without --compress and --raw\n\n");
+        return 1;
+    }
+
+    if ((g_ctx.live_window_min || g_ctx.live_bytes) && !g_ctx.live_socket) {
+        fprintf(stderr, "Error: --live-window and --live-size require --live\n\n");
+        return 1;
+    }
+
+    if (g_ctx.live_socket && (!g_ctx.output_csv || g_ctx.output_parquet || g_ctx.raw_journal)) {
+        fprintf(stderr, "Error: --live requires CSV output to a directory (-o) without --format parquet and --raw\n\n");
+        return 1;
+    }
+    // the selfstats file is opened with the first output files, before the
+    // BPF objects it reports on are loaded
+    g_ctx.selfstats = g_ctx.output_csv;
+
+    if (!g_ctx.live_window_min)
+        g_ctx.live_window_min = LIVE_DEFAULT_WINDOW_MIN;
+    if (!g_ctx.live_bytes)
+        g_ctx.live_bytes = LIVE_DEFAULT_BYTES;
+
+    // CSV output is written by pipeline threads, stdout mode stays synchronous
+    // as its per-iteration output is interleaved with the samples
+    g_ctx.pipelined = g_ctx.output_csv;
+
     // Note: -a and -p can be used together
     // -p selects which processes to examine
     // -a says to show all states (including sleeping) for selected processes
@@ -779,13 +1198,40 @@ int main(int argc, char **argv)
         if (err)
             return err;
 
+        // before the files are opened, they hand it their CSV headers
+        if (g_ctx.live_socket) {
+            err = live_start(&g_ctx);
+            if (err) {
+                fprintf(stderr, "Failed to start --live: %s\n", strerror(-err));
+                return -err;
+            }
+        }
+
         err = check_and_rotate_files(&g_ctx.files, &g_ctx);
         if (err)
             return err;
+
+        if (retention_enabled(&g_ctx)) {
+            err = retention_start(&g_ctx);
+            if (err) {
+                fprintf(stderr, "Failed to start retention thread: %s\n", strerror(-err));
+                return -err;
+            }
+        }
     }
 
-    // Initialize cgroup cache
+    // Initialize cgroup cache, indexed up front when the paths are written out
     cgroup_cache_init();
+    if ((g_ctx.output_csv || g_ctx.print_cgroups) && cgroup_index_init(CGROUP_ROOT) && g_ctx.output_verbose)
+        fprintf(stderr, "Could not index %s, resolving cgroup paths from /proc\n", CGROUP_ROOT);
+
+    if (g_ctx.aggregate_dims) {
+        err = aggregate_init();
+        if (err) {
+            fprintf(stderr, "Failed to allocate aggregation buffers: %s\n", strerror(-err));
+            return -err;
+        }
+    }
 
     signal(SIGINT,  sig_handler);
     signal(SIGTERM, sig_handler);
@@ -842,7 +1288,7 @@ int main(int argc, char **argv)
     // Set configuration via skeleton rodata before loading
     task_skel->rodata->xcap_show_all = show_all;
     task_skel->rodata->xcap_daemon_ports = daemon_ports;
-    task_skel->rodata->xcap_filter_tgid = filter_tgid;
+    SET_FILTER_RODATA(task_skel);
     task_skel->rodata->xcap_dump_kernel_stack_traces = g_ctx.dump_kernel_stack_traces;
     task_skel->rodata->xcap_dump_user_stack_traces = g_ctx.dump_user_stack_traces;
     task_skel->rodata->xcap_xcapture_pid = getpid();
@@ -850,6 +1296,36 @@ int main(int argc, char **argv)
     task_skel->rodata->xcap_dist_trace_https = dist_trace_https;
     task_skel->rodata->xcap_dist_trace_grpc = dist_trace_grpc;
     task_skel->rodata->xcap_capture_cmdline = (!g_ctx.output_csv && column_is_active(COL_CMDLINE));
+    task_skel->rodata->xcap_capture_rw_payloads = (track_syscalls && g_ctx.payload_trace_enabled);
+    task_skel->rodata->xcap_iter_seq_output = iter_stream;
+    task_skel->rodata->xcap_aggregate_dims = g_ctx.aggregate_dims;
+    task_skel->rodata->xcap_dwarf_unwind = g_ctx.dwarf_stacks;
+    task_skel->rodata->xcap_oncpu_sampling = oncpu_freq > 0;
+#ifndef OLD_KERNEL_SUPPORT
+    if (!oncpu_freq)
+        bpf_program__set_autoload(task_skel->progs.sample_oncpu, false);
+#endif
+
+    // Unwind tables take ~8 MB of kernel memory, only allocate them when used
+    if (!g_ctx.dwarf_stacks) {
+        if (bpf_map__set_max_entries(task_skel->maps.unwind_rows, 1) ||
+            bpf_map__set_max_entries(task_skel->maps.unwind_procs, 1)) {
+            err = -1;
+            fprintf(stderr, "Failed to resize unwind table maps\n");
+            goto cleanup;
+        }
+    }
+
+    // Task samples come through the iterator fd in streaming mode, so the task_samples
+    // ringbuf only needs to exist (it's still shared with the other skeletons),
+    // unless the on-CPU sampler writes into it
+    if (iter_stream && !oncpu_freq) {
+        err = bpf_map__set_max_entries(task_skel->maps.task_samples, getpagesize());
+        if (err) {
+            fprintf(stderr, "Failed to resize task_samples ring buffer (err=%d)\n", err);
+            goto cleanup;
+        }
+    }
     
     // Load the BPF program with the configuration
     err = task_bpf__load(task_skel);
@@ -864,6 +1340,15 @@ int main(int argc, char **argv)
         goto cleanup;
     }
     get_tasks_prog = task_skel->progs.get_tasks;
+
+    if (g_ctx.dwarf_stacks) {
+        err = unwind_tables_init(bpf_map__fd(task_skel->maps.unwind_rows),
+                                 bpf_map__fd(task_skel->maps.unwind_procs));
+        if (err) {
+            fprintf(stderr, "Failed to map unwind_rows: %s\n", strerror(errno));
+            goto cleanup;
+        }
+    }
     completion_fd = bpf_map__fd(task_skel->maps.completion_events);
     task_samples_fd = bpf_map__fd(task_skel->maps.task_samples);
     stack_traces_fd = bpf_map__fd(task_skel->maps.stack_traces);
@@ -913,6 +1398,17 @@ int main(int argc, char **argv)
         }
     }
 
+#ifndef OLD_KERNEL_SUPPORT
+    if (oncpu_freq) {
+        nr_oncpu_links = attach_oncpu_sampler(task_skel->progs.sample_oncpu, oncpu_freq, &oncpu_links);
+        if (nr_oncpu_links < 0) {
+            err = nr_oncpu_links;
+            nr_oncpu_links = 0;
+            goto cleanup;
+        }
+    }
+#endif
+
 #ifdef USE_BLAZESYM
     /* Initialize BlazeSym symbolizer if requested */
     if ((g_ctx.dump_kernel_stack_traces || g_ctx.dump_user_stack_traces) && symbolize_stacks) {
@@ -932,6 +1428,12 @@ int main(int argc, char **argv)
                     blaze_err_str(blaze_err_last()));
             fprintf(stderr, "         Stack traces will show raw addresses only\n");
             symbolize_stacks = false;
+        } else {
+            // stacks are symbolized only when first seen in each file period, but
+            // most of their frames have been resolved before
+            g_symcache = symcache_new(g_symbolizer, SYMCACHE_DEFAULT_ENTRIES);
+            if (!g_symcache)
+                symbolize_stacks = false;
         }
     }
 #endif
@@ -939,7 +1441,9 @@ int main(int argc, char **argv)
     /* Only load active tracking probes if requested */
     if (!passive_only) {
         /* Only set up active tracking ring buffer if needed */
-        tracking_rb = ring_buffer__new(completion_fd, handle_tracking_event, &g_ctx, NULL);
+        tracking_rb = ring_buffer__new(completion_fd,
+                                       g_ctx.pipelined ? pipeline_enqueue_tracking : handle_tracking_event,
+                                       &g_ctx, NULL);
         if (!tracking_rb) {
             fprintf(stderr, "Failed to create tracking events ring buffer\n");
             goto cleanup;
@@ -962,6 +1466,9 @@ int main(int argc, char **argv)
             syscall_skel->rodata->xcap_dist_trace_https = dist_trace_https;
             syscall_skel->rodata->xcap_dist_trace_grpc = dist_trace_grpc;
             syscall_skel->rodata->xcap_capture_rw_payloads = (track_syscalls && g_ctx.payload_trace_enabled);
+            syscall_skel->rodata->xcap_syscall_hist = g_ctx.syscall_hist;
+            SET_FILTER_RODATA(syscall_skel);
+            setup_syscall_attach(syscall_skel);
 
             err = syscall_bpf__load(syscall_skel);
             if (err) {
@@ -987,6 +1494,8 @@ int main(int argc, char **argv)
             iorq_skel->rodata->xcap_dist_trace_http = dist_trace_http;
             iorq_skel->rodata->xcap_dist_trace_https = dist_trace_https;
             iorq_skel->rodata->xcap_dist_trace_grpc = dist_trace_grpc;
+            iorq_skel->rodata->xcap_iorq_hist = g_ctx.iorq_hist;
+            SET_FILTER_RODATA(iorq_skel);
 
             err = iorq_bpf__load(iorq_skel);
             if (err) { fprintf(stderr, "Failed to load BPF skeleton: iorq\n"); goto cleanup; }
@@ -995,7 +1504,9 @@ int main(int argc, char **argv)
     }
 
     /* Always set up the passive task sampler ring buffer */
-    task_rb = ring_buffer__new(task_samples_fd, handle_task_event, &g_ctx, NULL);
+    task_rb = ring_buffer__new(task_samples_fd,
+                               g_ctx.pipelined ? pipeline_enqueue_task : handle_task_event,
+                               &g_ctx, NULL);
     if (!task_rb) {
         fprintf(stderr, "Failed to create task samples ring buffer\n");
         goto cleanup;
@@ -1003,13 +1514,53 @@ int main(int argc, char **argv)
     
     /* Set up stack traces ring buffer if stack collection is enabled */
     if (g_ctx.dump_kernel_stack_traces || g_ctx.dump_user_stack_traces) {
-        stack_rb = ring_buffer__new(stack_traces_fd, handle_stack_event, &g_ctx, NULL);
+        stack_rb = ring_buffer__new(stack_traces_fd,
+                                    g_ctx.pipelined ? pipeline_enqueue_stack : handle_stack_event,
+                                    &g_ctx, NULL);
         if (!stack_rb) {
             fprintf(stderr, "Failed to create stack traces ring buffer\n");
             goto cleanup;
         }
     }
 
+    // In CSV mode the ring buffers are drained, formatted and written out by
+    // pipeline threads, this thread just keeps triggering the task iterator
+    if (g_ctx.pipelined) {
+        struct ring_buffer *rbs[] = { task_rb, stack_rb, tracking_rb };
+        err = pipeline_start(&g_ctx, rbs, 3);
+        if (err) {
+            fprintf(stderr, "Failed to start output pipeline: %s\n", strerror(-err));
+            goto cleanup;
+        }
+    }
+
+    // Program run times, drop counters and loop timing go to xcapture_selfstats_*.csv
+    if (g_ctx.output_csv) {
+        err = selfstats_init(bpf_map__fd(task_skel->maps.xcap_drops), g_ctx.output_verbose);
+        if (err) {
+            fprintf(stderr, "Failed to set up self-instrumentation: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        selfstats_add_object(task_skel->obj);
+        if (syscall_skel)
+            selfstats_add_object(syscall_skel->obj);
+        if (iorq_skel)
+            selfstats_add_object(iorq_skel->obj);
+    }
+
+    // Latency histograms go to xcapture_schist/iohist_*.csv every --hist-interval
+    if (g_ctx.syscall_hist || g_ctx.iorq_hist) {
+        err = latency_hist_init(g_ctx.hist_interval_sec);
+        if (!err && g_ctx.syscall_hist)
+            err = latency_hist_add_syscalls(bpf_map__fd(syscall_skel->maps.syscall_hist), g_ctx.syscall_hist);
+        if (!err && g_ctx.iorq_hist)
+            err = latency_hist_add_iorqs(bpf_map__fd(iorq_skel->maps.iorq_hist));
+        if (err) {
+            fprintf(stderr, "Failed to set up latency histograms: %s\n", strerror(-err));
+            goto cleanup;
+        }
+    }
+
 
 
     char timestamp[64];  // human readable timestamp string
@@ -1021,17 +1572,45 @@ int main(int argc, char **argv)
     static struct timespec iter_fd_inner_start_ts;
     static struct timespec iter_fd_inner_end_ts;
 
+    static struct timespec ringbuf_start_ts;
+    static struct timespec ringbuf_end_ts;
+    static struct timespec prev_loop_start_ts;
+
     long target_interval_ns = 1000000000L / sample_freq;
     int iteration_count = 0;
-    
-    // Calculate sample weight in microseconds based on sampling frequency
-    g_ctx.sample_weight_us = 1000000L / sample_freq;
+    static long ticks_total = 0;
+    static long ticks_missed = 0;
+
+    if (oncpu_freq)
+        g_ctx.oncpu_weight_us = 1000000L / oncpu_freq;
+
+    // With --max-cpu the governor may shed stack collection and lower the frequency
+    governor_init(max_cpu_pct, sample_freq, g_ctx.dump_kernel_stack_traces,
+                  g_ctx.dump_user_stack_traces);
+
+    // Wait for the first wall clock aligned tick
+    __u64 tick_ns = next_tick_ns(realtime_ns(), target_interval_ns);
+    sleep_until_ns(tick_ns);
 
     // periodically sample and write task states to ringbuf
     while (!exiting) {
         clock_gettime(CLOCK_MONOTONIC, &loop_start_ts);
+
+        // Weigh the samples by the actual time since the previous sample, so that
+        // late iterations and missed ticks don't skew the totals
+        if (prev_loop_start_ts.tv_sec) {
+            struct timespec since_prev = get_ts_diff(loop_start_ts, prev_loop_start_ts);
+            g_ctx.sample_weight_us = since_prev.tv_sec * 1000000L + since_prev.tv_nsec / 1000L;
+        } else {
+            g_ctx.sample_weight_us = target_interval_ns / 1000L;
+        }
+        prev_loop_start_ts = loop_start_ts;
+        ticks_total++;
+
         clock_gettime(CLOCK_REALTIME, &g_ctx.tcorr.wall_time);
         clock_gettime(CLOCK_MONOTONIC, &g_ctx.tcorr.mono_time);
+        if (g_ctx.pipelined)
+            pipeline_note_iteration(&g_ctx);
 
         struct tm *tm = localtime(&g_ctx.tcorr.wall_time.tv_sec);
         strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", tm);
@@ -1039,10 +1618,26 @@ int main(int argc, char **argv)
 
         // Reset unique stacks for new iteration
         reset_unique_stacks();
+
+        // Rotate at the iteration boundary, so that the new stack epoch is in place
+        // before get_tasks runs and the stacks of this iteration land in the new files
+        if (g_ctx.output_csv) {
+            err = g_ctx.pipelined ? pipeline_rotate_files(&g_ctx) :
+                                    check_and_rotate_files(&g_ctx.files, &g_ctx);
+            if (err) {
+                fprintf(stderr, "Failed to rotate output files\n");
+                goto cleanup;
+            }
+            task_skel->bss->xcap_stack_epoch = g_ctx.files.epoch;
+            latency_hist_tick(&g_ctx.files);
+        }
         
         // Print headers for every sampling iteration in plain text mode
         if (!g_ctx.output_csv) {
-            print_column_headers();
+            if (g_ctx.aggregate_dims)
+                print_aggregate_header();
+            else
+                print_column_headers();
         }
 
         // Trigger the task iterator to collect data - it will send results to the ring buffer
@@ -1056,24 +1651,46 @@ int main(int argc, char **argv)
             goto cleanup;
         }
 
-        // Just trigger the iterator - we're not reading from it directly
-        // This causes the get_tasks BPF program to submit task samples to ring buffer
-        char dummy[4];
         clock_gettime(CLOCK_MONOTONIC, &iter_fd_inner_start_ts);
-        read(iter_fd, dummy, sizeof(dummy)); // this runs the kernel sampling
+        if (iter_stream) {
+            // Read task samples straight from the iterator seq_file until it's exhausted
+            err = consume_task_iter(iter_fd, &g_ctx);
+            if (err < 0) {
+                fprintf(stderr, "Error reading task iterator: %s\n", strerror(-err));
+                goto cleanup;
+            }
+        } else {
+            // Just trigger the iterator - we're not reading from it directly
+            // This causes the get_tasks BPF program to submit task samples to ring buffer
+            char dummy[4];
+            read(iter_fd, dummy, sizeof(dummy)); // this runs the kernel sampling
+        }
         clock_gettime(CLOCK_MONOTONIC, &iter_fd_inner_end_ts);
         close(iter_fd);
         clock_gettime(CLOCK_MONOTONIC, &iter_fd_end_ts);
 
+        clock_gettime(CLOCK_MONOTONIC, &ringbuf_start_ts);
+
+        // In aggregation mode get_tasks only bumped counters, drain them now
+        if (g_ctx.aggregate_dims) {
+            err = drain_task_aggregates(bpf_map__fd(task_skel->maps.task_agg), &g_ctx);
+            if (err < 0) {
+                fprintf(stderr, "Error draining task aggregates: %s\n", strerror(-err));
+                goto cleanup;
+            }
+        }
+
         // Poll the ring buffer for latest task samples
-        err = ring_buffer__poll(task_rb, 0 /* timeout, ms */);
-        if (err < 0) {
-            fprintf(stderr, "Error polling task ring buffer: %d\n", err);
-            goto cleanup;
+        if (!g_ctx.pipelined) {
+            err = ring_buffer__poll(task_rb, 0 /* timeout, ms */);
+            if (err < 0) {
+                fprintf(stderr, "Error polling task ring buffer: %d\n", err);
+                goto cleanup;
+            }
         }
 
         // Poll stack traces ring buffer if stack collection is enabled
-        if (stack_rb) {
+        if (stack_rb && !g_ctx.pipelined) {
             err = ring_buffer__poll(stack_rb, 0 /* timeout, ms */);
             if (err < 0) {
                 fprintf(stderr, "Error polling stack ring buffer: %d\n", err);
@@ -1081,8 +1698,12 @@ int main(int argc, char **argv)
             }
         }
 
+        // Compile unwind tables for processes first seen in this iteration
+        if (g_ctx.dwarf_stacks)
+            unwind_tables_refresh();
+
         // Only poll event completion tracking ring buffer if is set up and used
-        if (!passive_only && tracking_rb) {
+        if (!passive_only && tracking_rb && !g_ctx.pipelined) {
 
             if (!g_ctx.output_csv || g_ctx.output_verbose) {
                 printf("\n");
@@ -1095,6 +1716,8 @@ int main(int argc, char **argv)
             }
         }
 
+        clock_gettime(CLOCK_MONOTONIC, &ringbuf_end_ts);
+
         // Print unique stacks if -s is used
         if (!g_ctx.output_csv && g_ctx.print_stack_traces) {
             print_unique_stacks();
@@ -1105,35 +1728,67 @@ int main(int argc, char **argv)
             printf("Wall clock time: %s\n", timestamp);
         }
 
-        // exact sleep duration depends on how long it took to actively work on this iteration
         clock_gettime(CLOCK_MONOTONIC, &loop_end_ts);
         struct timespec sampling_time = get_ts_diff(loop_end_ts, loop_start_ts);
         long sampling_ns = sampling_time.tv_sec * 1000000000L + sampling_time.tv_nsec;
-        long sleep_ns = target_interval_ns - sampling_ns;
 
         struct timespec iter_fd_time = get_ts_diff(iter_fd_end_ts, iter_fd_start_ts);
         long iter_fd_ns = iter_fd_time.tv_sec * 1000000000L + iter_fd_time.tv_nsec;
         struct timespec iter_fd_inner_time = get_ts_diff(iter_fd_inner_end_ts, iter_fd_inner_start_ts);
         long iter_fd_inner_ns = iter_fd_inner_time.tv_sec * 1000000000L + iter_fd_inner_time.tv_nsec;
+        struct timespec ringbuf_time = get_ts_diff(ringbuf_end_ts, ringbuf_start_ts);
+        long ringbuf_ns = ringbuf_time.tv_sec * 1000000000L + ringbuf_time.tv_nsec;
 
-        // Only sleep if the previous processing hasn't exceeded the requested interval
-        if (!exiting && sleep_ns > 0) {
-            if (!g_ctx.output_csv || g_ctx.output_verbose) {
-                printf("Sampling took:   %'ld us (iter_fd: %'ld us, inner: %'ld us), sleeping for %'ld us\n",
-                        sampling_ns / 1000L, iter_fd_ns / 1000L, iter_fd_inner_ns / 1000L, sleep_ns / 1000L);
-                printf("\n");
+        // A new frequency applies from the next tick on
+        if (governor_update(iter_fd_inner_ns, ringbuf_ns)) {
+            task_skel->bss->xcap_governor_skip = governor_skip_mask();
+            target_interval_ns = 1000000000L / governor_sample_freq();
+        }
+
+        // Sleep until the next tick boundary, any boundaries that already passed
+        // while this iteration was running are skipped and counted as missed
+        __u64 now_ns = realtime_ns();
+        __u64 next_ns = next_tick_ns(now_ns, target_interval_ns);
+        long missed = 0;
+        if (next_ns > tick_ns + target_interval_ns)
+            missed = (next_ns - tick_ns) / target_interval_ns - 1;
+        ticks_missed += missed;
+        ticks_total += missed;
+
+        selfstats_record(SELFSTATS_ITERATION, sampling_ns);
+        if (!g_ctx.pipelined)
+            selfstats_record(SELFSTATS_POLL, ringbuf_ns);
+        if (missed)
+            selfstats_count_missed_ticks(missed);
+
+        if (!g_ctx.output_csv || g_ctx.output_verbose) {
+            if (missed) {
+                printf("Warning: Sampling took longer than the sampling interval (%ld.%06ld s), missed %ld tick%s\n",
+                    sampling_time.tv_sec, sampling_time.tv_nsec / 1000, missed, missed > 1 ? "s" : "");
+            } else {
+                printf("Sampling took:   %'ld us (iter_fd: %'ld us, inner: %'ld us, ringbuf: %'ld us), sleeping for %'ld us\n",
+                        sampling_ns / 1000L, iter_fd_ns / 1000L, iter_fd_inner_ns / 1000L, ringbuf_ns / 1000L,
+                        (long)(next_ns - now_ns) / 1000L);
             }
-            fflush(NULL);
-            usleep(sleep_ns / 1000); // Convert ns to microseconds for usleep
+            printf("\n");
+        }
+        if (g_ctx.pipelined) {
+            // the pipeline workers flush their own files, this thread only writes aggregates
+            if (g_ctx.files.agg_file)
+                fflush(g_ctx.files.agg_file);
+            fflush(stdout);
         } else {
-            if (!g_ctx.output_csv || g_ctx.output_verbose) {
-                printf("Warning: Sampling took longer than display interval (%ld.%06ld s)\n",
-                    sampling_time.tv_sec, sampling_time.tv_nsec / 1000);
-                printf("\n");
-                fflush(NULL);
-            }
+            struct timespec flush_start_ts, flush_end_ts;
+            clock_gettime(CLOCK_MONOTONIC, &flush_start_ts);
+            fflush(NULL);
+            clock_gettime(CLOCK_MONOTONIC, &flush_end_ts);
+            struct timespec flush_time = get_ts_diff(flush_end_ts, flush_start_ts);
+            selfstats_record(SELFSTATS_WRITE, flush_time.tv_sec * 1000000000ULL + flush_time.tv_nsec);
         }
 
+        tick_ns = next_ns;
+        sleep_until_ns(tick_ns);
+
         // Check if we've reached the maximum number of iterations
         if (max_iterations > 0) {
             iteration_count++;
@@ -1147,21 +1802,47 @@ int main(int argc, char **argv)
     }
 
 cleanup:
+    // drain the pipeline before anything else touches its FILE streams
+    if (g_ctx.pipelined)
+        pipeline_stop();
+
     // flush all open file streams and close fds
     fflush(NULL);
+    if (ticks_missed)
+        fprintf(stderr, "xcapture: missed %'ld of %'ld sampling ticks, the samples after them carry the extra weight\n",
+                ticks_missed, ticks_total);
     if (is_fd_open(iter_fd)) close(iter_fd);
+    retention_stop();
+    live_stop();
     if (g_ctx.output_csv) close_output_files(&g_ctx.files);
+    selfstats_destroy();
+    latency_hist_destroy();
+    if (g_ctx.pipelined) {
+        pipeline_destroy();
+        if (g_ctx.output_verbose || pipeline_dropped())
+            pipeline_print_stats(stderr);
+    }
     
+    for (int i = 0; i < nr_oncpu_links; i++)
+        bpf_link__destroy(oncpu_links[i]);
+    free(oncpu_links);
+
     // Clean up cgroup cache
     cgroup_cache_destroy();
+    stack_cache_destroy(g_ctx.output_verbose);
+    aggregate_destroy();
+    unwind_tables_destroy();
 
     // Unpin maps before destroying skeletons
     if (task_skel) {
         unpin_map_if_needed(task_skel->maps.task_storage);
+        unpin_map_if_needed(task_skel->maps.task_payloads);
+        unpin_map_if_needed(task_skel->maps.task_stacks);
         unpin_map_if_needed(task_skel->maps.completion_events);
         unpin_map_if_needed(task_skel->maps.task_samples);
         unpin_map_if_needed(task_skel->maps.emitted_stacks);
         unpin_map_if_needed(task_skel->maps.stack_traces);
+        unpin_map_if_needed(task_skel->maps.xcap_drops);
     }
 
     // cleanup BUG: if iorq_tracking prog failed to load due to verifier
@@ -1179,6 +1860,12 @@ cleanup:
     if (stack_rb)     ring_buffer__free(stack_rb);
 
 #ifdef USE_BLAZESYM
+    if (g_symcache) {
+        if (g_ctx.output_verbose)
+            symcache_print_stats(g_symcache, stderr);
+        symcache_free(g_symcache);
+        g_symcache = NULL;
+    }
     if (g_symbolizer) {
         blaze_symbolizer_free(g_symbolizer);
         g_symbolizer = NULL;
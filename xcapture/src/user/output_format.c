@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#include "xcapture_user.h"
+#include "csv_encoder.h"
+
+// Formatting helpers shared by xcapture and xcapture-decode
+
+const char *format_task_state(__u32 state, int on_rq, int on_cpu, void *migration_pending)
+{
+    static char state_str[64];  // Buffer for state string with flags
+    const char *base_state;
+    
+    // Determine base state string (TODO handle full bitset)
+    switch (state & 0xFF) {
+    case 0x0000: base_state = "RUN"; break;   // RUNNING
+    case 0x0001: base_state = "SLEEP"; break; // INTERRUPTIBLE
+    case 0x0002: base_state = "DISK"; break;  // UNINTERRUPTIBLE
+    case 0x0004: base_state = "STOPPED"; break;
+    case 0x0080: base_state = "DEAD"; break;
+    case 0x0200: base_state = "WAKING"; break;
+    case 0x0400: base_state = "NOLOAD"; break;
+    case 0x0402: base_state = "IDLE"; break;
+    case 0x0800: base_state = "NEW"; break;
+    default:
+        snprintf(state_str, sizeof(state_str), "0x%x", state);
+        base_state = state_str;
+    }
+    
+    // Copy base state to result buffer
+    strncpy(state_str, base_state, sizeof(state_str) - 3);
+    state_str[sizeof(state_str) - 3] = '\0';
+    
+    // Append flags
+    // Q = on runqueue but not on CPU (waiting to run)
+    if (on_rq > 0 && on_cpu == 0) {
+        strcat(state_str, "Q");
+    }
+    if (migration_pending != NULL) {
+        strcat(state_str, "M");
+    }
+    
+    return state_str;
+}
+
+
+// subtract nanoseconds from timespec
+struct timespec sub_ns_from_ts(struct timespec ts, __u64 ns)
+{
+    struct timespec result = ts;
+
+    if (result.tv_nsec < (long)(ns % 1000000000)) {
+        result.tv_sec--;  // Borrow a second
+        result.tv_nsec = result.tv_nsec + 1000000000 - (ns % 1000000000);
+    } else {
+        result.tv_nsec -= (ns % 1000000000);
+    }
+
+    result.tv_sec -= (ns / 1000000000);
+    return result;
+}
+
+void get_str_from_ts(struct timespec ts, char *buf, size_t bufsize) {
+    char tmp[CSV_TS_LEN + 1];
+
+    if (bufsize > CSV_TS_LEN) {
+        csv_format_ts(ts, buf);
+    } else if (bufsize) {
+        csv_format_ts(ts, tmp);
+        memcpy(buf, tmp, bufsize - 1);
+        buf[bufsize - 1] = '\0';
+    }
+}
+
+// get walltime timespec from monotonic clock ns (bpf ktime)
+struct timespec get_wall_from_mono(struct time_correlation *tcorr, __u64 bpf_time)
+{
+    struct timespec result = tcorr->wall_time;
+    __u64 mono_ns = tcorr->mono_time.tv_sec * 1000000000ULL + tcorr->mono_time.tv_nsec;
+    __s64 ns_diff = bpf_time - mono_ns;
+
+    result.tv_nsec += ns_diff % 1000000000;
+    result.tv_sec += ns_diff / 1000000000;
+
+    if (result.tv_nsec >= 1000000000) {
+        result.tv_nsec -= 1000000000;
+        result.tv_sec++;
+    } else if (result.tv_nsec < 0) {
+        result.tv_nsec += 1000000000;
+        result.tv_sec--;
+    }
+
+    return result;
+}
@@ -5,19 +5,95 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <linux/limits.h>
 
 #include "xcapture_user.h"
 #include "xcapture_context.h"
+#include "pipeline.h"
+#include "parquet_writer.h"
+#include "compress.h"
+#include "retention.h"
+#include "journal.h"
+#include "live_store.h"
+#include "selfstats.h"
+#include "latency_hist.h"
 
 static char samplebuf[XCAP_BUFSIZ];
 static char syscbuf[XCAP_BUFSIZ];
 static char iorqbuf[XCAP_BUFSIZ];
 static char kstackbuf[XCAP_BUFSIZ];
 static char ustackbuf[XCAP_BUFSIZ];
+static char aggbuf[XCAP_BUFSIZ];
+static char journalbuf[XCAP_BUFSIZ];
+static char umapsbuf[XCAP_BUFSIZ];
 
-static FILE *open_csv_file(const char *filename, const char *header)
+// Files of one rotation period are named <dir>/<base>_<stamp>.<ext>
+struct file_period {
+    char dir[PATH_MAX];         // output dir, plus date=YYYY-MM-DD/hour=HH with --hive
+    char stamp[32];             // YYYY-MM-DD.HH, .MM with --rotate < 60, .N after size rotations
+};
+
+// what got opened for the current period, handed to the retention thread
+static char opened_paths[RETENTION_MAX_FILES][PATH_MAX];
+static int nr_opened;
+
+static void note_opened(const char *path)
+{
+    if (nr_opened < RETENTION_MAX_FILES)
+        snprintf(opened_paths[nr_opened++], PATH_MAX, "%s", path);
+}
+
+// A compressed file or journal left behind by a crash may end in a partial
+// frame or record, which would make everything appended after it unreadable.
+// Like the Parquet writer, continue in the first free <stem>.N.<ext> instead of
+// appending. filename (a PATH_MAX buffer) is updated to the name actually used
+static int open_exclusive(char *filename, const char *ext)
+{
+    char stem[PATH_MAX];
+
+    snprintf(stem, sizeof(stem), "%.*s", (int)(strlen(filename) - strlen(ext)), filename);
+    for (int n = 1; ; n++) {
+        int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+        snprintf(filename, PATH_MAX, "%s.%d%s", stem, n, ext);
+    }
+}
+
+// In pipelined mode the file is written by its own writer thread through a
+// cookie stream, the header check is done on the fd before wrapping it
+static FILE *open_pipelined_csv_file(char *filename, const char *header,
+                                     enum pipeline_file slot, enum compress_algo compress)
+{
+    int fd = compress != COMPRESS_NONE ? open_exclusive(filename, compress == COMPRESS_ZSTD ? ".csv.zst" : ".csv.lz4") :
+             open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    bool empty = fstat(fd, &st) == 0 && st.st_size == 0;
+
+    FILE *f = pipeline_open_file(slot, fd, compress);
+    if (!f) {
+        fprintf(stderr, "Failed to set up writer for file %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    if (empty && header)
+        fprintf(f, "%s\n", header);
+
+    return f;
+}
+
+// Uncompressed and written with stdio by the calling thread
+static FILE *open_plain_csv_file(char *filename, const char *header)
 {
     FILE *f = fopen(filename, "a");
     if (!f) {
@@ -28,31 +104,237 @@ static FILE *open_csv_file(const char *filename, const char *header)
     if (fseek(f, 0, SEEK_END) == 0 && ftell(f) == 0 && header)
         fprintf(f, "%s\n", header);
 
+    note_opened(filename);
     return f;
 }
 
-static char *get_hourly_filename(char *buf, size_t buf_len,
-                                 const struct xcapture_context *ctx,
+static FILE *open_csv_file(char *filename, const char *header,
+                           const struct xcapture_context *ctx, enum pipeline_file slot)
+{
+    if (ctx->pipelined) {
+        FILE *f = open_pipelined_csv_file(filename, header, slot, ctx->compress);
+        if (f)
+            note_opened(filename);
+        return f;
+    }
+
+    return open_plain_csv_file(filename, header);
+}
+
+static char *get_period_filename(char *buf, size_t buf_len,
+                                 const struct file_period *period,
                                  const char *base_name,
-                                 const struct tm *tm)
-{
-    snprintf(buf, buf_len, "%s/%s_%04d-%02d-%02d.%02d.csv",
-             ctx->output_dirname ? ctx->output_dirname : DEFAULT_OUTPUT_DIR,
-             base_name,
-             tm->tm_year + 1900,
-             tm->tm_mon + 1,
-             tm->tm_mday,
-             tm->tm_hour);
+                                 const char *ext)
+{
+    snprintf(buf, buf_len, "%s/%s_%s.%s", period->dir, base_name, period->stamp, ext);
     return buf;
 }
 
-static int create_output_files(struct output_files *files,
-                               const struct tm *tm,
-                               const struct xcapture_context *ctx)
+// Period start for --rotate, minutes are counted from the top of the hour
+static int period_minute(const struct tm *tm, const struct xcapture_context *ctx)
+{
+    int len = ctx->rotate_minutes > 0 && ctx->rotate_minutes < 60 ? ctx->rotate_minutes : 60;
+    return tm->tm_min - tm->tm_min % len;
+}
+
+static int init_file_period(struct file_period *period, const struct tm *tm,
+                            const struct xcapture_context *ctx, int part)
+{
+    const char *dir = ctx->output_dirname ? ctx->output_dirname : DEFAULT_OUTPUT_DIR;
+    char date[16];
+    int n;
+
+    snprintf(date, sizeof(date), "%04d-%02d-%02d", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
+
+    n = snprintf(period->stamp, sizeof(period->stamp), "%s.%02d", date, tm->tm_hour);
+    if (ctx->rotate_minutes > 0 && ctx->rotate_minutes < 60)
+        n += snprintf(period->stamp + n, sizeof(period->stamp) - n, ".%02d", period_minute(tm, ctx));
+    if (part)
+        snprintf(period->stamp + n, sizeof(period->stamp) - n, ".%d", part);
+
+    if (!ctx->hive_layout) {
+        snprintf(period->dir, sizeof(period->dir), "%s", dir);
+        return 0;
+    }
+
+    // partition directories for query engines that prune on date=/hour=
+    snprintf(period->dir, sizeof(period->dir), "%s/date=%s", dir, date);
+    if (mkdir(period->dir, 0750) && errno != EEXIST)
+        goto fail;
+    n = strlen(period->dir);
+    snprintf(period->dir + n, sizeof(period->dir) - n, "/hour=%02d", tm->tm_hour);
+    if (mkdir(period->dir, 0750) && errno != EEXIST)
+        goto fail;
+
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to create directory %s: %s\n", period->dir, strerror(errno));
+    return -1;
+}
+
+// Parquet schemas, column names and order match the CSV headers so that xtop
+// can UNION ALL parquet and CSV hours. Strings are stored without the CSV quotes
+static const struct pq_column_def sample_columns[] = {
+    { "TIMESTAMP",          PQ_TIMESTAMP, 0 },
+    { "WEIGHT_US",          PQ_INT64,     0 },
+    { "TID",                PQ_INT64,     0 },
+    { "TGID",               PQ_INT64,     0 },
+    { "PIDNS",              PQ_INT64,     0 },
+    { "CGROUP_ID",          PQ_INT64,     0 },
+    { "STATE",              PQ_STRING,    PQ_DICT },
+    { "USERNAME",           PQ_STRING,    PQ_DICT },
+    { "EXE",                PQ_STRING,    PQ_DICT },
+    { "COMM",               PQ_STRING,    PQ_DICT },
+    { "SYSCALL",            PQ_STRING,    PQ_DICT },
+    { "SYSCALL_ACTIVE",     PQ_STRING,    PQ_DICT },
+    { "SYSC_ENTRY_TIME",    PQ_TIMESTAMP, PQ_OPTIONAL },
+    { "SYSC_NS_SO_FAR",     PQ_INT64,     0 },
+    { "SYSC_SEQ_NUM",       PQ_INT64,     0 },
+    { "IORQ_SEQ_NUM",       PQ_INT64,     0 },
+    { "SYSC_ARG1",          PQ_STRING,    0 },
+    { "SYSC_ARG2",          PQ_STRING,    0 },
+    { "SYSC_ARG3",          PQ_STRING,    0 },
+    { "SYSC_ARG4",          PQ_STRING,    0 },
+    { "SYSC_ARG5",          PQ_STRING,    0 },
+    { "SYSC_ARG6",          PQ_STRING,    0 },
+    { "FILENAME",           PQ_STRING,    PQ_DICT },
+    { "CONNECTION",         PQ_STRING,    PQ_DICT },
+    { "CONN_STATE",         PQ_STRING,    PQ_DICT },
+    { "EXTRA_INFO",         PQ_STRING,    PQ_DICT },
+    { "KSTACK_HASH",        PQ_STRING,    PQ_DICT },
+    { "USTACK_HASH",        PQ_STRING,    PQ_DICT },
+    // -Y only
+    { "TRACE_PAYLOAD",      PQ_STRING,    0 },
+    { "TRACE_PAYLOAD_LEN",  PQ_INT64,     0 },
+};
+
+static const struct pq_column_def sysc_columns[] = {
+    { "TYPE",               PQ_STRING,    PQ_DICT },
+    { "TID",                PQ_INT64,     0 },
+    { "TGID",               PQ_INT64,     0 },
+    { "SYSCALL_NAME",       PQ_STRING,    PQ_DICT },
+    { "DURATION_NS",        PQ_INT64,     0 },
+    { "SYSC_RET_VAL",       PQ_INT64,     0 },
+    { "SYSC_SEQ_NUM",       PQ_INT64,     0 },
+    { "SYSC_ENTER_TIME",    PQ_TIMESTAMP, 0 },
+    // -Y only
+    { "TRACE_PAYLOAD",      PQ_STRING,    0 },
+    { "TRACE_PAYLOAD_LEN",  PQ_INT64,     0 },
+    { "TRACE_PAYLOAD_SYS",  PQ_INT64,     0 },
+    { "TRACE_PAYLOAD_SEQ",  PQ_INT64,     0 },
+};
+
+static const struct pq_column_def iorq_columns[] = {
+    { "TYPE",               PQ_STRING,    PQ_DICT },
+    { "INSERT_TID",         PQ_INT64,     0 },
+    { "INSERT_TGID",        PQ_INT64,     0 },
+    { "ISSUE_TID",          PQ_INT64,     0 },
+    { "ISSUE_TGID",         PQ_INT64,     0 },
+    { "COMPLETE_TID",       PQ_INT64,     0 },
+    { "COMPLETE_TGID",      PQ_INT64,     0 },
+    { "DEV_MAJ",            PQ_INT64,     0 },
+    { "DEV_MIN",            PQ_INT64,     0 },
+    { "SECTOR",             PQ_INT64,     0 },
+    { "BYTES",              PQ_INT64,     0 },
+    { "IORQ_FLAGS",         PQ_STRING,    PQ_DICT },
+    { "IORQ_SEQ_NUM",       PQ_INT64,     0 },
+    { "DURATION_NS",        PQ_INT64,     0 },
+    { "SERVICE_NS",         PQ_INT64,     0 },
+    { "QUEUED_NS",          PQ_INT64,     0 },
+    { "ISSUE_TIMESTAMP",    PQ_TIMESTAMP, 0 },
+    { "ERROR",              PQ_INT64,     0 },
+};
+
+static const struct pq_column_def kstack_columns[] = {
+    { "KSTACK_HASH",        PQ_STRING,    0 },
+    { "KSTACK_SYMS",        PQ_STRING,    0 },
+};
+
+static const struct pq_column_def ustack_columns[] = {
+    { "USTACK_HASH",        PQ_STRING,    0 },
+    { "USTACK_SYMS",        PQ_STRING,    0 },
+};
+
+static const struct pq_column_def cgroup_columns[] = {
+    { "CGROUP_ID",          PQ_INT64,     0 },
+    { "CGROUP_PATH",        PQ_STRING,    0 },
+};
+
+#define PQ_PAYLOAD_SAMPLE_COLUMNS 2
+#define PQ_PAYLOAD_SYSC_COLUMNS   4
+#define ARRAY_LEN(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static struct pq_writer *open_parquet_file(const char *filename, const struct pq_column_def *cols, int nr_cols)
+{
+    struct pq_writer *pq = pq_open(filename, cols, nr_cols);
+    if (!pq)
+        fprintf(stderr, "Failed to open file %s.tmp: %s\n", filename, strerror(errno));
+    else
+        note_opened(filename);
+
+    return pq;
+}
+
+static int open_parquet_files(struct output_files *files,
+                              const struct file_period *period,
+                              const struct xcapture_context *ctx)
 {
     char path[PATH_MAX];
 
-    close_output_files(files);
+    if (!ctx->aggregate_dims) {
+        files->sample_pq = open_parquet_file(
+            get_period_filename(path, sizeof(path), period, SAMPLE_CSV_FILENAME, "parquet"),
+            sample_columns,
+            ARRAY_LEN(sample_columns) - (ctx->payload_trace_enabled ? 0 : PQ_PAYLOAD_SAMPLE_COLUMNS));
+        if (!files->sample_pq)
+            return -1;
+    }
+
+    files->sc_completion_pq = open_parquet_file(
+        get_period_filename(path, sizeof(path), period, SYSC_COMPLETION_CSV_FILENAME, "parquet"),
+        sysc_columns,
+        ARRAY_LEN(sysc_columns) - (ctx->payload_trace_enabled ? 0 : PQ_PAYLOAD_SYSC_COLUMNS));
+    if (!files->sc_completion_pq)
+        return -1;
+
+    files->iorq_completion_pq = open_parquet_file(
+        get_period_filename(path, sizeof(path), period, IORQ_COMPLETION_CSV_FILENAME, "parquet"),
+        iorq_columns, ARRAY_LEN(iorq_columns));
+    if (!files->iorq_completion_pq)
+        return -1;
+
+    if (ctx->dump_kernel_stack_traces) {
+        files->kstack_pq = open_parquet_file(
+            get_period_filename(path, sizeof(path), period, KSTACK_CSV_FILENAME, "parquet"),
+            kstack_columns, ARRAY_LEN(kstack_columns));
+        if (!files->kstack_pq)
+            return -1;
+    }
+
+    if (ctx->dump_user_stack_traces) {
+        files->ustack_pq = open_parquet_file(
+            get_period_filename(path, sizeof(path), period, USTACK_CSV_FILENAME, "parquet"),
+            ustack_columns, ARRAY_LEN(ustack_columns));
+        if (!files->ustack_pq)
+            return -1;
+    }
+
+    files->cgroup_pq = open_parquet_file(
+        get_period_filename(path, sizeof(path), period, "xcapture_cgroups", "parquet"),
+        cgroup_columns, ARRAY_LEN(cgroup_columns));
+    if (!files->cgroup_pq)
+        return -1;
+
+    return 0;
+}
+
+static int open_csv_files(struct output_files *files,
+                          const struct file_period *period,
+                          const struct xcapture_context *ctx,
+                          const char *csv_ext)
+{
+    char path[PATH_MAX];
 
     const char *sample_header = ctx->payload_trace_enabled ?
         "TIMESTAMP,WEIGHT_US,TID,TGID,PIDNS,CGROUP_ID,STATE,USERNAME,EXE,COMM,SYSCALL,SYSCALL_ACTIVE,"
@@ -65,12 +347,16 @@ static int create_output_files(struct output_files *files,
         "SYSC_ARG1,SYSC_ARG2,SYSC_ARG3,SYSC_ARG4,SYSC_ARG5,SYSC_ARG6,"
         "FILENAME,CONNECTION,CONN_STATE,EXTRA_INFO,KSTACK_HASH,USTACK_HASH";
 
-    files->sample_file = open_csv_file(
-        get_hourly_filename(path, sizeof(path), ctx, SAMPLE_CSV_FILENAME, tm),
-        sample_header);
-    if (!files->sample_file)
-        return -1;
-    setbuffer(files->sample_file, samplebuf, XCAP_BUFSIZ);
+    if (!ctx->aggregate_dims) {
+        files->sample_file = open_csv_file(
+            get_period_filename(path, sizeof(path), period, SAMPLE_CSV_FILENAME, csv_ext),
+            sample_header,
+            ctx, PIPE_FILE_SAMPLE);
+        if (!files->sample_file)
+            return -1;
+        setbuffer(files->sample_file, samplebuf, XCAP_BUFSIZ);
+        live_set_header(LIVE_SAMPLES, sample_header);
+    }
 
     const char *sysc_header = ctx->payload_trace_enabled ?
         "TYPE,TID,TGID,SYSCALL_NAME,DURATION_NS,SYSC_RET_VAL,SYSC_SEQ_NUM,SYSC_ENTER_TIME,TRACE_PAYLOAD,TRACE_PAYLOAD_LEN,TRACE_PAYLOAD_SYS,TRACE_PAYLOAD_SEQ"
@@ -78,49 +364,199 @@ static int create_output_files(struct output_files *files,
         "TYPE,TID,TGID,SYSCALL_NAME,DURATION_NS,SYSC_RET_VAL,SYSC_SEQ_NUM,SYSC_ENTER_TIME";
 
     files->sc_completion_file = open_csv_file(
-        get_hourly_filename(path, sizeof(path), ctx, SYSC_COMPLETION_CSV_FILENAME, tm),
-        sysc_header);
+        get_period_filename(path, sizeof(path), period, SYSC_COMPLETION_CSV_FILENAME, csv_ext),
+        sysc_header,
+        ctx, PIPE_FILE_SYSC);
     if (!files->sc_completion_file)
-        goto fail;
+        return -1;
     setbuffer(files->sc_completion_file, syscbuf, XCAP_BUFSIZ);
+    live_set_header(LIVE_SYSCEND, sysc_header);
 
-    files->iorq_completion_file = open_csv_file(
-        get_hourly_filename(path, sizeof(path), ctx, IORQ_COMPLETION_CSV_FILENAME, tm),
+    const char *iorq_header =
         "TYPE,INSERT_TID,INSERT_TGID,ISSUE_TID,ISSUE_TGID,COMPLETE_TID,COMPLETE_TGID,"
         "DEV_MAJ,DEV_MIN,SECTOR,BYTES,IORQ_FLAGS,IORQ_SEQ_NUM,"
-        "DURATION_NS,SERVICE_NS,QUEUED_NS,ISSUE_TIMESTAMP,ERROR");
+        "DURATION_NS,SERVICE_NS,QUEUED_NS,ISSUE_TIMESTAMP,ERROR";
+
+    files->iorq_completion_file = open_csv_file(
+        get_period_filename(path, sizeof(path), period, IORQ_COMPLETION_CSV_FILENAME, csv_ext),
+        iorq_header,
+        ctx, PIPE_FILE_IORQ);
     if (!files->iorq_completion_file)
-        goto fail;
+        return -1;
     setbuffer(files->iorq_completion_file, iorqbuf, XCAP_BUFSIZ);
+    live_set_header(LIVE_IORQEND, iorq_header);
 
     if (ctx->dump_kernel_stack_traces) {
         files->kstack_file = open_csv_file(
-            get_hourly_filename(path, sizeof(path), ctx, KSTACK_CSV_FILENAME, tm),
-            "KSTACK_HASH,KSTACK_SYMS");
+            get_period_filename(path, sizeof(path), period, KSTACK_CSV_FILENAME, csv_ext),
+            "KSTACK_HASH,KSTACK_SYMS",
+            ctx, PIPE_FILE_KSTACK);
         if (!files->kstack_file)
-            goto fail;
+            return -1;
         setbuffer(files->kstack_file, kstackbuf, XCAP_BUFSIZ);
+        live_set_header(LIVE_KSTACKS, "KSTACK_HASH,KSTACK_SYMS");
     }
 
-    if (ctx->dump_user_stack_traces) {
+    if (ctx->dump_user_stack_traces && ctx->defer_symbols) {
+        // xcapture-symbolize turns these into the ustacks file later
+        files->uaddrs_file = open_csv_file(
+            get_period_filename(path, sizeof(path), period, UADDRS_CSV_FILENAME, csv_ext),
+            "USTACK_HASH,MAPS_ID,USTACK_ADDRS",
+            ctx, PIPE_FILE_UADDRS);
+        if (!files->uaddrs_file)
+            return -1;
+        setbuffer(files->uaddrs_file, ustackbuf, XCAP_BUFSIZ);
+
+        files->umaps_file = open_csv_file(
+            get_period_filename(path, sizeof(path), period, UMAPS_CSV_FILENAME, csv_ext),
+            "MAPS_ID,START,END,FILE_OFFSET,BUILD_ID,PATH",
+            ctx, PIPE_FILE_UMAPS);
+        if (!files->umaps_file)
+            return -1;
+        setbuffer(files->umaps_file, umapsbuf, XCAP_BUFSIZ);
+    } else if (ctx->dump_user_stack_traces) {
         files->ustack_file = open_csv_file(
-            get_hourly_filename(path, sizeof(path), ctx, USTACK_CSV_FILENAME, tm),
-            "USTACK_HASH,USTACK_SYMS");
+            get_period_filename(path, sizeof(path), period, USTACK_CSV_FILENAME, csv_ext),
+            "USTACK_HASH,USTACK_SYMS",
+            ctx, PIPE_FILE_USTACK);
         if (!files->ustack_file)
-            goto fail;
+            return -1;
         setbuffer(files->ustack_file, ustackbuf, XCAP_BUFSIZ);
+        live_set_header(LIVE_USTACKS, "USTACK_HASH,USTACK_SYMS");
     }
 
     files->cgroup_file = open_csv_file(
-        get_hourly_filename(path, sizeof(path), ctx, "xcapture_cgroups", tm),
-        "CGROUP_ID,CGROUP_PATH");
+        get_period_filename(path, sizeof(path), period, "xcapture_cgroups", csv_ext),
+        "CGROUP_ID,CGROUP_PATH",
+        ctx, PIPE_FILE_CGROUP);
     if (!files->cgroup_file)
+        return -1;
+    live_set_header(LIVE_CGROUPS, "CGROUP_ID,CGROUP_PATH");
+
+    return 0;
+}
+
+// --raw: one journal segment per period, written by the pipeline like the CSV
+// files but never appended to
+static int open_journal_file(struct output_files *files,
+                             const struct file_period *period,
+                             const struct xcapture_context *ctx)
+{
+    char path[PATH_MAX];
+
+    get_period_filename(path, sizeof(path), period, JOURNAL_FILENAME, JOURNAL_EXT);
+
+    int fd = open_exclusive(path, "." JOURNAL_EXT);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    files->journal_file = pipeline_open_file(PIPE_FILE_JOURNAL, fd, COMPRESS_NONE);
+    if (!files->journal_file) {
+        fprintf(stderr, "Failed to set up writer for file %s\n", path);
+        close(fd);
+        return -1;
+    }
+    setbuffer(files->journal_file, journalbuf, XCAP_BUFSIZ);
+    note_opened(path);
+
+    return journal_write_header(files->journal_file, ctx);
+}
+
+static bool period_changed(const struct output_files *files, const struct tm *tm,
+                           const struct xcapture_context *ctx)
+{
+    return tm->tm_year != files->current_year  ||
+           tm->tm_mon  != files->current_month ||
+           tm->tm_mday != files->current_day   ||
+           tm->tm_hour != files->current_hour  ||
+           period_minute(tm, ctx) != files->current_minute;
+}
+
+static bool files_open(const struct output_files *files)
+{
+    return files->sample_file || files->agg_file || files->sc_completion_file || files->iorq_completion_file ||
+           files->sample_pq || files->sc_completion_pq || files->journal_file;
+}
+
+static int create_output_files(struct output_files *files,
+                               const struct tm *tm,
+                               const struct xcapture_context *ctx)
+{
+    struct file_period period;
+    char path[PATH_MAX];
+    char csv_ext[16];
+    int err;
+
+    // a rotation within the period is a --max-file-size one, continue in the next part
+    int part = files_open(files) && !period_changed(files, tm, ctx) ? files->part + 1 : 0;
+
+    snprintf(csv_ext, sizeof(csv_ext), "csv%s", compress_suffix(ctx->compress));
+
+    close_output_files(files);
+    files->epoch++;
+    nr_opened = 0;
+
+    if (init_file_period(&period, tm, ctx, part))
+        return -1;
+
+    // aggregation mode replaces per-sample rows with per-dimension counts
+    if (ctx->aggregate_dims) {
+        files->agg_file = open_csv_file(
+            get_period_filename(path, sizeof(path), &period, AGGREGATE_CSV_FILENAME, csv_ext),
+            "TIMESTAMP,SAMPLES,WEIGHT_US,STATE,USERNAME,EXE,COMM,TGID,SYSCALL,CGROUP_ID,KSTACK_HASH,USTACK_HASH",
+            ctx, PIPE_FILE_AGG);
+        if (!files->agg_file)
+            return -1;
+        setbuffer(files->agg_file, aggbuf, XCAP_BUFSIZ);
+    }
+
+    // always plain CSV, a few dozen rows per period
+    if (ctx->selfstats) {
+        files->selfstats_file = open_plain_csv_file(
+            get_period_filename(path, sizeof(path), &period, SELFSTATS_CSV_FILENAME, "csv"),
+            SELFSTATS_CSV_HEADER);
+        if (!files->selfstats_file)
+            goto fail;
+    }
+
+    // plain CSV as well, written by this thread every --hist-interval
+    if (ctx->syscall_hist) {
+        files->schist_file = open_plain_csv_file(
+            get_period_filename(path, sizeof(path), &period, SCHIST_CSV_FILENAME, "csv"),
+            SCHIST_CSV_HEADER);
+        if (!files->schist_file)
+            goto fail;
+    }
+    if (ctx->iorq_hist) {
+        files->iohist_file = open_plain_csv_file(
+            get_period_filename(path, sizeof(path), &period, IOHIST_CSV_FILENAME, "csv"),
+            IOHIST_CSV_HEADER);
+        if (!files->iohist_file)
+            goto fail;
+    }
+
+    if (ctx->raw_journal)
+        err = open_journal_file(files, &period, ctx);
+    else if (ctx->output_parquet)
+        err = open_parquet_files(files, &period, ctx);
+    else
+        err = open_csv_files(files, &period, ctx, csv_ext);
+    if (err < 0)
         goto fail;
 
     files->current_year = tm->tm_year;
     files->current_month = tm->tm_mon;
     files->current_day = tm->tm_mday;
     files->current_hour = tm->tm_hour;
+    files->current_minute = period_minute(tm, ctx);
+    files->part = part;
+
+    const char *paths[RETENTION_MAX_FILES];
+    for (int i = 0; i < nr_opened; i++)
+        paths[i] = opened_paths[i];
+    retention_set_current(paths, nr_opened);
 
     return 0;
 
@@ -129,6 +565,17 @@ fail:
     return -1;
 }
 
+// Writes the row group still buffered and the footer, then renames the file
+// from .tmp to its final name
+static void close_parquet_file(struct pq_writer **pq, const char *what)
+{
+    int err = pq_close(*pq);
+
+    if (err)
+        fprintf(stderr, "Failed to write %s parquet file: %s\n", what, strerror(-err));
+    *pq = NULL;
+}
+
 void close_output_files(struct output_files *files)
 {
     if (!files)
@@ -164,6 +611,68 @@ void close_output_files(struct output_files *files)
         fclose(files->cgroup_file);
         files->cgroup_file = NULL;
     }
+    if (files->agg_file) {
+        fflush(files->agg_file);
+        fclose(files->agg_file);
+        files->agg_file = NULL;
+    }
+    if (files->journal_file) {
+        fflush(files->journal_file);
+        fclose(files->journal_file);
+        files->journal_file = NULL;
+    }
+    if (files->uaddrs_file) {
+        fflush(files->uaddrs_file);
+        fclose(files->uaddrs_file);
+        files->uaddrs_file = NULL;
+    }
+    if (files->umaps_file) {
+        fflush(files->umaps_file);
+        fclose(files->umaps_file);
+        files->umaps_file = NULL;
+    }
+    if (files->selfstats_file) {
+        // the rows cover the period that ends here
+        selfstats_write(files->selfstats_file);
+        fclose(files->selfstats_file);
+        files->selfstats_file = NULL;
+    }
+    if (files->schist_file) {
+        latency_hist_write_syscalls(files->schist_file);
+        fclose(files->schist_file);
+        files->schist_file = NULL;
+    }
+    if (files->iohist_file) {
+        latency_hist_write_iorqs(files->iohist_file);
+        fclose(files->iohist_file);
+        files->iohist_file = NULL;
+    }
+    if (files->sample_pq)
+        close_parquet_file(&files->sample_pq, "samples");
+    if (files->sc_completion_pq)
+        close_parquet_file(&files->sc_completion_pq, "syscend");
+    if (files->iorq_completion_pq)
+        close_parquet_file(&files->iorq_completion_pq, "iorqend");
+    if (files->kstack_pq)
+        close_parquet_file(&files->kstack_pq, "kstacks");
+    if (files->ustack_pq)
+        close_parquet_file(&files->ustack_pq, "ustacks");
+    if (files->cgroup_pq)
+        close_parquet_file(&files->cgroup_pq, "cgroups");
+}
+
+static bool rotation_due(const struct output_files *files, const struct tm *tm,
+                         const struct xcapture_context *ctx)
+{
+    return period_changed(files, tm, ctx) || !files_open(files) || retention_size_rotation_due();
+}
+
+bool output_files_rotation_due(const struct output_files *files, const struct xcapture_context *ctx)
+{
+    time_t now = time(NULL);
+    struct tm *current_tm = localtime(&now);
+
+    return current_tm && rotation_due(files, current_tm, ctx);
 }
 
 int check_and_rotate_files(struct output_files *files, const struct xcapture_context *ctx)
@@ -174,13 +683,18 @@ int check_and_rotate_files(struct output_files *files, const struct xcapture_con
     if (!current_tm)
         return -1;
 
-    if (current_tm->tm_year != files->current_year  ||
-        current_tm->tm_mon  != files->current_month ||
-        current_tm->tm_mday != files->current_day   ||
-        current_tm->tm_hour != files->current_hour)
-        return create_output_files(files, current_tm, ctx);
+    return rotation_due(files, current_tm, ctx) ? create_output_files(files, current_tm, ctx) : 0;
+}
+
+// xcapture-decode starts new output files for every journal segment, named
+// after the period the segment was written in. The caller sets TZ to the
+// capture host's zone first
+int open_output_files_at(struct output_files *files, const struct xcapture_context *ctx, time_t when)
+{
+    struct tm tm;
+
+    if (!localtime_r(&when, &tm))
+        return -1;
 
-    return (files->sample_file || files->sc_completion_file || files->iorq_completion_file)
-        ? 0
-        : create_output_files(files, current_tm, ctx);
+    return create_output_files(files, &tm, ctx);
 }
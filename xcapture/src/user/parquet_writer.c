@@ -0,0 +1,850 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "parquet_writer.h"
+
+// Minimal Parquet writer for the hourly output files (--format parquet).
+//
+// Rows are buffered column by column and written out as one row group once
+// PQ_ROW_GROUP_ROWS rows or PQ_ROW_GROUP_BYTES bytes have accumulated. Each
+// column chunk is a single v1 data page, preceded by a dictionary page for
+// PQ_DICT columns, and pages are zstd compressed when built with USE_ZSTD.
+// Only flat schemas of required/optional INT64 and BYTE_ARRAY columns are
+// supported, that's all the xcapture files need. Page headers and the footer
+// are Thrift compact protocol, encoded by hand (see parquet.thrift).
+//
+// The file is written as <path>.tmp and renamed to <path> after the footer is
+// written, so readers never pick up a file without one. If <path> already
+// exists (xcapture restarted within the hour) the file becomes <stem>.N.parquet.
+// Until then nothing of the file is readable, a crash loses the whole period
+
+#define PQ_ROW_GROUP_ROWS   (128 * 1024)
+#define PQ_ROW_GROUP_BYTES  (32 * 1024 * 1024)
+#define PQ_ZSTD_LEVEL       3
+#define PQ_MAGIC            "PAR1"
+
+// parquet.thrift enum values
+#define PQ_T_INT64              2
+#define PQ_T_BYTE_ARRAY         6
+#define PQ_REP_REQUIRED         0
+#define PQ_REP_OPTIONAL         1
+#define PQ_CONV_UTF8            0
+#define PQ_ENC_PLAIN            0
+#define PQ_ENC_RLE              3
+#define PQ_ENC_RLE_DICTIONARY   8
+#define PQ_CODEC_UNCOMPRESSED   0
+#define PQ_CODEC_ZSTD           6
+#define PQ_PAGE_DATA            0
+#define PQ_PAGE_DICTIONARY      2
+
+// Thrift compact protocol field types
+#define TC_TRUE     1
+#define TC_FALSE    2
+#define TC_I32      5
+#define TC_I64      6
+#define TC_BINARY   8
+#define TC_LIST     9
+#define TC_STRUCT   12
+
+#ifdef USE_ZSTD
+#define PQ_CODEC PQ_CODEC_ZSTD
+#else
+#define PQ_CODEC PQ_CODEC_UNCOMPRESSED
+#endif
+
+struct pq_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct pq_col {
+    struct pq_column_def def;
+    struct pq_buf values;       // PLAIN encoded values, the dictionary for PQ_DICT columns
+    struct pq_buf indices;      // __u32 dictionary index per non-null value
+    struct pq_buf deflevels;    // one byte per row for PQ_OPTIONAL columns, 1 = not null
+    __u32 *dict_slots;          // open addressing hash table of dictionary index + 1
+    __u32 *dict_offs;           // offset of each dictionary entry in values
+    __u32 dict_cap;
+    __u32 dict_count;
+    __u64 nr_nulls;
+    __s64 min, max;             // statistics for INT64 and TIMESTAMP columns
+};
+
+// what the footer needs to know about every column chunk written
+struct pq_chunk {
+    __s64 dict_page_offset;     // -1 without a dictionary page
+    __s64 data_page_offset;
+    __s64 num_values;
+    __s64 uncompressed_size;
+    __s64 compressed_size;
+    __s64 nr_nulls;
+    __s64 min, max;
+    bool has_minmax;
+};
+
+struct pq_row_group {
+    __s64 num_rows;
+    __s64 total_byte_size;
+};
+
+struct pq_writer {
+    FILE *f;
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    int nr_cols;
+    struct pq_col *cols;
+    int cur;                    // next column of the row being added
+    __u64 rows;                 // rows buffered for the current row group
+    __u64 total_rows;
+    size_t buffered_bytes;
+    __s64 offset;               // file offset of the next write
+    int err;
+
+    struct pq_chunk *chunks;    // nr_cols per row group written
+    struct pq_row_group *row_groups;
+    int nr_row_groups;
+    int row_groups_cap;
+
+    struct pq_buf page;         // scratch buffers for page assembly
+    struct pq_buf hdr;
+#ifdef USE_ZSTD
+    struct pq_buf zbuf;
+    ZSTD_CCtx *zctx;
+#endif
+
+    time_t tz_sec;              // localtime offset cache for pq_put_ts
+    long tz_off;
+};
+
+static int buf_reserve(struct pq_buf *b, size_t extra)
+{
+    if (b->len + extra <= b->cap)
+        return 0;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra)
+        cap *= 2;
+
+    unsigned char *data = realloc(b->data, cap);
+    if (!data)
+        return -ENOMEM;
+
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static void buf_put(struct pq_writer *w, struct pq_buf *b, const void *src, size_t len)
+{
+    if (w->err)
+        return;
+
+    if (buf_reserve(b, len)) {
+        w->err = -ENOMEM;
+        return;
+    }
+
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+}
+
+static void buf_byte(struct pq_writer *w, struct pq_buf *b, unsigned char c)
+{
+    buf_put(w, b, &c, 1);
+}
+
+static void buf_le32(struct pq_writer *w, struct pq_buf *b, __u32 v)
+{
+    unsigned char le[4] = { v, v >> 8, v >> 16, v >> 24 };
+    buf_put(w, b, le, sizeof(le));
+}
+
+static void buf_le64(struct pq_writer *w, struct pq_buf *b, __u64 v)
+{
+    unsigned char le[8];
+    for (int i = 0; i < 8; i++)
+        le[i] = v >> (8 * i);
+    buf_put(w, b, le, sizeof(le));
+}
+
+static void buf_uvarint(struct pq_writer *w, struct pq_buf *b, __u64 v)
+{
+    unsigned char tmp[10];
+    int n = 0;
+
+    while (v >= 0x80) {
+        tmp[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    tmp[n++] = v;
+    buf_put(w, b, tmp, n);
+}
+
+// Thrift compact protocol, every struct level tracks its own last field id
+
+static void tc_field(struct pq_writer *w, struct pq_buf *b, int *last, int id, int type)
+{
+    int delta = id - *last;
+
+    if (delta > 0 && delta <= 15) {
+        buf_byte(w, b, (delta << 4) | type);
+    } else {
+        buf_byte(w, b, type);
+        buf_uvarint(w, b, ((__u32)id << 1) ^ (__u32)(id >> 15));
+    }
+    *last = id;
+}
+
+static void tc_varint(struct pq_writer *w, struct pq_buf *b, __s64 v)
+{
+    buf_uvarint(w, b, ((__u64)v << 1) ^ (__u64)(v >> 63));
+}
+
+static void tc_i32(struct pq_writer *w, struct pq_buf *b, int *last, int id, __s32 v)
+{
+    tc_field(w, b, last, id, TC_I32);
+    tc_varint(w, b, v);
+}
+
+static void tc_i64(struct pq_writer *w, struct pq_buf *b, int *last, int id, __s64 v)
+{
+    tc_field(w, b, last, id, TC_I64);
+    tc_varint(w, b, v);
+}
+
+static void tc_bytes(struct pq_writer *w, struct pq_buf *b, const void *data, size_t len)
+{
+    buf_uvarint(w, b, len);
+    buf_put(w, b, data, len);
+}
+
+static void tc_binary(struct pq_writer *w, struct pq_buf *b, int *last, int id, const void *data, size_t len)
+{
+    tc_field(w, b, last, id, TC_BINARY);
+    tc_bytes(w, b, data, len);
+}
+
+static void tc_bool(struct pq_writer *w, struct pq_buf *b, int *last, int id, bool v)
+{
+    tc_field(w, b, last, id, v ? TC_TRUE : TC_FALSE);
+}
+
+static void tc_list(struct pq_writer *w, struct pq_buf *b, int *last, int id, int elem_type, int count)
+{
+    tc_field(w, b, last, id, TC_LIST);
+    if (count < 15) {
+        buf_byte(w, b, (count << 4) | elem_type);
+    } else {
+        buf_byte(w, b, 0xf0 | elem_type);
+        buf_uvarint(w, b, count);
+    }
+}
+
+static void tc_stop(struct pq_writer *w, struct pq_buf *b)
+{
+    buf_byte(w, b, 0);
+}
+
+static void write_out(struct pq_writer *w, const void *data, size_t len)
+{
+    if (w->err)
+        return;
+
+    if (len && fwrite(data, 1, len, w->f) != len) {
+        w->err = errno ? -errno : -EIO;
+        return;
+    }
+    w->offset += len;
+}
+
+// RLE/bit-packing hybrid encoding, written as a single bit-packed run. The
+// last group of 8 is zero padded, readers stop at the page's value count
+static void put_bitpacked(struct pq_writer *w, struct pq_buf *b, const __u32 *vals, size_t n, int bit_width)
+{
+    size_t groups = (n + 7) / 8;
+    __u64 acc = 0;
+    int bits = 0;
+
+    buf_uvarint(w, b, (groups << 1) | 1);
+    if (w->err || buf_reserve(b, groups * bit_width)) {
+        w->err = w->err ? w->err : -ENOMEM;
+        return;
+    }
+
+    for (size_t i = 0; i < groups * 8; i++) {
+        acc |= (__u64)(i < n ? vals[i] : 0) << bits;
+        bits += bit_width;
+        while (bits >= 8) {
+            b->data[b->len++] = acc & 0xff;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+}
+
+// definition levels are 0/1 bytes, a bit width of one packs 8 rows per byte
+static void put_deflevels(struct pq_writer *w, struct pq_buf *b, const unsigned char *levels, size_t n)
+{
+    size_t groups = (n + 7) / 8;
+    size_t start = b->len;
+
+    buf_le32(w, b, 0);
+    buf_uvarint(w, b, (groups << 1) | 1);
+    if (w->err || buf_reserve(b, groups)) {
+        w->err = w->err ? w->err : -ENOMEM;
+        return;
+    }
+
+    for (size_t g = 0; g < groups; g++) {
+        unsigned char byte = 0;
+        for (size_t i = 0; i < 8 && g * 8 + i < n; i++)
+            byte |= (levels[g * 8 + i] & 1) << i;
+        b->data[b->len++] = byte;
+    }
+
+    __u32 len = b->len - start - 4;
+    unsigned char le[4] = { len, len >> 8, len >> 16, len >> 24 };
+    memcpy(b->data + start, le, sizeof(le));
+}
+
+static void write_page(struct pq_writer *w, int page_type, const struct pq_buf *body,
+                       __u32 num_values, int encoding, struct pq_chunk *ch)
+{
+    const void *payload = body->data;
+    size_t payload_len = body->len;
+
+#ifdef USE_ZSTD
+    w->zbuf.len = 0;
+    if (buf_reserve(&w->zbuf, ZSTD_compressBound(body->len))) {
+        w->err = -ENOMEM;
+        return;
+    }
+    size_t zlen = ZSTD_compressCCtx(w->zctx, w->zbuf.data, w->zbuf.cap,
+                                    body->data, body->len, PQ_ZSTD_LEVEL);
+    if (ZSTD_isError(zlen)) {
+        w->err = -EIO;
+        return;
+    }
+    payload = w->zbuf.data;
+    payload_len = zlen;
+#endif
+
+    struct pq_buf *h = &w->hdr;
+    int last = 0, inner = 0;
+
+    h->len = 0;
+    tc_i32(w, h, &last, 1, page_type);
+    tc_i32(w, h, &last, 2, body->len);
+    tc_i32(w, h, &last, 3, payload_len);
+    if (page_type == PQ_PAGE_DATA) {
+        tc_field(w, h, &last, 5, TC_STRUCT);
+        tc_i32(w, h, &inner, 1, num_values);
+        tc_i32(w, h, &inner, 2, encoding);
+        tc_i32(w, h, &inner, 3, PQ_ENC_RLE);
+        tc_i32(w, h, &inner, 4, PQ_ENC_RLE);
+    } else {
+        tc_field(w, h, &last, 7, TC_STRUCT);
+        tc_i32(w, h, &inner, 1, num_values);
+        tc_i32(w, h, &inner, 2, encoding);
+    }
+    tc_stop(w, h);
+    tc_stop(w, h);
+
+    write_out(w, h->data, h->len);
+    write_out(w, payload, payload_len);
+
+    ch->uncompressed_size += h->len + body->len;
+    ch->compressed_size += h->len + payload_len;
+}
+
+static int bit_width(__u32 max_val)
+{
+    int bits = 1;
+
+    while (bits < 32 && (max_val >> bits))
+        bits++;
+    return bits;
+}
+
+static void write_column_chunk(struct pq_writer *w, struct pq_col *c, struct pq_chunk *ch)
+{
+    bool dict = (c->def.flags & PQ_DICT) && c->dict_count > 0;
+    struct pq_buf *page = &w->page;
+
+    *ch = (struct pq_chunk) {
+        .dict_page_offset = -1,
+        .num_values = w->rows,
+        .nr_nulls = c->nr_nulls,
+        .min = c->min,
+        .max = c->max,
+        .has_minmax = c->def.type != PQ_STRING && c->nr_nulls < w->rows,
+    };
+
+    if (dict) {
+        ch->dict_page_offset = w->offset;
+        write_page(w, PQ_PAGE_DICTIONARY, &c->values, c->dict_count, PQ_ENC_PLAIN, ch);
+    }
+
+    ch->data_page_offset = w->offset;
+    page->len = 0;
+    if (c->def.flags & PQ_OPTIONAL)
+        put_deflevels(w, page, c->deflevels.data, c->deflevels.len);
+    if (dict) {
+        int bw = bit_width(c->dict_count - 1);
+        buf_byte(w, page, bw);
+        put_bitpacked(w, page, (const __u32 *)c->indices.data, c->indices.len / sizeof(__u32), bw);
+    } else {
+        buf_put(w, page, c->values.data, c->values.len);
+    }
+    write_page(w, PQ_PAGE_DATA, page, w->rows, dict ? PQ_ENC_RLE_DICTIONARY : PQ_ENC_PLAIN, ch);
+}
+
+static void reset_column(struct pq_col *c)
+{
+    c->values.len = 0;
+    c->indices.len = 0;
+    c->deflevels.len = 0;
+    c->nr_nulls = 0;
+    c->dict_count = 0;
+    if (c->dict_slots)
+        memset(c->dict_slots, 0, c->dict_cap * sizeof(*c->dict_slots));
+}
+
+static int flush_row_group(struct pq_writer *w)
+{
+    if (!w->rows || w->err)
+        return w->err;
+
+    if (w->nr_row_groups == w->row_groups_cap) {
+        int cap = w->row_groups_cap ? w->row_groups_cap * 2 : 16;
+        struct pq_row_group *rgs = realloc(w->row_groups, cap * sizeof(*rgs));
+        struct pq_chunk *chunks = rgs ? realloc(w->chunks, (size_t)cap * w->nr_cols * sizeof(*chunks)) : NULL;
+
+        if (rgs)
+            w->row_groups = rgs;
+        if (!chunks)
+            return w->err = -ENOMEM;
+        w->chunks = chunks;
+        w->row_groups_cap = cap;
+    }
+
+    struct pq_chunk *chunks = &w->chunks[(size_t)w->nr_row_groups * w->nr_cols];
+    __s64 total_bytes = 0;
+
+    for (int i = 0; i < w->nr_cols; i++) {
+        write_column_chunk(w, &w->cols[i], &chunks[i]);
+        total_bytes += chunks[i].uncompressed_size;
+        reset_column(&w->cols[i]);
+    }
+
+    w->row_groups[w->nr_row_groups++] = (struct pq_row_group) {
+        .num_rows = w->rows,
+        .total_byte_size = total_bytes,
+    };
+    w->total_rows += w->rows;
+    w->rows = 0;
+    w->buffered_bytes = 0;
+
+    return w->err;
+}
+
+static void write_schema(struct pq_writer *w, struct pq_buf *b, int *last)
+{
+    int el;
+
+    tc_list(w, b, last, 2, TC_STRUCT, w->nr_cols + 1);
+
+    el = 0;
+    tc_binary(w, b, &el, 4, "schema", 6);
+    tc_i32(w, b, &el, 5, w->nr_cols);
+    tc_stop(w, b);
+
+    for (int i = 0; i < w->nr_cols; i++) {
+        const struct pq_column_def *def = &w->cols[i].def;
+        int lt = 0, ts = 0, unit = 0;
+
+        el = 0;
+        tc_i32(w, b, &el, 1, def->type == PQ_STRING ? PQ_T_BYTE_ARRAY : PQ_T_INT64);
+        tc_i32(w, b, &el, 3, def->flags & PQ_OPTIONAL ? PQ_REP_OPTIONAL : PQ_REP_REQUIRED);
+        tc_binary(w, b, &el, 4, def->name, strlen(def->name));
+
+        if (def->type == PQ_STRING) {
+            tc_i32(w, b, &el, 6, PQ_CONV_UTF8);
+            tc_field(w, b, &el, 10, TC_STRUCT);
+            tc_field(w, b, &lt, 1, TC_STRUCT);      // LogicalType.STRING
+            tc_stop(w, b);
+            tc_stop(w, b);
+        } else if (def->type == PQ_TIMESTAMP) {
+            // no ConvertedType, TIMESTAMP_MICROS would mean adjusted to UTC
+            tc_field(w, b, &el, 10, TC_STRUCT);
+            tc_field(w, b, &lt, 8, TC_STRUCT);      // LogicalType.TIMESTAMP
+            tc_bool(w, b, &ts, 1, false);           // local time, not UTC
+            tc_field(w, b, &ts, 2, TC_STRUCT);
+            tc_field(w, b, &unit, 2, TC_STRUCT);    // TimeUnit.MICROS
+            tc_stop(w, b);
+            tc_stop(w, b);
+            tc_stop(w, b);
+            tc_stop(w, b);
+        }
+        tc_stop(w, b);
+    }
+}
+
+static void write_column_meta(struct pq_writer *w, struct pq_buf *b, const struct pq_col *c,
+                              const struct pq_chunk *ch)
+{
+    int cc = 0, md = 0, st = 0;
+    bool dict = ch->dict_page_offset >= 0;
+
+    tc_i64(w, b, &cc, 2, dict ? ch->dict_page_offset : ch->data_page_offset);
+    tc_field(w, b, &cc, 3, TC_STRUCT);
+
+    tc_i32(w, b, &md, 1, c->def.type == PQ_STRING ? PQ_T_BYTE_ARRAY : PQ_T_INT64);
+    tc_list(w, b, &md, 2, TC_I32, dict ? 3 : 2);
+    tc_varint(w, b, PQ_ENC_PLAIN);
+    tc_varint(w, b, PQ_ENC_RLE);
+    if (dict)
+        tc_varint(w, b, PQ_ENC_RLE_DICTIONARY);
+    tc_list(w, b, &md, 3, TC_BINARY, 1);
+    tc_bytes(w, b, c->def.name, strlen(c->def.name));
+    tc_i32(w, b, &md, 4, PQ_CODEC);
+    tc_i64(w, b, &md, 5, ch->num_values);
+    tc_i64(w, b, &md, 6, ch->uncompressed_size);
+    tc_i64(w, b, &md, 7, ch->compressed_size);
+    tc_i64(w, b, &md, 9, ch->data_page_offset);
+    if (dict)
+        tc_i64(w, b, &md, 11, ch->dict_page_offset);
+
+    tc_field(w, b, &md, 12, TC_STRUCT);
+    tc_i64(w, b, &st, 3, ch->nr_nulls);
+    if (ch->has_minmax) {
+        unsigned char max_le[8], min_le[8];
+        for (int i = 0; i < 8; i++) {
+            max_le[i] = (__u64)ch->max >> (8 * i);
+            min_le[i] = (__u64)ch->min >> (8 * i);
+        }
+        tc_binary(w, b, &st, 5, max_le, sizeof(max_le));
+        tc_binary(w, b, &st, 6, min_le, sizeof(min_le));
+    }
+    tc_stop(w, b);
+
+    tc_stop(w, b);      // ColumnMetaData
+    tc_stop(w, b);      // ColumnChunk
+}
+
+static int write_footer(struct pq_writer *w)
+{
+    struct pq_buf *b = &w->page;
+    int last = 0;
+
+    b->len = 0;
+    tc_i32(w, b, &last, 1, 1);
+    write_schema(w, b, &last);
+    tc_i64(w, b, &last, 3, w->total_rows);
+
+    tc_list(w, b, &last, 4, TC_STRUCT, w->nr_row_groups);
+    for (int rg = 0; rg < w->nr_row_groups; rg++) {
+        int rgl = 0;
+
+        tc_list(w, b, &rgl, 1, TC_STRUCT, w->nr_cols);
+        for (int i = 0; i < w->nr_cols; i++)
+            write_column_meta(w, b, &w->cols[i], &w->chunks[(size_t)rg * w->nr_cols + i]);
+        tc_i64(w, b, &rgl, 2, w->row_groups[rg].total_byte_size);
+        tc_i64(w, b, &rgl, 3, w->row_groups[rg].num_rows);
+        tc_stop(w, b);
+    }
+
+    tc_binary(w, b, &last, 6, "xcapture", 8);
+
+    // readers ignore min_value/max_value statistics without a column order
+    tc_list(w, b, &last, 7, TC_STRUCT, w->nr_cols);
+    for (int i = 0; i < w->nr_cols; i++) {
+        int co = 0;
+        tc_field(w, b, &co, 1, TC_STRUCT);      // ColumnOrder.TYPE_ORDER
+        tc_stop(w, b);
+        tc_stop(w, b);
+    }
+    tc_stop(w, b);
+
+    __u32 footer_len = b->len;
+    buf_le32(w, b, footer_len);
+    buf_put(w, b, PQ_MAGIC, 4);
+    write_out(w, b->data, b->len);
+
+    return w->err;
+}
+
+struct pq_writer *pq_open(const char *path, const struct pq_column_def *cols, int nr_cols)
+{
+    struct pq_writer *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->nr_cols = nr_cols;
+    w->cols = calloc(nr_cols, sizeof(*w->cols));
+    if (!w->cols)
+        goto fail;
+
+    for (int i = 0; i < nr_cols; i++)
+        w->cols[i].def = cols[i];
+
+#ifdef USE_ZSTD
+    w->zctx = ZSTD_createCCtx();
+    if (!w->zctx)
+        goto fail;
+#endif
+
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    snprintf(w->tmp_path, sizeof(w->tmp_path), "%s.tmp", path);
+    w->f = fopen(w->tmp_path, "w");
+    if (!w->f)
+        goto fail;
+
+    w->tz_sec = -1;
+    write_out(w, PQ_MAGIC, 4);
+    if (w->err)
+        goto fail;
+
+    return w;
+
+fail:
+    pq_close(w);
+    return NULL;
+}
+
+void pq_put_null(struct pq_writer *w)
+{
+    if (w->cur >= w->nr_cols)
+        return;
+
+    struct pq_col *c = &w->cols[w->cur++];
+
+    if (!(c->def.flags & PQ_OPTIONAL)) {
+        w->err = -EINVAL;
+        return;
+    }
+    buf_byte(w, &c->deflevels, 0);
+    c->nr_nulls++;
+}
+
+static struct pq_col *next_value(struct pq_writer *w)
+{
+    if (w->cur >= w->nr_cols)
+        return NULL;
+
+    struct pq_col *c = &w->cols[w->cur++];
+
+    if (c->def.flags & PQ_OPTIONAL)
+        buf_byte(w, &c->deflevels, 1);
+    return c;
+}
+
+void pq_put_i64(struct pq_writer *w, __s64 val)
+{
+    struct pq_col *c = next_value(w);
+    if (!c)
+        return;
+
+    if (c->values.len == 0) {
+        c->min = c->max = val;
+    } else {
+        if (val < c->min)
+            c->min = val;
+        if (val > c->max)
+            c->max = val;
+    }
+
+    buf_le64(w, &c->values, val);
+    w->buffered_bytes += 8;
+}
+
+void pq_put_ts(struct pq_writer *w, struct timespec ts)
+{
+    // the CSV files have local time without a zone, keep the same wall clock time
+    if (ts.tv_sec != w->tz_sec) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        w->tz_sec = ts.tv_sec;
+        w->tz_off = tm.tm_gmtoff;
+    }
+
+    pq_put_i64(w, ((__s64)ts.tv_sec + w->tz_off) * 1000000 + ts.tv_nsec / 1000);
+}
+
+static __u32 str_hash(const char *s, size_t len)
+{
+    __u32 h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static int dict_grow(struct pq_col *c)
+{
+    __u32 cap = c->dict_cap ? c->dict_cap * 2 : 1024;
+    __u32 *slots = calloc(cap, sizeof(*slots));
+    __u32 *offs = realloc(c->dict_offs, cap / 2 * sizeof(*offs));
+
+    if (!slots || !offs) {
+        free(slots);
+        if (offs)
+            c->dict_offs = offs;
+        return -ENOMEM;
+    }
+
+    // rehash existing entries
+    for (__u32 i = 0; i < c->dict_count; i++) {
+        const unsigned char *e = c->values.data + offs[i];
+        __u32 len = e[0] | e[1] << 8 | e[2] << 16 | (__u32)e[3] << 24;
+        __u32 slot = str_hash((const char *)e + 4, len) & (cap - 1);
+
+        while (slots[slot])
+            slot = (slot + 1) & (cap - 1);
+        slots[slot] = i + 1;
+    }
+
+    free(c->dict_slots);
+    c->dict_slots = slots;
+    c->dict_offs = offs;
+    c->dict_cap = cap;
+    return 0;
+}
+
+static void dict_put(struct pq_writer *w, struct pq_col *c, const char *str, size_t len)
+{
+    // keep the load factor under 1/2
+    if (c->dict_count * 2 >= c->dict_cap && dict_grow(c)) {
+        w->err = -ENOMEM;
+        return;
+    }
+
+    __u32 slot = str_hash(str, len) & (c->dict_cap - 1);
+    __u32 idx;
+
+    while ((idx = c->dict_slots[slot])) {
+        const unsigned char *e = c->values.data + c->dict_offs[idx - 1];
+        __u32 elen = e[0] | e[1] << 8 | e[2] << 16 | (__u32)e[3] << 24;
+
+        if (elen == len && !memcmp(e + 4, str, len))
+            break;
+        slot = (slot + 1) & (c->dict_cap - 1);
+    }
+
+    if (!idx) {
+        c->dict_offs[c->dict_count] = c->values.len;
+        buf_le32(w, &c->values, len);
+        buf_put(w, &c->values, str, len);
+        if (w->err)
+            return;
+        idx = ++c->dict_count;
+        c->dict_slots[slot] = idx;
+        w->buffered_bytes += len + 4;
+    }
+
+    idx--;
+    buf_put(w, &c->indices, &idx, sizeof(idx));
+    w->buffered_bytes += sizeof(idx);
+}
+
+void pq_put_str(struct pq_writer *w, const char *str)
+{
+    struct pq_col *c = next_value(w);
+    if (!c)
+        return;
+
+    size_t len = strlen(str);
+
+    if (c->def.flags & PQ_DICT) {
+        dict_put(w, c, str, len);
+    } else {
+        buf_le32(w, &c->values, len);
+        buf_put(w, &c->values, str, len);
+        w->buffered_bytes += len + 4;
+    }
+}
+
+int pq_end_row(struct pq_writer *w)
+{
+    if (w->cur != w->nr_cols) {
+        fprintf(stderr, "Parquet row for %s has %d of %d columns\n", w->path, w->cur, w->nr_cols);
+        w->err = -EINVAL;
+    }
+    w->cur = 0;
+    w->rows++;
+
+    if (w->rows >= PQ_ROW_GROUP_ROWS || w->buffered_bytes >= PQ_ROW_GROUP_BYTES)
+        flush_row_group(w);
+
+    return w->err;
+}
+
+// rename to <path>, or to the first free <stem>.N.parquet if it exists
+static int publish(struct pq_writer *w)
+{
+    char path[PATH_MAX];
+    size_t stem_len = strlen(w->path);
+
+    if (stem_len > 8 && !strcmp(w->path + stem_len - 8, ".parquet"))
+        stem_len -= 8;
+
+    snprintf(path, sizeof(path), "%s", w->path);
+    for (int n = 1; access(path, F_OK) == 0; n++)
+        snprintf(path, sizeof(path), "%.*s.%d.parquet", (int)stem_len, w->path, n);
+
+    return rename(w->tmp_path, path) ? -errno : 0;
+}
+
+int pq_close(struct pq_writer *w)
+{
+    int err;
+
+    if (!w)
+        return 0;
+
+    if (w->f) {
+        flush_row_group(w);
+        write_footer(w);
+        if (fclose(w->f) && !w->err)
+            w->err = -errno;
+        if (!w->err)
+            w->err = publish(w);
+        if (w->err)
+            unlink(w->tmp_path);
+    }
+
+    err = w->err;
+
+    for (int i = 0; w->cols && i < w->nr_cols; i++) {
+        free(w->cols[i].values.data);
+        free(w->cols[i].indices.data);
+        free(w->cols[i].deflevels.data);
+        free(w->cols[i].dict_slots);
+        free(w->cols[i].dict_offs);
+    }
+    free(w->cols);
+    free(w->chunks);
+    free(w->row_groups);
+    free(w->page.data);
+    free(w->hdr.data);
+#ifdef USE_ZSTD
+    free(w->zbuf.data);
+    ZSTD_freeCCtx(w->zctx);
+#endif
+    free(w);
+
+    return err;
+}
@@ -0,0 +1,35 @@
+#ifndef __PARQUET_WRITER_H
+#define __PARQUET_WRITER_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <linux/types.h>
+
+enum pq_type {
+    PQ_INT64,
+    PQ_STRING,
+    PQ_TIMESTAMP,       // local wall clock time in microseconds, like the CSV timestamps
+};
+
+#define PQ_DICT      (1U << 0)   // dictionary encode, for low cardinality strings
+#define PQ_OPTIONAL  (1U << 1)   // the column can hold NULLs (empty CSV fields)
+
+struct pq_column_def {
+    const char *name;
+    enum pq_type type;
+    unsigned int flags;
+};
+
+struct pq_writer;
+
+struct pq_writer *pq_open(const char *path, const struct pq_column_def *cols, int nr_cols);
+int pq_close(struct pq_writer *w);
+
+// Values are added left to right in schema order, pq_end_row() completes the row
+void pq_put_i64(struct pq_writer *w, __s64 val);
+void pq_put_str(struct pq_writer *w, const char *str);
+void pq_put_ts(struct pq_writer *w, struct timespec ts);
+void pq_put_null(struct pq_writer *w);
+int pq_end_row(struct pq_writer *w);
+
+#endif /* __PARQUET_WRITER_H */
@@ -0,0 +1,1025 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include <bpf/libbpf.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "xcapture_context.h"
+#include "pipeline.h"
+#include "task_handler.h"
+#include "tracking_handler.h"
+#include "compress.h"
+#include "journal.h"
+#include "selfstats.h"
+
+// Pipelined CSV output. The sampler thread only triggers the task iterator,
+// everything downstream of the ring buffers runs on other threads:
+//
+//   consumer thread   drains task_samples, stack_traces and completion_events
+//                     into single-producer/single-consumer queues
+//   format worker     decodes task samples and completion events into CSV rows
+//   symbolize worker  symbolizes stack traces into the stack CSV files
+//   writer threads    one per output file, batch the stdio buffers of the
+//                     workers into writev() calls
+//
+// The workers still fprintf() into FILE streams, but those are fopencookie()
+// streams whose write callback just hands the buffer to the file's writer
+// queue. Input queues drop records when full (counted, like a full ringbuf
+// would), writer queues never drop, a slow disk backs up into the workers.
+// With --compress the writer threads also run the zstd/lz4 stream compression,
+// ending the current frame when it gets COMPRESS_FRAME_MS old and when a file
+// is closed, so every hourly file starts with a new frame.
+//
+// Hourly file rotation needs the workers off the FILE streams, so the sampler
+// pauses the pipeline: the consumer drains the ring buffers one last time and
+// parks, the workers park once their queues are empty, the sampler swaps the
+// files and lets everyone go again.
+//
+// With --raw the format worker takes all four input queues and only copies the
+// records into the journal file, preceded by the iterations they belong to.
+
+#define PIPE_INPUT_QUEUE_SIZE   (4 * 1024 * 1024)  // power of 2
+#define PIPE_WRITER_QUEUE_SIZE  (2 * 1024 * 1024)  // power of 2
+#define PIPE_CHUNK_MAX          (PIPE_WRITER_QUEUE_SIZE / 4)
+#define PIPE_WRITE_IOV          64
+#define PIPE_ITERATIONS         64                 // sampling iterations remembered for the workers
+#define PIPE_REC_PAD            0xffffffffU
+#define PIPE_ALIGN(x)           (((x) + 7) & ~(size_t)7)
+
+struct pipe_rec {
+    __u32 len;                  // payload bytes, PIPE_REC_PAD fills up to the wraparound
+    __s32 aux;                  // output fd in writer queues
+};
+
+// Sleeping consumers set waiting before their final emptiness check, producers
+// only pay for an eventfd write when the consumer is actually asleep
+struct waker {
+    int efd;
+    int waiting;
+};
+
+struct spsc_queue {
+    const char *name;
+    char *buf;
+    size_t size;
+    size_t head;                // advanced by the consumer only
+    size_t tail;                // advanced by the producer only
+    struct waker *consumer;
+    __u64 records;
+    __u64 dropped;
+    __u64 stalls;               // writer queue full, producer had to wait
+    size_t high_water;
+};
+
+enum { PIPE_Q_TASK, PIPE_Q_ITER, PIPE_Q_TRACKING, PIPE_Q_STACK, PIPE_INPUT_QUEUES };
+
+struct pipe_worker {
+    const char *name;
+    pthread_t thread;
+    bool started;
+    struct waker waker;
+    int queues[PIPE_INPUT_QUEUES];
+    int nr_queues;
+    struct xcapture_context xctx;   // private copy, the sampler keeps changing g_ctx
+    __u64 journal_iter;             // --raw: next iteration to write into the journal
+};
+
+struct pipe_writer {
+    pthread_t thread;
+    bool started;
+    struct waker waker;
+    struct spsc_queue queue;
+    struct compressor *comp;    // NULL when writing plain CSV
+    int frame_fd;
+    __u64 frame_start_ns;
+    __u64 raw_bytes;
+    __u64 bytes;
+    __u64 writes;
+};
+
+struct pipe_iteration {
+    __u32 seq;                  // odd while being updated
+    __u64 mono_ns;
+    long weight_us;
+    struct time_correlation tcorr;
+};
+
+struct pipe_cookie {
+    struct pipe_writer *writer;
+    int fd;
+};
+
+static const char *writer_names[PIPE_FILES] = {
+    "samples", "syscend", "iorqend", "kstacks", "ustacks", "cgroups", "aggregates", "journal",
+    "uaddrs", "umaps",
+};
+
+static struct {
+    struct xcapture_context *xctx;
+    struct spsc_queue inputs[PIPE_INPUT_QUEUES];
+    struct pipe_worker workers[2];
+    struct pipe_writer writers[PIPE_FILES];
+
+    pthread_t consumer;
+    bool consumer_started;
+    struct waker consumer_waker;
+    int epfd;
+
+    struct pipe_iteration iterations[PIPE_ITERATIONS];
+    __u64 nr_iterations;
+
+    pthread_mutex_t ctl_lock;
+    pthread_cond_t ctl_cond;
+    int pause_requested;
+    int consumer_parked;
+    int parked;
+    int participants;
+    int stop_consumer;
+    int stop_workers;
+    int stop_writers;
+} pl = {
+    .epfd = -1,
+    .ctl_lock = PTHREAD_MUTEX_INITIALIZER,
+    .ctl_cond = PTHREAD_COND_INITIALIZER,
+};
+
+#define LOAD(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Pipeline threads block all signals, so that SIGINT/SIGTERM interrupt the
+// sampler's clock_nanosleep() and not some worker
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return -err;
+}
+
+static int waker_init(struct waker *w)
+{
+    w->waiting = 0;
+    w->efd = eventfd(0, EFD_CLOEXEC);
+    return w->efd < 0 ? -errno : 0;
+}
+
+static void waker_wake(struct waker *w)
+{
+    if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&w->waiting, 0, __ATOMIC_SEQ_CST))
+        eventfd_write(w->efd, 1);
+}
+
+static void waker_wait(struct waker *w, bool (*ready)(void *), void *arg)
+{
+    eventfd_t v;
+
+    __atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+    if (ready(arg)) {
+        __atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+    eventfd_read(w->efd, &v);
+}
+
+// As waker_wait(), but gives up after timeout_ms. A wakeup that races with the
+// timeout leaves the eventfd readable, which only costs one spurious loop
+static void waker_wait_timeout(struct waker *w, bool (*ready)(void *), void *arg, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = w->efd, .events = POLLIN };
+    eventfd_t v;
+
+    __atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+    if (ready(arg)) {
+        __atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+    if (poll(&pfd, 1, timeout_ms) > 0)
+        eventfd_read(w->efd, &v);
+    else
+        __atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static __u64 mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int queue_init(struct spsc_queue *q, const char *name, size_t size, struct waker *consumer)
+{
+    q->buf = malloc(size);
+    if (!q->buf)
+        return -ENOMEM;
+
+    q->name = name;
+    q->size = size;
+    q->head = q->tail = 0;
+    q->consumer = consumer;
+    return 0;
+}
+
+static bool queue_empty(struct spsc_queue *q)
+{
+    return LOAD(&q->head) == LOAD(&q->tail);
+}
+
+// Reserve room for a record of len bytes, skipping to the start of the buffer if
+// it doesn't fit before the end. Returns NULL when the queue is full
+static struct pipe_rec *queue_reserve(struct spsc_queue *q, size_t len, size_t *new_tail)
+{
+    size_t need = PIPE_ALIGN(sizeof(struct pipe_rec) + len);
+    if (need > q->size / 2)
+        return NULL;
+
+    size_t tail = q->tail;
+    size_t head = LOAD(&q->head);
+    size_t off = tail & (q->size - 1);
+    size_t pad = off + need > q->size ? q->size - off : 0;
+
+    if (tail + pad + need - head > q->size)
+        return NULL;
+
+    if (pad) {
+        ((struct pipe_rec *)(q->buf + off))->len = PIPE_REC_PAD;
+        tail += pad;
+    }
+
+    struct pipe_rec *rec = (struct pipe_rec *)(q->buf + (tail & (q->size - 1)));
+    rec->len = len;
+    rec->aux = 0;
+    *new_tail = tail + need;
+    return rec;
+}
+
+static void queue_commit(struct spsc_queue *q, size_t new_tail)
+{
+    __atomic_store_n(&q->tail, new_tail, __ATOMIC_SEQ_CST);
+
+    size_t depth = new_tail - LOAD(&q->head);
+    if (depth > q->high_water)
+        q->high_water = depth;
+    __atomic_add_fetch(&q->records, 1, __ATOMIC_RELAXED);
+
+    waker_wake(q->consumer);
+}
+
+static void queue_push(struct spsc_queue *q, const void *data, size_t len)
+{
+    size_t new_tail;
+    struct pipe_rec *rec = queue_reserve(q, len, &new_tail);
+
+    if (!rec) {
+        __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(rec + 1, data, len);
+    queue_commit(q, new_tail);
+}
+
+// Next record at or after *pos, skipping wraparound fillers
+static struct pipe_rec *queue_at(struct spsc_queue *q, size_t *pos, size_t tail)
+{
+    while (*pos != tail) {
+        struct pipe_rec *rec = (struct pipe_rec *)(q->buf + (*pos & (q->size - 1)));
+        if (rec->len != PIPE_REC_PAD)
+            return rec;
+        *pos += q->size - (*pos & (q->size - 1));
+    }
+    return NULL;
+}
+
+static size_t rec_size(const struct pipe_rec *rec)
+{
+    return PIPE_ALIGN(sizeof(*rec) + rec->len);
+}
+
+int pipeline_enqueue_task(void *ctx, void *data, size_t data_sz)
+{
+    XCAP_UNUSED(ctx);
+    queue_push(&pl.inputs[PIPE_Q_TASK], data, data_sz);
+    return 0;
+}
+
+int pipeline_enqueue_stack(void *ctx, void *data, size_t data_sz)
+{
+    XCAP_UNUSED(ctx);
+    queue_push(&pl.inputs[PIPE_Q_STACK], data, data_sz);
+    return 0;
+}
+
+int pipeline_enqueue_tracking(void *ctx, void *data, size_t data_sz)
+{
+    XCAP_UNUSED(ctx);
+    queue_push(&pl.inputs[PIPE_Q_TRACKING], data, data_sz);
+    return 0;
+}
+
+// --iter-stream records are read by the sampler thread, so they get their own queue
+void pipeline_enqueue_iter(const void *data, size_t data_sz)
+{
+    queue_push(&pl.inputs[PIPE_Q_ITER], data, data_sz);
+}
+
+// Publish the weight and clock correlation of a new sampling iteration, the
+// workers may still be formatting samples of earlier ones
+void pipeline_note_iteration(const struct xcapture_context *xctx)
+{
+    __u64 n = pl.nr_iterations;
+    struct pipe_iteration *it = &pl.iterations[n % PIPE_ITERATIONS];
+
+    __atomic_store_n(&it->seq, it->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    it->mono_ns = xctx->tcorr.mono_time.tv_sec * 1000000000ULL + xctx->tcorr.mono_time.tv_nsec;
+    it->weight_us = xctx->sample_weight_us;
+    it->tcorr = xctx->tcorr;
+    __atomic_store_n(&it->seq, it->seq + 1, __ATOMIC_RELEASE);
+
+    STORE(&pl.nr_iterations, n + 1);
+}
+
+// Consistent copy of iteration i, false if the sampler is overwriting its slot
+static bool iteration_copy(__u64 i, struct pipe_iteration *copy)
+{
+    struct pipe_iteration *it = &pl.iterations[i % PIPE_ITERATIONS];
+
+    __u32 seq = LOAD(&it->seq);
+    if (seq & 1)
+        return false;
+    *copy = *it;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&it->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Find the latest iteration that started at or before ktime
+void pipeline_iteration_info(__u64 ktime, long *weight_us, struct time_correlation *tcorr)
+{
+    __u64 n = LOAD(&pl.nr_iterations);
+    __u64 oldest = n > PIPE_ITERATIONS ? n - PIPE_ITERATIONS : 0;
+
+    for (__u64 i = n; i > oldest; i--) {
+        struct pipe_iteration copy;
+
+        if (!iteration_copy(i - 1, &copy))
+            continue;
+
+        if (copy.mono_ns <= ktime || i - 1 == oldest) {
+            *weight_us = copy.weight_us;
+            *tcorr = copy.tcorr;
+            return;
+        }
+    }
+}
+
+// Block in the control path until the sampler resumes the pipeline
+static void park(bool consumer)
+{
+    pthread_mutex_lock(&pl.ctl_lock);
+    if (consumer)
+        STORE(&pl.consumer_parked, 1);
+    pl.parked++;
+    pthread_cond_broadcast(&pl.ctl_cond);
+    while (pl.pause_requested)
+        pthread_cond_wait(&pl.ctl_cond, &pl.ctl_lock);
+    pl.parked--;
+    pthread_mutex_unlock(&pl.ctl_lock);
+}
+
+static void wake_all(void)
+{
+    eventfd_write(pl.consumer_waker.efd, 1);
+    for (int i = 0; i < 2; i++)
+        if (pl.workers[i].started)
+            eventfd_write(pl.workers[i].waker.efd, 1);
+}
+
+static void consume_all(struct ring_buffer **rbs, int nr_rbs)
+{
+    for (int i = 0; i < nr_rbs; i++)
+        ring_buffer__consume(rbs[i]);
+}
+
+static struct consumer_args {
+    struct ring_buffer *rbs[4];
+    int nr_rbs;
+} consumer_args;
+
+static void *consumer_main(void *arg)
+{
+    struct consumer_args *args = arg;
+    struct epoll_event events[8];
+
+    while (!LOAD(&pl.stop_consumer)) {
+        if (LOAD(&pl.pause_requested)) {
+            consume_all(args->rbs, args->nr_rbs);
+            park(true);
+            continue;
+        }
+
+        int n = epoll_wait(pl.epfd, events, 8, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Pipeline consumer epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                eventfd_t v;
+                eventfd_read(pl.consumer_waker.efd, &v);
+            } else {
+                __u64 start_ns = mono_ns();
+                ring_buffer__consume(events[i].data.ptr);
+                selfstats_record(SELFSTATS_POLL, mono_ns() - start_ns);
+            }
+        }
+    }
+
+    consume_all(args->rbs, args->nr_rbs);
+    return NULL;
+}
+
+static bool worker_ready(void *arg)
+{
+    struct pipe_worker *w = arg;
+
+    for (int i = 0; i < w->nr_queues; i++)
+        if (!queue_empty(&pl.inputs[w->queues[i]]))
+            return true;
+
+    return LOAD(&pl.stop_workers) || (LOAD(&pl.pause_requested) && LOAD(&pl.consumer_parked));
+}
+
+static void worker_flush(struct pipe_worker *w)
+{
+    struct output_files *files = &w->xctx.files;
+
+    if (files->journal_file) {
+        fflush(files->journal_file);
+    } else if (w == &pl.workers[0]) {
+        if (files->sample_file) fflush(files->sample_file);
+        if (files->sc_completion_file) fflush(files->sc_completion_file);
+        if (files->iorq_completion_file) fflush(files->iorq_completion_file);
+        if (files->cgroup_file) fflush(files->cgroup_file);
+    } else {
+        if (files->kstack_file) fflush(files->kstack_file);
+        if (files->ustack_file) fflush(files->ustack_file);
+        if (files->uaddrs_file) fflush(files->uaddrs_file);
+        if (files->umaps_file) fflush(files->umaps_file);
+    }
+}
+
+// --raw: write the iterations published since the last record, so that the
+// decoder finds the clock correlation and weight of every record before it
+static void journal_sync_iterations(struct pipe_worker *w)
+{
+    __u64 n = LOAD(&pl.nr_iterations);
+
+    if (n - w->journal_iter > PIPE_ITERATIONS)
+        w->journal_iter = n - PIPE_ITERATIONS;
+
+    for (; w->journal_iter < n; w->journal_iter++) {
+        struct pipe_iteration copy;
+        struct xcj_iteration rec;
+
+        if (!iteration_copy(w->journal_iter, &copy))
+            break;
+
+        rec.mono_ns = copy.mono_ns;
+        rec.wall_sec = copy.tcorr.wall_time.tv_sec;
+        rec.wall_nsec = copy.tcorr.wall_time.tv_nsec;
+        rec.weight_us = copy.weight_us;
+        journal_append(w->xctx.files.journal_file, XCJ_REC_ITERATION, &rec, sizeof(rec));
+    }
+}
+
+static void journal_handle(struct pipe_worker *w, int queue, void *data, size_t len)
+{
+    journal_sync_iterations(w);
+
+    switch (queue) {
+        case PIPE_Q_TASK:
+        case PIPE_Q_ITER:
+            journal_append_task(&w->xctx, data, len);
+            break;
+        case PIPE_Q_TRACKING:
+            journal_append(w->xctx.files.journal_file, XCJ_REC_TRACKING, data, len);
+            break;
+        case PIPE_Q_STACK:
+            journal_append(w->xctx.files.journal_file, XCJ_REC_STACK, data, len);
+            break;
+    }
+}
+
+static void worker_handle(struct pipe_worker *w, int queue, void *data, size_t len)
+{
+    if (w->xctx.raw_journal) {
+        journal_handle(w, queue, data, len);
+        return;
+    }
+
+    switch (queue) {
+        case PIPE_Q_TASK:
+        case PIPE_Q_ITER:
+            handle_task_event(&w->xctx, data, len);
+            break;
+        case PIPE_Q_TRACKING:
+            // completion events only need a consistent wall clock correlation
+            pipeline_iteration_info(~0ULL, &w->xctx.sample_weight_us, &w->xctx.tcorr);
+            handle_tracking_event(&w->xctx, data, len);
+            break;
+        case PIPE_Q_STACK:
+            handle_stack_event(&w->xctx, data, len);
+            break;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct pipe_worker *w = arg;
+
+    for (;;) {
+        bool busy = false;
+
+        for (int i = 0; i < w->nr_queues; i++) {
+            struct spsc_queue *q = &pl.inputs[w->queues[i]];
+            size_t pos = q->head;
+            size_t tail = LOAD(&q->tail);
+            struct pipe_rec *rec;
+
+            // a bounded batch per queue, so neither input starves the other
+            for (int n = 0; n < 1024 && (rec = queue_at(q, &pos, tail)); n++) {
+                worker_handle(w, w->queues[i], rec + 1, rec->len);
+                pos += rec_size(rec);
+                STORE(&q->head, pos);
+                busy = true;
+            }
+        }
+
+        if (busy)
+            continue;
+
+        // idle: hand whatever is buffered to the writers
+        worker_flush(w);
+
+        if (LOAD(&pl.stop_workers))
+            break;
+
+        if (LOAD(&pl.pause_requested) && LOAD(&pl.consumer_parked)) {
+            park(false);
+            // a new journal segment starts with the iterations still remembered
+            if (w->xctx.raw_journal && w->xctx.files.epoch != pl.xctx->files.epoch) {
+                __u64 n = LOAD(&pl.nr_iterations);
+                w->journal_iter = n > PIPE_ITERATIONS ? n - PIPE_ITERATIONS : 0;
+            }
+            w->xctx.files = pl.xctx->files;
+            continue;
+        }
+
+        waker_wait(&w->waker, worker_ready, w);
+    }
+
+    return NULL;
+}
+
+static ssize_t write_iov(int fd, struct iovec *iov, int niov)
+{
+    ssize_t total = 0;
+
+    while (niov > 0) {
+        ssize_t n = writev(fd, iov, niov);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        total += n;
+
+        while (niov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return total;
+}
+
+static ssize_t compress_iov(struct pipe_writer *w, int fd, const struct iovec *iov, int niov)
+{
+    ssize_t total = 0, n;
+
+    // only one file per slot is open at a time, but never let a frame span files
+    if (compressor_frame_open(w->comp) && w->frame_fd != fd) {
+        if ((n = compressor_end_frame(w->comp, w->frame_fd)) < 0)
+            return n;
+        total += n;
+    }
+
+    if (!compressor_frame_open(w->comp)) {
+        w->frame_fd = fd;
+        w->frame_start_ns = mono_ns();
+    }
+
+    for (int i = 0; i < niov; i++) {
+        if ((n = compressor_write(w->comp, fd, iov[i].iov_base, iov[i].iov_len)) < 0)
+            return n;
+        total += n;
+        w->raw_bytes += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+static void end_frame(struct pipe_writer *w)
+{
+    ssize_t n = compressor_end_frame(w->comp, w->frame_fd);
+
+    if (n < 0)
+        fprintf(stderr, "Failed to write %s file: %s\n",
+                writer_names[w - pl.writers], strerror(-n));
+    else
+        w->bytes += n;
+}
+
+static bool writer_ready(void *arg)
+{
+    struct pipe_writer *w = arg;
+    return !queue_empty(&w->queue) || LOAD(&pl.stop_writers);
+}
+
+static void *writer_main(void *arg)
+{
+    struct pipe_writer *w = arg;
+    struct spsc_queue *q = &w->queue;
+    struct iovec iov[PIPE_WRITE_IOV];
+
+    for (;;) {
+        size_t pos = q->head;
+        size_t tail = LOAD(&q->tail);
+        struct pipe_rec *rec;
+        int niov = 0, fd = -1;
+
+        // gather consecutive chunks of the same file into one writev()
+        while (niov < PIPE_WRITE_IOV && (rec = queue_at(q, &pos, tail))) {
+            if (rec->len == 0) {
+                // close marker, after everything queued before it
+                if (niov)
+                    break;
+                if (w->comp && compressor_frame_open(w->comp) && w->frame_fd == rec->aux)
+                    end_frame(w);
+                close(rec->aux);
+                pos += rec_size(rec);
+                continue;
+            }
+            if (niov && rec->aux != fd)
+                break;
+
+            fd = rec->aux;
+            iov[niov].iov_base = rec + 1;
+            iov[niov].iov_len = rec->len;
+            niov++;
+            pos += rec_size(rec);
+        }
+
+        if (niov) {
+            __u64 start_ns = mono_ns();
+            ssize_t n = w->comp ? compress_iov(w, fd, iov, niov) : write_iov(fd, iov, niov);
+            selfstats_record(SELFSTATS_WRITE, mono_ns() - start_ns);
+            if (n < 0)
+                fprintf(stderr, "Failed to write %s file: %s\n",
+                        writer_names[w - pl.writers], strerror(-n));
+            else
+                w->bytes += n;
+            w->writes++;
+        }
+
+        bool progress = pos != q->head;
+        if (progress)
+            STORE(&q->head, pos);
+
+        // bound how much a crash can lose, whether the file is busy or idle
+        int timeout_ms = -1;
+        if (w->comp && compressor_frame_open(w->comp)) {
+            __u64 age_ms = (mono_ns() - w->frame_start_ns) / 1000000;
+            if (age_ms >= COMPRESS_FRAME_MS)
+                end_frame(w);
+            else
+                timeout_ms = COMPRESS_FRAME_MS - age_ms;
+        }
+
+        if (progress)
+            continue;
+
+        if (LOAD(&pl.stop_writers))
+            break;
+
+        if (timeout_ms >= 0)
+            waker_wait_timeout(&w->waker, writer_ready, w, timeout_ms);
+        else
+            waker_wait(&w->waker, writer_ready, w);
+    }
+
+    return NULL;
+}
+
+static void writer_push(struct pipe_writer *w, int fd, const char *buf, size_t len)
+{
+    struct spsc_queue *q = &w->queue;
+    size_t new_tail;
+    struct pipe_rec *rec;
+
+    // never drop file data, wait for the writer instead
+    while (!(rec = queue_reserve(q, len, &new_tail))) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        __atomic_add_fetch(&q->stalls, 1, __ATOMIC_RELAXED);
+        nanosleep(&ts, NULL);
+    }
+
+    rec->aux = fd;
+    if (len)
+        memcpy(rec + 1, buf, len);
+    queue_commit(q, new_tail);
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+    struct pipe_cookie *c = cookie;
+    size_t done = 0;
+
+    while (done < size) {
+        size_t len = size - done < PIPE_CHUNK_MAX ? size - done : PIPE_CHUNK_MAX;
+        writer_push(c->writer, c->fd, buf + done, len);
+        done += len;
+    }
+
+    return size;
+}
+
+static int cookie_close(void *cookie)
+{
+    struct pipe_cookie *c = cookie;
+
+    writer_push(c->writer, c->fd, NULL, 0);
+    free(c);
+    return 0;
+}
+
+// Wrap an output file fd into a FILE stream written by the slot's writer thread
+FILE *pipeline_open_file(enum pipeline_file slot, int fd, enum compress_algo compress)
+{
+    struct pipe_writer *w = &pl.writers[slot];
+
+    if (!w->started) {
+        if (waker_init(&w->waker) ||
+            queue_init(&w->queue, writer_names[slot], PIPE_WRITER_QUEUE_SIZE, &w->waker))
+            return NULL;
+        if (compress != COMPRESS_NONE && !(w->comp = compressor_new(compress))) {
+            fprintf(stderr, "Failed to set up %s compression\n", writer_names[slot]);
+            return NULL;
+        }
+        if (start_thread(&w->thread, writer_main, w)) {
+            fprintf(stderr, "Failed to start %s writer thread\n", writer_names[slot]);
+            return NULL;
+        }
+        w->started = true;
+    }
+
+    struct pipe_cookie *c = malloc(sizeof(*c));
+    if (!c)
+        return NULL;
+    c->writer = w;
+    c->fd = fd;
+
+    cookie_io_functions_t io = {
+        .write = cookie_write,
+        .close = cookie_close,
+    };
+
+    FILE *f = fopencookie(c, "w", io);
+    if (!f)
+        free(c);
+    return f;
+}
+
+static void pipeline_pause(void)
+{
+    pthread_mutex_lock(&pl.ctl_lock);
+    STORE(&pl.pause_requested, 1);
+    wake_all();
+    while (pl.parked < pl.participants) {
+        // workers park only after the consumer did, make sure they notice it
+        if (LOAD(&pl.consumer_parked))
+            wake_all();
+        pthread_cond_wait(&pl.ctl_cond, &pl.ctl_lock);
+    }
+    pthread_mutex_unlock(&pl.ctl_lock);
+}
+
+static void pipeline_resume(void)
+{
+    pthread_mutex_lock(&pl.ctl_lock);
+    STORE(&pl.pause_requested, 0);
+    STORE(&pl.consumer_parked, 0);
+    pthread_cond_broadcast(&pl.ctl_cond);
+    pthread_mutex_unlock(&pl.ctl_lock);
+}
+
+// Rotate the output files at an iteration boundary, with the consumer and the
+// workers parked so that nobody touches the FILE streams being swapped
+int pipeline_rotate_files(struct xcapture_context *xctx)
+{
+    if (!output_files_rotation_due(&xctx->files, xctx))
+        return 0;
+
+    pipeline_pause();
+    int err = check_and_rotate_files(&xctx->files, xctx);
+    pipeline_resume();
+
+    return err;
+}
+
+int pipeline_start(struct xcapture_context *xctx, struct ring_buffer **rbs, int nr_rbs)
+{
+    static const char *input_names[PIPE_INPUT_QUEUES] = { "task", "iter", "tracking", "stack" };
+    int err;
+
+    pl.xctx = xctx;
+
+    pl.workers[0] = (struct pipe_worker) {
+        .name = "format", .queues = { PIPE_Q_TASK, PIPE_Q_ITER, PIPE_Q_TRACKING }, .nr_queues = 3,
+    };
+    pl.workers[1] = (struct pipe_worker) {
+        .name = "symbolize", .queues = { PIPE_Q_STACK }, .nr_queues = 1,
+    };
+    if (xctx->raw_journal) {
+        // the journal has a single writer, which keeps stacks ahead of their samples
+        pl.workers[0].name = "journal";
+        pl.workers[0].queues[3] = PIPE_Q_STACK;
+        pl.workers[0].nr_queues = 4;
+    }
+
+    if ((err = waker_init(&pl.consumer_waker)) ||
+        (err = waker_init(&pl.workers[0].waker)) ||
+        (err = waker_init(&pl.workers[1].waker)))
+        return err;
+
+    for (int i = 0; i < PIPE_INPUT_QUEUES; i++) {
+        struct waker *consumer = i == PIPE_Q_STACK && !xctx->raw_journal ?
+                                 &pl.workers[1].waker : &pl.workers[0].waker;
+        if ((err = queue_init(&pl.inputs[i], input_names[i], PIPE_INPUT_QUEUE_SIZE, consumer)))
+            return err;
+    }
+
+    pl.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pl.epfd < 0)
+        return -errno;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(pl.epfd, EPOLL_CTL_ADD, pl.consumer_waker.efd, &ev))
+        return -errno;
+
+    consumer_args.nr_rbs = 0;
+    for (int i = 0; i < nr_rbs && consumer_args.nr_rbs < 4; i++) {
+        if (!rbs[i])
+            continue;
+        ev.data.ptr = rbs[i];
+        if (epoll_ctl(pl.epfd, EPOLL_CTL_ADD, ring_buffer__epoll_fd(rbs[i]), &ev))
+            return -errno;
+        consumer_args.rbs[consumer_args.nr_rbs++] = rbs[i];
+    }
+
+    for (int i = 0; i < (xctx->raw_journal ? 1 : 2); i++) {
+        pl.workers[i].xctx = *xctx;
+        if (start_thread(&pl.workers[i].thread, worker_main, &pl.workers[i]))
+            return -EAGAIN;
+        pl.workers[i].started = true;
+        pl.participants++;
+    }
+
+    if (start_thread(&pl.consumer, consumer_main, &consumer_args))
+        return -EAGAIN;
+    pl.consumer_started = true;
+    pl.participants++;
+
+    return 0;
+}
+
+// Drain the ring buffers and the input queues, leaving only the writers running
+// until the output files are closed
+void pipeline_stop(void)
+{
+    if (pl.consumer_started) {
+        STORE(&pl.stop_consumer, 1);
+        eventfd_write(pl.consumer_waker.efd, 1);
+        pthread_join(pl.consumer, NULL);
+        pl.consumer_started = false;
+    }
+
+    STORE(&pl.stop_workers, 1);
+    for (int i = 0; i < 2; i++) {
+        if (!pl.workers[i].started)
+            continue;
+        eventfd_write(pl.workers[i].waker.efd, 1);
+        pthread_join(pl.workers[i].thread, NULL);
+        pl.workers[i].started = false;
+    }
+}
+
+void pipeline_destroy(void)
+{
+    pipeline_stop();
+
+    STORE(&pl.stop_writers, 1);
+    for (int i = 0; i < PIPE_FILES; i++) {
+        struct pipe_writer *w = &pl.writers[i];
+        if (!w->started)
+            continue;
+        eventfd_write(w->waker.efd, 1);
+        pthread_join(w->thread, NULL);
+        w->started = false;
+        free(w->queue.buf);
+        w->queue.buf = NULL;
+        compressor_free(w->comp);
+        w->comp = NULL;
+        close(w->waker.efd);
+    }
+
+    for (int i = 0; i < PIPE_INPUT_QUEUES; i++) {
+        free(pl.inputs[i].buf);
+        pl.inputs[i].buf = NULL;
+    }
+
+    if (pl.epfd >= 0) {
+        close(pl.epfd);
+        pl.epfd = -1;
+    }
+}
+
+__u64 pipeline_dropped(void)
+{
+    __u64 dropped = 0;
+
+    for (int i = 0; i < PIPE_INPUT_QUEUES; i++)
+        dropped += __atomic_load_n(&pl.inputs[i].dropped, __ATOMIC_RELAXED);
+
+    return dropped;
+}
+
+static void print_queue_stats(FILE *f, const struct spsc_queue *q)
+{
+    fprintf(f, "  %-10s records %'llu, dropped %'llu, stalls %'llu, max depth %'zu KB of %'zu KB\n",
+            q->name,
+            __atomic_load_n(&q->records, __ATOMIC_RELAXED),
+            __atomic_load_n(&q->dropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&q->stalls, __ATOMIC_RELAXED),
+            q->high_water / 1024, q->size / 1024);
+}
+
+void pipeline_print_stats(FILE *f)
+{
+    fprintf(f, "Pipeline queues:\n");
+    for (int i = 0; i < PIPE_INPUT_QUEUES; i++)
+        if (pl.inputs[i].size && pl.inputs[i].records)
+            print_queue_stats(f, &pl.inputs[i]);
+
+    for (int i = 0; i < PIPE_FILES; i++) {
+        const struct pipe_writer *w = &pl.writers[i];
+        if (!w->queue.size)
+            continue;
+        print_queue_stats(f, &w->queue);
+        if (w->raw_bytes)
+            fprintf(f, "  %-10s %'llu bytes (%'llu uncompressed) in %'llu writes\n", "",
+                    w->bytes, w->raw_bytes, w->writes);
+        else
+            fprintf(f, "  %-10s %'llu bytes in %'llu writes\n", "", w->bytes, w->writes);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+#include "xcapture_context.h"
+#include "compress.h"
+
+// Output files that get their own writer thread in pipelined (CSV) mode
+enum pipeline_file {
+    PIPE_FILE_SAMPLE,
+    PIPE_FILE_SYSC,
+    PIPE_FILE_IORQ,
+    PIPE_FILE_KSTACK,
+    PIPE_FILE_USTACK,
+    PIPE_FILE_CGROUP,
+    PIPE_FILE_AGG,
+    PIPE_FILE_JOURNAL,
+    PIPE_FILE_UADDRS,
+    PIPE_FILE_UMAPS,
+    PIPE_FILES
+};
+
+int pipeline_start(struct xcapture_context *xctx, struct ring_buffer **rbs, int nr_rbs);
+void pipeline_stop(void);
+void pipeline_destroy(void);
+
+// ring_buffer_sample_fn callbacks, they only copy the record into a queue
+int pipeline_enqueue_task(void *ctx, void *data, size_t data_sz);
+int pipeline_enqueue_stack(void *ctx, void *data, size_t data_sz);
+int pipeline_enqueue_tracking(void *ctx, void *data, size_t data_sz);
+void pipeline_enqueue_iter(const void *data, size_t data_sz);
+
+void pipeline_note_iteration(const struct xcapture_context *xctx);
+void pipeline_iteration_info(__u64 ktime, long *weight_us, struct time_correlation *tcorr);
+int pipeline_rotate_files(struct xcapture_context *xctx);
+FILE *pipeline_open_file(enum pipeline_file slot, int fd, enum compress_algo compress);
+__u64 pipeline_dropped(void);
+void pipeline_print_stats(FILE *f);
+
+#endif /* __PIPELINE_H */
@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/limits.h>
+
+#include "xcapture_user.h"
+#include "retention.h"
+
+// Retention manager (--max-file-size, --retain-size, --retain-free). It runs
+// on its own thread so that nothing here ever blocks the sampling thread,
+// which only does an atomic load per tick and hands over the new file names
+// at rotation.
+//
+// Once a second the thread checks the sizes of the files being written and
+// requests an early rotation when one of them has grown past --max-file-size.
+// Every RETENTION_SCAN_SEC, and right after each rotation, it walks the output
+// directory (and its date=/hour= subdirectories with --hive) and deletes the
+// oldest finished xcapture files until their total is within --retain-size and
+// the filesystem has at least --retain-free bytes available. Files currently
+// being written and Parquet .tmp files are never deleted.
+
+#define RETENTION_CHECK_MS   1000
+#define RETENTION_SCAN_SEC   10
+
+struct ret_file {
+    char *path;
+    time_t mtime;
+    __u64 bytes;                // allocated bytes, what du and df would count
+};
+
+static struct {
+    char dir[PATH_MAX];
+    __u64 max_file_bytes;
+    __u64 quota_bytes;
+    __u64 min_free_bytes;
+
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    bool rotated;               // rescan right away, the previous files just got closed
+    char current[RETENTION_MAX_FILES][PATH_MAX];
+    int nr_current;
+    __u64 generation;           // bumped with every new current file list
+    int size_due;
+
+    // below here only touched by the retention thread
+    char checked[RETENTION_MAX_FILES][PATH_MAX];
+    struct stat checked_st[RETENTION_MAX_FILES];
+    int nr_checked;
+    __u64 checked_generation;
+    struct ret_file *files;
+    size_t nr_files;
+    size_t max_files;
+    bool quota_warned;
+} ret = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// NUMBER[K|M|G|T][B], binary multiples
+int parse_size(const char *arg, __u64 *bytes_out)
+{
+    char *end = NULL;
+
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || end == arg || v == 0 || *arg == '-')
+        return -EINVAL;
+
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        case 't': case 'T': shift = 40; end++; break;
+    }
+    if (*end == 'b' || *end == 'B')
+        end++;
+    if (*end != '\0' || v > (~0ULL >> shift))
+        return -EINVAL;
+
+    *bytes_out = (__u64)v << shift;
+    return 0;
+}
+
+bool retention_enabled(const struct xcapture_context *xctx)
+{
+    return xctx->max_file_size || xctx->retain_bytes || xctx->retain_free_bytes;
+}
+
+void retention_set_current(const char **paths, int nr_paths)
+{
+    pthread_mutex_lock(&ret.lock);
+    ret.nr_current = 0;
+    for (int i = 0; i < nr_paths && i < RETENTION_MAX_FILES; i++)
+        snprintf(ret.current[ret.nr_current++], PATH_MAX, "%s", paths[i]);
+    ret.generation++;
+    ret.rotated = true;
+    __atomic_store_n(&ret.size_due, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&ret.cond);
+    pthread_mutex_unlock(&ret.lock);
+}
+
+bool retention_size_rotation_due(void)
+{
+    return __atomic_load_n(&ret.size_due, __ATOMIC_ACQUIRE);
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+    size_t len = strlen(s), slen = strlen(suffix);
+    return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+// Parquet files are only renamed to their final name at close, the .tmp is what grows
+static int stat_current(const char *path, struct stat *st)
+{
+    if (has_suffix(path, ".parquet")) {
+        char tmp[PATH_MAX + 4];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        if (stat(tmp, st) == 0)
+            return 0;
+    }
+    return stat(path, st);
+}
+
+// Take a private copy of the current file list, so that no stat() on a slow
+// filesystem ever happens with the lock held
+static void refresh_current(void)
+{
+    pthread_mutex_lock(&ret.lock);
+    ret.nr_checked = ret.nr_current;
+    ret.checked_generation = ret.generation;
+    memcpy(ret.checked, ret.current, sizeof(ret.current[0]) * ret.nr_current);
+    pthread_mutex_unlock(&ret.lock);
+
+    for (int i = 0; i < ret.nr_checked; i++)
+        if (stat_current(ret.checked[i], &ret.checked_st[i]))
+            memset(&ret.checked_st[i], 0, sizeof(ret.checked_st[i]));
+}
+
+// A rotation while the copies were stat'ed has already replaced the files
+// that grew too big, the request would only rotate the new ones right away
+static void check_file_sizes(void)
+{
+    for (int i = 0; i < ret.nr_checked; i++) {
+        if ((__u64)ret.checked_st[i].st_size >= ret.max_file_bytes) {
+            pthread_mutex_lock(&ret.lock);
+            if (ret.generation == ret.checked_generation)
+                __atomic_store_n(&ret.size_due, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&ret.lock);
+            return;
+        }
+    }
+}
+
+static bool is_current(const struct stat *st)
+{
+    for (int i = 0; i < ret.nr_checked; i++)
+        if (ret.checked_st[i].st_ino == st->st_ino && ret.checked_st[i].st_dev == st->st_dev)
+            return true;
+    return false;
+}
+
+static bool is_output_file(const char *name)
+{
+    return strncmp(name, "xcapture_", 9) == 0 &&
+           (has_suffix(name, ".csv") || has_suffix(name, ".csv.zst") ||
+            has_suffix(name, ".csv.lz4") || has_suffix(name, ".parquet") || has_suffix(name, ".xcj"));
+}
+
+// nftw() has no user pointer, the scan state lives in ret
+static int collect_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    const char *name = path + ftw->base;
+
+    // only descend into the --hive date=YYYY-MM-DD/hour=HH directories
+    if (type == FTW_D) {
+        if (ftw->level == 0 ||
+            (ftw->level == 1 && strncmp(name, "date=", 5) == 0) ||
+            (ftw->level == 2 && strncmp(name, "hour=", 5) == 0))
+            return FTW_CONTINUE;
+        return FTW_SKIP_SUBTREE;
+    }
+
+    if (type != FTW_F || !is_output_file(name) || is_current(st))
+        return FTW_CONTINUE;
+
+    if (ret.nr_files == ret.max_files) {
+        size_t max = ret.max_files ? ret.max_files * 2 : 1024;
+        struct ret_file *files = realloc(ret.files, max * sizeof(*files));
+        if (!files)
+            return FTW_STOP;
+        ret.files = files;
+        ret.max_files = max;
+    }
+
+    char *copy = strdup(path);
+    if (!copy)
+        return FTW_STOP;
+
+    ret.files[ret.nr_files++] = (struct ret_file) {
+        .path = copy,
+        .mtime = st->st_mtime,
+        .bytes = (__u64)st->st_blocks * 512,
+    };
+    return FTW_CONTINUE;
+}
+
+static int cmp_oldest(const void *a, const void *b)
+{
+    const struct ret_file *fa = a, *fb = b;
+
+    if (fa->mtime != fb->mtime)
+        return fa->mtime < fb->mtime ? -1 : 1;
+    return strcmp(fa->path, fb->path);
+}
+
+// remove the hour=HH and date=YYYY-MM-DD directories once they're empty
+static void prune_dirs(char *path)
+{
+    for (int depth = 0; depth < 2; depth++) {
+        char *slash = strrchr(path, '/');
+        if (!slash)
+            return;
+        *slash = '\0';
+        if (strcmp(path, ret.dir) == 0 || rmdir(path))
+            return;
+    }
+}
+
+static void enforce_quota(void)
+{
+    __u64 total = 0, avail = 0, removed_bytes = 0;
+    int removed = 0;
+    struct statvfs vfs;
+
+    ret.nr_files = 0;
+    if (nftw(ret.dir, collect_file, 16, FTW_PHYS | FTW_ACTIONRETVAL) < 0) {
+        fprintf(stderr, "Retention: failed to scan %s: %s\n", ret.dir, strerror(errno));
+        goto out;
+    }
+
+    // files being written count towards the total, but can't be deleted
+    for (int i = 0; i < ret.nr_checked; i++)
+        total += (__u64)ret.checked_st[i].st_blocks * 512;
+    for (size_t i = 0; i < ret.nr_files; i++)
+        total += ret.files[i].bytes;
+
+    if (ret.min_free_bytes) {
+        if (statvfs(ret.dir, &vfs)) {
+            fprintf(stderr, "Retention: statvfs %s failed: %s\n", ret.dir, strerror(errno));
+            goto out;
+        }
+        avail = (__u64)vfs.f_bavail * vfs.f_frsize;
+    }
+
+    if (ret.nr_files)
+        qsort(ret.files, ret.nr_files, sizeof(*ret.files), cmp_oldest);
+
+    for (size_t i = 0; i < ret.nr_files; i++) {
+        bool over_quota = ret.quota_bytes && total > ret.quota_bytes;
+        bool low_space = ret.min_free_bytes && avail < ret.min_free_bytes;
+
+        if (!over_quota && !low_space)
+            break;
+
+        if (unlink(ret.files[i].path)) {
+            if (errno != ENOENT)
+                fprintf(stderr, "Retention: failed to delete %s: %s\n", ret.files[i].path, strerror(errno));
+            continue;
+        }
+
+        total -= ret.files[i].bytes;
+        avail += ret.files[i].bytes;
+        removed_bytes += ret.files[i].bytes;
+        removed++;
+        prune_dirs(ret.files[i].path);
+    }
+
+    if (removed)
+        fprintf(stderr, "Retention: deleted %d old output files, %'llu KB\n", removed, removed_bytes / 1024);
+
+    // only the files being written are left, nothing more we can do
+    bool still_over = (ret.quota_bytes && total > ret.quota_bytes) ||
+                      (ret.min_free_bytes && avail < ret.min_free_bytes);
+    if (still_over && !ret.quota_warned)
+        fprintf(stderr, "Retention: quota still exceeded after deleting all finished output files\n");
+    ret.quota_warned = still_over;
+
+out:
+    for (size_t i = 0; i < ret.nr_files; i++)
+        free(ret.files[i].path);
+    ret.nr_files = 0;
+}
+
+static void *retention_main(void *arg)
+{
+    (void)arg;
+    struct timespec now, next_scan = { 0 };
+
+    pthread_mutex_lock(&ret.lock);
+    while (!ret.stop) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool scan = (ret.quota_bytes || ret.min_free_bytes) &&
+                    (ret.rotated || now.tv_sec >= next_scan.tv_sec);
+        ret.rotated = false;
+        pthread_mutex_unlock(&ret.lock);
+
+        refresh_current();
+        if (ret.max_file_bytes)
+            check_file_sizes();
+        if (scan) {
+            enforce_quota();
+            next_scan.tv_sec = now.tv_sec + RETENTION_SCAN_SEC;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec deadline = {
+            .tv_sec = now.tv_sec + RETENTION_CHECK_MS / 1000,
+            .tv_nsec = now.tv_nsec,
+        };
+
+        pthread_mutex_lock(&ret.lock);
+        while (!ret.stop && !ret.rotated &&
+               pthread_cond_timedwait(&ret.cond, &ret.lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&ret.lock);
+
+    return NULL;
+}
+
+int retention_start(const struct xcapture_context *xctx)
+{
+    pthread_condattr_t attr;
+    sigset_t all, old;
+    int err;
+
+    snprintf(ret.dir, sizeof(ret.dir), "%s", xctx->output_dirname ? xctx->output_dirname : DEFAULT_OUTPUT_DIR);
+    ret.max_file_bytes = xctx->max_file_size;
+    ret.quota_bytes = xctx->retain_bytes;
+    ret.min_free_bytes = xctx->retain_free_bytes;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ret.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // keep SIGINT/SIGTERM for the sampler thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&ret.thread, NULL, retention_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err)
+        return -err;
+
+    ret.started = true;
+    return 0;
+}
+
+void retention_stop(void)
+{
+    if (!ret.started)
+        return;
+
+    pthread_mutex_lock(&ret.lock);
+    ret.stop = true;
+    pthread_cond_signal(&ret.cond);
+    pthread_mutex_unlock(&ret.lock);
+
+    pthread_join(ret.thread, NULL);
+    ret.started = false;
+    free(ret.files);
+    ret.files = NULL;
+    ret.max_files = 0;
+}
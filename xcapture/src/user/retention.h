@@ -0,0 +1,19 @@
+#ifndef __RETENTION_H
+#define __RETENTION_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+#include "xcapture_context.h"
+
+#define RETENTION_MAX_FILES 8     // output files open at the same time
+
+int parse_size(const char *arg, __u64 *bytes_out);
+bool retention_enabled(const struct xcapture_context *xctx);
+int retention_start(const struct xcapture_context *xctx);
+void retention_stop(void);
+
+// Called after each rotation with the files that are now being written
+void retention_set_current(const char **paths, int nr_paths);
+bool retention_size_rotation_due(void);
+
+#endif /* __RETENTION_H */
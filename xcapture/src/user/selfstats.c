@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xcapture.h"
+#include "selfstats.h"
+#include "pipeline.h"
+
+// Self-instrumentation. Every output file period gets one batch of rows in
+// xcapture_selfstats_*.csv, covering the time since the previous batch:
+//
+//   KIND     NAME                  METRIC
+//   prog     get_tasks, ...        run_cnt, run_time_ns, avg_ns   (BPF_ENABLE_STATS)
+//   drops    task_samples, ...     count   (xcap_drops map, pipeline input queues)
+//   latency  iteration/poll/write  count, sum_ns, max_ns, p50_ns, p99_ns, p999_ns
+//                                  and lt_<N> bucket counts, N = ns upper bound
+//   loop     ticks                 missed
+//   process  xcapture              user_us, sys_us (getrusage)
+//
+// Program stats and drop counters are cumulative in the kernel, the rows hold
+// the difference to the previous batch. The latency histograms have log2
+// buckets, the percentiles are the upper bound of the bucket they fall into
+
+#define SELFSTATS_BUCKETS 41    // 0 ns, then [2^(i-1), 2^i) up to ~18 minutes
+
+static const char *drop_names[XCAP_DROP_COUNTERS] = {
+    [XCAP_DROP_TASK_SAMPLES]    = "task_samples",
+    [XCAP_DROP_STACK_TRACES]    = "stack_traces",
+    [XCAP_DROP_SC_COMPLETION]   = "syscall_completion",
+    [XCAP_DROP_IORQ_COMPLETION] = "iorq_completion",
+    [XCAP_DROP_EMITTED_STACKS]  = "emitted_stacks",
+    [XCAP_DROP_TASK_AGG]        = "task_agg",
+    [XCAP_DROP_IORQ_TRACKING]   = "iorq_tracking",
+    [XCAP_DROP_TASK_STORAGE]    = "task_storage",
+    [XCAP_DROP_LATENCY_HIST]    = "latency_hist",
+    [XCAP_DROP_TASK_SEQ]        = "task_seq",
+};
+
+static const char *hist_names[SELFSTATS_NR_HISTS] = {
+    [SELFSTATS_ITERATION] = "iteration",
+    [SELFSTATS_POLL]      = "poll",
+    [SELFSTATS_WRITE]     = "write",
+};
+
+struct selfstats_hist_data {
+    __u64 buckets[SELFSTATS_BUCKETS];
+    __u64 sum_ns;
+    __u64 max_ns;
+};
+
+struct selfstats_prog {
+    char name[BPF_OBJ_NAME_LEN];
+    int fd;
+    __u64 run_time_ns;
+    __u64 run_cnt;
+};
+
+static struct {
+    bool enabled;
+    int stats_fd;               // BPF_ENABLE_STATS stays on while this is open
+    int drops_fd;
+    int ncpus;
+    __u64 *percpu;
+    __u64 drops[XCAP_DROP_COUNTERS];
+    __u64 pipeline_drops;
+    __u64 missed_ticks;
+    struct selfstats_prog progs[SELFSTATS_MAX_PROGS];
+    int nr_progs;
+    struct selfstats_hist_data hists[SELFSTATS_NR_HISTS];
+    struct timespec last_ts;
+    struct rusage last_ru;
+} ss = { .stats_fd = -1, .drops_fd = -1 };
+
+int selfstats_init(int drops_map_fd, bool verbose)
+{
+    ss.ncpus = libbpf_num_possible_cpus();
+    if (ss.ncpus <= 0)
+        return -EINVAL;
+
+    ss.percpu = calloc(ss.ncpus, sizeof(*ss.percpu));
+    if (!ss.percpu)
+        return -ENOMEM;
+
+    // Without CAP_SYS_ADMIN (or on old kernels) the program rows just stay at 0,
+    // unless kernel.bpf_stats_enabled is set
+    ss.stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+    if (ss.stats_fd < 0 && verbose)
+        fprintf(stderr, "Warning: Failed to enable BPF program run time stats: %s\n", strerror(-ss.stats_fd));
+
+    ss.drops_fd = drops_map_fd;
+    clock_gettime(CLOCK_REALTIME, &ss.last_ts);
+    getrusage(RUSAGE_SELF, &ss.last_ru);
+    ss.enabled = true;
+    return 0;
+}
+
+void selfstats_add_object(struct bpf_object *obj)
+{
+    struct bpf_program *prog;
+
+    if (!ss.enabled || !obj)
+        return;
+
+    bpf_object__for_each_program(prog, obj) {
+        int fd = bpf_program__fd(prog);
+
+        if (fd < 0 || ss.nr_progs == SELFSTATS_MAX_PROGS)
+            continue;
+
+        struct selfstats_prog *p = &ss.progs[ss.nr_progs++];
+        snprintf(p->name, sizeof(p->name), "%s", bpf_program__name(prog));
+        p->fd = fd;
+    }
+}
+
+void selfstats_destroy(void)
+{
+    if (ss.stats_fd >= 0)
+        close(ss.stats_fd);
+    ss.stats_fd = -1;
+    free(ss.percpu);
+    ss.percpu = NULL;
+    ss.enabled = false;
+}
+
+void selfstats_record(enum selfstats_hist hist, __u64 ns)
+{
+    struct selfstats_hist_data *h = &ss.hists[hist];
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    if (b >= SELFSTATS_BUCKETS)
+        b = SELFSTATS_BUCKETS - 1;
+
+    __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_ns, ns, __ATOMIC_RELAXED);
+
+    __u64 max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void selfstats_count_missed_ticks(long missed)
+{
+    __atomic_add_fetch(&ss.missed_ticks, missed, __ATOMIC_RELAXED);
+}
+
+static void write_row(FILE *f, const char *ts, double interval, const char *kind,
+                      const char *name, const char *metric, __u64 value)
+{
+    fprintf(f, "%s,%.3f,%s,%s,%s,%llu\n", ts, interval, kind, name, metric, value);
+}
+
+static __u64 bucket_limit(int b)
+{
+    return b ? 1ULL << b : 1;
+}
+
+static __u64 percentile(const __u64 *buckets, __u64 count, double pct)
+{
+    __u64 want = (__u64)(count * pct + 0.999999), seen = 0;
+
+    for (int b = 0; b < SELFSTATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= want)
+            return bucket_limit(b);
+    }
+    return bucket_limit(SELFSTATS_BUCKETS - 1);
+}
+
+static void write_hist(FILE *f, const char *ts, double interval, enum selfstats_hist hist)
+{
+    struct selfstats_hist_data *h = &ss.hists[hist];
+    const char *name = hist_names[hist];
+    __u64 buckets[SELFSTATS_BUCKETS], count = 0;
+    char metric[32];
+
+    // take and reset, records that race with this land in the next batch
+    for (int b = 0; b < SELFSTATS_BUCKETS; b++) {
+        buckets[b] = __atomic_exchange_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+        count += buckets[b];
+    }
+    __u64 sum = __atomic_exchange_n(&h->sum_ns, 0, __ATOMIC_RELAXED);
+    __u64 max = __atomic_exchange_n(&h->max_ns, 0, __ATOMIC_RELAXED);
+
+    write_row(f, ts, interval, "latency", name, "count", count);
+    if (!count)
+        return;
+
+    write_row(f, ts, interval, "latency", name, "sum_ns", sum);
+    write_row(f, ts, interval, "latency", name, "max_ns", max);
+    write_row(f, ts, interval, "latency", name, "p50_ns", percentile(buckets, count, 0.50));
+    write_row(f, ts, interval, "latency", name, "p99_ns", percentile(buckets, count, 0.99));
+    write_row(f, ts, interval, "latency", name, "p999_ns", percentile(buckets, count, 0.999));
+
+    for (int b = 0; b < SELFSTATS_BUCKETS; b++) {
+        if (!buckets[b])
+            continue;
+        snprintf(metric, sizeof(metric), "lt_%llu", bucket_limit(b));
+        write_row(f, ts, interval, "latency", name, metric, buckets[b]);
+    }
+}
+
+static void write_progs(FILE *f, const char *ts, double interval)
+{
+    for (int i = 0; i < ss.nr_progs; i++) {
+        struct selfstats_prog *p = &ss.progs[i];
+        struct bpf_prog_info info;
+        __u32 len = sizeof(info);
+
+        memset(&info, 0, sizeof(info));
+        if (bpf_prog_get_info_by_fd(p->fd, &info, &len))
+            continue;
+
+        __u64 cnt = info.run_cnt - p->run_cnt;
+        __u64 ns = info.run_time_ns - p->run_time_ns;
+        p->run_cnt = info.run_cnt;
+        p->run_time_ns = info.run_time_ns;
+
+        write_row(f, ts, interval, "prog", p->name, "run_cnt", cnt);
+        write_row(f, ts, interval, "prog", p->name, "run_time_ns", ns);
+        write_row(f, ts, interval, "prog", p->name, "avg_ns", cnt ? ns / cnt : 0);
+    }
+}
+
+static void write_drops(FILE *f, const char *ts, double interval)
+{
+    for (__u32 key = 0; ss.drops_fd >= 0 && key < XCAP_DROP_COUNTERS; key++) {
+        __u64 total = 0;
+
+        if (bpf_map_lookup_elem(ss.drops_fd, &key, ss.percpu))
+            continue;
+        for (int cpu = 0; cpu < ss.ncpus; cpu++)
+            total += ss.percpu[cpu];
+
+        write_row(f, ts, interval, "drops", drop_names[key], "count", total - ss.drops[key]);
+        ss.drops[key] = total;
+    }
+
+    __u64 pipeline_total = pipeline_dropped();
+    write_row(f, ts, interval, "drops", "pipeline_input", "count", pipeline_total - ss.pipeline_drops);
+    ss.pipeline_drops = pipeline_total;
+}
+
+static __u64 tv_us(struct timeval tv)
+{
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+void selfstats_write(FILE *f)
+{
+    struct timespec now;
+    struct rusage ru;
+    struct tm tm;
+    char ts[64];
+
+    if (!ss.enabled || !f)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    double interval = (now.tv_sec - ss.last_ts.tv_sec) + (now.tv_nsec - ss.last_ts.tv_nsec) / 1e9;
+    localtime_r(&now.tv_sec, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(ts + 19, sizeof(ts) - 19, ".%06ld", now.tv_nsec / 1000);
+
+    write_progs(f, ts, interval);
+    write_drops(f, ts, interval);
+
+    for (int i = 0; i < SELFSTATS_NR_HISTS; i++)
+        write_hist(f, ts, interval, i);
+
+    write_row(f, ts, interval, "loop", "ticks", "missed",
+              __atomic_exchange_n(&ss.missed_ticks, 0, __ATOMIC_RELAXED));
+
+    getrusage(RUSAGE_SELF, &ru);
+    write_row(f, ts, interval, "process", "xcapture", "user_us", tv_us(ru.ru_utime) - tv_us(ss.last_ru.ru_utime));
+    write_row(f, ts, interval, "process", "xcapture", "sys_us", tv_us(ru.ru_stime) - tv_us(ss.last_ru.ru_stime));
+
+    ss.last_ts = now;
+    ss.last_ru = ru;
+}
@@ -0,0 +1,34 @@
+#ifndef __SELFSTATS_H
+#define __SELFSTATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+
+// xcapture's own overhead and data loss, written to xcapture_selfstats_*.csv
+// once per output file period. See selfstats.c for the rows
+
+#define SELFSTATS_CSV_FILENAME "xcapture_selfstats"
+#define SELFSTATS_CSV_HEADER   "TIMESTAMP,INTERVAL_SEC,KIND,NAME,METRIC,VALUE"
+#define SELFSTATS_MAX_PROGS    32
+
+enum selfstats_hist {
+    SELFSTATS_ITERATION,        // one sampling loop iteration
+    SELFSTATS_POLL,             // ring buffer poll (or pipeline consumer wakeup)
+    SELFSTATS_WRITE,            // fflush of the output files (or pipeline writev)
+    SELFSTATS_NR_HISTS
+};
+
+int selfstats_init(int drops_map_fd, bool verbose);
+void selfstats_add_object(struct bpf_object *obj);
+void selfstats_destroy(void);
+
+// Safe to call from any thread
+void selfstats_record(enum selfstats_hist hist, __u64 ns);
+void selfstats_count_missed_ticks(long missed);
+
+// Rows for everything since the previous call
+void selfstats_write(FILE *f);
+
+#endif /* __SELFSTATS_H */
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdlib.h>
+#include <string.h>
+#include "stack_table.h"
+
+#define STACK_TABLE_INIT_SLOTS 1024     // power of 2
+#define STACK_TABLE_INIT_ARENA (64 * 1024)
+
+struct stack_slot {
+    __u64 hash;
+    __u32 off;          // into the arena
+    __u32 len;          // without the NUL
+    __u32 epoch;        // of the last lookup or insert
+    __u8 used;
+    __u8 is_kernel;
+};
+
+struct stack_table {
+    struct stack_slot *slots;
+    __u32 mask;
+    __u32 count;
+
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t live_bytes;  // strings still referenced, the rest are replaced ones
+    size_t max_bytes;
+
+    __u32 epoch;
+    struct stack_table_stats stats;
+};
+
+static inline __u32 slot_index(const struct stack_table *st, __u64 hash, bool is_kernel)
+{
+    // stack hashes come from the kernel already mixed, spread them once more
+    // so that kernel and user stacks with the same hash don't collide
+    return (__u32)(((hash ^ is_kernel) * 0x9e3779b97f4a7c15ULL) >> 32) & st->mask;
+}
+
+// Slot holding the key, or the free slot where it would go
+static struct stack_slot *find_slot(struct stack_table *st, __u64 hash, bool is_kernel)
+{
+    __u32 i = slot_index(st, hash, is_kernel);
+
+    for (;;) {
+        struct stack_slot *s = &st->slots[i];
+
+        if (!s->used || (s->hash == hash && s->is_kernel == is_kernel))
+            return s;
+        i = (i + 1) & st->mask;
+    }
+}
+
+static int grow_slots(struct stack_table *st)
+{
+    struct stack_slot *old = st->slots;
+    __u32 old_cap = st->mask + 1;
+    __u32 cap = old_cap * 2;
+
+    st->slots = calloc(cap, sizeof(*st->slots));
+    if (!st->slots) {
+        st->slots = old;
+        return -1;
+    }
+    st->mask = cap - 1;
+
+    for (__u32 i = 0; i < old_cap; i++)
+        if (old[i].used)
+            *find_slot(st, old[i].hash, old[i].is_kernel) = old[i];
+
+    free(old);
+    return 0;
+}
+
+struct stack_table *stack_table_new(size_t max_bytes)
+{
+    struct stack_table *st = calloc(1, sizeof(*st));
+    if (!st)
+        return NULL;
+
+    st->max_bytes = max_bytes < STACK_TABLE_MIN_BYTES ? STACK_TABLE_MIN_BYTES : max_bytes;
+    st->arena_cap = STACK_TABLE_INIT_ARENA;
+    st->arena = malloc(st->arena_cap);
+    st->slots = calloc(STACK_TABLE_INIT_SLOTS, sizeof(*st->slots));
+    st->mask = STACK_TABLE_INIT_SLOTS - 1;
+
+    if (!st->arena || !st->slots) {
+        stack_table_free(st);
+        return NULL;
+    }
+    return st;
+}
+
+void stack_table_free(struct stack_table *st)
+{
+    if (!st)
+        return;
+    free(st->slots);
+    free(st->arena);
+    free(st);
+}
+
+static int cmp_epoch_desc(const void *a, const void *b)
+{
+    const struct stack_slot *sa = a, *sb = b;
+
+    if (sa->epoch != sb->epoch)
+        return sa->epoch > sb->epoch ? -1 : 1;
+    return 0;
+}
+
+static int cmp_offset(const void *a, const void *b)
+{
+    const struct stack_slot *sa = a, *sb = b;
+
+    return sa->off < sb->off ? -1 : sa->off > sb->off;
+}
+
+// Keep the most recently used strings that fit in half the budget, leaving
+// room for need more bytes, and move them to the start of the arena
+static int compact(struct stack_table *st, size_t need)
+{
+    struct stack_slot *keep = malloc(st->count * sizeof(*keep) + 1);
+    size_t target = st->max_bytes / 2;
+    size_t kept_bytes = 0;
+    __u32 n = 0, kept = 0;
+
+    if (!keep)
+        return -1;
+
+    for (__u32 i = 0; i <= st->mask; i++)
+        if (st->slots[i].used)
+            keep[n++] = st->slots[i];
+
+    qsort(keep, n, sizeof(*keep), cmp_epoch_desc);
+    while (kept < n && kept_bytes + keep[kept].len + 1 + need <= target) {
+        kept_bytes += keep[kept].len + 1;
+        kept++;
+    }
+    st->stats.evictions += n - kept;
+
+    // moving down in offset order never overwrites a string not yet moved
+    qsort(keep, kept, sizeof(*keep), cmp_offset);
+    memset(st->slots, 0, (st->mask + 1) * sizeof(*st->slots));
+    st->arena_len = 0;
+
+    for (__u32 i = 0; i < kept; i++) {
+        memmove(st->arena + st->arena_len, st->arena + keep[i].off, keep[i].len + 1);
+        keep[i].off = st->arena_len;
+        st->arena_len += keep[i].len + 1;
+        *find_slot(st, keep[i].hash, keep[i].is_kernel) = keep[i];
+    }
+
+    st->count = kept;
+    st->live_bytes = st->arena_len;
+    st->stats.compactions++;
+    free(keep);
+    return 0;
+}
+
+int stack_table_insert(struct stack_table *st, __u64 hash, bool is_kernel, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (len + 1 > st->max_bytes / 2)
+        len = st->max_bytes / 2 - 1;
+
+    if (st->arena_len + len + 1 > st->max_bytes && compact(st, len + 1))
+        return -1;
+
+    if (st->arena_len + len + 1 > st->arena_cap) {
+        size_t cap = st->arena_cap;
+
+        while (cap < st->arena_len + len + 1)
+            cap *= 2;
+        if (cap > st->max_bytes)
+            cap = st->max_bytes;
+
+        char *p = realloc(st->arena, cap);
+        if (!p)
+            return -1;
+        st->arena = p;
+        st->arena_cap = cap;
+    }
+
+    if ((st->count + 1) * 10 > (st->mask + 1) * 7 && grow_slots(st))
+        return -1;
+
+    struct stack_slot *s = find_slot(st, hash, is_kernel);
+    if (s->used) {
+        st->live_bytes -= s->len + 1;
+    } else {
+        s->used = 1;
+        s->hash = hash;
+        s->is_kernel = is_kernel;
+        st->count++;
+    }
+
+    memcpy(st->arena + st->arena_len, str, len);
+    st->arena[st->arena_len + len] = '\0';
+    s->off = st->arena_len;
+    s->len = len;
+    s->epoch = st->epoch;
+    st->arena_len += len + 1;
+    st->live_bytes += len + 1;
+    st->stats.inserts++;
+    return 0;
+}
+
+const char *stack_table_lookup(struct stack_table *st, __u64 hash, bool is_kernel)
+{
+    st->stats.lookups++;
+
+    struct stack_slot *s = find_slot(st, hash, is_kernel);
+    if (!s->used)
+        return NULL;
+
+    s->epoch = st->epoch;
+    st->stats.hits++;
+    return st->arena + s->off;
+}
+
+void stack_table_next_epoch(struct stack_table *st)
+{
+    st->epoch++;
+}
+
+void stack_table_get_stats(struct stack_table *st, struct stack_table_stats *stats)
+{
+    *stats = st->stats;
+    stats->entries = st->count;
+    stats->arena_bytes = st->live_bytes;
+    stats->arena_alloc = st->arena_cap + (st->mask + 1) * sizeof(*st->slots);
+}
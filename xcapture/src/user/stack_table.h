@@ -0,0 +1,45 @@
+#ifndef __STACK_TABLE_H
+#define __STACK_TABLE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/types.h>
+
+// Symbolized stacks by stack hash, for the stack traces printed after each
+// sample in stdout mode. An open addressing table holds (hash, offset) pairs
+// into one growable string arena. When the arena reaches its byte budget, the
+// stacks not looked up or inserted for the longest time are dropped and the
+// arena is compacted down to half the budget.
+
+#define STACK_TABLE_DEFAULT_BYTES (16 * 1024 * 1024)
+#define STACK_TABLE_MIN_BYTES     (64 * 1024)
+
+struct stack_table;
+
+struct stack_table_stats {
+    __u64 lookups;
+    __u64 hits;
+    __u64 inserts;
+    __u64 evictions;
+    __u64 compactions;
+    __u64 entries;
+    __u64 arena_bytes;      // in use by the current strings
+    __u64 arena_alloc;      // allocated, arena and slots
+};
+
+// max_bytes bounds the string arena, raised to STACK_TABLE_MIN_BYTES
+struct stack_table *stack_table_new(size_t max_bytes);
+void stack_table_free(struct stack_table *st);
+
+// Returns 0, or -1 when out of memory. An existing string is replaced
+int stack_table_insert(struct stack_table *st, __u64 hash, bool is_kernel, const char *str);
+
+// The string stays valid until the next stack_table_insert(), NULL if not cached
+const char *stack_table_lookup(struct stack_table *st, __u64 hash, bool is_kernel);
+
+// Starts a new sampling iteration, eviction drops the stacks of older ones first
+void stack_table_next_epoch(struct stack_table *st);
+
+void stack_table_get_stats(struct stack_table *st, struct stack_table_stats *stats);
+
+#endif /* __STACK_TABLE_H */
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+// Lookup time and memory of the stack table over synthetic stack hash
+// distributions, compared to the direct mapped 4096 x 4 kB caches and the
+// linear scan unique stack list it replaced. Not installed, build it with
+// cmake -DBUILD_BENCHMARKS=ON and run build/stack-table-bench [distinct] [lookups]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "stack_table.h"
+
+#define OLD_CACHE_SIZE 4096
+#define OLD_UNIQUE_MAX 131072
+
+struct old_cache_entry {
+    __u64 hash;
+    bool valid;
+    char symbolized[4096];
+};
+
+struct old_unique {
+    __u64 hash;
+    bool is_kernel;
+};
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// resident set size from /proc/self/statm, in kB
+static long rss_kb(void)
+{
+    long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * 4;
+}
+
+static __u64 rnd_state = 0x2545f4914f6cdd1dULL;
+
+static __u64 rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+// stack hashes as the BPF side produces them, already well mixed
+static __u64 stack_hash_of(__u32 n)
+{
+    __u64 h = (n + 1) * 0x9e3779b97f4a7c15ULL;
+
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 29);
+}
+
+// A symbolized stack of 5-60 frames, about 30 bytes per frame
+static size_t fake_stack(__u32 n, char *buf, size_t len)
+{
+    int frames = 5 + n % 56;
+    size_t off = 0;
+
+    for (int i = 0; i < frames && off + 40 < len; i++)
+        off += snprintf(buf + off, len - off, "func_%u_%d+0x%x;", n % 997, i, (n * 31 + i) & 0xfff);
+    return off;
+}
+
+enum dist { DIST_UNIFORM, DIST_ZIPF, DIST_HOTSET };
+
+static const char *dist_name[] = { "uniform", "zipf(1.1)", "90/10 hotset" };
+
+// Pick the index of the next sampled stack among distinct ones
+struct picker {
+    enum dist dist;
+    __u32 distinct;
+    double *cdf;    // zipf only
+};
+
+static void picker_init(struct picker *p, enum dist dist, __u32 distinct)
+{
+    p->dist = dist;
+    p->distinct = distinct;
+    p->cdf = NULL;
+
+    if (dist == DIST_ZIPF) {
+        double sum = 0;
+
+        p->cdf = malloc(distinct * sizeof(*p->cdf));
+        for (__u32 i = 0; i < distinct; i++) {
+            sum += 1.0 / pow(i + 1, 1.1);
+            p->cdf[i] = sum;
+        }
+        for (__u32 i = 0; i < distinct; i++)
+            p->cdf[i] /= sum;
+    }
+}
+
+static __u32 pick(struct picker *p)
+{
+    switch (p->dist) {
+    case DIST_ZIPF: {
+        double u = (rnd() >> 11) * (1.0 / 9007199254740992.0);
+        __u32 lo = 0, hi = p->distinct - 1;
+
+        while (lo < hi) {
+            __u32 mid = (lo + hi) / 2;
+            if (p->cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+    case DIST_HOTSET:
+        // 90% of the samples hit 10% of the stacks
+        if (rnd() % 10)
+            return rnd() % (p->distinct / 10 + 1);
+        return rnd() % p->distinct;
+    default:
+        return rnd() % p->distinct;
+    }
+}
+
+// Every sampled stack is looked up, and emitted with its string on a miss,
+// the way lookup_cached_stack() and handle_stack_event() use the table
+static void bench_table(struct picker *p, __u32 lookups, size_t max_bytes)
+{
+    long rss0 = rss_kb();
+    struct stack_table *st = stack_table_new(max_bytes);
+    struct stack_table_stats stats;
+    char buf[4096];
+    __u64 t0 = now_ns();
+
+    for (__u32 i = 0; i < lookups; i++) {
+        __u32 n = pick(p);
+        __u64 hash = stack_hash_of(n);
+
+        if (!stack_table_lookup(st, hash, n & 1)) {
+            fake_stack(n, buf, sizeof(buf));
+            stack_table_insert(st, hash, n & 1, buf);
+        }
+        if (i % 1000 == 999)
+            stack_table_next_epoch(st);
+    }
+
+    __u64 ns = now_ns() - t0;
+
+    stack_table_get_stats(st, &stats);
+    printf("  stack_table %5zu MB  %7.1f ns/op  hit %5.1f%%  rss +%6ld kB  alloc %6llu kB  evicted %llu\n",
+           max_bytes >> 20, (double)ns / lookups, 100.0 * stats.hits / stats.lookups,
+           rss_kb() - rss0, stats.arena_alloc / 1024, stats.evictions);
+    stack_table_free(st);
+}
+
+static void bench_old_cache(struct picker *p, __u32 lookups)
+{
+    long rss0 = rss_kb();
+    struct old_cache_entry *kcache = calloc(OLD_CACHE_SIZE, sizeof(*kcache));
+    struct old_cache_entry *ucache = calloc(OLD_CACHE_SIZE, sizeof(*ucache));
+    __u64 hits = 0;
+    __u64 t0 = now_ns();
+
+    for (__u32 i = 0; i < lookups; i++) {
+        __u32 n = pick(p);
+        __u64 hash = stack_hash_of(n);
+        struct old_cache_entry *c = (n & 1) ? &kcache[hash % OLD_CACHE_SIZE] : &ucache[hash % OLD_CACHE_SIZE];
+
+        if (c->valid && c->hash == hash) {
+            hits++;
+            continue;
+        }
+        c->hash = hash;
+        c->valid = true;
+        fake_stack(n, c->symbolized, sizeof(c->symbolized));
+    }
+
+    __u64 ns = now_ns() - t0;
+
+    printf("  direct mapped      %7.1f ns/op  hit %5.1f%%  rss +%6ld kB  alloc %6zu kB\n",
+           (double)ns / lookups, 100.0 * hits / lookups, rss_kb() - rss0,
+           2 * OLD_CACHE_SIZE * sizeof(*kcache) / 1024);
+    free(kcache);
+    free(ucache);
+}
+
+// One sampling iteration's worth of add_unique_stack() calls, old and new
+static void bench_unique(struct picker *p, __u32 adds)
+{
+    static struct old_unique list[OLD_UNIQUE_MAX];
+    static __u32 slots[2 * OLD_UNIQUE_MAX];
+    __u32 mask = 2 * OLD_UNIQUE_MAX - 1;
+    __u32 *picks = malloc(adds * sizeof(*picks));
+    int count = 0;
+
+    for (__u32 i = 0; i < adds; i++)
+        picks[i] = pick(p);
+
+    __u64 t0 = now_ns();
+    for (__u32 i = 0; i < adds; i++) {
+        __u64 hash = stack_hash_of(picks[i]);
+        bool is_kernel = picks[i] & 1;
+        int j;
+
+        for (j = 0; j < count; j++)
+            if (list[j].hash == hash && list[j].is_kernel == is_kernel)
+                break;
+        if (j == count && count < OLD_UNIQUE_MAX) {
+            list[count].hash = hash;
+            list[count].is_kernel = is_kernel;
+            count++;
+        }
+    }
+    __u64 scan_ns = now_ns() - t0;
+    int scan_count = count;
+
+    count = 0;
+    memset(slots, 0, sizeof(slots));
+    t0 = now_ns();
+    for (__u32 i = 0; i < adds; i++) {
+        __u64 hash = stack_hash_of(picks[i]);
+        bool is_kernel = picks[i] & 1;
+        __u32 s = (__u32)(((hash ^ is_kernel) * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+        while (slots[s]) {
+            struct old_unique *u = &list[slots[s] - 1];
+            if (u->hash == hash && u->is_kernel == is_kernel)
+                break;
+            s = (s + 1) & mask;
+        }
+        if (!slots[s] && count < OLD_UNIQUE_MAX) {
+            list[count].hash = hash;
+            list[count].is_kernel = is_kernel;
+            slots[s] = ++count;
+        }
+    }
+    __u64 hash_ns = now_ns() - t0;
+
+    printf("  unique stacks %d/%d  linear scan %9.1f ns/add  open addressing %5.1f ns/add\n",
+           scan_count, count, (double)scan_ns / adds, (double)hash_ns / adds);
+    free(picks);
+}
+
+int main(int argc, char **argv)
+{
+    __u32 distinct = argc > 1 ? strtoul(argv[1], NULL, 10) : 50000;
+    __u32 lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+
+    if (distinct < 10 || lookups == 0) {
+        fprintf(stderr, "Usage: %s [distinct stacks >= 10] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    for (int d = DIST_UNIFORM; d <= DIST_HOTSET; d++) {
+        struct picker p;
+
+        picker_init(&p, d, distinct);
+        printf("%s, %u distinct stacks, %u lookups\n", dist_name[d], distinct, lookups);
+        bench_old_cache(&p, lookups);
+        bench_table(&p, lookups, STACK_TABLE_DEFAULT_BYTES);
+        bench_table(&p, lookups, 1 << 20);
+        bench_unique(&p, lookups < 200000 ? lookups : 200000);
+        free(p.cdf);
+    }
+    return 0;
+}
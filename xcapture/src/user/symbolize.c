@@ -0,0 +1,518 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+// xcapture-symbolize turns the raw user stacks that xcapture --defer-symbols
+// wrote into the ustacks files that xcapture would have written itself. Every
+// address is looked up in the mapping snapshot of its process, turned into an
+// offset in the ELF file and symbolized from that file, found by build id in
+// the debug directories or by its path under --root. A binary whose build id
+// doesn't match the captured one is not used, its frames stay unresolved.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <argp.h>
+#include <sys/stat.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "symcache.h"
+#include "blazesym.h"
+
+#define SYM_BINARY_BUCKETS 1024
+#define SYM_MAX_DEBUG_DIRS 8
+
+// an ELF file as captured, by build id or by path when it has none
+struct sym_binary {
+    char *key;
+    char *file;                 // what gets symbolized, NULL when not found
+    struct symcache_elf elf;
+    struct sym_binary *next;
+};
+
+struct sym_mapping {
+    __u64 maps_id;
+    __u64 start;
+    __u64 end;
+    __u64 offset;
+    char *build_id;
+    char *path;
+    struct sym_binary *bin;     // resolved on first use
+    bool resolved;
+};
+
+static const char *output_dirname;
+static const char *root_dirname = "";
+static const char *debug_dirs[SYM_MAX_DEBUG_DIRS] = { "/usr/lib/debug" };
+static int nr_debug_dirs = 1;
+static bool user_debug_dirs;
+static bool verbose;
+static char **inputs;
+static int nr_inputs;
+
+static blaze_symbolizer *symbolizer;
+static struct sym_binary *binaries[SYM_BINARY_BUCKETS];
+static struct sym_mapping *mappings;
+static size_t nr_mappings;
+
+static struct {
+    __u64 stacks;
+    __u64 frames;
+    __u64 unresolved;
+    __u64 mismatched;
+} stats;
+
+const char *argp_program_version = "xcapture-symbolize " XCAPTURE_VERSION;
+const char *argp_program_bug_address = "https://github.com/tanelpoder/0xtools";
+static const char argp_program_doc[] =
+"xcapture-symbolize writes ustacks files from xcapture --defer-symbols output\n"
+"\n"
+"USAGE: xcapture-symbolize [-o OUTPUT_DIRNAME] [--root DIR] [--debug-dir DIR] UADDRS_FILE...\n"
+"\n"
+"EXAMPLES:\n"
+"    xcapture-symbolize /tmp/data/xcapture_uaddrs_*.csv\n"
+"    xcapture-symbolize --root /mnt/prod-image --debug-dir /srv/debug -o /tmp/sym xcapture_uaddrs_2025-05-01.14.csv\n";
+
+enum {
+    OPT_ROOT = 1000,
+    OPT_DEBUG_DIR,
+};
+
+static const struct argp_option opts[] = {
+    { "output-dir", 'o', "DIR", 0, "Write the ustacks files to specified directory (default: next to the input files)", 0 },
+    { "root", OPT_ROOT, "DIR", 0, "Look up the captured binaries under DIR instead of /", 0 },
+    { "debug-dir", OPT_DEBUG_DIR, "DIR", 0, "Look up debug files by build id under DIR/.build-id (default: /usr/lib/debug, repeatable)", 0 },
+    { "verbose", 'v', NULL, 0, "Report binaries that could not be found or don't match the capture", 0 },
+    {},
+};
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+    switch (key) {
+        case 'o':
+            output_dirname = arg;
+            break;
+        case OPT_ROOT:
+            root_dirname = strcmp(arg, "/") == 0 ? "" : arg;
+            break;
+        case OPT_DEBUG_DIR:
+            if (!user_debug_dirs) {
+                nr_debug_dirs = 0;
+                user_debug_dirs = true;
+            }
+            if (nr_debug_dirs == SYM_MAX_DEBUG_DIRS) {
+                fprintf(stderr, "At most %d --debug-dir options are supported\n", SYM_MAX_DEBUG_DIRS);
+                argp_usage(state);
+                return EINVAL;
+            }
+            debug_dirs[nr_debug_dirs++] = arg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case ARGP_KEY_ARG:
+            inputs = realloc(inputs, (nr_inputs + 1) * sizeof(*inputs));
+            if (!inputs)
+                return ENOMEM;
+            inputs[nr_inputs++] = arg;
+            break;
+        case ARGP_KEY_END:
+            if (!nr_inputs) {
+                fprintf(stderr, "No uaddrs files given\n");
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static bool read_elf(const char *path, struct symcache_elf *elf)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    int err = symcache_read_elf(fd, elf);
+    close(fd);
+    return err == 0;
+}
+
+// The binary itself under --root when it is still the captured build, then a
+// separate debug file by build id, which keeps the program headers of the
+// binary it was split from
+static void find_binary(struct sym_binary *bin, const char *build_id, const char *path)
+{
+    char file[PATH_MAX];
+
+    snprintf(file, sizeof(file), "%s%s", root_dirname, path);
+    if (read_elf(file, &bin->elf)) {
+        if (!build_id[0] || strcmp(bin->elf.build_id, build_id) == 0) {
+            bin->file = strdup(file);
+            return;
+        }
+        stats.mismatched++;
+        if (verbose)
+            fprintf(stderr, "%s has build id %s, the capture had %s\n",
+                    file, bin->elf.build_id[0] ? bin->elf.build_id : "none", build_id);
+    }
+
+    if (!build_id[0] || strlen(build_id) < 3)
+        goto not_found;
+
+    for (int i = 0; i < nr_debug_dirs; i++) {
+        snprintf(file, sizeof(file), "%s/.build-id/%.2s/%s.debug", debug_dirs[i], build_id, build_id + 2);
+        if (read_elf(file, &bin->elf) && strcmp(bin->elf.build_id, build_id) == 0) {
+            bin->file = strdup(file);
+            return;
+        }
+    }
+
+not_found:
+    if (verbose)
+        fprintf(stderr, "No binary or debug file found for %s%s%s\n",
+                path, build_id[0] ? " build id " : "", build_id);
+}
+
+static struct sym_binary *get_binary(const char *build_id, const char *path)
+{
+    const char *key = build_id[0] ? build_id : path;
+    unsigned int h = 5381;
+
+    for (const char *p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    h &= SYM_BINARY_BUCKETS - 1;
+
+    for (struct sym_binary *b = binaries[h]; b; b = b->next)
+        if (strcmp(b->key, key) == 0)
+            return b;
+
+    struct sym_binary *bin = calloc(1, sizeof(*bin));
+    if (!bin)
+        return NULL;
+    bin->key = strdup(key);
+    find_binary(bin, build_id, path);
+
+    bin->next = binaries[h];
+    binaries[h] = bin;
+    return bin;
+}
+
+static int cmp_mapping(const void *a, const void *b)
+{
+    const struct sym_mapping *ma = a, *mb = b;
+
+    if (ma->maps_id != mb->maps_id)
+        return ma->maps_id < mb->maps_id ? -1 : 1;
+    if (ma->start != mb->start)
+        return ma->start < mb->start ? -1 : 1;
+    return 0;
+}
+
+static struct sym_mapping *find_mapping(__u64 maps_id, __u64 addr)
+{
+    size_t lo = 0, hi = nr_mappings;
+
+    // last mapping at or before (maps_id, addr)
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct sym_mapping *m = &mappings[mid];
+
+        if (m->maps_id < maps_id || (m->maps_id == maps_id && m->start <= addr))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!lo)
+        return NULL;
+
+    struct sym_mapping *m = &mappings[lo - 1];
+    return m->maps_id == maps_id && addr < m->end ? m : NULL;
+}
+
+// xcapture_umaps_STAMP.csv next to xcapture_uaddrs_STAMP.csv
+static int load_umaps(const char *uaddrs_path)
+{
+    char path[PATH_MAX];
+    char *dir = strdup(uaddrs_path);
+    const char *base = strrchr(uaddrs_path, '/');
+
+    base = base ? base + 1 : uaddrs_path;
+    snprintf(path, sizeof(path), "%s/%s%s", dirname(dir), UMAPS_CSV_FILENAME,
+             base + strlen(UADDRS_CSV_FILENAME));
+    free(dir);
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0, alloc = 0;
+    ssize_t len;
+
+    nr_mappings = 0;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        struct sym_mapping m = {0};
+        int pos = 0;
+
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        // the header line doesn't parse as hex
+        if (sscanf(line, "%llx,%llx,%llx,%llx,%n", &m.maps_id, &m.start, &m.end, &m.offset, &pos) < 4 || !pos)
+            continue;
+
+        char *build_id = line + pos;
+        char *comma = strchr(build_id, ',');
+        if (!comma || comma[1] != '\'' || line[len - 1] != '\'')
+            continue;
+        *comma = '\0';
+        line[len - 1] = '\0';
+
+        m.build_id = strdup(build_id);
+        m.path = strdup(comma + 2);
+
+        if (nr_mappings == alloc) {
+            alloc = alloc ? alloc * 2 : 4096;
+            mappings = realloc(mappings, alloc * sizeof(*mappings));
+            if (!mappings) {
+                fclose(f);
+                free(line);
+                return -1;
+            }
+        }
+        mappings[nr_mappings++] = m;
+    }
+
+    free(line);
+    fclose(f);
+
+    qsort(mappings, nr_mappings, sizeof(*mappings), cmp_mapping);
+    return 0;
+}
+
+static void free_umaps(void)
+{
+    for (size_t i = 0; i < nr_mappings; i++) {
+        free(mappings[i].build_id);
+        free(mappings[i].path);
+    }
+    nr_mappings = 0;
+}
+
+// Append one frame as in xcapture's own ustacks: symbol+0xoffset;inlined[inlined]
+static void symbolize_frame(__u64 maps_id, __u64 addr, char **out, char *end, bool *first)
+{
+    struct sym_mapping *m = find_mapping(maps_id, addr);
+
+    stats.frames++;
+    if (!m) {
+        stats.unresolved++;
+        return;
+    }
+
+    if (!m->resolved) {
+        m->bin = get_binary(m->build_id, m->path);
+        m->resolved = true;
+    }
+    if (!m->bin || !m->bin->file) {
+        stats.unresolved++;
+        return;
+    }
+
+    // address -> file offset -> virtual address in the ELF file
+    __u64 file_off = addr - m->start + m->offset;
+    __u64 virt = 0;
+    bool found = false;
+
+    for (int i = 0; i < m->bin->elf.nr_loads; i++) {
+        if (file_off >= m->bin->elf.loads[i].offset &&
+            file_off < m->bin->elf.loads[i].offset + m->bin->elf.loads[i].filesz) {
+            virt = file_off - m->bin->elf.loads[i].offset + m->bin->elf.loads[i].vaddr;
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        stats.unresolved++;
+        return;
+    }
+
+    struct blaze_symbolize_src_elf src = {
+        .type_size = sizeof(src),
+        .path = m->bin->file,
+        .debug_syms = true,
+    };
+    uint64_t offset = virt;
+
+    const struct blaze_syms *syms = blaze_symbolize_elf_virt_offsets(symbolizer, &src, &offset, 1);
+    if (!syms || syms->cnt == 0 || syms->syms[0].name == NULL) {
+        stats.unresolved++;
+        if (syms)
+            blaze_syms_free(syms);
+        return;
+    }
+
+    const struct blaze_sym *sym = &syms->syms[0];
+    int n = snprintf(*out, end - *out, "%s%s+0x%lx", *first ? "" : ";", sym->name, sym->offset);
+    if (n > 0 && n < end - *out) {
+        *out += n;
+        *first = false;
+    }
+
+    for (size_t j = 0; j < sym->inlined_cnt; j++) {
+        n = snprintf(*out, end - *out, ";%s[inlined]", sym->inlined[j].name);
+        if (n <= 0 || n >= end - *out)
+            break;
+        *out += n;
+    }
+
+    blaze_syms_free(syms);
+}
+
+static int symbolize_file(const char *uaddrs_path)
+{
+    const char *base = strrchr(uaddrs_path, '/');
+    char path[PATH_MAX];
+    int err = 0;
+
+    base = base ? base + 1 : uaddrs_path;
+    if (strncmp(base, UADDRS_CSV_FILENAME, strlen(UADDRS_CSV_FILENAME)) != 0) {
+        fprintf(stderr, "%s is not an xcapture uaddrs file\n", uaddrs_path);
+        return -1;
+    }
+
+    if (load_umaps(uaddrs_path))
+        return -1;
+
+    if (output_dirname) {
+        snprintf(path, sizeof(path), "%s/%s%s", output_dirname, USTACK_CSV_FILENAME,
+                 base + strlen(UADDRS_CSV_FILENAME));
+    } else {
+        char *dir = strdup(uaddrs_path);
+        snprintf(path, sizeof(path), "%s/%s%s", dirname(dir), USTACK_CSV_FILENAME,
+                 base + strlen(UADDRS_CSV_FILENAME));
+        free(dir);
+    }
+
+    FILE *in = fopen(uaddrs_path, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", uaddrs_path, strerror(errno));
+        free_umaps();
+        return -1;
+    }
+
+    // never overwrite, a ustacks file with that name may have real symbols in it
+    FILE *out = fopen(path, "wx");
+    if (!out) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        fclose(in);
+        free_umaps();
+        return -1;
+    }
+    fprintf(out, "USTACK_HASH,USTACK_SYMS\n");
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &cap, in)) > 0) {
+        __u64 hash, maps_id;
+        int pos = 0;
+
+        if (sscanf(line, "%llx,%llx,'%n", &hash, &maps_id, &pos) < 2 || !pos)
+            continue;
+
+        char syms[4096] = "";
+        char *p = syms;
+        bool first = true;
+
+        for (char *a = line + pos; *a && *a != '\''; ) {
+            char *next;
+            __u64 addr = strtoull(a, &next, 16);
+
+            if (next == a)
+                break;
+            if (maps_id)
+                symbolize_frame(maps_id, addr, &p, syms + sizeof(syms), &first);
+            else {
+                stats.frames++;
+                stats.unresolved++;
+            }
+            a = *next == ';' ? next + 1 : next;
+        }
+
+        fprintf(out, "%llx,'%s'\n", hash, syms);
+        stats.stacks++;
+    }
+
+    free(line);
+    fclose(in);
+    if (fclose(out)) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        err = -1;
+    }
+    free_umaps();
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct argp argp = {
+        .options = opts,
+        .parser = parse_arg,
+        .doc = argp_program_doc,
+    };
+    int err, failed = 0;
+
+    err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+    if (err)
+        return err;
+
+    if (output_dirname && mkdir(output_dirname, 0750) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create output directory %s: %s\n", output_dirname, strerror(errno));
+        return 1;
+    }
+
+    blaze_symbolizer_opts sym_opts = {
+        .type_size = sizeof(sym_opts),
+        .debug_dirs = debug_dirs,
+        .debug_dirs_len = nr_debug_dirs,
+        .auto_reload = false,
+        .code_info = true,
+        .inlined_fns = true,
+        .demangle = true,
+    };
+
+    symbolizer = blaze_symbolizer_new_opts(&sym_opts);
+    if (!symbolizer) {
+        fprintf(stderr, "Failed to initialize BlazeSym symbolizer: %s\n", blaze_err_str(blaze_err_last()));
+        return 1;
+    }
+
+    for (int i = 0; i < nr_inputs; i++)
+        if (symbolize_file(inputs[i]))
+            failed++;
+
+    blaze_symbolizer_free(symbolizer);
+
+    fprintf(stderr, "xcapture-symbolize: %llu stacks, %llu of %llu frames unresolved",
+            stats.stacks, stats.unresolved, stats.frames);
+    if (stats.mismatched)
+        fprintf(stderr, ", %llu binaries differ from the captured build", stats.mismatched);
+    fprintf(stderr, "\n");
+
+    free(inputs);
+    free(mappings);
+    return failed ? 1 : 0;
+}
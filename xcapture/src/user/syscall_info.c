@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <linux/types.h>
 #include "xcapture.h"
@@ -32,6 +33,16 @@ const char *safe_syscall_name(__s32 syscall_nr)
     return unknown_str;
 }
 
+// -1 if there's no such syscall on this platform
+int syscall_nr_by_name(const char *name)
+{
+    for (int nr = 0; nr < NR_SYSCALLS; nr++)
+        if (sysent0[nr].name && strcmp(sysent0[nr].name, name) == 0)
+            return nr;
+
+    return -1;
+}
+
 const char *get_syscall_info_desc(__u32 syscall_nr)
 {
     switch (syscall_nr) {
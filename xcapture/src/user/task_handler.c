@@ -2,6 +2,7 @@
 // Copyright 2024-2038 Tanel Poder [0x.tools]
 
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <time.h>
@@ -13,10 +14,19 @@
 
 #include "xcapture.h"
 #include "task_handler.h"
+#include "task_wire.h"
 #include "xcapture_user.h"
 #include "xcapture_context.h"
 #include "columns.h"
 #include "cgroup_cache.h"
+#include "unwind_table.h"
+#include "pipeline.h"
+#include "parquet_writer.h"
+#include "csv_encoder.h"
+#include "umaps.h"
+#include "stack_table.h"
+#include "live_store.h"
+#include "symcache.h"
 
 #ifdef USE_BLAZESYM
 #include "blazesym.h"
@@ -30,38 +40,41 @@
 #endif
 
 #ifdef USE_BLAZESYM
-extern blaze_symbolizer *g_symbolizer;
+extern struct symcache *g_symcache;
 extern bool symbolize_stacks;
 #endif
 
-// Simple hash table to store stack traces for stdout printing
-#define STACK_CACHE_SIZE 4096
-struct stack_cache_entry {
-    __u64 hash;
-    bool valid;
-    char symbolized[4096];
-};
+// Symbolized stack traces for stdout printing, created on first use
+static struct stack_table *stdout_stacks;
 
-static struct stack_cache_entry kernel_stack_cache[STACK_CACHE_SIZE] = {0};
-static struct stack_cache_entry user_stack_cache[STACK_CACHE_SIZE] = {0};
+// Lookup cached stack trace by hash
+const char* lookup_cached_stack(__u64 hash, bool is_kernel) {
+    if (hash == 0 || !stdout_stacks) return NULL;
 
-static inline unsigned int hash_to_index(__u64 hash) {
-    return (unsigned int)(hash % STACK_CACHE_SIZE);
+    return stack_table_lookup(stdout_stacks, hash, is_kernel);
 }
 
-// Lookup cached stack trace by hash
-const char* lookup_cached_stack(__u64 hash, bool is_kernel) {
-    if (hash == 0) return NULL;
+// Start a new iteration of the stdout stack traces, older ones get evicted first
+void stack_cache_next_iteration(void) {
+    if (stdout_stacks)
+        stack_table_next_epoch(stdout_stacks);
+}
 
-    unsigned int idx = hash_to_index(hash);
-    struct stack_cache_entry *cache = is_kernel ?
-        &kernel_stack_cache[idx] : &user_stack_cache[idx];
+void stack_cache_destroy(bool print_stats) {
+    if (!stdout_stacks)
+        return;
 
-    if (cache->valid && cache->hash == hash) {
-        return cache->symbolized;
-    }
+    if (print_stats) {
+        struct stack_table_stats st;
 
-    return NULL;
+        stack_table_get_stats(stdout_stacks, &st);
+        fprintf(stderr, "Stack table: %llu stacks, %llu KB of strings, %llu KB allocated, "
+                "%llu lookups, %llu hits, %llu evicted in %llu compactions\n",
+                st.entries, st.arena_bytes / 1024, st.arena_alloc / 1024,
+                st.lookups, st.hits, st.evictions, st.compactions);
+    }
+    stack_table_free(stdout_stacks);
+    stdout_stacks = NULL;
 }
 
 // Function declarations for common functions
@@ -399,156 +412,46 @@ struct symbolized_frame {
     bool is_inlined;
 };
 
-// Forward declaration
-static int symbolize_user_stack(const __u64 *stack, int stack_len, pid_t pid, char *out_buf, size_t buflen);
-
-// Symbolize kernel stack trace and format as CSV-friendly string
-static int symbolize_kernel_stack(const __u64 *stack, int stack_len, char *out_buf, size_t buflen)
+// Symbolize a kernel or userspace stack through the symbol cache and format
+// it as CSV-friendly string: symbol1+0xoffset;inlined[inlined];symbol2+0xoffset
+// Frames that could not be resolved are left out
+static int symbolize_stack(const __u64 *stack, int stack_len, pid_t pid, bool is_kernel,
+                           char *out_buf, size_t buflen)
 {
-    if (!g_symbolizer || !symbolize_stacks || stack_len <= 0) {
-        return 0;
-    }
-
-    struct blaze_symbolize_src_kernel src = {
-        .type_size = sizeof(src),
-    };
-
-    const struct blaze_syms *syms = blaze_symbolize_kernel_abs_addrs(
-        g_symbolizer, &src, (const uintptr_t *)stack, stack_len);
-
-    if (!syms) {
-        return 0;
-    }
-
-    char *ptr = out_buf;
-    size_t remaining = buflen;
-    int written_count = 0;
-    size_t frame_limit = (size_t)stack_len;
-
-    // Format: symbol1+0xoffset;symbol2+0xoffset;...
-    for (size_t i = 0; i < frame_limit && i < syms->cnt && remaining > 1; i++) {
-        if (syms->syms[i].name == NULL) continue;
-
-        const struct blaze_sym *sym = &syms->syms[i];
-        int written;
-
-        if (written_count > 0 && remaining > 1) {
-            *ptr++ = ';';
-            remaining--;
-        }
-
-        // Write main symbol
-        written = snprintf(ptr, remaining, "%s+0x%lx", sym->name, sym->offset);
-        if (written < 0) {
-            break;
-        }
-        if ((size_t)written >= remaining) break;
-
-        ptr += written;
-        remaining -= written;
-        written_count++;
-
-        // Add inlined functions if any
-        for (size_t j = 0; j < sym->inlined_cnt && remaining > 1; j++) {
-            const struct blaze_symbolize_inlined_fn *inlined = &sym->inlined[j];
-
-            *ptr++ = ';';
-            remaining--;
-
-            written = snprintf(ptr, remaining, "%s[inlined]", inlined->name);
-            if (written < 0) {
-                remaining = 0;
-                break;
-            }
-            if ((size_t)written >= remaining) break;
-
-            ptr += written;
-            remaining -= written;
-            written_count++;
-        }
-    }
-
-    blaze_syms_free(syms);
-    return written_count;
-}
-
+    struct symcache_sym syms[MAX_STACK_LEN];
 
-// Symbolize userspace stack trace using PID
-static int symbolize_user_stack(const __u64 *stack, int stack_len, pid_t pid, char *out_buf, size_t buflen)
-{
-    if (!g_symbolizer || !symbolize_stacks || stack_len <= 0 || pid <= 0) {
+    if (!g_symcache || !symbolize_stacks || stack_len <= 0 || (!is_kernel && pid <= 0)) {
         return 0;
     }
 
-    struct blaze_symbolize_src_process src = {
-        .type_size = sizeof(src),
-        .pid = pid,
-    };
-
-    const struct blaze_syms *syms = blaze_symbolize_process_abs_addrs(
-        g_symbolizer, &src, (const uintptr_t *)stack, stack_len);
+    if (stack_len > MAX_STACK_LEN)
+        stack_len = MAX_STACK_LEN;
 
-    if (!syms) {
-        return 0;
-    }
+    symcache_resolve(g_symcache, pid, is_kernel, stack, stack_len, syms);
 
     char *ptr = out_buf;
     size_t remaining = buflen;
     int written_count = 0;
-    size_t frame_limit = (size_t)stack_len;
 
-    // Format: symbol1+0xoffset;symbol2+0xoffset;...
-    for (size_t i = 0; i < frame_limit && i < syms->cnt && remaining > 1; i++) {
-        if (syms->syms[i].name == NULL) continue;
-
-        const struct blaze_sym *sym = &syms->syms[i];
-        int written;
-
-        if (written_count > 0 && remaining > 1) {
-            *ptr++ = ';';
-            remaining--;
-        }
+    for (int i = 0; i < stack_len && remaining > 1; i++) {
+        if (syms[i].name == NULL) continue;
 
-        // Write main symbol
-        written = snprintf(ptr, remaining, "%s+0x%lx", sym->name, sym->offset);
-        if (written < 0) {
+        int written = snprintf(ptr, remaining, "%s%s+0x%llx%s", written_count ? ";" : "",
+                               syms[i].name, syms[i].offset, syms[i].inlined ? syms[i].inlined : "");
+        if (written < 0 || (size_t)written >= remaining)
             break;
-        }
-        if ((size_t)written >= remaining) break;
 
         ptr += written;
         remaining -= written;
         written_count++;
-
-        // Add inlined functions if any
-        for (size_t j = 0; j < sym->inlined_cnt && remaining > 1; j++) {
-            const struct blaze_symbolize_inlined_fn *inlined = &sym->inlined[j];
-
-            *ptr++ = ';';
-            remaining--;
-
-            written = snprintf(ptr, remaining, "%s[inlined]", inlined->name);
-            if (written < 0) {
-                remaining = 0;
-                break;
-            }
-            if ((size_t)written >= remaining) break;
-
-            ptr += written;
-            remaining -= written;
-            written_count++;
-        }
     }
 
-    blaze_syms_free(syms);
     return written_count;
 }
 #endif
 
 int handle_task_event(void *ctx, void *data, size_t data_sz)
 {
-    XCAP_UNUSED(data_sz);
-
     struct xcapture_context *xctx = ctx;
     if (!xctx)
         return 0;
@@ -562,7 +465,26 @@ int handle_task_event(void *ctx, void *data, size_t data_sz)
         return 0;
     }
 
-    const struct task_output_event *event = data;
+    // decode the compact wire record into the full event layout used by formatters
+    static struct task_output_event decoded;
+    if (decode_task_wire(data, data_sz, &decoded) < 0) {
+        fprintf(stderr, "Malformed task sample record (%zu bytes)\n", data_sz);
+        return 0;
+    }
+    const struct task_output_event *event = &decoded;
+
+    // a pipeline worker may be behind the sampler, so use the weight and clock
+    // correlation of the iteration that took this sample
+    if (xctx->pipelined)
+        pipeline_iteration_info(event->storage.sample_start_ktime, &xctx->sample_weight_us, &xctx->tcorr);
+
+    // on-CPU samples come from the perf_event sampler at its own frequency
+    long sample_weight_us = event->emit_reason == EMIT_REASON_ONCPU ?
+                            xctx->oncpu_weight_us : xctx->sample_weight_us;
+
+    // processes get DWARF unwinding from their next sample on, once their tables are published
+    if (xctx->dwarf_stacks && !(event->flags & PF_KTHREAD))
+        unwind_note_process(event->tgid);
 
     // get sample_start timestamp from when this task loop iteration started
     char timestamp[64];
@@ -577,12 +499,13 @@ int handle_task_event(void *ctx, void *data, size_t data_sz)
     }
 
     char sc_start_time_str[64] = "";
+    struct timespec current_sc_start_ts = {0};
     // when this task struct was actually read
     // struct timespec current_sample_ts_this_task = get_wall_from_mono(&tcorr, event->storage.sample_actual_ktime);
 
     // get syscall start timestamp string from ktime ns
     if (event->storage.sc_enter_time > 0) {
-        struct timespec current_sc_start_ts = get_wall_from_mono(
+        current_sc_start_ts = get_wall_from_mono(
             &xctx->tcorr, event->storage.sample_actual_ktime - sc_duration_ns);
         get_str_from_ts(current_sc_start_ts, sc_start_time_str, sizeof(sc_start_time_str));
     }
@@ -612,90 +535,96 @@ int handle_task_event(void *ctx, void *data, size_t data_sz)
     }
 
     char trace_payload_hex[TRACE_PAYLOAD_LEN * 2 + 1] = "";
-    if (xctx->payload_trace_enabled && event->storage.trace_payload_len > 0 &&
-        event->storage.trace_payload_len <= TRACE_PAYLOAD_LEN) {
-        bytes_to_hex(event->storage.trace_payload,
-                     event->storage.trace_payload_len,
+    if (xctx->payload_trace_enabled && event->trace_payload_len > 0 &&
+        event->trace_payload_len <= TRACE_PAYLOAD_LEN) {
+        bytes_to_hex(event->trace_payload,
+                     event->trace_payload_len,
                      trace_payload_hex,
                      sizeof(trace_payload_hex));
     }
 
     if (xctx->output_csv) {
-        if (check_and_rotate_files(&xctx->files, xctx) < 0) {
+        if (!xctx->pipelined && check_and_rotate_files(&xctx->files, xctx) < 0) {
             fprintf(stderr, "Failed to rotate output files\n");
             return -1;
         }
 
-        if (xctx->payload_trace_enabled) {
-            fprintf(xctx->files.sample_file,
-                   "%s,%ld,%d,%d,%u,%llu,%s,'%s','%s','%s',%s,%s,%s,%lld,%lld,%lld,%llx,%llx,%llx,%llx,%llx,%llx,'%s','%s','%s','%s',%llx,%llx,'%s',%u\n",
-                   timestamp,
-                   xctx->sample_weight_us,
-                   event->pid,
-                   event->tgid,
-                   event->storage.pid_ns_id,
-                   event->storage.cgroup_id,
-                   format_task_state(event->state, event->on_rq, event->on_cpu, event->migration_pending),
-                   getusername(event->euid),
-                   (event->flags & PF_KTHREAD) ? "[kernel]" : event->exe_file,
-                   event->comm,
-                   (event->flags & PF_KTHREAD) ? "-" : safe_syscall_name(event->syscall_nr),
-                   (event->flags & PF_KTHREAD) ? "-" : (
-                       event->storage.sc_enter_time ? safe_syscall_name(event->storage.in_syscall_nr) : "?"
-                   ),
-                   event->storage.sc_enter_time > 0 ? sc_start_time_str : "", // todo validate bug
-                   sc_duration_ns,
-                   event->storage.sc_sequence_num,
-                   event->storage.iorq_sequence_num,
-                   event->syscall_args[0],
-                   event->syscall_args[1],
-                   event->syscall_args[2],
-                   event->syscall_args[3],
-                   event->syscall_args[4],
-                   event->syscall_args[5],
-                   event->filename[0] ? event->filename : "",
-                   conn_buf[0] ? conn_buf : "",
-                   conn_state_str[0] ? conn_state_str : "",
-                   extra_info,
-                   event->kstack_hash,
-                   event->ustack_hash,
-                   trace_payload_hex,
-                   event->storage.trace_payload_len
-            );
+        if (xctx->files.sample_pq) {
+            struct pq_writer *pq = xctx->files.sample_pq;
+            char hex[32];
+
+            pq_put_ts(pq, current_sample_ts_iter_start);
+            pq_put_i64(pq, sample_weight_us);
+            pq_put_i64(pq, event->pid);
+            pq_put_i64(pq, event->tgid);
+            pq_put_i64(pq, event->storage.pid_ns_id);
+            pq_put_i64(pq, event->storage.cgroup_id);
+            pq_put_str(pq, format_task_state(event->state, event->on_rq, event->on_cpu, event->migration_pending));
+            pq_put_str(pq, getusername(event->euid));
+            pq_put_str(pq, (event->flags & PF_KTHREAD) ? "[kernel]" : event->exe_file);
+            pq_put_str(pq, event->comm);
+            pq_put_str(pq, (event->flags & PF_KTHREAD) ? "-" : safe_syscall_name(event->syscall_nr));
+            pq_put_str(pq, (event->flags & PF_KTHREAD) ? "-" : (
+                           event->storage.sc_enter_time ? safe_syscall_name(event->storage.in_syscall_nr) : "?"));
+            if (event->storage.sc_enter_time > 0)
+                pq_put_ts(pq, current_sc_start_ts);
+            else
+                pq_put_null(pq);
+            pq_put_i64(pq, sc_duration_ns);
+            pq_put_i64(pq, event->storage.sc_sequence_num);
+            pq_put_i64(pq, event->storage.iorq_sequence_num);
+            for (int i = 0; i < 6; i++) {
+                snprintf(hex, sizeof(hex), "%llx", event->syscall_args[i]);
+                pq_put_str(pq, hex);
+            }
+            pq_put_str(pq, event->filename);
+            pq_put_str(pq, conn_buf);
+            pq_put_str(pq, conn_state_str);
+            pq_put_str(pq, extra_info);
+            snprintf(hex, sizeof(hex), "%llx", event->kstack_hash);
+            pq_put_str(pq, hex);
+            snprintf(hex, sizeof(hex), "%llx", event->ustack_hash);
+            pq_put_str(pq, hex);
+            if (xctx->payload_trace_enabled) {
+                pq_put_str(pq, trace_payload_hex);
+                pq_put_i64(pq, event->trace_payload_len);
+            }
+            pq_end_row(pq);
         } else {
-            fprintf(xctx->files.sample_file,
-                   "%s,%ld,%d,%d,%u,%llu,%s,'%s','%s','%s',%s,%s,%s,%lld,%lld,%lld,%llx,%llx,%llx,%llx,%llx,%llx,'%s','%s','%s','%s',%llx,%llx\n",
-                   timestamp,
-                   xctx->sample_weight_us,
-                   event->pid,
-                   event->tgid,
-                   event->storage.pid_ns_id,
-                   event->storage.cgroup_id,
-                   format_task_state(event->state, event->on_rq, event->on_cpu, event->migration_pending),
-                   getusername(event->euid),
-                   (event->flags & PF_KTHREAD) ? "[kernel]" : event->exe_file,
-                   event->comm,
-                   (event->flags & PF_KTHREAD) ? "-" : safe_syscall_name(event->syscall_nr),
-                   (event->flags & PF_KTHREAD) ? "-" : (
-                       event->storage.sc_enter_time ? safe_syscall_name(event->storage.in_syscall_nr) : "?"
-                   ),
-                   event->storage.sc_enter_time > 0 ? sc_start_time_str : "", // todo validate bug
-                   sc_duration_ns,
-                   event->storage.sc_sequence_num,
-                   event->storage.iorq_sequence_num,
-                   event->syscall_args[0],
-                   event->syscall_args[1],
-                   event->syscall_args[2],
-                   event->syscall_args[3],
-                   event->syscall_args[4],
-                   event->syscall_args[5],
-                   event->filename[0] ? event->filename : "",
-                   conn_buf[0] ? conn_buf : "",
-                   conn_state_str[0] ? conn_state_str : "",
-                   extra_info,
-                   event->kstack_hash,
-                   event->ustack_hash
-            );
+            struct csv_row row;
+
+            csv_begin_row(&row);
+            csv_str(&row, timestamp);
+            csv_s64(&row, sample_weight_us);
+            csv_s64(&row, event->pid);
+            csv_s64(&row, event->tgid);
+            csv_u64(&row, event->storage.pid_ns_id);
+            csv_u64(&row, event->storage.cgroup_id);
+            csv_str(&row, format_task_state(event->state, event->on_rq, event->on_cpu, event->migration_pending));
+            csv_quoted(&row, getusername(event->euid));
+            csv_quoted(&row, (event->flags & PF_KTHREAD) ? "[kernel]" : event->exe_file);
+            csv_quoted(&row, event->comm);
+            csv_str(&row, (event->flags & PF_KTHREAD) ? "-" : safe_syscall_name(event->syscall_nr));
+            csv_str(&row, (event->flags & PF_KTHREAD) ? "-" : (
+                        event->storage.sc_enter_time ? safe_syscall_name(event->storage.in_syscall_nr) : "?"));
+            csv_str(&row, event->storage.sc_enter_time > 0 ? sc_start_time_str : ""); // todo validate bug
+            csv_s64(&row, sc_duration_ns);
+            csv_s64(&row, event->storage.sc_sequence_num);
+            csv_s64(&row, event->storage.iorq_sequence_num);
+            for (int i = 0; i < 6; i++)
+                csv_hex(&row, event->syscall_args[i]);
+            csv_quoted(&row, event->filename);
+            csv_quoted(&row, conn_buf);
+            csv_quoted(&row, conn_state_str);
+            csv_quoted(&row, extra_info);
+            csv_hex(&row, event->kstack_hash);
+            csv_hex(&row, event->ustack_hash);
+            if (xctx->payload_trace_enabled) {
+                csv_quoted(&row, trace_payload_hex);
+                csv_u64(&row, event->trace_payload_len);
+            }
+            csv_end_row(&row, xctx->files.sample_file);
+            live_append(LIVE_SAMPLES, current_sample_ts_iter_start, row.buf, row.pos - row.buf);
         }
     }
     else {
@@ -707,7 +636,7 @@ int handle_task_event(void *ctx, void *data, size_t data_sz)
             .extra_info = extra_info,
             .kstack_hash_str = kstack_hash_str,
             .ustack_hash_str = ustack_hash_str,
-            .sample_weight_us = xctx->sample_weight_us,
+            .sample_weight_us = sample_weight_us,
             .off_us = (event->storage.sample_actual_ktime - event->storage.sample_start_ktime) / 1000,
             .sysc_us_so_far = sc_duration_ns / 1000,
             .sysc_entry_time_str = event->storage.sc_enter_time > 0 ? sc_start_time_str : "-"
@@ -727,24 +656,42 @@ int handle_task_event(void *ctx, void *data, size_t data_sz)
     }
 
     // Handle cgroup path resolution and caching
-    if (event->storage.cgroup_id != 0 && !cgroup_cache_contains(event->storage.cgroup_id)) {
-        char cgroup_path[CGROUP_PATH_MAX];
-        if (resolve_cgroup_path(event->storage.cgroup_id, event->pid, cgroup_path, sizeof(cgroup_path)) == 0) {
-            // Successfully resolved - it's now cached
-
-            // Write to cgroup CSV file if in CSV mode
-            if (xctx->output_csv && xctx->files.cgroup_file) {
-                write_cgroup_entry(xctx->files.cgroup_file, event->storage.cgroup_id, cgroup_path);
-            }
+    record_cgroup_path(xctx, event->storage.cgroup_id, event->pid);
+
+    return 0;
+}
 
-            // Print to stdout if requested (will add -c flag later)
-            if (xctx->print_cgroups && !xctx->output_csv) {
-                printf("CGROUP  %18llu  %s\n", event->storage.cgroup_id, cgroup_path);
+// Resolve and cache the path of a cgroup seen for the first time, then
+// write it to the cgroups CSV file (or print it in stdout mode with -C)
+void record_cgroup_path(struct xcapture_context *xctx, __u64 cgroup_id, pid_t pid)
+{
+    if (cgroup_id == 0 || cgroup_cache_reported(cgroup_id))
+        return;
+
+    char cgroup_path[CGROUP_PATH_MAX];
+    if (resolve_cgroup_path(cgroup_id, pid, cgroup_path, sizeof(cgroup_path)) == 0) {
+        // Successfully resolved - it's now cached
+        cgroup_cache_set_reported(cgroup_id);
+
+        // Write to cgroup CSV file if in CSV mode
+        if (xctx->output_csv && xctx->files.cgroup_pq) {
+            pq_put_i64(xctx->files.cgroup_pq, cgroup_id);
+            pq_put_str(xctx->files.cgroup_pq, cgroup_path);
+            pq_end_row(xctx->files.cgroup_pq);
+        } else if (xctx->output_csv && xctx->files.cgroup_file) {
+            write_cgroup_entry(xctx->files.cgroup_file, cgroup_id, cgroup_path);
+            if (live_enabled) {
+                char row[CGROUP_PATH_MAX + 32];
+                int len = snprintf(row, sizeof(row), "%llu,%s\n", cgroup_id, cgroup_path);
+                live_append(LIVE_CGROUPS, (struct timespec){0}, row, len);
             }
         }
-    }
 
-    return 0;
+        // Print to stdout if requested (will add -c flag later)
+        if (xctx->print_cgroups && !xctx->output_csv) {
+            printf("CGROUP  %18llu  %s\n", cgroup_id, cgroup_path);
+        }
+    }
 }
 
 int handle_stack_event(void *ctx, void *data, size_t data_sz)
@@ -768,93 +715,136 @@ int handle_stack_event(void *ctx, void *data, size_t data_sz)
 
     // Cache symbolized stack for stdout printing if needed
     if (xctx->print_stack_traces && !xctx->output_csv) {
-        unsigned int idx = hash_to_index(event->stack_hash);
-        struct stack_cache_entry *cache = event->is_kernel ?
-            &kernel_stack_cache[idx] : &user_stack_cache[idx];
+        char symbolized[4096];
+        int symbol_count = 0;
 
-        cache->hash = event->stack_hash;
-        cache->valid = true;
+        if (!stdout_stacks)
+            stdout_stacks = stack_table_new(STACK_TABLE_DEFAULT_BYTES);
 
 #ifdef USE_BLAZESYM
-        if (g_symbolizer && symbolize_stacks) {
-            int symbol_count;
-            if (event->is_kernel) {
-                symbol_count = symbolize_kernel_stack(event->stack, event->stack_len,
-                                                     cache->symbolized, sizeof(cache->symbolized));
-            } else {
-                symbol_count = symbolize_user_stack(event->stack, event->stack_len,
-                                                   event->pid, cache->symbolized, sizeof(cache->symbolized));
-            }
-
-            if (symbol_count == 0) {
-                // Fall back to raw addresses if symbolization fails
-                cache->symbolized[0] = '\0';
-                for (int i = 0; i < event->stack_len && i < MAX_STACK_LEN; i++) {
-                    char addr_buf[32];
-                    snprintf(addr_buf, sizeof(addr_buf), "%llx;", event->stack[i]);
-                    strncat(cache->symbolized, addr_buf,
-                           sizeof(cache->symbolized) - strlen(cache->symbolized) - 1);
-                }
-            }
-        } else {
+        if (g_symcache && symbolize_stacks)
+            symbol_count = symbolize_stack(event->stack, event->stack_len, event->pid, event->is_kernel,
+                                           symbolized, sizeof(symbolized));
 #endif
-            // No symbolization - just store raw addresses
-            cache->symbolized[0] = '\0';
+        // No or failed symbolization - store raw addresses
+        if (symbol_count <= 0) {
+            char *p = symbolized;
+            size_t remaining = sizeof(symbolized);
+
+            symbolized[0] = '\0';
             for (int i = 0; i < event->stack_len && i < MAX_STACK_LEN; i++) {
-                char addr_buf[32];
-                snprintf(addr_buf, sizeof(addr_buf), "%llx;", event->stack[i]);
-                strncat(cache->symbolized, addr_buf,
-                       sizeof(cache->symbolized) - strlen(cache->symbolized) - 1);
+                int n = snprintf(p, remaining, "%llx;", event->stack[i]);
+                if (n < 0 || (size_t)n >= remaining)
+                    break;
+                p += n;
+                remaining -= n;
             }
-#ifdef USE_BLAZESYM
         }
-#endif
+
+        if (stdout_stacks)
+            stack_table_insert(stdout_stacks, event->stack_hash, event->is_kernel, symbolized);
+    }
+
+    // --defer-symbols leaves user stacks to xcapture-symbolize
+    if (!event->is_kernel && xctx->files.uaddrs_file) {
+        umaps_write_ustack(xctx, event);
+        return 0;
     }
 
     // Determine which file to write to based on stack type
     FILE *output_file = NULL;
-    if (event->is_kernel && xctx->files.kstack_file) {
+    struct pq_writer *output_pq = NULL;
+    if (event->is_kernel) {
         output_file = xctx->files.kstack_file;
-    } else if (!event->is_kernel && xctx->files.ustack_file) {
+        output_pq = xctx->files.kstack_pq;
+    } else {
         output_file = xctx->files.ustack_file;
+        output_pq = xctx->files.ustack_pq;
     }
 
     // Skip if no appropriate file is open
-    if (!output_file)
+    if (!output_file && !output_pq)
         return 0;
 
-    // Write stack hash (no IS_KERNEL flag anymore)
-    fprintf(output_file, "%llx,", event->stack_hash);
+    char symbol_buf[4096] = "";
 
 #ifdef USE_BLAZESYM
     // Add symbolized stack trace if available
-    if (g_symbolizer && symbolize_stacks) {
-        char symbol_buf[4096];
-        int symbol_count;
+    if (g_symcache && symbolize_stacks) {
+        int symbol_count = symbolize_stack(event->stack, event->stack_len, event->pid, event->is_kernel,
+                                           symbol_buf, sizeof(symbol_buf));
 
-        if (event->is_kernel) {
-            symbol_count = symbolize_kernel_stack(event->stack, event->stack_len,
-                                                 symbol_buf, sizeof(symbol_buf));
-        } else {
-            // Use PID-based symbolization for userspace stacks
-            symbol_count = symbolize_user_stack(event->stack, event->stack_len,
-                                               event->pid, symbol_buf, sizeof(symbol_buf));
-        }
-
-        if (symbol_count > 0) {
-            fprintf(output_file, "'%s'", symbol_buf);
-        } else {
-            fprintf(output_file, "''");
-        }
-    } else {
-        fprintf(output_file, "''");
+        if (symbol_count <= 0)
+            symbol_buf[0] = '\0';
     }
-#else
-    fprintf(output_file, "''");
 #endif
 
-    fprintf(output_file, "\n");
+    if (output_pq) {
+        char hash_str[32];
+        snprintf(hash_str, sizeof(hash_str), "%llx", event->stack_hash);
+        pq_put_str(output_pq, hash_str);
+        pq_put_str(output_pq, symbol_buf);
+        pq_end_row(output_pq);
+        return 0;
+    }
+
+    // Write stack hash (no IS_KERNEL flag anymore) and the symbols, if any
+    fprintf(output_file, "%llx,'%s'\n", event->stack_hash, symbol_buf);
     fflush(output_file);
 
+    if (live_enabled) {
+        char row[sizeof(symbol_buf) + 32];
+        int len = snprintf(row, sizeof(row), "%llx,'%s'\n", event->stack_hash, symbol_buf);
+        live_append(event->is_kernel ? LIVE_KSTACKS : LIVE_USTACKS, (struct timespec){0}, row, len);
+    }
+
     return 0;
 }
+
+// Drain task samples written into the iterator seq_file by get_tasks (--iter-stream).
+// The kernel fills at most one seq buffer per read() and resumes the iteration on the
+// next call, so large reads keep the syscall count low while the reader pace provides
+// backpressure instead of dropping records like a full ringbuf would
+#define TASK_ITER_READ_BUFSIZ (256 * 1024)
+
+int consume_task_iter(int iter_fd, struct xcapture_context *xctx)
+{
+    static __u64 buf[TASK_ITER_READ_BUFSIZ / sizeof(__u64)];
+    char *bufp = (char *)buf;
+    size_t have = 0;
+    int records = 0;
+
+    for (;;) {
+        ssize_t n = read(iter_fd, bufp + have, sizeof(buf) - have);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            break;
+
+        have += n;
+
+        size_t off = 0, rec_size;
+        while ((rec_size = task_wire_record_len(bufp + off, have - off)) > 0) {
+            if (xctx->pipelined)
+                pipeline_enqueue_iter(bufp + off, rec_size);
+            else
+                handle_task_event(xctx, bufp + off, rec_size);
+            off += rec_size;
+            records++;
+        }
+
+        // carry a partial record over to the next read
+        if (off) {
+            memmove(bufp, bufp + off, have - off);
+            have -= off;
+        }
+    }
+
+    if (have)
+        fprintf(stderr, "Warning: discarding %zu trailing bytes from task iterator\n", have);
+
+    return records;
+}
@@ -4,8 +4,11 @@
 #include <bpf/libbpf.h>
 #include "xcapture.h"
 #include "xcapture_user.h"
+#include "xcapture_context.h"
 
 int handle_task_event(void *ctx, void *data, size_t data_sz);
 int handle_stack_event(void *ctx, void *data, size_t data_sz);
+int consume_task_iter(int iter_fd, struct xcapture_context *xctx);
+void record_cgroup_path(struct xcapture_context *xctx, __u64 cgroup_id, pid_t pid);
 
 #endif /* __TASK_HANDLER_H */
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#include "xcapture.h"
+#include "task_wire.h"
+
+// Decoder for the compact task sample encoding produced by wire_helpers.h.
+// Records are decoded back into struct task_output_event, so the column
+// formatters and CSV writers don't need to know about the wire format.
+
+// Length of the next complete record in a byte stream (iterator seq_file),
+// 0 if more bytes are needed first
+size_t task_wire_record_len(const void *data, size_t avail)
+{
+    struct task_wire_header hdr;
+
+    if (avail < sizeof(hdr))
+        return 0;
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.len < sizeof(hdr) + TASK_STATE_WIRE_SIZE || hdr.len > avail)
+        return 0;
+
+    return hdr.len;
+}
+
+static void copy_wire_str(char *dst, size_t dst_size, const __u8 *src, __u16 len)
+{
+    if (len >= dst_size)
+        len = dst_size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+int decode_task_wire(const void *data, size_t data_sz, struct task_output_event *event)
+{
+    const __u8 *buf = data;
+    struct task_wire_header hdr;
+
+    if (data_sz < sizeof(hdr) + TASK_STATE_WIRE_SIZE)
+        return -1;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.len > data_sz || hdr.len < sizeof(hdr) + TASK_STATE_WIRE_SIZE)
+        return -1;
+
+    event->type = hdr.type;
+    event->pid = hdr.pid;
+    event->tgid = hdr.tgid;
+    event->state = hdr.state;
+    event->flags = hdr.flags;
+    event->euid = hdr.euid;
+    event->emit_reason = hdr.emit_reason;
+    event->syscall_nr = hdr.syscall_nr;
+    event->aio_fd = hdr.aio_fd;
+    event->on_cpu = hdr.on_cpu;
+    event->on_rq = hdr.on_rq;
+    event->in_execve = !!(hdr.sched_bits & TASK_WIRE_SCHED_IN_EXECVE);
+    event->in_iowait = !!(hdr.sched_bits & TASK_WIRE_SCHED_IN_IOWAIT);
+    event->in_thrashing = !!(hdr.sched_bits & TASK_WIRE_SCHED_IN_THRASHING);
+    event->sched_remote_wakeup = !!(hdr.sched_bits & TASK_WIRE_SCHED_REMOTE_WAKEUP);
+    memcpy(event->comm, hdr.comm, sizeof(event->comm));
+    event->comm[TASK_COMM_LEN - 1] = '\0';
+    memcpy(event->syscall_args, hdr.syscall_args, sizeof(event->syscall_args));
+    event->migration_pending = (void *)(unsigned long)hdr.migration_pending;
+    event->kstack_hash = hdr.kstack_hash;
+    event->ustack_hash = hdr.ustack_hash;
+
+    memcpy(&event->storage, buf + sizeof(hdr), TASK_STATE_WIRE_SIZE);
+
+    // defaults for sections that were not emitted (same as the BPF side resets)
+    event->filename[0] = '\0';
+    event->exe_file[0] = '\0';
+    event->cmdline_len = 0;
+    event->cmdline[0] = '\0';
+    event->has_socket_info = false;
+    event->has_tcp_stats = false;
+    event->aio_filename[0] = '\0';
+    event->ur_filename[0] = '\0';
+    event->ur_sq_filename[0] = '\0';
+    event->uring_fd = -1;
+    event->uring_reg_idx = -1;
+    event->uring_offset = 0;
+    event->uring_len = 0;
+    event->uring_opcode = 0;
+    event->uring_flags = 0;
+    event->uring_rw_flags = 0;
+    event->uring_dbg_sq_idx = -1;
+    event->uring_dbg_sq_fixed = 0;
+    event->uring_dbg_sq_user_data = 0;
+    event->uring_dbg_sq_file_ptr = 0;
+    event->uring_dbg_cq_scanned = 0;
+    event->uring_dbg_cq_matched = 0;
+    event->uring_dbg_cq_file_ptr = 0;
+    event->trace_payload_len = 0;
+    event->trace_payload_syscall = -1;
+    event->trace_payload_seq_num = 0;
+
+    size_t off = sizeof(hdr) + TASK_STATE_WIRE_SIZE;
+    while (off + sizeof(struct task_wire_section) <= hdr.len) {
+        struct task_wire_section sec;
+        memcpy(&sec, buf + off, sizeof(sec));
+        off += sizeof(sec);
+
+        if (off + sec.len > hdr.len)
+            return -1;
+
+        const __u8 *p = buf + off;
+
+        switch (sec.tag) {
+            case TASK_WIRE_FILENAME:
+                copy_wire_str(event->filename, sizeof(event->filename), p, sec.len);
+                break;
+            case TASK_WIRE_EXE_FILE:
+                copy_wire_str(event->exe_file, sizeof(event->exe_file), p, sec.len);
+                break;
+            case TASK_WIRE_CMDLINE:
+                copy_wire_str(event->cmdline, sizeof(event->cmdline), p, sec.len);
+                event->cmdline_len = sec.len < MAX_CMDLINE_LEN ? sec.len : MAX_CMDLINE_LEN - 1;
+                break;
+            case TASK_WIRE_SOCKET: {
+                size_t fixed = offsetof(struct socket_info, unix_path);
+                if (sec.len < fixed || sec.len > sizeof(event->sock_info))
+                    break;
+                memcpy(&event->sock_info, p, fixed);
+                event->sock_info.unix_path_len = sec.len - fixed;
+                copy_wire_str(event->sock_info.unix_path, sizeof(event->sock_info.unix_path),
+                              p + fixed, sec.len - fixed);
+                event->has_socket_info = true;
+                break;
+            }
+            case TASK_WIRE_TCP_STATS:
+                if (sec.len == sizeof(event->tcp_stats)) {
+                    memcpy(&event->tcp_stats, p, sizeof(event->tcp_stats));
+                    event->has_tcp_stats = true;
+                }
+                break;
+            case TASK_WIRE_AIO_FILENAME:
+                copy_wire_str(event->aio_filename, sizeof(event->aio_filename), p, sec.len);
+                break;
+            case TASK_WIRE_UR_FILENAME:
+                copy_wire_str(event->ur_filename, sizeof(event->ur_filename), p, sec.len);
+                break;
+            case TASK_WIRE_UR_SQ_FILENAME:
+                copy_wire_str(event->ur_sq_filename, sizeof(event->ur_sq_filename), p, sec.len);
+                break;
+            case TASK_WIRE_URING: {
+                struct task_wire_uring ur;
+                if (sec.len != sizeof(ur))
+                    break;
+                memcpy(&ur, p, sizeof(ur));
+                event->uring_fd = ur.fd;
+                event->uring_reg_idx = ur.reg_idx;
+                event->uring_offset = ur.offset;
+                event->uring_len = ur.len;
+                event->uring_rw_flags = ur.rw_flags;
+                event->uring_opcode = ur.opcode;
+                event->uring_flags = ur.flags;
+                break;
+            }
+            case TASK_WIRE_URING_DBG: {
+                struct task_wire_uring_dbg dbg;
+                if (sec.len != sizeof(dbg))
+                    break;
+                memcpy(&dbg, p, sizeof(dbg));
+                event->uring_dbg_sq_idx = dbg.sq_idx;
+                event->uring_dbg_sq_fixed = dbg.sq_fixed;
+                event->uring_dbg_sq_user_data = dbg.sq_user_data;
+                event->uring_dbg_sq_file_ptr = dbg.sq_file_ptr;
+                event->uring_dbg_cq_scanned = dbg.cq_scanned;
+                event->uring_dbg_cq_matched = dbg.cq_matched;
+                event->uring_dbg_cq_file_ptr = dbg.cq_file_ptr;
+                break;
+            }
+            case TASK_WIRE_PAYLOAD: {
+                struct task_wire_payload pl;
+                if (sec.len < sizeof(pl))
+                    break;
+                memcpy(&pl, p, sizeof(pl));
+                if (pl.len > TRACE_PAYLOAD_LEN || sizeof(pl) + pl.len > sec.len)
+                    break;
+                memcpy(event->trace_payload, p + sizeof(pl), pl.len);
+                event->trace_payload_len = pl.len;
+                event->trace_payload_syscall = pl.syscall;
+                event->trace_payload_seq_num = pl.seq_num;
+                break;
+            }
+            default:
+                // unknown section from a newer BPF side, skip it
+                break;
+        }
+
+        off += sec.len;
+    }
+
+    return 0;
+}
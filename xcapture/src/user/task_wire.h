@@ -0,0 +1,12 @@
+#ifndef __TASK_WIRE_H
+#define __TASK_WIRE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include "xcapture.h"
+
+size_t task_wire_record_len(const void *data, size_t avail);
+int decode_task_wire(const void *data, size_t data_sz, struct task_output_event *event);
+
+#endif /* __TASK_WIRE_H */
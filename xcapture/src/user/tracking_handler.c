@@ -15,6 +15,9 @@
 #include "tracking_handler.h"
 #include "xcapture_user.h"
 #include "xcapture_context.h"
+#include "parquet_writer.h"
+#include "csv_encoder.h"
+#include "live_store.h"
 
 // Function declarations for functions you'll call
 extern const char *safe_syscall_name(__s32 syscall_nr);
@@ -72,59 +75,55 @@ int handle_tracking_event(void *ctx, void *data, size_t data_sz)
                 }
 
                 if (xctx->output_csv) {
-                    if (check_and_rotate_files(&xctx->files, xctx) < 0) {
+                    if (!xctx->pipelined && check_and_rotate_files(&xctx->files, xctx) < 0) {
                         fprintf(stderr, "Failed to rotate output files\n");
                         return -1;
                     }
 
-                    if (xctx->payload_trace_enabled) {
-                        if (e->completed_sc_ret_val >= -4095 && e->completed_sc_ret_val <= (1024*1024*16)) {
-                            fprintf(xctx->files.sc_completion_file, "SYSC_END,%d,%d,'%s',%llu,%lld,%llu,%s,'%s',%u,%d,%llu\n",
-                                    e->pid,
-                                    e->tgid,
-                                    safe_syscall_name(e->completed_syscall_nr),
-                                    duration_ns,
-                                    e->completed_sc_ret_val,
-                                    e->completed_sc_sequence_num,
-                                    ts_enter,
-                                    payload_csv,
-                                    (unsigned int)payload_len,
-                                    (int)payload_syscall,
-                                    (unsigned long long)payload_seq);
-                        } else {
-                            fprintf(xctx->files.sc_completion_file, "SYSC_END,%d,%d,'%s',%llu,0x%llx,%llu,%s,'%s',%u,%d,%llu\n",
-                                    e->pid,
-                                    e->tgid,
-                                    safe_syscall_name(e->completed_syscall_nr),
-                                    duration_ns,
-                                    (unsigned long long)e->completed_sc_ret_val,
-                                    e->completed_sc_sequence_num,
-                                    ts_enter,
-                                    payload_csv,
-                                    (unsigned int)payload_len,
-                                    (int)payload_syscall,
-                                    (unsigned long long)payload_seq);
+                    if (xctx->files.sc_completion_pq) {
+                        struct pq_writer *pq = xctx->files.sc_completion_pq;
+
+                        pq_put_str(pq, "SYSC_END");
+                        pq_put_i64(pq, e->pid);
+                        pq_put_i64(pq, e->tgid);
+                        pq_put_str(pq, safe_syscall_name(e->completed_syscall_nr));
+                        pq_put_i64(pq, duration_ns);
+                        pq_put_i64(pq, e->completed_sc_ret_val);
+                        pq_put_i64(pq, e->completed_sc_sequence_num);
+                        pq_put_ts(pq, get_wall_from_mono(&xctx->tcorr, e->completed_sc_enter_time));
+                        if (xctx->payload_trace_enabled) {
+                            pq_put_str(pq, payload_csv);
+                            pq_put_i64(pq, payload_len);
+                            pq_put_i64(pq, payload_syscall);
+                            pq_put_i64(pq, payload_seq);
                         }
+                        pq_end_row(pq);
                     } else {
+                        struct csv_row row;
+
+                        csv_begin_row(&row);
+                        csv_str(&row, "SYSC_END");
+                        csv_s64(&row, e->pid);
+                        csv_s64(&row, e->tgid);
+                        csv_quoted(&row, safe_syscall_name(e->completed_syscall_nr));
+                        csv_u64(&row, duration_ns);
                         if (e->completed_sc_ret_val >= -4095 && e->completed_sc_ret_val <= (1024*1024*16)) {
-                            fprintf(xctx->files.sc_completion_file, "SYSC_END,%d,%d,'%s',%llu,%lld,%llu,%s\n",
-                                    e->pid,
-                                    e->tgid,
-                                    safe_syscall_name(e->completed_syscall_nr),
-                                    duration_ns,
-                                    e->completed_sc_ret_val,
-                                    e->completed_sc_sequence_num,
-                                    ts_enter);
+                            csv_s64(&row, e->completed_sc_ret_val);
                         } else {
-                            fprintf(xctx->files.sc_completion_file, "SYSC_END,%d,%d,'%s',%llu,0x%llx,%llu,%s\n",
-                                    e->pid,
-                                    e->tgid,
-                                    safe_syscall_name(e->completed_syscall_nr),
-                                    duration_ns,
-                                    (unsigned long long)e->completed_sc_ret_val,
-                                    e->completed_sc_sequence_num,
-                                    ts_enter);
+                            csv_raw(&row, "0x", 2);
+                            csv_hex(&row, e->completed_sc_ret_val);
                         }
+                        csv_u64(&row, e->completed_sc_sequence_num);
+                        csv_str(&row, ts_enter);
+                        if (xctx->payload_trace_enabled) {
+                            csv_quoted(&row, payload_csv);
+                            csv_u64(&row, payload_len);
+                            csv_s64(&row, payload_syscall);
+                            csv_u64(&row, payload_seq);
+                        }
+                        csv_end_row(&row, xctx->files.sc_completion_file);
+                        live_append(LIVE_SYSCEND, get_wall_from_mono(&xctx->tcorr, e->completed_sc_exit_time),
+                                    row.buf, row.pos - row.buf);
                     }
                 } else {
                     printf(printf_format_str,
@@ -161,20 +160,61 @@ int handle_tracking_event(void *ctx, void *data, size_t data_sz)
                 get_str_from_ts(get_wall_from_mono(&xctx->tcorr, e->iorq_complete_time), iorq_complete_str, sizeof(iorq_complete_str));
 
                 if (xctx->output_csv) {
-                    if (check_and_rotate_files(&xctx->files, xctx) < 0) {
+                    if (!xctx->pipelined && check_and_rotate_files(&xctx->files, xctx) < 0) {
                         fprintf(stderr, "Failed to rotate output files\n");
                         return -1;
                     }
                     
+                    if (xctx->files.iorq_completion_pq) {
+                        struct pq_writer *pq = xctx->files.iorq_completion_pq;
+
+                        pq_put_str(pq, "IORQ_END");
+                        pq_put_i64(pq, e->insert_pid);
+                        pq_put_i64(pq, e->insert_tgid);
+                        pq_put_i64(pq, e->issue_pid);
+                        pq_put_i64(pq, e->issue_tgid);
+                        pq_put_i64(pq, e->complete_pid);
+                        pq_put_i64(pq, e->complete_tgid);
+                        pq_put_i64(pq, MAJOR(e->iorq_dev));
+                        pq_put_i64(pq, MINOR(e->iorq_dev));
+                        pq_put_i64(pq, e->iorq_sector);
+                        pq_put_i64(pq, e->iorq_bytes);
+                        pq_put_str(pq, get_iorq_op_flags(e->iorq_cmd_flags));
+                        pq_put_i64(pq, e->iorq_sequence_num);
+                        pq_put_i64(pq, duration_ns);
+                        pq_put_i64(pq, service_ns);
+                        pq_put_i64(pq, duration_ns - service_ns);
+                        pq_put_ts(pq, get_wall_from_mono(&xctx->tcorr, e->iorq_insert_time));
+                        pq_put_i64(pq, e->iorq_error);
+                        pq_end_row(pq);
+                        break;
+                    }
+
                     // nanosec granularity for csv
-                    fprintf(xctx->files.iorq_completion_file,
-                        "IORQ_END,%d,%d,%d,%d,%d,%d,%u,%u,%llu,%u,'%s',%llu,%llu,%llu,%llu,%s,%d\n",
-                        e->insert_pid, e->insert_tgid, e->issue_pid, e->issue_tgid,
-                        e->complete_pid, e->complete_tgid,
-                        MAJOR(e->iorq_dev), MINOR(e->iorq_dev), e->iorq_sector, e->iorq_bytes,
-                        get_iorq_op_flags(e->iorq_cmd_flags), e->iorq_sequence_num,
-                        duration_ns, service_ns, (duration_ns - service_ns),
-                        iorq_insert_str, e->iorq_error);
+                    struct csv_row row;
+
+                    csv_begin_row(&row);
+                    csv_str(&row, "IORQ_END");
+                    csv_s64(&row, e->insert_pid);
+                    csv_s64(&row, e->insert_tgid);
+                    csv_s64(&row, e->issue_pid);
+                    csv_s64(&row, e->issue_tgid);
+                    csv_s64(&row, e->complete_pid);
+                    csv_s64(&row, e->complete_tgid);
+                    csv_u64(&row, MAJOR(e->iorq_dev));
+                    csv_u64(&row, MINOR(e->iorq_dev));
+                    csv_u64(&row, e->iorq_sector);
+                    csv_u64(&row, e->iorq_bytes);
+                    csv_quoted(&row, get_iorq_op_flags(e->iorq_cmd_flags));
+                    csv_u64(&row, e->iorq_sequence_num);
+                    csv_u64(&row, duration_ns);
+                    csv_u64(&row, service_ns);
+                    csv_u64(&row, duration_ns - service_ns);
+                    csv_str(&row, iorq_insert_str);
+                    csv_s64(&row, e->iorq_error);
+                    csv_end_row(&row, xctx->files.iorq_completion_file);
+                    live_append(LIVE_IORQEND, get_wall_from_mono(&xctx->tcorr, e->iorq_complete_time),
+                                row.buf, row.pos - row.buf);
                 } else {
                     // microsec granularity for dev display mode
                     printf("IORQ_END  %7d  %7d  %7d  %7d  %7d  %7d  %-20s dur= %-'10llu  que= %-'10llu  svc= %-'10llu  "
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "xcapture.h"
+#include "xcapture_user.h"
+#include "xcapture_context.h"
+#include "csv_encoder.h"
+#include "symcache.h"
+#include "umaps.h"
+
+// A snapshot is identified by its MAPS_ID, an FNV-1a hash of the executable
+// file mappings (range, file offset, path) of the process. Neither mmap() nor
+// dlopen() touch any timestamp that procfs exposes, so /proc/PID/maps is read
+// again for every new user stack and the hash tells whether the mappings are
+// still the ones already written. Stacks are deduplicated per file period in
+// the kernel, so this happens once per new stack and not once per sample.
+// Threads of a process, and forked children that haven't changed their
+// mappings, share one snapshot.
+
+#define UMAPS_SEEN_SIZE      8192   // power of 2
+#define UMAPS_BINARY_BUCKETS 1024
+
+// build ids of the binaries seen so far, by file identity
+struct umaps_binary {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    char build_id[2 * SYMCACHE_BUILD_ID_MAX + 1];
+    struct umaps_binary *next;
+};
+
+static struct {
+    char *maps;                     // /proc/PID/maps of the current stack
+    size_t maps_cap;
+    __u64 seen[UMAPS_SEEN_SIZE];    // MAPS_IDs written into the current files, 0 = free
+    __u32 seen_epoch;
+    struct umaps_binary *buckets[UMAPS_BINARY_BUCKETS];
+} um;
+
+// Build id of the file behind a mapping. map_files opens what is actually
+// mapped, even if it was deleted or lives in another mount namespace
+static const char *get_build_id(pid_t pid, __u64 start, __u64 end, const char *path)
+{
+    char fullpath[PATH_MAX];
+    struct stat st;
+
+    snprintf(fullpath, sizeof(fullpath), "/proc/%d/map_files/%llx-%llx", pid, start, end);
+    if (stat(fullpath, &st) < 0) {
+        snprintf(fullpath, sizeof(fullpath), "/proc/%d/root%s", pid, path);
+        if (stat(fullpath, &st) < 0)
+            return "";
+    }
+
+    unsigned int h = (unsigned int)((st.st_ino ^ st.st_dev) * 2654435761ULL) & (UMAPS_BINARY_BUCKETS - 1);
+    for (struct umaps_binary *b = um.buckets[h]; b; b = b->next)
+        if (b->dev == st.st_dev && b->ino == st.st_ino && b->size == st.st_size && b->mtime == st.st_mtime)
+            return b->build_id;
+
+    struct umaps_binary *bin = calloc(1, sizeof(*bin));
+    if (!bin)
+        return "";
+
+    bin->dev = st.st_dev;
+    bin->ino = st.st_ino;
+    bin->size = st.st_size;
+    bin->mtime = st.st_mtime;
+
+    int fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct symcache_elf elf;
+        if (symcache_read_elf(fd, &elf) == 0)
+            memcpy(bin->build_id, elf.build_id, sizeof(bin->build_id));
+        close(fd);
+    }
+
+    bin->next = um.buckets[h];
+    um.buckets[h] = bin;
+    return bin->build_id;
+}
+
+static bool read_maps(pid_t pid)
+{
+    char path[64];
+    size_t len = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    for (;;) {
+        if (um.maps_cap - len < 4096) {
+            size_t cap = um.maps_cap ? um.maps_cap * 2 : 64 * 1024;
+            char *p = realloc(um.maps, cap);
+            if (!p)
+                break;
+            um.maps = p;
+            um.maps_cap = cap;
+        }
+
+        ssize_t n = read(fd, um.maps + len, um.maps_cap - len - 1);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+
+    if (um.maps)
+        um.maps[len] = '\0';
+    return len > 0;
+}
+
+// Next executable file mapping in the maps text at *pos, NULL at the end.
+// The path is NUL terminated in place
+static char *next_mapping(char **pos, __u64 *start, __u64 *end, __u64 *offset)
+{
+    while (**pos) {
+        char *line = *pos;
+        char *nl = strchr(line, '\n');
+        char perms[5];
+        int name_pos = 0;
+
+        if (nl) {
+            *nl = '\0';
+            *pos = nl + 1;
+        } else {
+            *pos = line + strlen(line);
+        }
+
+        if (sscanf(line, "%llx-%llx %4s %llx %*x:%*x %*u %n", start, end, perms, offset, &name_pos) < 4 ||
+            perms[2] != 'x' || line[name_pos] != '/')
+            continue;
+
+        char *name = line + name_pos;
+        char *deleted = strstr(name, " (deleted)");
+        if (deleted)
+            *deleted = '\0';
+        return name;
+    }
+    return NULL;
+}
+
+static __u64 fnv1a(__u64 h, const void *data, size_t len)
+{
+    const __u8 *p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static __u64 *seen_slot(__u64 id)
+{
+    unsigned int i = (id * 2654435761ULL) & (UMAPS_SEEN_SIZE - 1);
+
+    for (int n = 0; n < UMAPS_SEEN_SIZE; n++, i = (i + 1) & (UMAPS_SEEN_SIZE - 1))
+        if (um.seen[i] == id || um.seen[i] == 0)
+            return &um.seen[i];
+    return NULL;
+}
+
+// MAPS_ID of the process's current mappings, written into the umaps file if
+// needed. 0 when the process is gone already
+static __u64 snapshot(struct xcapture_context *xctx, pid_t pid)
+{
+    __u64 h = 0xcbf29ce484222325ULL;
+    __u64 start, end, offset;
+    char *pos, *name;
+    int nr = 0;
+
+    if (pid <= 0 || !read_maps(pid))
+        return 0;
+
+    // every file period gets the snapshots its stacks refer to
+    if (um.seen_epoch != xctx->files.epoch) {
+        memset(um.seen, 0, sizeof(um.seen));
+        um.seen_epoch = xctx->files.epoch;
+    }
+
+    // hashing cuts the lines up, the rows are written from a fresh copy
+    size_t len = strlen(um.maps);
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return 0;
+    memcpy(copy, um.maps, len + 1);
+
+    for (pos = copy; (name = next_mapping(&pos, &start, &end, &offset)) && nr < UMAPS_MAX_MAPPINGS; nr++) {
+        h = fnv1a(h, &start, sizeof(start));
+        h = fnv1a(h, &end, sizeof(end));
+        h = fnv1a(h, &offset, sizeof(offset));
+        h = fnv1a(h, name, strlen(name));
+    }
+    free(copy);
+
+    if (nr == 0)
+        return 0;
+    if (h == 0)
+        h = 1;
+
+    __u64 *slot = seen_slot(h);
+    if (slot && *slot == h)
+        return h;
+    if (slot)
+        *slot = h;
+
+    nr = 0;
+    for (pos = um.maps; (name = next_mapping(&pos, &start, &end, &offset)) && nr < UMAPS_MAX_MAPPINGS; nr++) {
+        struct csv_row row;
+
+        csv_begin_row(&row);
+        csv_hex(&row, h);
+        csv_hex(&row, start);
+        csv_hex(&row, end);
+        csv_hex(&row, offset);
+        csv_str(&row, get_build_id(pid, start, end, name));
+        csv_quoted(&row, name);
+        csv_end_row(&row, xctx->files.umaps_file);
+    }
+
+    return h;
+}
+
+void umaps_write_ustack(struct xcapture_context *xctx, const struct stack_trace_event *event)
+{
+    static const char hex[] = "0123456789abcdef";
+    char addrs[MAX_STACK_LEN * 17 + 1];
+    char *p = addrs;
+    struct csv_row row;
+
+    __u64 maps_id = snapshot(xctx, event->pid);
+
+    // 7f12ab34;7f12ab56;... as in the stdout fallback for unsymbolized stacks
+    for (int i = 0; i < event->stack_len && i < MAX_STACK_LEN; i++) {
+        char tmp[16];
+        char *t = tmp + sizeof(tmp);
+        __u64 v = event->stack[i];
+
+        do {
+            *--t = hex[v & 0xf];
+            v >>= 4;
+        } while (v);
+
+        if (i)
+            *p++ = ';';
+        memcpy(p, t, tmp + sizeof(tmp) - t);
+        p += tmp + sizeof(tmp) - t;
+    }
+    *p = '\0';
+
+    csv_begin_row(&row);
+    csv_hex(&row, event->stack_hash);
+    csv_hex(&row, maps_id);
+    csv_quoted(&row, addrs);
+    csv_end_row(&row, xctx->files.uaddrs_file);
+}
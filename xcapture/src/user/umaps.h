@@ -0,0 +1,21 @@
+#ifndef __UMAPS_H
+#define __UMAPS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include "xcapture.h"
+#include "xcapture_context.h"
+
+// --defer-symbols: user stacks are written as raw addresses along with a
+// snapshot of the executable mappings of the process they came from, which
+// xcapture-symbolize resolves later, on this host or another one.
+
+#define UMAPS_MAX_MAPPINGS  1024    // executable mappings per snapshot
+
+// Write the raw addresses of a user stack into the uaddrs file, preceded by a
+// snapshot of the process mappings when the current files don't have it yet
+void umaps_write_ustack(struct xcapture_context *xctx, const struct stack_trace_event *event);
+
+#endif /* __UMAPS_H */
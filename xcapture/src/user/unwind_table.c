@@ -0,0 +1,921 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+// Copyright 2024-2038 Tanel Poder [0x.tools]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bpf/bpf.h>
+
+#include "xcapture.h"
+#include "unwind_table.h"
+
+// Compiles the .eh_frame CFI of executables mapped into sampled processes into
+// the flat unwind_row format the task iterator uses for DWARF user stack unwinding
+// (--dwarf-stacks). Only the x86_64 subset of CFA rules that show up in compiler
+// generated code is supported: CFA = rsp/rbp + offset, rbp saved at CFA + offset
+// and the return address at CFA - 8. Anything else (PLT expressions, hand written
+// asm) becomes an UNWIND_CFA_UNKNOWN row and the unwinder uses frame pointers there.
+//
+// Rows are appended to the mmaped unwind_rows array once per build-id and never
+// freed, so libc & co are compiled just once regardless of how many processes map them.
+
+#define UNWIND_BINARY_BUCKETS 1024
+#define UNWIND_BUILD_ID_MAX   32
+#define UNWIND_MAX_LOADS      8
+#define UNWIND_PROC_SLOTS     8192
+#define UNWIND_PENDING_MAX    256
+#define CFI_STATE_STACK       8
+
+// x86_64 DWARF register numbers
+#define DWARF_REG_RBP         6
+#define DWARF_REG_RSP         7
+
+// .eh_frame pointer encodings
+#define DW_EH_PE_omit         0xff
+#define DW_EH_PE_absptr       0x00
+#define DW_EH_PE_uleb128      0x01
+#define DW_EH_PE_udata2       0x02
+#define DW_EH_PE_udata4       0x03
+#define DW_EH_PE_udata8       0x04
+#define DW_EH_PE_sleb128      0x09
+#define DW_EH_PE_sdata2       0x0a
+#define DW_EH_PE_sdata4       0x0b
+#define DW_EH_PE_sdata8       0x0c
+#define DW_EH_PE_pcrel        0x10
+
+struct unwind_binary {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    __u8 build_id[UNWIND_BUILD_ID_MAX];
+    int build_id_len;
+    __u32 first_row;
+    __u32 nr_rows;                  // 0 = not an x86_64 ELF or no usable .eh_frame
+    int nr_loads;
+    struct {
+        __u64 vaddr;
+        __u64 offset;
+        __u64 filesz;
+    } loads[UNWIND_MAX_LOADS];      // executable PT_LOAD segments, for computing load bias
+    struct unwind_binary *next;
+};
+
+struct unwind_proc_slot {
+    pid_t tgid;
+    bool pending;
+    time_t scanned;
+};
+
+// CFI row as it comes out of the interpreter, before sorting and deduplication
+struct cfi_row {
+    struct unwind_row row;
+    __u32 seq;
+};
+
+struct cfi_state {
+    __u64 cfa_reg;
+    __s64 cfa_offset;
+    __s64 fp_offset;
+    bool cfa_expr;
+    bool fp_saved;
+    bool ra_undefined;
+};
+
+struct cie_info {
+    __u64 code_align;
+    __s64 data_align;
+    __u64 ra_reg;
+    __u8 fde_enc;
+    bool has_aug;
+    const __u8 *insns;
+    const __u8 *insns_end;
+};
+
+static struct {
+    int procs_fd;
+    struct unwind_row *rows;        // mmap of the unwind_rows array map
+    __u32 nr_rows;
+    bool rows_full_warned;
+    struct unwind_binary *buckets[UNWIND_BINARY_BUCKETS];
+    struct unwind_proc_slot procs[UNWIND_PROC_SLOTS];
+    pthread_mutex_t pending_lock;   // procs/pending are also updated by the pipeline's format worker
+    pid_t pending[UNWIND_PENDING_MAX];
+    int nr_pending;
+    time_t now;
+    struct cfi_row *tmp;            // scratch rows of the binary being compiled
+    size_t tmp_len;
+    size_t tmp_cap;
+} g_unwind = { .procs_fd = -1, .pending_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __u64 read_uleb(const __u8 **p, const __u8 *end)
+{
+    __u64 val = 0;
+    int shift = 0;
+
+    while (*p < end) {
+        __u8 b = *(*p)++;
+        if (shift < 64)
+            val |= (__u64)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80))
+            break;
+    }
+    return val;
+}
+
+static __s64 read_sleb(const __u8 **p, const __u8 *end)
+{
+    __s64 val = 0;
+    int shift = 0;
+    __u8 b = 0;
+
+    while (*p < end) {
+        b = *(*p)++;
+        if (shift < 64)
+            val |= (__s64)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80))
+            break;
+    }
+    if (shift < 64 && (b & 0x40))
+        val |= -((__s64)1 << shift);
+    return val;
+}
+
+static bool read_fixed(const __u8 **p, const __u8 *end, void *dst, size_t size)
+{
+    if ((size_t)(end - *p) < size)
+        return false;
+    memcpy(dst, *p, size);
+    *p += size;
+    return true;
+}
+
+// vaddr is the ELF virtual address of *p, needed for pc-relative encodings
+static bool read_encoded(const __u8 **p, const __u8 *end, __u8 enc, __u64 vaddr, __u64 *out)
+{
+    __u64 val = 0;
+
+    if (enc == DW_EH_PE_omit) {
+        *out = 0;
+        return true;
+    }
+
+    switch (enc & 0x0f) {
+        case DW_EH_PE_absptr:
+        case DW_EH_PE_udata8:
+        case DW_EH_PE_sdata8: {
+            __u64 v;
+            if (!read_fixed(p, end, &v, sizeof(v))) return false;
+            val = v;
+            break;
+        }
+        case DW_EH_PE_udata2: {
+            __u16 v;
+            if (!read_fixed(p, end, &v, sizeof(v))) return false;
+            val = v;
+            break;
+        }
+        case DW_EH_PE_sdata2: {
+            __s16 v;
+            if (!read_fixed(p, end, &v, sizeof(v))) return false;
+            val = (__u64)(__s64)v;
+            break;
+        }
+        case DW_EH_PE_udata4: {
+            __u32 v;
+            if (!read_fixed(p, end, &v, sizeof(v))) return false;
+            val = v;
+            break;
+        }
+        case DW_EH_PE_sdata4: {
+            __s32 v;
+            if (!read_fixed(p, end, &v, sizeof(v))) return false;
+            val = (__u64)(__s64)v;
+            break;
+        }
+        case DW_EH_PE_uleb128:
+            val = read_uleb(p, end);
+            break;
+        case DW_EH_PE_sleb128:
+            val = (__u64)read_sleb(p, end);
+            break;
+        default:
+            return false;
+    }
+
+    switch (enc & 0x70) {
+        case 0:
+            break;
+        case DW_EH_PE_pcrel:
+            val += vaddr;
+            break;
+        default:
+            return false;   // textrel/datarel/funcrel don't appear in x86_64 .eh_frame FDE pointers
+    }
+
+    *out = val;
+    return true;
+}
+
+static void emit_cfi_row(__u64 pc, const struct cfi_state *st, bool end_marker)
+{
+    if (g_unwind.tmp_len == g_unwind.tmp_cap) {
+        size_t cap = g_unwind.tmp_cap ? g_unwind.tmp_cap * 2 : 4096;
+        struct cfi_row *tmp = realloc(g_unwind.tmp, cap * sizeof(*tmp));
+        if (!tmp)
+            return;
+        g_unwind.tmp = tmp;
+        g_unwind.tmp_cap = cap;
+    }
+
+    struct unwind_row row = { .pc = pc, .cfa_type = UNWIND_CFA_UNKNOWN };
+
+    if (end_marker) {
+        // gap after a function, unknown until another FDE covers it
+    } else if (st->ra_undefined) {
+        row.cfa_type = UNWIND_CFA_END;
+    } else if (!st->cfa_expr &&
+               (st->cfa_reg == DWARF_REG_RSP || st->cfa_reg == DWARF_REG_RBP) &&
+               st->cfa_offset >= INT32_MIN && st->cfa_offset <= INT32_MAX &&
+               (!st->fp_saved || (st->fp_offset != 0 && st->fp_offset >= INT16_MIN && st->fp_offset <= INT16_MAX))) {
+        row.cfa_type = st->cfa_reg == DWARF_REG_RSP ? UNWIND_CFA_SP : UNWIND_CFA_FP;
+        row.cfa_offset = (__s32)st->cfa_offset;
+        row.fp_offset = st->fp_saved ? (__s16)st->fp_offset : 0;
+    }
+
+    g_unwind.tmp[g_unwind.tmp_len].row = row;
+    g_unwind.tmp[g_unwind.tmp_len].seq = (__u32)g_unwind.tmp_len;
+    g_unwind.tmp_len++;
+}
+
+// Run CFA instructions, emitting a row for every address range when emit is set.
+// Returns false on malformed or unsupported input
+static bool run_cfi(const struct cie_info *cie, const __u8 *p, const __u8 *end,
+                    struct cfi_state *st, const struct cfi_state *initial,
+                    __u64 loc, __u64 pc_end, __u64 eh_vaddr, const __u8 *eh_start, bool emit)
+{
+    struct cfi_state stack[CFI_STATE_STACK];
+    int depth = 0;
+
+    while (p < end) {
+        __u8 op = *p++;
+        __u8 low = op & 0x3f;
+        __u64 reg, delta = 0;
+        __s64 off;
+
+        switch (op & 0xc0) {
+            case 0x40:  // DW_CFA_advance_loc
+                delta = low * cie->code_align;
+                goto advance;
+            case 0x80:  // DW_CFA_offset
+                off = (__s64)read_uleb(&p, end) * cie->data_align;
+                if (low == DWARF_REG_RBP) {
+                    st->fp_saved = true;
+                    st->fp_offset = off;
+                }
+                continue;
+            case 0xc0:  // DW_CFA_restore
+                if (low == DWARF_REG_RBP && initial) {
+                    st->fp_saved = initial->fp_saved;
+                    st->fp_offset = initial->fp_offset;
+                }
+                continue;
+        }
+
+        switch (op) {
+            case 0x00:  // DW_CFA_nop
+                break;
+            case 0x01: {// DW_CFA_set_loc
+                __u64 newloc;
+                if (!read_encoded(&p, end, cie->fde_enc, eh_vaddr + (p - eh_start), &newloc))
+                    return false;
+                if (emit && newloc > loc)
+                    emit_cfi_row(loc, st, false);
+                loc = newloc;
+                break;
+            }
+            case 0x02:  // DW_CFA_advance_loc1
+                if (p + 1 > end) return false;
+                delta = *p++ * cie->code_align;
+                goto advance;
+            case 0x03: {// DW_CFA_advance_loc2
+                __u16 v;
+                if (!read_fixed(&p, end, &v, sizeof(v))) return false;
+                delta = v * cie->code_align;
+                goto advance;
+            }
+            case 0x04: {// DW_CFA_advance_loc4
+                __u32 v;
+                if (!read_fixed(&p, end, &v, sizeof(v))) return false;
+                delta = v * cie->code_align;
+                goto advance;
+            }
+            case 0x05:  // DW_CFA_offset_extended
+                reg = read_uleb(&p, end);
+                off = (__s64)read_uleb(&p, end) * cie->data_align;
+                if (reg == DWARF_REG_RBP) {
+                    st->fp_saved = true;
+                    st->fp_offset = off;
+                }
+                break;
+            case 0x11:  // DW_CFA_offset_extended_sf
+                reg = read_uleb(&p, end);
+                off = read_sleb(&p, end) * cie->data_align;
+                if (reg == DWARF_REG_RBP) {
+                    st->fp_saved = true;
+                    st->fp_offset = off;
+                }
+                break;
+            case 0x06:  // DW_CFA_restore_extended
+                reg = read_uleb(&p, end);
+                if (reg == DWARF_REG_RBP && initial) {
+                    st->fp_saved = initial->fp_saved;
+                    st->fp_offset = initial->fp_offset;
+                }
+                break;
+            case 0x07:  // DW_CFA_undefined
+                reg = read_uleb(&p, end);
+                if (reg == cie->ra_reg)
+                    st->ra_undefined = true;
+                else if (reg == DWARF_REG_RBP)
+                    st->fp_saved = false;
+                break;
+            case 0x08:  // DW_CFA_same_value
+                reg = read_uleb(&p, end);
+                if (reg == DWARF_REG_RBP)
+                    st->fp_saved = false;
+                break;
+            case 0x09:  // DW_CFA_register
+                reg = read_uleb(&p, end);
+                read_uleb(&p, end);
+                if (reg == DWARF_REG_RBP) {
+                    // rbp kept in another register, not representable
+                    st->fp_saved = true;
+                    st->fp_offset = INT64_MAX;
+                }
+                break;
+            case 0x0a:  // DW_CFA_remember_state
+                if (depth < CFI_STATE_STACK)
+                    stack[depth] = *st;
+                depth++;
+                break;
+            case 0x0b:  // DW_CFA_restore_state
+                if (depth > 0) {
+                    depth--;
+                    if (depth < CFI_STATE_STACK)
+                        *st = stack[depth];     // the whole row, CFA rule included
+                }
+                break;
+            case 0x0c:  // DW_CFA_def_cfa
+                st->cfa_reg = read_uleb(&p, end);
+                st->cfa_offset = (__s64)read_uleb(&p, end);
+                st->cfa_expr = false;
+                break;
+            case 0x12:  // DW_CFA_def_cfa_sf
+                st->cfa_reg = read_uleb(&p, end);
+                st->cfa_offset = read_sleb(&p, end) * cie->data_align;
+                st->cfa_expr = false;
+                break;
+            case 0x0d:  // DW_CFA_def_cfa_register
+                st->cfa_reg = read_uleb(&p, end);
+                st->cfa_expr = false;
+                break;
+            case 0x0e:  // DW_CFA_def_cfa_offset
+                st->cfa_offset = (__s64)read_uleb(&p, end);
+                break;
+            case 0x13:  // DW_CFA_def_cfa_offset_sf
+                st->cfa_offset = read_sleb(&p, end) * cie->data_align;
+                break;
+            case 0x0f: {// DW_CFA_def_cfa_expression
+                __u64 len = read_uleb(&p, end);
+                if (len > (__u64)(end - p)) return false;
+                p += len;
+                st->cfa_expr = true;
+                break;
+            }
+            case 0x10:  // DW_CFA_expression
+            case 0x16: {// DW_CFA_val_expression
+                reg = read_uleb(&p, end);
+                __u64 len = read_uleb(&p, end);
+                if (len > (__u64)(end - p)) return false;
+                p += len;
+                if (reg == DWARF_REG_RBP) {
+                    st->fp_saved = true;
+                    st->fp_offset = INT64_MAX;
+                }
+                break;
+            }
+            case 0x14:  // DW_CFA_val_offset
+            case 0x15:  // DW_CFA_val_offset_sf
+                reg = read_uleb(&p, end);
+                if (op == 0x14)
+                    read_uleb(&p, end);
+                else
+                    read_sleb(&p, end);
+                if (reg == DWARF_REG_RBP) {
+                    st->fp_saved = true;
+                    st->fp_offset = INT64_MAX;
+                }
+                break;
+            case 0x2e:  // DW_CFA_GNU_args_size
+                read_uleb(&p, end);
+                break;
+            case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+                reg = read_uleb(&p, end);
+                off = -(__s64)read_uleb(&p, end) * cie->data_align;
+                if (reg == DWARF_REG_RBP) {
+                    st->fp_saved = true;
+                    st->fp_offset = off;
+                }
+                break;
+            default:
+                return false;
+        }
+        continue;
+
+advance:
+        if (emit && delta) {
+            emit_cfi_row(loc, st, false);
+        }
+        loc += delta;
+    }
+
+    if (emit) {
+        if (loc < pc_end)
+            emit_cfi_row(loc, st, false);
+        emit_cfi_row(pc_end, st, true);
+    }
+
+    return true;
+}
+
+// p points at the CIE length field
+static bool parse_cie(const __u8 *p, const __u8 *sec_end, struct cie_info *cie)
+{
+    __u32 len32;
+    __u64 len;
+
+    if (!read_fixed(&p, sec_end, &len32, sizeof(len32)))
+        return false;
+    len = len32;
+    if (len32 == 0xffffffff && !read_fixed(&p, sec_end, &len, sizeof(len)))
+        return false;
+    if (len > (__u64)(sec_end - p))
+        return false;
+
+    const __u8 *end = p + len;
+    __u32 id;
+    if (!read_fixed(&p, end, &id, sizeof(id)) || id != 0)
+        return false;
+
+    if (p >= end)
+        return false;
+    __u8 version = *p++;
+
+    const char *aug = (const char *)p;
+    size_t aug_len = strnlen(aug, end - p);
+    p += aug_len + 1;
+    if (p > end)
+        return false;
+
+    if (strstr(aug, "eh"))
+        return false;   // ancient GCC layout, not worth supporting
+
+    memset(cie, 0, sizeof(*cie));
+    cie->fde_enc = DW_EH_PE_absptr;
+    cie->code_align = read_uleb(&p, end);
+    cie->data_align = read_sleb(&p, end);
+    cie->ra_reg = version == 1 ? (p < end ? *p++ : 0) : read_uleb(&p, end);
+
+    if (aug[0] == 'z') {
+        cie->has_aug = true;
+        __u64 data_len = read_uleb(&p, end);
+        if (data_len > (__u64)(end - p))
+            return false;
+        const __u8 *data = p;
+        const __u8 *data_end = p + data_len;
+
+        for (const char *a = aug + 1; *a; a++) {
+            if (*a == 'R') {
+                if (data >= data_end) return false;
+                cie->fde_enc = *data++;
+            } else if (*a == 'P') {
+                if (data >= data_end) return false;
+                __u8 penc = *data++;
+                __u64 dummy;
+                // only the size matters here, indirect/pcrel don't change it
+                if (!read_encoded(&data, data_end, penc & 0x0f, 0, &dummy))
+                    return false;
+            } else if (*a == 'L') {
+                if (data >= data_end) return false;
+                data++;
+            } else if (*a != 'S' && *a != 'B') {
+                return false;
+            }
+        }
+        p = data_end;
+    } else if (aug[0] != '\0') {
+        return false;
+    }
+
+    cie->insns = p;
+    cie->insns_end = end;
+    return true;
+}
+
+// Walk all FDEs of .eh_frame and collect their rows into g_unwind.tmp
+static void compile_eh_frame(const __u8 *sec, size_t sec_size, __u64 sec_vaddr)
+{
+    const __u8 *p = sec;
+    const __u8 *sec_end = sec + sec_size;
+
+    while (p < sec_end) {
+        __u32 len32;
+        __u64 len;
+
+        if (!read_fixed(&p, sec_end, &len32, sizeof(len32)) || len32 == 0)
+            break;  // zero terminator
+        len = len32;
+        if (len32 == 0xffffffff && !read_fixed(&p, sec_end, &len, sizeof(len)))
+            break;
+        if (len > (__u64)(sec_end - p))
+            break;
+
+        const __u8 *end = p + len;
+        const __u8 *id_pos = p;
+        __u32 id;
+        if (!read_fixed(&p, end, &id, sizeof(id)))
+            break;
+
+        if (id != 0 && (size_t)(id_pos - sec) >= id) {
+            struct cie_info cie;
+            if (parse_cie(id_pos - id, sec_end, &cie)) {
+                __u64 pc_begin, pc_range;
+                if (read_encoded(&p, end, cie.fde_enc, sec_vaddr + (p - sec), &pc_begin) &&
+                    read_encoded(&p, end, cie.fde_enc & 0x0f, 0, &pc_range)) {
+
+                    if (cie.has_aug) {
+                        __u64 aug_len = read_uleb(&p, end);
+                        p += aug_len < (__u64)(end - p) ? aug_len : (__u64)(end - p);
+                    }
+
+                    struct cfi_state initial = { .cfa_reg = DWARF_REG_RSP, .cfa_offset = 8 };
+                    if (run_cfi(&cie, cie.insns, cie.insns_end, &initial, NULL,
+                                pc_begin, pc_begin + pc_range, sec_vaddr, sec, false)) {
+                        struct cfi_state st = initial;
+                        size_t mark = g_unwind.tmp_len;
+                        if (!run_cfi(&cie, p, end, &st, &initial,
+                                     pc_begin, pc_begin + pc_range, sec_vaddr, sec, true))
+                            g_unwind.tmp_len = mark;    // drop partially decoded FDE
+                    }
+                }
+            }
+        }
+
+        p = end;
+    }
+}
+
+static int cmp_cfi_row(const void *a, const void *b)
+{
+    const struct cfi_row *x = a, *y = b;
+    bool xk = x->row.cfa_type != UNWIND_CFA_UNKNOWN;
+    bool yk = y->row.cfa_type != UNWIND_CFA_UNKNOWN;
+
+    if (x->row.pc != y->row.pc)
+        return x->row.pc < y->row.pc ? -1 : 1;
+    // for the same pc the last known rule wins, so sort end markers first
+    if (xk != yk)
+        return xk ? 1 : -1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static bool same_rule(const struct unwind_row *a, const struct unwind_row *b)
+{
+    return a->cfa_type == b->cfa_type && a->cfa_offset == b->cfa_offset && a->fp_offset == b->fp_offset;
+}
+
+// Sort and deduplicate the scratch rows and append them to the BPF array
+static void publish_rows(struct unwind_binary *bin)
+{
+    size_t n = 0;
+
+    qsort(g_unwind.tmp, g_unwind.tmp_len, sizeof(*g_unwind.tmp), cmp_cfi_row);
+
+    for (size_t i = 0; i < g_unwind.tmp_len; i++) {
+        // keep only the last row of every pc
+        if (i + 1 < g_unwind.tmp_len && g_unwind.tmp[i + 1].row.pc == g_unwind.tmp[i].row.pc)
+            continue;
+        // and drop rows that don't change the rule
+        if (n > 0 && same_rule(&g_unwind.tmp[n - 1].row, &g_unwind.tmp[i].row))
+            continue;
+        g_unwind.tmp[n++] = g_unwind.tmp[i];
+    }
+
+    if (!n)
+        return;
+
+    if (n > UNWIND_MAX_ROWS - g_unwind.nr_rows) {
+        if (!g_unwind.rows_full_warned) {
+            fprintf(stderr, "Unwind table space exhausted (%u rows), new binaries use frame pointers only\n",
+                    UNWIND_MAX_ROWS);
+            g_unwind.rows_full_warned = true;
+        }
+        return;
+    }
+
+    bin->first_row = g_unwind.nr_rows;
+    for (size_t i = 0; i < n; i++)
+        g_unwind.rows[g_unwind.nr_rows + i] = g_unwind.tmp[i].row;
+    g_unwind.nr_rows += n;
+    bin->nr_rows = n;
+}
+
+static struct unwind_binary *find_by_build_id(const struct unwind_binary *bin)
+{
+    if (!bin->build_id_len)
+        return NULL;
+
+    for (int i = 0; i < UNWIND_BINARY_BUCKETS; i++) {
+        for (struct unwind_binary *b = g_unwind.buckets[i]; b; b = b->next) {
+            if (b != bin && b->build_id_len == bin->build_id_len &&
+                memcmp(b->build_id, bin->build_id, bin->build_id_len) == 0)
+                return b;
+        }
+    }
+    return NULL;
+}
+
+static void read_build_id(struct unwind_binary *bin, const __u8 *note, size_t size)
+{
+    const __u8 *p = note, *end = note + size;
+
+    while ((size_t)(end - p) >= sizeof(Elf64_Nhdr)) {
+        Elf64_Nhdr nh;
+        memcpy(&nh, p, sizeof(nh));
+        p += sizeof(nh);
+
+        size_t name_sz = (nh.n_namesz + 3) & ~3U;
+        size_t desc_sz = (nh.n_descsz + 3) & ~3U;
+        if (name_sz > (size_t)(end - p) || desc_sz > (size_t)(end - p - name_sz))
+            return;
+
+        if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4 && memcmp(p, "GNU", 4) == 0) {
+            bin->build_id_len = nh.n_descsz < UNWIND_BUILD_ID_MAX ? nh.n_descsz : UNWIND_BUILD_ID_MAX;
+            memcpy(bin->build_id, p + name_sz, bin->build_id_len);
+            return;
+        }
+        p += name_sz + desc_sz;
+    }
+}
+
+// Parse the ELF file and compile (or reuse by build-id) its unwind rows
+static void load_binary(struct unwind_binary *bin, int fd)
+{
+    const __u8 *img = mmap(NULL, bin->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (img == MAP_FAILED)
+        return;
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)img;
+    if ((size_t)bin->size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64 ||
+        eh->e_phoff + (__u64)eh->e_phnum * sizeof(Elf64_Phdr) > (__u64)bin->size ||
+        eh->e_shoff + (__u64)eh->e_shnum * sizeof(Elf64_Shdr) > (__u64)bin->size ||
+        eh->e_shstrndx >= eh->e_shnum)
+        goto out;
+
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)(img + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum && bin->nr_loads < UNWIND_MAX_LOADS; i++) {
+        if (ph[i].p_type == PT_LOAD && (ph[i].p_flags & PF_X)) {
+            bin->loads[bin->nr_loads].vaddr = ph[i].p_vaddr;
+            bin->loads[bin->nr_loads].offset = ph[i].p_offset;
+            bin->loads[bin->nr_loads].filesz = ph[i].p_filesz;
+            bin->nr_loads++;
+        }
+    }
+
+    const Elf64_Shdr *sh = (const Elf64_Shdr *)(img + eh->e_shoff);
+    const Elf64_Shdr *strtab = &sh[eh->e_shstrndx];
+    const Elf64_Shdr *eh_frame = NULL;
+
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == SHT_NOBITS || sh[i].sh_offset + sh[i].sh_size > (__u64)bin->size ||
+            sh[i].sh_name >= strtab->sh_size)
+            continue;
+
+        const char *name = (const char *)img + strtab->sh_offset + sh[i].sh_name;
+        if (strcmp(name, ".eh_frame") == 0)
+            eh_frame = &sh[i];
+        else if (sh[i].sh_type == SHT_NOTE && strcmp(name, ".note.gnu.build-id") == 0)
+            read_build_id(bin, img + sh[i].sh_offset, sh[i].sh_size);
+    }
+
+    struct unwind_binary *same = find_by_build_id(bin);
+    if (same) {
+        bin->first_row = same->first_row;
+        bin->nr_rows = same->nr_rows;
+        goto out;
+    }
+
+    if (eh_frame) {
+        g_unwind.tmp_len = 0;
+        compile_eh_frame(img + eh_frame->sh_offset, eh_frame->sh_size, eh_frame->sh_addr);
+        publish_rows(bin);
+    }
+
+out:
+    munmap((void *)img, bin->size);
+}
+
+static struct unwind_binary *get_binary(pid_t tgid, const char *path)
+{
+    char fullpath[PATH_MAX];
+    struct stat st;
+
+    // go through the process's root so that binaries in containers resolve too
+    snprintf(fullpath, sizeof(fullpath), "/proc/%d/root%s", tgid, path);
+    int fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    unsigned int h = (unsigned int)((st.st_ino ^ st.st_dev) * 2654435761ULL) & (UNWIND_BINARY_BUCKETS - 1);
+    for (struct unwind_binary *b = g_unwind.buckets[h]; b; b = b->next) {
+        if (b->dev == st.st_dev && b->ino == st.st_ino &&
+            b->size == st.st_size && b->mtime == st.st_mtime) {
+            close(fd);
+            return b;
+        }
+    }
+
+    struct unwind_binary *bin = calloc(1, sizeof(*bin));
+    if (!bin) {
+        close(fd);
+        return NULL;
+    }
+
+    bin->dev = st.st_dev;
+    bin->ino = st.st_ino;
+    bin->size = st.st_size;
+    bin->mtime = st.st_mtime;
+    load_binary(bin, fd);
+    close(fd);
+
+    bin->next = g_unwind.buckets[h];
+    g_unwind.buckets[h] = bin;
+    return bin;
+}
+
+// Read /proc/PID/maps and publish the process's executable mappings
+static void register_process(pid_t tgid)
+{
+    char path[64], line[PATH_MAX + 128];
+    struct unwind_proc proc;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", tgid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+
+    memset(&proc, 0, sizeof(proc));
+
+    while (fgets(line, sizeof(line), f) && proc.nr_mappings < UNWIND_MAX_MAPPINGS) {
+        unsigned long long start, end, offset, inode;
+        char perms[5];
+        int name_pos = 0;
+
+        if (sscanf(line, "%llx-%llx %4s %llx %*x:%*x %llu %n",
+                   &start, &end, perms, &offset, &inode, &name_pos) < 5)
+            continue;
+        if (perms[2] != 'x' || inode == 0 || line[name_pos] != '/')
+            continue;
+
+        char *name = line + name_pos;
+        name[strcspn(name, "\n")] = '\0';
+        if (strstr(name, " (deleted)"))
+            continue;
+
+        struct unwind_binary *bin = get_binary(tgid, name);
+        if (!bin || !bin->nr_loads)
+            continue;
+
+        // find the PT_LOAD segment this mapping comes from to get the load bias
+        for (int i = 0; i < bin->nr_loads; i++) {
+            if (offset >= bin->loads[i].offset &&
+                offset < bin->loads[i].offset + bin->loads[i].filesz) {
+                struct unwind_mapping *m = &proc.mappings[proc.nr_mappings++];
+                m->start = start;
+                m->end = end;
+                m->load_bias = start - (bin->loads[i].vaddr + (offset - bin->loads[i].offset));
+                m->first_row = bin->first_row;
+                m->nr_rows = bin->nr_rows;
+                break;
+            }
+        }
+    }
+
+    fclose(f);
+
+    if (proc.nr_mappings)
+        bpf_map_update_elem(g_unwind.procs_fd, &tgid, &proc, BPF_ANY);
+}
+
+int unwind_tables_init(int rows_fd, int procs_fd)
+{
+    void *rows = mmap(NULL, (size_t)UNWIND_MAX_ROWS * sizeof(struct unwind_row),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, rows_fd, 0);
+    if (rows == MAP_FAILED)
+        return -1;
+
+    g_unwind.rows = rows;
+    g_unwind.procs_fd = procs_fd;
+    g_unwind.now = time(NULL);
+    return 0;
+}
+
+void unwind_note_process(pid_t tgid)
+{
+    if (!g_unwind.rows || tgid <= 0)
+        return;
+
+    // direct mapped, a collision just means an earlier rescan of the evicted process
+    struct unwind_proc_slot *slot = &g_unwind.procs[tgid & (UNWIND_PROC_SLOTS - 1)];
+
+    pthread_mutex_lock(&g_unwind.pending_lock);
+    if (!(slot->tgid == tgid && (slot->pending || g_unwind.now - slot->scanned < UNWIND_RESCAN_SEC)) &&
+        g_unwind.nr_pending < UNWIND_PENDING_MAX) {
+        slot->tgid = tgid;
+        slot->pending = true;
+        slot->scanned = 0;
+        g_unwind.pending[g_unwind.nr_pending++] = tgid;
+    }
+    pthread_mutex_unlock(&g_unwind.pending_lock);
+}
+
+void unwind_tables_refresh(void)
+{
+    if (!g_unwind.rows)
+        return;
+
+    pid_t batch[UNWIND_PROCS_PER_ITER];
+    time_t now = time(NULL);
+
+    // take a batch off the pending list, the (slow) registration runs unlocked
+    pthread_mutex_lock(&g_unwind.pending_lock);
+    g_unwind.now = now;
+    int n = g_unwind.nr_pending < UNWIND_PROCS_PER_ITER ? g_unwind.nr_pending : UNWIND_PROCS_PER_ITER;
+    memcpy(batch, g_unwind.pending, n * sizeof(pid_t));
+    memmove(g_unwind.pending, g_unwind.pending + n, (g_unwind.nr_pending - n) * sizeof(pid_t));
+    g_unwind.nr_pending -= n;
+    pthread_mutex_unlock(&g_unwind.pending_lock);
+
+    for (int i = 0; i < n; i++)
+        register_process(batch[i]);
+
+    pthread_mutex_lock(&g_unwind.pending_lock);
+    for (int i = 0; i < n; i++) {
+        struct unwind_proc_slot *slot = &g_unwind.procs[batch[i] & (UNWIND_PROC_SLOTS - 1)];
+        if (slot->tgid == batch[i]) {
+            slot->pending = false;
+            slot->scanned = now;
+        }
+    }
+    pthread_mutex_unlock(&g_unwind.pending_lock);
+}
+
+void unwind_tables_destroy(void)
+{
+    for (int i = 0; i < UNWIND_BINARY_BUCKETS; i++) {
+        struct unwind_binary *b = g_unwind.buckets[i];
+        while (b) {
+            struct unwind_binary *next = b->next;
+            free(b);
+            b = next;
+        }
+        g_unwind.buckets[i] = NULL;
+    }
+
+    if (g_unwind.rows)
+        munmap(g_unwind.rows, (size_t)UNWIND_MAX_ROWS * sizeof(struct unwind_row));
+    g_unwind.rows = NULL;
+
+    free(g_unwind.tmp);
+    g_unwind.tmp = NULL;
+    g_unwind.tmp_len = g_unwind.tmp_cap = 0;
+}
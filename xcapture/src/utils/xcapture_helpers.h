@@ -16,99 +16,66 @@ struct fred_info___check {
 
 // Simple BPF-compatible hash function for stack traces
 // Uses FNV-1a hash algorithm which is simple and effective
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+#ifdef OLD_KERNEL_SUPPORT
+// No bpf_loop() on old kernels, hash an unrolled prefix of the stack instead
+#define STACK_HASH_MAX_FRAMES 20
+
 static __u64 __always_inline get_stack_hash(__u64 *stack, int stack_len)
 {
     if (!stack || stack_len <= 0)
         return 0;
-    
-    // FNV-1a 64-bit offset basis and prime
-    __u64 hash = 0xcbf29ce484222325ULL;  // FNV offset basis
-    const __u64 fnv_prime = 0x100000001b3ULL;
-    
-    // Hash each address in the stack - unrolled for BPF verifier
-    if (stack_len > 0 && 0 < MAX_STACK_LEN) {
-        hash ^= stack[0];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 1 && 1 < MAX_STACK_LEN) {
-        hash ^= stack[1];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 2 && 2 < MAX_STACK_LEN) {
-        hash ^= stack[2];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 3 && 3 < MAX_STACK_LEN) {
-        hash ^= stack[3];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 4 && 4 < MAX_STACK_LEN) {
-        hash ^= stack[4];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 5 && 5 < MAX_STACK_LEN) {
-        hash ^= stack[5];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 6 && 6 < MAX_STACK_LEN) {
-        hash ^= stack[6];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 7 && 7 < MAX_STACK_LEN) {
-        hash ^= stack[7];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 8 && 8 < MAX_STACK_LEN) {
-        hash ^= stack[8];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 9 && 9 < MAX_STACK_LEN) {
-        hash ^= stack[9];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 10 && 10 < MAX_STACK_LEN) {
-        hash ^= stack[10];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 11 && 11 < MAX_STACK_LEN) {
-        hash ^= stack[11];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 12 && 12 < MAX_STACK_LEN) {
-        hash ^= stack[12];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 13 && 13 < MAX_STACK_LEN) {
-        hash ^= stack[13];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 14 && 14 < MAX_STACK_LEN) {
-        hash ^= stack[14];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 15 && 15 < MAX_STACK_LEN) {
-        hash ^= stack[15];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 16 && 16 < MAX_STACK_LEN) {
-        hash ^= stack[16];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 17 && 17 < MAX_STACK_LEN) {
-        hash ^= stack[17];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 18 && 18 < MAX_STACK_LEN) {
-        hash ^= stack[18];
-        hash *= fnv_prime;
-    }
-    if (stack_len > 19 && 19 < MAX_STACK_LEN) {
-        hash ^= stack[19];
-        hash *= fnv_prime;
+
+    __u64 hash = FNV_OFFSET_BASIS;
+
+#pragma unroll
+    for (int i = 0; i < STACK_HASH_MAX_FRAMES && i < MAX_STACK_LEN; i++) {
+        if (i >= stack_len)
+            break;
+        hash ^= stack[i];
+        hash *= FNV_PRIME;
     }
-    
+
     return hash;
 }
+#else
+struct stack_hash_ctx {
+    const __u64 *stack;
+    __u32 len;
+    __u64 hash;
+};
+
+static long stack_hash_step(__u64 i, void *data)
+{
+    struct stack_hash_ctx *c = data;
+
+    if (i >= c->len || i >= MAX_STACK_LEN)
+        return 1; // stop
+
+    c->hash ^= c->stack[i];
+    c->hash *= FNV_PRIME;
+    return 0;
+}
+
+// Hashes the full stack depth with a single copy of the loop body, so the
+// instruction count does not grow with MAX_STACK_LEN
+static __u64 __always_inline get_stack_hash(__u64 *stack, int stack_len)
+{
+    if (!stack || stack_len <= 0)
+        return 0;
+
+    struct stack_hash_ctx c = {
+        .stack = stack,
+        .len = stack_len > MAX_STACK_LEN ? MAX_STACK_LEN : stack_len,
+        .hash = FNV_OFFSET_BASIS,
+    };
+
+    bpf_loop(c.len, stack_hash_step, &c, 0);
+    return c.hash;
+}
+#endif
 
 // Helper function to get disk information from request
 static struct gendisk __always_inline *get_disk(struct request *rq)
@@ -122,6 +89,44 @@ static struct gendisk __always_inline *get_disk(struct request *rq)
 
     return disk; // will be NULL if (!q)
 }
+// Cgroup the request is charged to, from the blkcg of its first bio. Unlike
+// the current task at completion (or issue), this is also right for writeback
+static __u64 __always_inline get_rq_cgroup_id(struct request *rq)
+{
+    struct bio *bio = BPF_CORE_READ(rq, bio);
+
+    if (!bio || !bpf_core_field_exists(bio->bi_blkg))
+        return 0;
+
+    return BPF_CORE_READ(bio, bi_blkg, blkcg, css.cgroup, kn, id);
+}
+
+// floor(log2(v)) for v > 0 without branches or loops, BPF has no clz
+static __u32 __always_inline log2_u64(__u64 v)
+{
+    __u32 r, shift;
+
+    r = (v > 0xFFFFFFFFULL) << 5; v >>= r;
+    shift = (v > 0xFFFF) << 4; v >>= shift; r |= shift;
+    shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+    shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+    shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+    return r | (v >> 1);
+}
+
+// Log-linear histogram slot of a latency, see XCAP_HIST_SUB_BITS
+static __u32 __always_inline hist_slot(__u64 ns)
+{
+    if (ns < (1 << XCAP_HIST_SUB_BITS))
+        return ns;
+
+    __u32 p = log2_u64(ns);
+    __u32 slot = ((p - XCAP_HIST_SUB_BITS + 1) << XCAP_HIST_SUB_BITS) |
+                 ((ns >> (p - XCAP_HIST_SUB_BITS)) & ((1 << XCAP_HIST_SUB_BITS) - 1));
+
+    return slot < XCAP_HIST_SLOTS ? slot : XCAP_HIST_SLOTS - 1;
+}
+
 #ifdef OLD_KERNEL_SUPPORT
 #define xcap_copy_from_user_task(dst, size, src, task, flags) (-1)
 #else
@@ -25,6 +25,7 @@
 
 #include "xintr.h"
 #include "xintr.skel.h"
+#include "symcache.h"
 
 #ifdef USE_BLAZESYM
 #include "blazesym.h"
@@ -50,49 +51,10 @@ static __u64 handle_softirq_start = 0; // CONFIG_FRED_ENABLED=y
 static __u64 handle_softirq_end = 0;
 
 
-// Look up handle_softirqs address (ignoring handle_softirqs.cold, etc variations for now)
-// If a symbol is found (found=true), loop one more time to find next symbol's start addr
-static bool lookup_symbol_range(const char *name, __u64 *start, __u64 *end)
-{
-    FILE *fp = fopen("/proc/kallsyms", "r");
-    if (!fp)
-        return false;
-
-    char line[512];
-    bool found = false;
-
-    while (fgets(line, sizeof(line), fp)) {
-        unsigned long long addr;
-        char type;
-        char sym[256];
-
-        if (sscanf(line, "%llx %c %255s", &addr, &type, sym) != 3) // 3 fields successfully read
-            continue;
-
-        if (found) {
-            *end = addr;
-            fclose(fp);
-            return true;
-        }
-
-        if (strcmp(sym, name) == 0) {
-            *start = addr;
-            found = true;
-        }
-    }
-
-    fclose(fp);
-
-    if (found) {
-        *end = *start + 0x2000; // fallback range guess
-        return true;
-    }
-    return false;
-}
-
 #ifdef USE_BLAZESYM
 static blaze_symbolizer *symbolizer = NULL;
 #endif
+static struct symcache *symcache = NULL;
 
 // Exit signal handler
 static void sig_handler(int sig)
@@ -210,90 +172,91 @@ static int collect_stack_entries(const struct irq_stack_event *e, __u64 *out,
     return found;
 }
 
-// Symbolize stack addresses
-static char *symbolize_stack(__u64 *addrs, int count)
+// Symbolize stack addresses into buf, unresolved frames are printed as addresses
+static void symbolize_stack(__u64 *addrs, int count, char *buf, size_t buflen)
 {
-#ifdef USE_BLAZESYM
-    if (!symbolizer || count <= 0)
-        return strdup("");
-
-    static char symbuf[8192];
-    symbuf[0] = '\0';
-
-    struct blaze_symbolize_src_kernel src = {
-        .type_size = sizeof(src),
-    };
+    struct symcache_sym syms[MAX_STACK_DEPTH];
+    char *ptr = buf;
+    size_t remaining = buflen;
+    bool first = true;
 
-    const struct blaze_syms *syms = blaze_symbolize_kernel_abs_addrs(
-        symbolizer, &src, (const uintptr_t *)addrs, count);
-
-    if (!syms || syms->cnt == 0) {
-        if (syms) blaze_syms_free(syms);
-        // Return hex addresses if symbolization did not work
-        for (int i = 0; i < count; i++) {
-            if (i > 0) strcat(symbuf, ";");
-            char addr[32];
-            snprintf(addr, sizeof(addr), "0x%llx", addrs[i]);
-            strcat(symbuf, addr);
-        }
-        return strdup(symbuf);
-    }
+    buf[0] = '\0';
+    if (count <= 0)
+        return;
 
-    char *ptr = symbuf;
-    size_t remaining = sizeof(symbuf) - 1;
-    bool first = true;
+    symcache_resolve(symcache, 0, true, addrs, count, syms);
 
-    for (size_t i = 0; i < syms->cnt && i < count; i++) {
-        const struct blaze_sym *sym = &syms->syms[i];
+    for (int i = 0; i < count; i++) {
+        const struct symcache_sym *sym = &syms[i];
+        int written;
 
         // Skip srso_return_thunk mitigation frames unless -e flag is set
-        if (!show_every && sym->name && strncmp(sym->name, "srso_return_thunk", 17) == 0) {
+        if (!show_every && sym->name && strncmp(sym->name, "srso_return_thunk", 17) == 0)
             continue;
-        }
 
-        if (!first) {
-            if (remaining > 1) {
-                *ptr++ = ';';
-                remaining--;
-            }
-        }
-        first = false;
+        if (sym->name && sym->name[0])
+            written = snprintf(ptr, remaining, "%s%s+0x%llx", first ? "" : ";", sym->name, sym->offset);
+        else
+            written = snprintf(ptr, remaining, "%s0x%llx", first ? "" : ";", addrs[i]);
 
-        if (sym->name && sym->name[0]) {
-            int written = snprintf(ptr, remaining, "%s+0x%lx",
-                                 sym->name, sym->offset);
-            if (written > 0 && written < remaining) {
-                ptr += written;
-                remaining -= written;
-            }
-        } else {
-            int written = snprintf(ptr, remaining, "0x%llx", addrs[i]);
-            if (written > 0 && written < remaining) {
-                ptr += written;
-                remaining -= written;
-            }
-        }
+        if (written < 0 || (size_t)written >= remaining)
+            break;
+        ptr += written;
+        remaining -= written;
+        first = false;
     }
+}
 
-    *ptr = '\0';
-    blaze_syms_free(syms);
-    return strdup(symbuf);
-#else
-    // No blazesym return hex addresses
-    static char addrbuf[8192];
-    addrbuf[0] = '\0';
+// A sample waiting for the symcache worker to symbolize and print it, the
+// raw IRQ stack stays behind in the ring buffer
+struct pending_sample {
+    char timestamp[64];
+    __u32 cpu;
+    __u64 call_depth;
+    int hardirq_in_use;
+    __u64 hardirq_stack_ptr;
+    __u64 top_of_stack;
+    __u64 debug_values[4];
+    int stack_cnt;
+    __u64 stack[MAX_STACK_DEPTH];
+};
 
-    for (int i = 0; i < count; i++) {
-        if (i > 0) strcat(addrbuf, ";");
-        char frame[32];
-        snprintf(frame, sizeof(frame), "0x%llx", addrs[i]);
-        strcat(addrbuf, frame);
+// Runs in the symcache worker, in sampling order
+static void print_sample(struct symcache *sc, void *arg)
+{
+    struct pending_sample *p = arg;
+    static char syms[8192];
+
+    (void)sc;
+    symbolize_stack(p->stack, p->stack_cnt, syms, sizeof(syms));
+
+    if (debug_mode) {
+        printf("%s|%u|%llu|%d|0x%llx|0x%llx|DEBUG[0x%llx,0x%llx,0x%llx,0x%llx]|%s\n",
+               p->timestamp,
+               p->cpu,
+               (unsigned long long)p->call_depth,
+               p->hardirq_in_use,
+               (unsigned long long)p->hardirq_stack_ptr,
+               (unsigned long long)p->top_of_stack,
+               (unsigned long long)p->debug_values[0],
+               (unsigned long long)p->debug_values[1],
+               (unsigned long long)p->debug_values[2],
+               (unsigned long long)p->debug_values[3],
+               syms
+            );
+    } else {
+        printf("%s|%u|%s\n",
+               p->timestamp,
+               p->cpu,
+               syms
+            );
     }
-    return strdup(addrbuf);
-#endif
+    fflush(stdout);
+
+    free(p);
 }
 
-// Ring buffer callback
+// Ring buffer callback, symbolization and printing happen in the symcache worker
 static int handle_event(void *ctx, void *data, size_t data_sz)
 {
     struct irq_stack_event *e = data;
@@ -316,42 +279,26 @@ static int handle_event(void *ctx, void *data, size_t data_sz)
         }
     }
 
-    __u64 stack_entries[MAX_STACK_DEPTH];
-    int stack_cnt = collect_stack_entries(e, stack_entries, MAX_STACK_DEPTH);
+    struct pending_sample *p = malloc(sizeof(*p));
+    if (!p)
+        return 0;
+
+    p->stack_cnt = collect_stack_entries(e, p->stack, MAX_STACK_DEPTH);
 
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&ts.tv_sec));
-    snprintf(timestamp + strlen(timestamp), sizeof(timestamp) - strlen(timestamp),
+    strftime(p->timestamp, sizeof(p->timestamp), "%Y-%m-%d %H:%M:%S", localtime(&ts.tv_sec));
+    snprintf(p->timestamp + strlen(p->timestamp), sizeof(p->timestamp) - strlen(p->timestamp),
              ".%06ld", ts.tv_nsec / 1000);
 
-    char *syms = symbolize_stack(stack_entries, stack_cnt);
-
-    if (debug_mode) {
-        printf("%s|%u|%llu|%d|0x%llx|0x%llx|DEBUG[0x%llx,0x%llx,0x%llx,0x%llx]|%s\n",
-               timestamp,
-               e->cpu,
-               (unsigned long long)e->call_depth,
-               e->hardirq_in_use,
-               (unsigned long long)e->hardirq_stack_ptr,
-               (unsigned long long)e->top_of_stack,
-               (unsigned long long)e->debug_values[0],
-               (unsigned long long)e->debug_values[1],
-               (unsigned long long)e->debug_values[2],
-               (unsigned long long)e->debug_values[3],
-               syms ? syms : ""
-            );
-    } else {
-        printf("%s|%u|%s\n",
-               timestamp,
-               e->cpu,
-               syms ? syms : ""
-            );
-    }
-    fflush(stdout);
+    p->cpu = e->cpu;
+    p->call_depth = e->call_depth;
+    p->hardirq_in_use = e->hardirq_in_use;
+    p->hardirq_stack_ptr = e->hardirq_stack_ptr;
+    p->top_of_stack = e->top_of_stack;
+    memcpy(p->debug_values, e->debug_values, sizeof(p->debug_values));
 
-    if (syms) free(syms);
+    symcache_submit(symcache, print_sample, p);
 
     return 0;
 }
@@ -470,26 +417,6 @@ int main(int argc, char **argv)
     everything_mode = args.everything;
     include_softirq = args.softirq;
 
-    if (include_softirq) {
-        bool found = false;
-
-        // Currently scanning through /proc/kallsyms twice on xintr startup, for code simplicity    
-        if (lookup_symbol_range("__do_softirq", &do_softirq_start, &do_softirq_end))
-            found = true;
-        else
-            fprintf(stderr, "Warning: failed to locate __do_softirq in /proc/kallsyms\n");
-    
-        if (lookup_symbol_range("handle_softirqs", &handle_softirq_start, &handle_softirq_end))
-            found = true;
-        else
-            fprintf(stderr, "Warning: failed to locate handle_softirqs in /proc/kallsyms\n");
-    
-        if (!found) {
-            fprintf(stderr, "softirq heuristic disabled\n");
-            include_softirq = false;
-        }
-    }
-
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
 
@@ -548,7 +475,37 @@ int main(int argc, char **argv)
     if (!symbolizer) {
         fprintf(stderr, "Warning: Failed to create symbolizer\n");
     }
+    symcache = symcache_new(symbolizer, SYMCACHE_DEFAULT_ENTRIES);
+#else
+    symcache = symcache_new(NULL, SYMCACHE_DEFAULT_ENTRIES);
 #endif
+    if (!symcache || symcache_start(symcache)) {
+        fprintf(stderr, "Failed to create symbol cache\n");
+        ring_buffer__free(rb);
+        bpf_link__destroy(link);
+        xintr_bpf__destroy(skel);
+        return 1;
+    }
+
+    if (include_softirq) {
+        bool found = false;
+
+        // both come from the symbol cache's sorted copy of /proc/kallsyms
+        if (symcache_ksym_range(symcache, "__do_softirq", &do_softirq_start, &do_softirq_end))
+            found = true;
+        else
+            fprintf(stderr, "Warning: failed to locate __do_softirq in /proc/kallsyms\n");
+
+        if (symcache_ksym_range(symcache, "handle_softirqs", &handle_softirq_start, &handle_softirq_end))
+            found = true;
+        else
+            fprintf(stderr, "Warning: failed to locate handle_softirqs in /proc/kallsyms\n");
+
+        if (!found) {
+            fprintf(stderr, "softirq heuristic disabled\n");
+            include_softirq = false;
+        }
+    }
 
     if (!quiet) {
         if (debug_mode) {
@@ -613,7 +570,12 @@ int main(int argc, char **argv)
         iteration++;
     }
 
-    // Cleanup
+    // Cleanup, the samples still queued get printed first
+    symcache_drain(symcache);
+    if (debug_mode)
+        symcache_print_stats(symcache, stderr);
+    symcache_free(symcache);
+
 #ifdef USE_BLAZESYM
     if (symbolizer)
         blaze_symbolizer_free(symbolizer);
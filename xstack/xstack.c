@@ -16,6 +16,7 @@
 
 #include "xstack.h"
 #include "xstack.skel.h"
+#include "symcache.h"
 
 #define XSTACK_VERSION "3.0.0"
 #define XSTACK_AUTHOR "Tanel Poder [0x.tools]"
@@ -33,6 +34,7 @@ static pid_t my_pid = 0;  // Our own PID to filter out
 #ifdef USE_BLAZESYM
 static blaze_symbolizer *symbolizer = NULL;
 #endif
+static struct symcache *symcache = NULL;
 
 // Signal handler
 static void sig_handler(int sig)
@@ -72,135 +74,81 @@ static const char *state_to_str(__u32 state)
     }
 }
 
-// Symbolize a single stack
-static char *symbolize_stack(__u64 *addrs, int count, pid_t pid, bool is_kernel)
+// Symbolize a single stack into buf, unresolved frames are printed as addresses
+static void symbolize_stack(__u64 *addrs, int count, pid_t pid, bool is_kernel, char *buf, size_t buflen)
 {
-#ifdef USE_BLAZESYM
-    if (!symbolizer || count <= 0)
-        return strdup(is_kernel ? "" : "[no_ustack]");
-
-    static char symbuf[65536];  // Large buffer for symbols
-    symbuf[0] = '\0';
-
-    const struct blaze_syms *syms = NULL;
-
-    if (is_kernel) {
-        struct blaze_symbolize_src_kernel src = {
-            .type_size = sizeof(src),
-        };
-        syms = blaze_symbolize_kernel_abs_addrs(symbolizer, &src,
-                                                (const uintptr_t *)addrs, count);
-    } else {
-        struct blaze_symbolize_src_process src = {
-            .type_size = sizeof(src),
-            .pid = pid,
-        };
-        syms = blaze_symbolize_process_abs_addrs(symbolizer, &src,
-                                                 (const uintptr_t *)addrs, count);
+    struct symcache_sym syms[MAX_STACK_DEPTH];
+
+    if (count <= 0) {
+        snprintf(buf, buflen, "%s", is_kernel ? "" : "[no_ustack]");
+        return;
     }
+    if (count > MAX_STACK_DEPTH)
+        count = MAX_STACK_DEPTH;
 
-    if (!syms || syms->cnt == 0) {
-        if (syms) blaze_syms_free(syms);
-        return strdup(is_kernel ? "[no_ksymbols]" : "[no_usymbols]");
+    int resolved = symcache_resolve(symcache, pid, is_kernel, addrs, count, syms);
+#ifdef USE_BLAZESYM
+    if (symbolizer && resolved == 0) {
+        snprintf(buf, buflen, "%s", is_kernel ? "[no_ksymbols]" : "[no_usymbols]");
+        return;
     }
+#else
+    (void)resolved;
+#endif
 
-    char *ptr = symbuf;
-    size_t remaining = sizeof(symbuf) - 1;
+    char *ptr = buf;
+    size_t remaining = buflen;
 
     // Iterate in reverse order if requested
-    if (reverse_stack) {
-        for (int i = count - 1; i >= 0; i--) {
-            if (i < count - 1) {
-                if (remaining > 1) {
-                    *ptr++ = ';';
-                    remaining--;
-                }
-            }
-
-            if (i < syms->cnt) {
-                const struct blaze_sym *sym = &syms->syms[i];
-                if (sym->name && sym->name[0]) {
-                    int written = snprintf(ptr, remaining, "%s+0x%lx",
-                                         sym->name, sym->offset);
-                    if (written > 0 && written < remaining) {
-                        ptr += written;
-                        remaining -= written;
-                    }
-                } else {
-                    int written = snprintf(ptr, remaining, "0x%llx", addrs[i]);
-                    if (written > 0 && written < remaining) {
-                        ptr += written;
-                        remaining -= written;
-                    }
-                }
-            } else {
-                int written = snprintf(ptr, remaining, "0x%llx", addrs[i]);
-                if (written > 0 && written < remaining) {
-                    ptr += written;
-                    remaining -= written;
-                }
-            }
-        }
-    } else {
-        for (size_t i = 0; i < syms->cnt && i < count; i++) {
-            if (i > 0) {
-                if (remaining > 1) {
-                    *ptr++ = ';';
-                    remaining--;
-                }
-            }
-
-            const struct blaze_sym *sym = &syms->syms[i];
-            if (sym->name && sym->name[0]) {
-                int written = snprintf(ptr, remaining, "%s+0x%lx",
-                                     sym->name, sym->offset);
-                if (written > 0 && written < remaining) {
-                    ptr += written;
-                    remaining -= written;
-                }
-            } else {
-                int written = snprintf(ptr, remaining, "0x%llx", addrs[i]);
-                if (written > 0 && written < remaining) {
-                    ptr += written;
-                    remaining -= written;
-                }
-            }
-        }
-    }
+    for (int n = 0; n < count; n++) {
+        int i = reverse_stack ? count - 1 - n : n;
+        int written;
 
-    *ptr = '\0';
-    blaze_syms_free(syms);
-    return strdup(symbuf);
-#else
-    // No blazesym - just return addresses as hex
-    static char addrbuf[8192];
-    addrbuf[0] = '\0';
-
-    if (count == 0)
-        return strdup(is_kernel ? "" : "[no_ustack]");
-
-    if (reverse_stack) {
-        for (int i = count - 1; i >= 0; i--) {
-            if (i < count - 1)
-                strcat(addrbuf, ";");
-            char frame[32];
-            snprintf(frame, sizeof(frame), "0x%llx", addrs[i]);
-            strcat(addrbuf, frame);
-        }
-    } else {
-        for (int i = 0; i < count; i++) {
-            if (i > 0)
-                strcat(addrbuf, ";");
-            char frame[32];
-            snprintf(frame, sizeof(frame), "0x%llx", addrs[i]);
-            strcat(addrbuf, frame);
-        }
+        if (syms[i].name && syms[i].name[0])
+            written = snprintf(ptr, remaining, "%s%s+0x%llx", n ? ";" : "", syms[i].name, syms[i].offset);
+        else
+            written = snprintf(ptr, remaining, "%s0x%llx", n ? ";" : "", addrs[i]);
+
+        if (written < 0 || (size_t)written >= remaining)
+            break;
+        ptr += written;
+        remaining -= written;
     }
-    return strdup(addrbuf);
-#endif
+    *ptr = '\0';
+}
+
+// A sample waiting for the symcache worker to symbolize and print it
+struct pending_sample {
+    char timestamp[64];
+    struct stack_event e;
+};
+
+// Runs in the symcache worker, in sampling order
+static void print_sample(struct symcache *sc, void *arg)
+{
+    struct pending_sample *p = arg;
+    static char ksyms[65536];
+    static char usyms[65536];
+
+    (void)sc;
+    symbolize_stack(p->e.kstack, p->e.kstack_sz, p->e.pid, true, ksyms, sizeof(ksyms));
+    symbolize_stack(p->e.ustack, p->e.ustack_sz, p->e.pid, false, usyms, sizeof(usyms));
+
+    // Print CSV values: timestamp,tid,tgid,comm,state,ustack,kstack
+    printf("%s|%u|%u|%s|%s|%s|%s\n",
+           p->timestamp,
+           p->e.pid,
+           p->e.tgid,
+           p->e.comm,
+           state_to_str(p->e.state),
+           usyms,
+           ksyms
+        );
+
+    free(p);
 }
 
-// Ring buffer callback
+// Ring buffer callback, symbolization and printing happen in the symcache worker
 static int handle_event(void *ctx, void *data, size_t data_sz)
 {
     struct stack_event *e = data;
@@ -208,29 +156,18 @@ static int handle_event(void *ctx, void *data, size_t data_sz)
     if (e->pid == my_pid)
         return 0;
 
+    struct pending_sample *p = malloc(sizeof(*p));
+    if (!p)
+        return 0;
+
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&ts.tv_sec));
-    snprintf(timestamp + strlen(timestamp), sizeof(timestamp) - strlen(timestamp),
+    strftime(p->timestamp, sizeof(p->timestamp), "%Y-%m-%d %H:%M:%S", localtime(&ts.tv_sec));
+    snprintf(p->timestamp + strlen(p->timestamp), sizeof(p->timestamp) - strlen(p->timestamp),
              ".%06ld", ts.tv_nsec / 1000);
 
-    char *ksyms = symbolize_stack(e->kstack, e->kstack_sz, e->pid, true);
-    char *usyms = symbolize_stack(e->ustack, e->ustack_sz, e->pid, false);
-
-    // Print CSV values: timestamp,tid,tgid,comm,state,ustack,kstack
-    printf("%s|%u|%u|%s|%s|%s|%s\n",
-           timestamp,
-           e->pid,
-           e->tgid,
-           e->comm,
-           state_to_str(e->state),
-           usyms ? usyms : "[no_ustack]",
-           ksyms ? ksyms : "[no_kstack]"
-        );
-
-    if (ksyms) free(ksyms);
-    if (usyms) free(usyms);
+    memcpy(&p->e, e, sizeof(*e));
+    symcache_submit(symcache, print_sample, p);
 
     return 0;
 }
@@ -424,7 +361,17 @@ int main(int argc, char **argv)
     if (!symbolizer) {
         fprintf(stderr, "Warning: Failed to create symbolizer\n");
     }
+    symcache = symcache_new(symbolizer, SYMCACHE_DEFAULT_ENTRIES);
+#else
+    symcache = symcache_new(NULL, SYMCACHE_DEFAULT_ENTRIES);
 #endif
+    if (!symcache || symcache_start(symcache)) {
+        fprintf(stderr, "Failed to create symbol cache\n");
+        ring_buffer__free(rb);
+        bpf_link__destroy(link);
+        xstack_bpf__destroy(skel);
+        return 1;
+    }
 
     if (!quiet) {
         printf("timestamp|tid|tgid|comm|state|ustack|kstack\n");
@@ -480,7 +427,13 @@ int main(int argc, char **argv)
         iteration++;
     }
 
-    // Cleanup
+    // Cleanup, the samples still queued get printed first
+    symcache_drain(symcache);
+    fflush(stdout);
+    if (!quiet)
+        symcache_print_stats(symcache, stderr);
+    symcache_free(symcache);
+
 #ifdef USE_BLAZESYM
     if (symbolizer)
         blaze_symbolizer_free(symbolizer);
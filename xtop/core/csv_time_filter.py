@@ -92,7 +92,8 @@ class CSVTimeFilter:
                             high_time: Optional[datetime]):
         """Return (parquet_files, csv_files) for the given hourly time window.
 
-        Prefers per-hour .parquet if present, otherwise uses .csv for that hour.
+        Prefers per-hour .parquet if present, otherwise uses .csv (or the
+        .csv.zst written by xcapture --compress zstd) for that hour.
         Hours without either file are skipped.
         """
         parquet_files = []
@@ -106,13 +107,14 @@ class CSVTimeFilter:
             date_str = hour_dt.strftime("%Y-%m-%d")
             hour_str = hour_dt.strftime("%H")
             base = f"xcapture_{csv_type}_{date_str}.{hour_str}"
-            parquet_path = self.datadir / f"{base}.parquet"
-            csv_path = self.datadir / f"{base}.csv"
             try:
-                if parquet_path.exists():
-                    parquet_files.append(str(parquet_path))
-                elif csv_path.exists():
-                    csv_files.append(str(csv_path))
+                # xcapture --hive writes into date=YYYY-MM-DD/hour=HH/ subdirectories
+                dirs = [self.datadir, self.datadir / f"date={date_str}" / f"hour={hour_str}"]
+                for ext, files in (("parquet", parquet_files), ("csv", csv_files), ("csv.zst", csv_files)):
+                    found = self._hour_files(dirs, base, ext)
+                    if found:
+                        files.extend(found)
+                        break
                 else:
                     # Nothing for this hour; skip
                     self.logger.debug(f"No files for {base} (type={csv_type})")
@@ -127,6 +129,24 @@ class CSVTimeFilter:
 
         return parquet_files, csv_files
 
+    @staticmethod
+    def _hour_files(dirs, base: str, ext: str):
+        """Files of one hour with the given extension.
+
+        Besides {base}.{ext} this picks up {base}.*.{ext}: the {base}.MM.{ext}
+        periods of xcapture --rotate, the {base}.N.{ext} parts written after a
+        --max-file-size rotation or a restart within the hour (.parquet and
+        compressed CSV are never appended to).
+        """
+        files = []
+        for d in dirs:
+            path = d / f"{base}.{ext}"
+            if path.exists():
+                files.append(str(path))
+            if d.is_dir():
+                files.extend(str(p) for p in sorted(d.glob(f"{base}.*.{ext}")))
+        return files
+
     def build_mixed_source_select(self,
                                   csv_type: str,
                                   low_time: Optional[datetime],
@@ -148,13 +168,13 @@ class CSVTimeFilter:
 
         if pq_files and csv_files:
             return (
-                f"(SELECT * FROM read_parquet({_list_literal(pq_files)}) "
-                f"UNION ALL SELECT * FROM read_csv_auto({_list_literal(csv_files)}))"
+                f"(SELECT * FROM read_parquet({_list_literal(pq_files)}, hive_partitioning=false) "
+                f"UNION ALL SELECT * FROM read_csv_auto({_list_literal(csv_files)}, hive_partitioning=false))"
             )
         elif pq_files:
-            return f"SELECT * FROM read_parquet({_list_literal(pq_files)})"
+            return f"SELECT * FROM read_parquet({_list_literal(pq_files)}, hive_partitioning=false)"
         elif csv_files:
-            return f"SELECT * FROM read_csv_auto({_list_literal(csv_files)})"
+            return f"SELECT * FROM read_csv_auto({_list_literal(csv_files)}, hive_partitioning=false)"
         else:
             # Fallback to previous behavior: CSV glob pattern
             pattern = self.get_hourly_files_in_range(csv_type, low_time, high_time)
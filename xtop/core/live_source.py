@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+"""
+Live data source for xtop --live.
+Copies the rolling window of a running `xcapture --live SOCKET` into CSV files
+in a tmpfs directory, which the regular CSV data source then reads.
+
+After the first full copy only the rows added since the previous refresh are
+fetched (with from=) and appended. The files are rewritten from a full copy
+when the hour of the newest sample changes and every RESYNC_SEC, which also
+drops the rows xcapture has expired from its window.
+"""
+
+import os
+import shutil
+import socket
+import tempfile
+import time
+import logging
+from dataclasses import dataclass, field
+from datetime import datetime, timedelta
+from pathlib import Path
+from typing import Dict, Optional, Set, Tuple
+
+
+class LiveSourceError(Exception):
+    """Raised when the xcapture live socket can't be queried"""
+
+
+@dataclass
+class LiveUpdate:
+    """Rows fetched by LiveSnapshot.fetch(), written out by LiveSnapshot.apply()"""
+    first_time: Optional[datetime]
+    last_time: Optional[datetime]
+    stamp: str
+    full: bool
+    # whole table with header when full, otherwise only the new rows
+    data: Dict[str, bytes] = field(default_factory=dict)
+    headers: Dict[str, bytes] = field(default_factory=dict)
+
+
+class LiveSnapshot:
+    """Mirrors the in-memory tables of xcapture --live into a directory"""
+
+    TABLES = ('samples', 'syscend', 'iorqend', 'kstacks', 'ustacks', 'cgroups')
+    TIMED_TABLES = ('samples', 'syscend', 'iorqend')
+    TIMEOUT_SEC = 10
+    # rows may be appended to xcapture's tables a little after their timestamp,
+    # incremental fetches reach back this far and skip the rows seen already
+    OVERLAP_SEC = 15
+    RESYNC_SEC = 600
+
+    def __init__(self, socket_path: str, snapdir: Optional[str] = None):
+        """
+        Args:
+            socket_path: Unix socket given to xcapture --live
+            snapdir: Directory for the CSV copies (default: a new one in /dev/shm)
+        """
+        self.socket_path = socket_path
+        self.logger = logging.getLogger('xtop.live_source')
+        self._own_dir = snapdir is None
+        if snapdir is None:
+            base = '/dev/shm' if os.path.isdir('/dev/shm') else None
+            snapdir = tempfile.mkdtemp(prefix='xtop-live-', dir=base)
+        self.datadir = Path(snapdir)
+        self.first_time: Optional[datetime] = None
+        self.last_time: Optional[datetime] = None
+
+        # fetch() state, only touched by one fetch at a time
+        self._stamp: Optional[str] = None
+        self._synced = 0.0
+        self._recent: Dict[str, Set[bytes]] = {}        # rows of the previous answer
+        self._counts: Dict[str, Tuple[str, str]] = {}    # ROWS, BYTES of untimed tables
+
+    def query(self, request: str) -> bytes:
+        """Send one request line and return the whole answer"""
+        chunks = []
+        try:
+            with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+                s.settimeout(self.TIMEOUT_SEC)
+                s.connect(self.socket_path)
+                s.sendall(request.encode() + b'\n')
+                while True:
+                    data = s.recv(1 << 20)
+                    if not data:
+                        break
+                    chunks.append(data)
+        except OSError as e:
+            raise LiveSourceError(f"Cannot query xcapture at {self.socket_path}: {e}") from e
+
+        answer = b''.join(chunks)
+        if answer.startswith(b'ERROR '):
+            raise LiveSourceError(answer[6:].decode(errors='replace').strip())
+        return answer
+
+    def tables(self) -> Dict[str, Dict[str, str]]:
+        """Row counts, bytes and time range of every table"""
+        lines = self.query('TABLES').decode(errors='replace').splitlines()
+        if not lines:
+            return {}
+        header = lines[0].split(',')
+        result = {}
+        for line in lines[1:]:
+            values = line.split(',')
+            if len(values) == len(header):
+                result[values[0]] = dict(zip(header, values))
+        return result
+
+    @staticmethod
+    def _parse_ts(value: str) -> Optional[datetime]:
+        if not value:
+            return None
+        try:
+            return datetime.fromisoformat(value)
+        except ValueError:
+            return None
+
+    @staticmethod
+    def _split_rows(data: bytes) -> Tuple[bytes, list]:
+        """Header line and rows of an answer"""
+        lines = data.split(b'\n')
+        return lines[0], [line for line in lines[1:] if line]
+
+    def fetch(self) -> LiveUpdate:
+        """
+        Query xcapture for what changed since the previous fetch.
+
+        Only talks to the socket, so it can run in a worker thread while the
+        files are queried. The result is written out by apply().
+        """
+        info = self.tables()
+        samples = info.get('samples', {})
+        first_time = self._parse_ts(samples.get('FIRST_TIMESTAMP', ''))
+        last_time = self._parse_ts(samples.get('LAST_TIMESTAMP', ''))
+        stamp = (last_time or datetime.now()).strftime('%Y-%m-%d.%H')
+
+        full = stamp != self._stamp or time.monotonic() - self._synced >= self.RESYNC_SEC
+        update = LiveUpdate(first_time, last_time, stamp, full)
+        since = (datetime.now() - timedelta(seconds=self.OVERLAP_SEC)).strftime('%Y-%m-%dT%H:%M:%S.%f')
+
+        # a failed query leaves the state as it was, the next fetch asks again
+        recent = dict(self._recent)
+        counts = dict(self._counts)
+
+        for table in self.TABLES:
+            if table in self.TIMED_TABLES:
+                data = self.query(table if full else f"{table} from={since}")
+                header, rows = self._split_rows(data)
+                new_rows = rows if full else [r for r in rows if r not in recent.get(table, ())]
+                recent[table] = set(rows)
+            else:
+                table_info = info.get(table, {})
+                table_counts = (table_info.get('ROWS', ''), table_info.get('BYTES', ''))
+                if not full and table_counts == counts.get(table):
+                    continue
+                counts[table] = table_counts
+                data = self.query(table)
+                header, rows = self._split_rows(data)
+                seen = set() if full else recent.get(table, set())
+                new_rows = [r for r in rows if r not in seen]
+                recent[table] = seen | set(new_rows)
+
+            update.headers[table] = header
+            if full:
+                update.data[table] = data
+            elif new_rows:
+                update.data[table] = b'\n'.join(new_rows) + b'\n'
+
+        self._recent = recent
+        self._counts = counts
+        if full:
+            self._stamp = stamp
+            self._synced = time.monotonic()
+        return update
+
+    def apply(self, update: LiveUpdate) -> Tuple[Optional[datetime], Optional[datetime]]:
+        """
+        Write the rows of a fetch() into the CSV files.
+
+        All rows of a table go into one file named after the hour of the
+        newest sample, the queries filter on TIMESTAMP themselves.
+
+        Returns:
+            Time range of the samples held by xcapture
+        """
+        self.first_time = update.first_time
+        self.last_time = update.last_time
+
+        if update.full:
+            keep = set()
+            for table, data in update.data.items():
+                if not data:
+                    continue
+                name = f"xcapture_{table}_{update.stamp}.csv"
+                tmp = self.datadir / f".{name}.tmp"
+                tmp.write_bytes(data)
+                os.replace(tmp, self.datadir / name)
+                keep.add(name)
+
+            # files of the previous hour once the newest sample is in a new one
+            for path in self.datadir.glob('xcapture_*.csv'):
+                if path.name not in keep:
+                    path.unlink(missing_ok=True)
+        else:
+            for table, rows in update.data.items():
+                path = self.datadir / f"xcapture_{table}_{update.stamp}.csv"
+                new_file = not path.exists()
+                with open(path, 'ab') as f:
+                    if new_file:
+                        f.write(update.headers[table] + b'\n')
+                    f.write(rows)
+
+        self.logger.debug(f"Live snapshot {self.first_time} - {self.last_time} in {self.datadir}"
+                          f" ({'full' if update.full else 'incremental'})")
+        return self.first_time, self.last_time
+
+    def refresh(self) -> Tuple[Optional[datetime], Optional[datetime]]:
+        """fetch() and apply() in one go"""
+        return self.apply(self.fetch())
+
+    def time_range(self) -> Tuple[Optional[datetime], Optional[datetime]]:
+        """Loaded time range for queries, the end just past the newest sample"""
+        if not self.first_time or not self.last_time:
+            return None, None
+        return (self.first_time.replace(microsecond=0),
+                self.last_time.replace(microsecond=0) + timedelta(seconds=1))
+
+    def close(self):
+        """Remove the snapshot directory if this object created it"""
+        if self._own_dir:
+            shutil.rmtree(self.datadir, ignore_errors=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
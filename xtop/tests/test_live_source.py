@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""
+Tests for live_source module against a fake xcapture --live socket.
+"""
+
+import sys
+import os
+import socket
+import tempfile
+import threading
+import unittest
+from datetime import datetime
+
+# Add parent directory to path
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from core.live_source import LiveSnapshot, LiveSourceError
+
+
+ANSWERS = {
+    'TABLES': (
+        "NAME,ROWS,BYTES,FIRST_TIMESTAMP,LAST_TIMESTAMP\n"
+        "samples,2,120,2025-08-11T16:58:00.123456,2025-08-11T17:01:30.000001\n"
+        "syscend,0,0,,\n"
+        "iorqend,0,0,,\n"
+        "kstacks,1,12,,\n"
+        "ustacks,0,0,,\n"
+        "cgroups,0,0,,\n"
+    ),
+    'samples': (
+        "TIMESTAMP,TID,STATE\n"
+        "2025-08-11T16:58:00.123456,1,Running\n"
+        "2025-08-11T17:01:30.000001,2,Disk (Uninterruptible)\n"
+    ),
+    'kstacks': "KSTACK_HASH,KSTACK_SYMS\nabc,'x;y'\n",
+}
+
+
+class FakeXcapture:
+    """Answers one request per connection like xcapture --live"""
+
+    def __init__(self, path):
+        self.path = path
+        self.requests = []
+        self.answers = dict(ANSWERS)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(path)
+        self.sock.listen(8)
+        self.thread = threading.Thread(target=self._serve, daemon=True)
+        self.thread.start()
+
+    def _serve(self):
+        while True:
+            try:
+                conn, _ = self.sock.accept()
+            except OSError:
+                return
+            with conn:
+                request = conn.makefile('rb').readline().decode().strip()
+                self.requests.append(request)
+                table = request.split(' ')[0]
+                if table in self.answers:
+                    conn.sendall(self.answers[table].encode())
+                elif table == 'bogus':
+                    conn.sendall(b"ERROR unknown table bogus\n")
+
+    def requested(self, table):
+        """Requests for a table, TABLES excluded"""
+        return [r for r in self.requests if r.split(' ')[0] == table]
+
+    def close(self):
+        self.sock.close()
+
+
+class TestLiveSnapshot(unittest.TestCase):
+    """Test cases for LiveSnapshot"""
+
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.server = FakeXcapture(os.path.join(self.tmp.name, 'live.sock'))
+
+    def tearDown(self):
+        self.server.close()
+        self.tmp.cleanup()
+
+    def test_refresh_writes_hourly_files(self):
+        """Tables land in files named after the newest sample's hour"""
+        with LiveSnapshot(self.server.path) as snap:
+            first, last = snap.refresh()
+            self.assertEqual(first, datetime(2025, 8, 11, 16, 58, 0, 123456))
+            self.assertEqual(last, datetime(2025, 8, 11, 17, 1, 30, 1))
+
+            files = sorted(p.name for p in snap.datadir.glob('xcapture_*.csv'))
+            self.assertEqual(files, ['xcapture_kstacks_2025-08-11.17.csv',
+                                     'xcapture_samples_2025-08-11.17.csv'])
+            samples = (snap.datadir / 'xcapture_samples_2025-08-11.17.csv').read_text()
+            self.assertEqual(samples, ANSWERS['samples'])
+
+            self.assertEqual(snap.time_range(), (datetime(2025, 8, 11, 16, 58, 0),
+                                                 datetime(2025, 8, 11, 17, 1, 31)))
+            datadir = snap.datadir
+        self.assertFalse(datadir.exists())
+
+    def test_stale_files_removed(self):
+        """Files of an earlier hour go away on the next refresh"""
+        with LiveSnapshot(self.server.path) as snap:
+            stale = snap.datadir / 'xcapture_samples_2025-08-11.16.csv'
+            stale.write_text('TIMESTAMP\n')
+            snap.refresh()
+            self.assertFalse(stale.exists())
+
+    def test_incremental_append(self):
+        """Rows added between fetches are appended once, the overlap is skipped"""
+        with LiveSnapshot(self.server.path) as snap:
+            snap.refresh()
+            # the from= answer repeats the last row seen and adds a new one
+            self.server.answers['TABLES'] = ANSWERS['TABLES'].replace(
+                'samples,2,120,2025-08-11T16:58:00.123456,2025-08-11T17:01:30.000001',
+                'samples,3,180,2025-08-11T16:58:00.123456,2025-08-11T17:01:31.000002')
+            self.server.answers['samples'] = (
+                "TIMESTAMP,TID,STATE\n"
+                "2025-08-11T17:01:30.000001,2,Disk (Uninterruptible)\n"
+                "2025-08-11T17:01:31.000002,3,Running\n"
+            )
+
+            update = snap.fetch()
+            self.assertFalse(update.full)
+            self.assertEqual(update.data['samples'], b"2025-08-11T17:01:31.000002,3,Running\n")
+            self.assertIn('from=', self.server.requested('samples')[-1])
+            snap.apply(update)
+
+            # nothing new in the next answer, nothing appended
+            update = snap.fetch()
+            self.assertNotIn('samples', update.data)
+            snap.apply(update)
+
+            samples = (snap.datadir / 'xcapture_samples_2025-08-11.17.csv').read_text()
+            self.assertEqual(samples, ANSWERS['samples'] + "2025-08-11T17:01:31.000002,3,Running\n")
+            self.assertEqual(snap.last_time, datetime(2025, 8, 11, 17, 1, 31, 2))
+
+    def test_untimed_tables_follow_counts(self):
+        """Stack tables are only fetched again when their ROWS or BYTES change"""
+        with LiveSnapshot(self.server.path) as snap:
+            snap.refresh()
+            snap.refresh()
+            self.assertEqual(len(self.server.requested('kstacks')), 1)
+
+            self.server.answers['TABLES'] = ANSWERS['TABLES'].replace('kstacks,1,12,,', 'kstacks,2,24,,')
+            self.server.answers['kstacks'] = "KSTACK_HASH,KSTACK_SYMS\nabc,'x;y'\ndef,'z'\n"
+            update = snap.fetch()
+            self.assertEqual(update.data['kstacks'], b"def,'z'\n")
+            snap.apply(update)
+
+            kstacks = (snap.datadir / 'xcapture_kstacks_2025-08-11.17.csv').read_text()
+            self.assertEqual(kstacks, self.server.answers['kstacks'])
+
+    def test_append_creates_missing_file(self):
+        """A table that was empty at the full copy gets its file and header on the first rows"""
+        with LiveSnapshot(self.server.path) as snap:
+            snap.refresh()
+            path = snap.datadir / 'xcapture_syscend_2025-08-11.17.csv'
+            self.assertFalse(path.exists())
+
+            self.server.answers['syscend'] = (
+                "TIMESTAMP,TID,SYSCALL\n"
+                "2025-08-11T17:01:30.500000,2,pread64\n"
+            )
+            update = snap.fetch()
+            self.assertFalse(update.full)
+            snap.apply(update)
+            self.assertEqual(path.read_text(), self.server.answers['syscend'])
+
+    def test_new_hour_rewrites_files(self):
+        """A newest sample in a new hour starts over with a full copy"""
+        with LiveSnapshot(self.server.path) as snap:
+            snap.refresh()
+            self.server.answers['TABLES'] = ANSWERS['TABLES'].replace(
+                'samples,2,120,2025-08-11T16:58:00.123456,2025-08-11T17:01:30.000001',
+                'samples,2,120,2025-08-11T17:01:30.000001,2025-08-11T18:00:01.000000')
+            self.server.answers['samples'] = (
+                "TIMESTAMP,TID,STATE\n"
+                "2025-08-11T17:01:30.000001,2,Disk (Uninterruptible)\n"
+                "2025-08-11T18:00:01.000000,3,Running\n"
+            )
+
+            update = snap.fetch()
+            self.assertTrue(update.full)
+            self.assertNotIn('from=', self.server.requested('samples')[-1])
+            snap.apply(update)
+
+            files = sorted(p.name for p in snap.datadir.glob('xcapture_*.csv'))
+            self.assertEqual(files, ['xcapture_kstacks_2025-08-11.18.csv',
+                                     'xcapture_samples_2025-08-11.18.csv'])
+            samples = (snap.datadir / 'xcapture_samples_2025-08-11.18.csv').read_text()
+            self.assertEqual(samples, self.server.answers['samples'])
+
+    def test_resync_drops_expired_rows(self):
+        """The periodic full copy drops rows xcapture has expired"""
+        with LiveSnapshot(self.server.path) as snap:
+            snap.refresh()
+            snap.RESYNC_SEC = 0
+            self.server.answers['samples'] = (
+                "TIMESTAMP,TID,STATE\n"
+                "2025-08-11T17:01:30.000001,2,Disk (Uninterruptible)\n"
+            )
+
+            update = snap.fetch()
+            self.assertTrue(update.full)
+            snap.apply(update)
+            samples = (snap.datadir / 'xcapture_samples_2025-08-11.17.csv').read_text()
+            self.assertEqual(samples, self.server.answers['samples'])
+
+    def test_error_answer(self):
+        """ERROR lines become LiveSourceError"""
+        with LiveSnapshot(self.server.path) as snap:
+            with self.assertRaises(LiveSourceError) as ctx:
+                snap.query('bogus')
+            self.assertIn('unknown table bogus', str(ctx.exception))
+
+    def test_missing_socket(self):
+        """A socket nobody listens on is reported, not raised as OSError"""
+        with LiveSnapshot(os.path.join(self.tmp.name, 'nothing.sock')) as snap:
+            with self.assertRaises(LiveSourceError):
+                snap.refresh()
+
+
+if __name__ == '__main__':
+    unittest.main()